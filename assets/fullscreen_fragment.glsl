@@ -1,10 +1,24 @@
 precision highp float;
 uniform sampler2D s_Texture;
+uniform bool u_ToneMap; /* Set for float accumulation formats */
 
 varying vec2 v_TexCoord;
 
+/* Leaves everything below the shoulder untouched and rolls the highlights
+ * off towards 1 so overlapping lights don't clip.
+ */
+const float kShoulder = 0.6;
+vec3 tone_map(vec3 color)
+{
+    vec3 highlight = kShoulder + (1.0-kShoulder)*(1.0 - exp(-(color-kShoulder)/(1.0-kShoulder)));
+    return mix(color, highlight, step(kShoulder, color));
+}
+
 void main()
 {
-    gl_FragColor = texture2D(s_Texture, v_TexCoord);
+    vec4 color = texture2D(s_Texture, v_TexCoord);
+    if(u_ToneMap)
+        color.rgb = tone_map(color.rgb);
+    gl_FragColor = color;
     //gl_FragColor = vec4(v_TexCoord,1.0,1.0);
 }
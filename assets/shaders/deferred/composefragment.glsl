@@ -0,0 +1,61 @@
+#version 300 es
+precision highp float;
+precision highp sampler2D;
+
+uniform sampler2D   s_GBuffer[GBUFFER_SIZE+1];
+uniform sampler2D   s_HalfGBuffer[GBUFFER_SIZE+1];
+uniform sampler2D   s_Light;
+
+uniform mat4    u_InvProj;
+
+out vec4 o_Color;
+
+#include "include/gbuffer.glsl"
+#include "include/upsample.glsl"
+
+vec3 half_normal(ivec2 texel)
+{
+    vec4 half_gbuffer[GBUFFER_SIZE];
+    half_gbuffer[GBUFFER_NORMAL_TARGET] = texelFetch(s_HalfGBuffer[GBUFFER_NORMAL_TARGET], texel, 0);
+    return decode(GBUFFER_NORMAL(half_gbuffer));
+}
+float half_view_depth(ivec2 texel)
+{
+    return view_depth(u_InvProj, texelFetch(s_HalfGBuffer[GBUFFER_SIZE], texel, 0).r);
+}
+
+void main(void)
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+
+    float depth = texelFetch(s_GBuffer[GBUFFER_SIZE], pixel, 0).r;
+    if(depth == 1.0) {
+        o_Color = vec4(0.0, 0.0, 0.0, 1.0);
+        return;
+    }
+    vec4 gbuffer[GBUFFER_SIZE];
+    gbuffer[0] = texelFetch(s_GBuffer[0], pixel, 0);
+#if GBUFFER_SIZE > 1
+    gbuffer[1] = texelFetch(s_GBuffer[1], pixel, 0);
+#endif
+#if GBUFFER_SIZE > 2
+    gbuffer[2] = texelFetch(s_GBuffer[2], pixel, 0);
+#endif
+    vec3 albedo = GBUFFER_ALBEDO(gbuffer);
+    vec3 normal = decode(GBUFFER_NORMAL(gbuffer));
+    float z = view_depth(u_InvProj, depth);
+
+    vec4 light = upsample_light(s_Light, normal, z);
+
+    vec3 color = light.rgb * albedo;
+#ifdef SPECULAR
+  #ifdef GBUFFER_SPECULAR_COLOR
+    vec3 specular_color = GBUFFER_SPECULAR_COLOR(gbuffer);
+  #else
+    vec3 specular_color = vec3(GBUFFER_SPECULAR_INTENSITY(gbuffer));
+  #endif
+    color += specular_color * colored_specular(light);
+#endif
+
+    o_Color = vec4(color, 1.0);
+}
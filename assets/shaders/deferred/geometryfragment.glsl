@@ -11,10 +11,8 @@ varying vec3 v_TangentVS;
 varying vec3 v_BitangentVS;
 varying vec2 v_TexCoord;
 
-vec4 encode(vec3 normal)
-{
-    return vec4(normal.xy*0.5+0.5, 0,0);
-}
+#include "include/octahedral.glsl"
+#include "include/lighting.glsl"
 
 void main(void) {
     /** Load texture values
@@ -30,11 +28,34 @@ void main(void) {
     mat3 TBN = mat3(T, B, N);
     normal = normalize(TBN*normal);
 
-    /** GBuffer format
-     *  [0] RGB: Albedo
-     *  [1] RGB: VS Normal
-     *  [2] R: Depth
+    /** GBuffer format, GBUFFER_SIZE and the GBUFFER_<field>(g) accessors
+     *  are generated from the layout in deferred.c
      */
-    gl_FragData[0] = vec4(albedo, 1.0);
-    gl_FragData[1] = encode(normal);
+    vec4 gbuffer[GBUFFER_SIZE];
+    gbuffer[0] = vec4(0.0);
+#if GBUFFER_SIZE > 1
+    gbuffer[1] = vec4(0.0);
+#endif
+#if GBUFFER_SIZE > 2
+    gbuffer[2] = vec4(0.0);
+#endif
+    GBUFFER_ALBEDO(gbuffer) = albedo;
+    GBUFFER_NORMAL(gbuffer) = encode(normal);
+#ifdef GBUFFER_SPECULAR_INTENSITY
+    GBUFFER_SPECULAR_INTENSITY(gbuffer) = max(specular_color.r, max(specular_color.g, specular_color.b));
+#endif
+#ifdef GBUFFER_SPECULAR_COLOR
+    GBUFFER_SPECULAR_COLOR(gbuffer) = specular_color;
+#endif
+#ifdef GBUFFER_SPECULAR_POWER
+    GBUFFER_SPECULAR_POWER(gbuffer) = u_SpecularPower/kMaxSpecularPower;
+#endif
+
+    gl_FragData[0] = gbuffer[0];
+#if GBUFFER_SIZE > 1
+    gl_FragData[1] = gbuffer[1];
+#endif
+#if GBUFFER_SIZE > 2
+    gl_FragData[2] = gbuffer[2];
+#endif
 }
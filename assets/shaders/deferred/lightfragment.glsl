@@ -1,54 +1,73 @@
 precision highp float;
-uniform sampler2D s_GBuffer[3];
+uniform sampler2D s_GBuffer[GBUFFER_SIZE+1];
 
 uniform mat4    u_InvProj;
 
 uniform vec2    u_Viewport;
 
-uniform vec3    u_LightColor;
-uniform vec3    u_LightPosition;
-uniform float   u_LightSize;
+varying vec4    v_LightPosition;
+varying vec3    v_LightColor;
 
+#include "include/gbuffer.glsl"
 
-vec3 decode(vec2 encoded)
-{
-    vec3 norm;
-    norm.xy = (encoded*2.0) - 1.0;
-    norm.z = sqrt(1.0-dot(norm.xy,norm.xy));
-    return norm;
-}
-
-/** GBuffer format
- *  [0] RGB: Albedo
- *  [1] RGB: VS Normal
- *  [2] R: Depth
- */
 void main(void)
 {
     /** Load texture values
      */
     vec2 tex_coord = gl_FragCoord.xy/u_Viewport; // map to [0..1]
 
-    vec3 albedo = texture2D(s_GBuffer[0], tex_coord).rgb;
-    vec3 normal = decode(texture2D(s_GBuffer[1], tex_coord).rg);
-    float depth = texture2D(s_GBuffer[2], tex_coord).r;
+    vec4 gbuffer[GBUFFER_SIZE];
+    gbuffer[0] = texture2D(s_GBuffer[0], tex_coord);
+#if GBUFFER_SIZE > 1
+    gbuffer[1] = texture2D(s_GBuffer[1], tex_coord);
+#endif
+#if GBUFFER_SIZE > 2
+    gbuffer[2] = texture2D(s_GBuffer[2], tex_coord);
+#endif
+    vec3 albedo = GBUFFER_ALBEDO(gbuffer);
+    vec3 normal = decode(GBUFFER_NORMAL(gbuffer));
+    float depth = texture2D(s_GBuffer[GBUFFER_SIZE], tex_coord).r;
+#ifdef SPECULAR
+  #ifdef GBUFFER_SPECULAR_COLOR
+    vec3 specular_color = GBUFFER_SPECULAR_COLOR(gbuffer);
+  #else
+    vec3 specular_color = vec3(GBUFFER_SPECULAR_INTENSITY(gbuffer));
+  #endif
+    float specular_power = GBUFFER_SPECULAR_POWER(gbuffer) * kMaxSpecularPower;
+    vec3 reflection = reflect(vec3(0.0,0.0,-1.0), normal);
+#endif
 
     /* Calculate the pixel's position in view space */
-    vec4 view_pos = vec4(tex_coord*2.0-1.0, depth*2.0 - 1.0, 1.0);
-    view_pos = u_InvProj * view_pos;
-    view_pos /= view_pos.w;
+    vec3 view_pos = view_position(u_InvProj, tex_coord, depth);
 
-    vec3 light_dir = u_LightPosition - view_pos.xyz;
+    vec3 light_dir = v_LightPosition.xyz - view_pos;
     float dist = length(light_dir);
-    float size = u_LightSize;
-    float attenuation = 1.0 - pow( clamp(dist/size, 0.0, 1.0), 2.0);
+    float size = v_LightPosition.w;
+    float attenuation = light_attenuation(dist, size);
     light_dir = normalize(light_dir);
 
     /* Calculate diffuse lighting */
     float n_dot_l = clamp(dot(light_dir, normal), 0.0, 1.0);
-    vec3 diffuse = u_LightColor * n_dot_l;
+    vec3 diffuse = v_LightColor * n_dot_l;
+#ifdef SPECULAR
+    /* Calculate specular lighting, the same way the forward renderer does */
+    float r_dot_l = clamp(dot(reflection, -light_dir), 0.0, 1.0);
+    float specular = min(1.0, pow(r_dot_l, specular_power));
+#else
+    float specular = 0.0;
+    vec3 specular_color = vec3(0.0);
+#endif
 
-    vec3 final_lighting = attenuation * (diffuse);
+#ifdef LIGHT_BUFFER
+    /** Half resolution light buffer, composed with the full resolution
+     *  GBuffer by composefragment.glsl
+     *  RGB: Diffuse light
+     *  A: Specular light, as luminance
+     */
+    gl_FragColor = attenuation * vec4(diffuse, specular*light_luminance(v_LightColor));
+#else
+    vec3 final_lighting = attenuation * (diffuse*albedo + specular_color*specular*v_LightColor);
 
-    gl_FragColor = vec4(final_lighting * albedo,1.0);
+    gl_FragColor = vec4(final_lighting,1.0);
+#endif
 }
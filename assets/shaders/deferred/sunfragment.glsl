@@ -0,0 +1,79 @@
+#version 300 es
+precision highp float;
+precision highp sampler2D;
+precision highp sampler2DArrayShadow;
+
+uniform sampler2D   s_GBuffer[GBUFFER_SIZE+1];
+uniform sampler2DArrayShadow    s_ShadowMap;
+
+uniform mat4    u_InvProj;
+uniform vec2    u_Viewport;
+
+uniform vec3    u_SunDirection; /* View space, towards the sun */
+uniform vec3    u_SunColor;
+
+/* Must match NUM_SHADOW_CASCADES */
+const int kNumCascades = 3;
+uniform mat4    u_ShadowMatrix[kNumCascades]; /* View space to cascade clip space */
+uniform float   u_CascadeEnd[kNumCascades];
+
+out vec4 o_Color;
+
+#include "include/gbuffer.glsl"
+float shadow(vec3 view_pos)
+{
+    int cascade = 0;
+    while(cascade < kNumCascades && view_pos.z > u_CascadeEnd[cascade])
+        ++cascade;
+    if(cascade == kNumCascades)
+        return 1.0;
+
+    vec4 shadow_pos = u_ShadowMatrix[cascade] * vec4(view_pos, 1.0);
+    shadow_pos.xyz = shadow_pos.xyz*0.5 + 0.5;
+    return texture(s_ShadowMap, vec4(shadow_pos.xy, float(cascade), shadow_pos.z));
+}
+
+void main(void)
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec2 tex_coord = gl_FragCoord.xy/u_Viewport; // map to [0..1]
+
+    float depth = texelFetch(s_GBuffer[GBUFFER_SIZE], pixel, 0).r;
+    if(depth == 1.0)
+        discard;
+    vec4 gbuffer[GBUFFER_SIZE];
+    gbuffer[0] = texelFetch(s_GBuffer[0], pixel, 0);
+#if GBUFFER_SIZE > 1
+    gbuffer[1] = texelFetch(s_GBuffer[1], pixel, 0);
+#endif
+#if GBUFFER_SIZE > 2
+    gbuffer[2] = texelFetch(s_GBuffer[2], pixel, 0);
+#endif
+    vec3 albedo = GBUFFER_ALBEDO(gbuffer);
+    vec3 normal = decode(GBUFFER_NORMAL(gbuffer));
+#ifdef SPECULAR
+  #ifdef GBUFFER_SPECULAR_COLOR
+    vec3 specular_color = GBUFFER_SPECULAR_COLOR(gbuffer);
+  #else
+    vec3 specular_color = vec3(GBUFFER_SPECULAR_INTENSITY(gbuffer));
+  #endif
+    float specular_power = GBUFFER_SPECULAR_POWER(gbuffer) * kMaxSpecularPower;
+    vec3 reflection = reflect(vec3(0.0,0.0,-1.0), normal);
+#endif
+
+    /* Calculate the pixel's position in view space */
+    vec3 view_pos = view_position(u_InvProj, tex_coord, depth);
+
+    float n_dot_l = clamp(dot(u_SunDirection, normal), 0.0, 1.0);
+    float lit = n_dot_l > 0.0 ? shadow(view_pos) : 0.0;
+
+    vec3 diffuse = n_dot_l * albedo;
+#ifdef SPECULAR
+    float r_dot_l = clamp(dot(reflection, -u_SunDirection), 0.0, 1.0);
+    vec3 specular = specular_color * min(1.0, pow(r_dot_l, specular_power));
+#else
+    vec3 specular = vec3(0.0);
+#endif
+
+    o_Color = vec4(u_SunColor * lit * (diffuse + specular), 1.0);
+}
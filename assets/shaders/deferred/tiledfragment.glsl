@@ -0,0 +1,96 @@
+#version 300 es
+precision highp float;
+precision highp int;
+precision highp sampler2D;
+precision highp usampler2D;
+
+uniform sampler2D   s_GBuffer[GBUFFER_SIZE+1];
+uniform sampler2D   s_LightData;
+uniform usampler2D  s_LightGrid;
+uniform usampler2D  s_LightIndices;
+
+uniform mat4    u_InvProj;
+
+uniform vec2    u_Viewport;
+
+out vec4 o_Color;
+
+/* Must match LIGHT_GRID_TILE_SIZE */
+const int kTileSize = 16;
+
+#include "include/gbuffer.glsl"
+ivec2 texel_from_index(int index, int width)
+{
+    return ivec2(index % width, index / width);
+}
+
+void main(void)
+{
+    /** Load texture values
+     */
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec2 tex_coord = gl_FragCoord.xy/u_Viewport; // map to [0..1]
+
+    float depth = texelFetch(s_GBuffer[GBUFFER_SIZE], pixel, 0).r;
+    if(depth == 1.0) {
+        o_Color = vec4(0.0, 0.0, 0.0, 1.0);
+        return;
+    }
+    vec4 gbuffer[GBUFFER_SIZE];
+    gbuffer[0] = texelFetch(s_GBuffer[0], pixel, 0);
+#if GBUFFER_SIZE > 1
+    gbuffer[1] = texelFetch(s_GBuffer[1], pixel, 0);
+#endif
+#if GBUFFER_SIZE > 2
+    gbuffer[2] = texelFetch(s_GBuffer[2], pixel, 0);
+#endif
+    vec3 albedo = GBUFFER_ALBEDO(gbuffer);
+    vec3 normal = decode(GBUFFER_NORMAL(gbuffer));
+#ifdef SPECULAR
+  #ifdef GBUFFER_SPECULAR_COLOR
+    vec3 specular_color = GBUFFER_SPECULAR_COLOR(gbuffer);
+  #else
+    vec3 specular_color = vec3(GBUFFER_SPECULAR_INTENSITY(gbuffer));
+  #endif
+    float specular_power = GBUFFER_SPECULAR_POWER(gbuffer) * kMaxSpecularPower;
+    vec3 reflection = reflect(vec3(0.0,0.0,-1.0), normal);
+#endif
+
+    /* Calculate the pixel's position in view space */
+    vec3 view_pos = view_position(u_InvProj, tex_coord, depth);
+
+    /* Walk this tile's light list */
+    int light_width = textureSize(s_LightData, 0).x;
+    int index_width = textureSize(s_LightIndices, 0).x;
+    uvec2 tile = texelFetch(s_LightGrid, pixel / kTileSize, 0).rg;
+    int first = int(tile.x);
+    int count = int(tile.y);
+
+    vec3 final_lighting = vec3(0.0);
+    for(int ii=0; ii<count; ++ii) {
+        int light = int(texelFetch(s_LightIndices, texel_from_index(first+ii, index_width), 0).r);
+        vec4 position_size = texelFetch(s_LightData, texel_from_index(light*2+0, light_width), 0);
+        vec3 light_color = texelFetch(s_LightData, texel_from_index(light*2+1, light_width), 0).rgb;
+
+        vec3 light_dir = position_size.xyz - view_pos;
+        float dist = length(light_dir);
+        float size = position_size.w;
+        float attenuation = light_attenuation(dist, size);
+        light_dir = normalize(light_dir);
+
+        /* Calculate diffuse lighting */
+        float n_dot_l = clamp(dot(light_dir, normal), 0.0, 1.0);
+        vec3 diffuse = light_color * n_dot_l * albedo;
+#ifdef SPECULAR
+        /* Calculate specular lighting, the same way the forward renderer does */
+        float r_dot_l = clamp(dot(reflection, -light_dir), 0.0, 1.0);
+        vec3 specular = specular_color * min(1.0, pow(r_dot_l, specular_power)) * light_color;
+#else
+        vec3 specular = vec3(0.0);
+#endif
+
+        final_lighting += attenuation * (diffuse + specular);
+    }
+
+    o_Color = vec4(final_lighting,1.0);
+}
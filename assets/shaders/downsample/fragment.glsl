@@ -0,0 +1,36 @@
+#version 300 es
+precision highp float;
+precision highp sampler2D;
+
+/* Must match MAX_DOWNSAMPLE_TARGETS */
+uniform sampler2D   s_Depth;
+uniform sampler2D   s_Target[3];
+
+layout(location = 0) out vec4 o_Target0;
+layout(location = 1) out vec4 o_Target1;
+layout(location = 2) out vec4 o_Target2;
+
+void main(void)
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 source = pixel*2;
+    ivec2 last = textureSize(s_Depth, 0) - 1;
+
+    /* Nearest on even pixels, farthest on odd ones */
+    bool farthest = ((pixel.x + pixel.y) & 1) == 1;
+    ivec2 best = source;
+    float best_depth = texelFetch(s_Depth, source, 0).r;
+    for(int ii=1; ii<4; ++ii) {
+        ivec2 texel = min(source + ivec2(ii & 1, ii >> 1), last);
+        float depth = texelFetch(s_Depth, texel, 0).r;
+        if(farthest ? depth > best_depth : depth < best_depth) {
+            best = texel;
+            best_depth = depth;
+        }
+    }
+
+    gl_FragDepth = best_depth;
+    o_Target0 = texelFetch(s_Target[0], best, 0);
+    o_Target1 = texelFetch(s_Target[1], best, 0);
+    o_Target2 = texelFetch(s_Target[2], best, 0);
+}
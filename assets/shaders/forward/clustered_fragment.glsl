@@ -0,0 +1,93 @@
+#version 300 es
+precision highp float;
+precision highp int;
+precision highp sampler2D;
+precision highp usampler2D;
+
+uniform sampler2D   s_Albedo;
+uniform sampler2D   s_Normal;
+uniform sampler2D   s_LightData;
+uniform usampler2D  s_LightGrid;
+uniform usampler2D  s_LightIndices;
+
+uniform vec3    u_SpecularColor;
+uniform float   u_SpecularPower;
+uniform float   u_SpecularCoefficient;
+
+/* slice = log(z)*u_SliceScale + u_SliceBias */
+uniform float   u_SliceScale;
+uniform float   u_SliceBias;
+uniform int     u_NumSlices;
+uniform int     u_TilesX;
+uniform int     u_TilesY;
+uniform int     u_SliceColumns; /* Slices side by side in s_LightGrid */
+
+in vec3 v_PositionVS;
+in vec3 v_NormalVS;
+in vec3 v_TangentVS;
+in vec3 v_BitangentVS;
+in vec2 v_TexCoord;
+
+out vec4 o_Color;
+
+/* Must match LIGHT_GRID_TILE_SIZE */
+const int kTileSize = 16;
+
+#include "include/lighting.glsl"
+
+ivec2 texel_from_index(int index, int width)
+{
+    return ivec2(index % width, index / width);
+}
+
+void main(void) {
+    /** Load texture values
+     */
+    vec3 albedo = texture(s_Albedo, v_TexCoord).rgb;
+    vec3 normal = normalize(texture(s_Normal, v_TexCoord).rgb*2.0 - 1.0);
+    vec3 specular_color = u_SpecularCoefficient * u_SpecularColor;
+
+    vec3 N = normalize(v_NormalVS);
+    vec3 T = normalize(v_TangentVS);
+    vec3 B = normalize(v_BitangentVS);
+
+    mat3 TBN = mat3(T, B, N);
+    normal = normalize(TBN*normal);
+
+    /* Find this fragment's cluster */
+    ivec2 tile = ivec2(gl_FragCoord.xy) / kTileSize;
+    int slice = int(floor(log(max(v_PositionVS.z, 1e-4))*u_SliceScale + u_SliceBias));
+    slice = clamp(slice, 0, u_NumSlices-1);
+    ivec2 slice_origin = ivec2(slice % u_SliceColumns, slice / u_SliceColumns) * ivec2(u_TilesX, u_TilesY);
+    uvec2 cluster = texelFetch(s_LightGrid, slice_origin + tile, 0).rg;
+    int first = int(cluster.x);
+    int count = int(cluster.y);
+
+    int light_width = textureSize(s_LightData, 0).x;
+    int index_width = textureSize(s_LightIndices, 0).x;
+
+    vec3 final_color = vec3(0);
+    for(int ii=0; ii < count; ++ii) {
+        int light = int(texelFetch(s_LightIndices, texel_from_index(first+ii, index_width), 0).r);
+        vec4 position_size = texelFetch(s_LightData, texel_from_index(light*2+0, light_width), 0);
+        vec3 light_color = texelFetch(s_LightData, texel_from_index(light*2+1, light_width), 0).rgb;
+
+        vec3 light_dir = position_size.xyz - v_PositionVS;
+        float dist = length(light_dir);
+        float size = position_size.w;
+        float attenuation = light_attenuation(dist, size);
+        light_dir = normalize(light_dir);
+
+        /* Calculate diffuse lighting */
+        float n_dot_l = clamp(dot(light_dir, normal), 0.0, 1.0);
+        /* Calculate specular lighting */
+        vec3 reflection = reflect(vec3(0.0,0.0,-1.0), normal);
+        float r_dot_l = clamp(dot(reflection, -light_dir), 0.0, 1.0);
+        /* Calculate final colors */
+        vec3 diffuse = albedo * light_color * n_dot_l;
+        vec3 specular = specular_color * vec3(min(1.0, pow(r_dot_l, u_SpecularPower))) * light_color;
+
+        final_color += attenuation * (diffuse + specular);
+    }
+    o_Color = vec4(final_color,1.0);
+}
@@ -2,10 +2,18 @@ precision highp float;
 uniform sampler2D s_Albedo;
 uniform sampler2D s_Normal;
 
-uniform vec3    u_LightPositions[64];
-uniform vec3    u_LightColors[64];
-uniform float   u_LightSizes[64];
-uniform int     u_NumLights;
+/** Features, defined per permutation by the renderer
+ *  NUM_LIGHTS: The fixed number of lights, unrolled
+ *  NORMAL_MAP: Perturbs the vertex normals with s_Normal
+ */
+#ifndef NUM_LIGHTS
+    #define NUM_LIGHTS 0
+#endif
+#if NUM_LIGHTS > 0
+uniform vec3    u_LightPositions[NUM_LIGHTS];
+uniform vec3    u_LightColors[NUM_LIGHTS];
+uniform float   u_LightSizes[NUM_LIGHTS];
+#endif
 
 uniform vec3    u_SpecularColor;
 uniform float   u_SpecularPower;
@@ -17,39 +25,70 @@ varying vec3 v_TangentVS;
 varying vec3 v_BitangentVS;
 varying vec2 v_TexCoord;
 
+#include "include/lighting.glsl"
+
+vec3 shade_light(vec3 light_position, vec3 light_color, float size,
+                 vec3 albedo, vec3 normal, vec3 specular_color)
+{
+    vec3 light_dir = light_position - v_PositionVS;
+    float dist = length(light_dir);
+    float attenuation = light_attenuation(dist, size);
+    light_dir = normalize(light_dir);
+
+    /* Calculate diffuse lighting */
+    float n_dot_l = clamp(dot(light_dir, normal), 0.0, 1.0);
+    /* Calculate specular lighting */
+    vec3 reflection = reflect(vec3(0.0,0.0,-1.0), normal);
+    float r_dot_l = clamp(dot(reflection, -light_dir), 0.0, 1.0);
+    /* Calculate final colors */
+    vec3 diffuse = albedo * light_color * n_dot_l;
+    vec3 specular = specular_color * vec3(min(1.0, pow(r_dot_l, u_SpecularPower))) * light_color;
+
+    return attenuation * (diffuse + specular);
+}
+
+/* The light loop, unrolled by the preprocessor */
+#define SHADE1(ii)  final_color += shade_light(u_LightPositions[ii], u_LightColors[ii], u_LightSizes[ii], albedo, normal, specular_color);
+#define SHADE2(ii)  SHADE1(ii)  SHADE1(ii+1)
+#define SHADE4(ii)  SHADE2(ii)  SHADE2(ii+2)
+#define SHADE8(ii)  SHADE4(ii)  SHADE4(ii+4)
+#define SHADE16(ii) SHADE8(ii)  SHADE8(ii+8)
+#define SHADE32(ii) SHADE16(ii) SHADE16(ii+16)
+#define SHADE64(ii) SHADE32(ii) SHADE32(ii+32)
+
 void main(void) {
     /** Load texture values
      */
     vec3 albedo = texture2D(s_Albedo, v_TexCoord).rgb;
-    vec3 normal = normalize(texture2D(s_Normal, v_TexCoord).rgb*2.0 - 1.0);
     vec3 specular_color = u_SpecularCoefficient * u_SpecularColor;
 
+#ifdef NORMAL_MAP
+    vec3 normal = normalize(texture2D(s_Normal, v_TexCoord).rgb*2.0 - 1.0);
     vec3 N = normalize(v_NormalVS);
     vec3 T = normalize(v_TangentVS);
     vec3 B = normalize(v_BitangentVS);
 
     mat3 TBN = mat3(T, B, N);
     normal = normalize(TBN*normal);
+#else
+    vec3 normal = normalize(v_NormalVS);
+#endif
 
     vec3 final_color = vec3(0);
-    for(int ii=0; ii < u_NumLights; ++ii) {
-        vec3 light_color = u_LightColors[ii];
-        vec3 light_dir = u_LightPositions[ii] - v_PositionVS;
-        float dist = length(light_dir);
-        float size = u_LightSizes[ii];
-        float attenuation = 1.0 - pow( clamp(dist/size, 0.0, 1.0), 2.0);
-        light_dir = normalize(light_dir);
-
-        /* Calculate diffuse lighting */
-        float n_dot_l = clamp(dot(light_dir, normal), 0.0, 1.0);
-        /* Calculate specular lighting */
-        vec3 reflection = reflect(vec3(0.0,0.0,-1.0), normal);
-        float r_dot_l = clamp(dot(reflection, -light_dir), 0.0, 1.0);
-        /* Calculate final colors */
-        vec3 diffuse = albedo * light_color * n_dot_l;
-        vec3 specular = specular_color * vec3(min(1.0, pow(r_dot_l, u_SpecularPower))) * light_color;
-
-        final_color += attenuation * (diffuse + specular);
-    }
+#if NUM_LIGHTS == 1
+    SHADE1(0)
+#elif NUM_LIGHTS == 2
+    SHADE2(0)
+#elif NUM_LIGHTS == 4
+    SHADE4(0)
+#elif NUM_LIGHTS == 8
+    SHADE8(0)
+#elif NUM_LIGHTS == 16
+    SHADE16(0)
+#elif NUM_LIGHTS == 32
+    SHADE32(0)
+#elif NUM_LIGHTS == 64
+    SHADE64(0)
+#endif
     gl_FragColor = vec4(final_color,1.0);
 }
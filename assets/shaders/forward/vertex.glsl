@@ -14,6 +14,11 @@ varying vec3 v_TangentVS;
 varying vec3 v_BitangentVS;
 varying vec2 v_TexCoord;
 
+/* Models with more lights than one pass holds are drawn again, additively,
+ * over the same depth
+ */
+invariant gl_Position;
+
 void main(void) {
     mat3 world3 = mat3(u_World);
     mat3 view3 = mat3(u_View);
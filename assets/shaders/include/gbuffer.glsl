@@ -0,0 +1,13 @@
+#ifndef GBUFFER_GLSL
+#define GBUFFER_GLSL
+/** Layout fields, GBUFFER_SIZE and the GBUFFER_<field>(g) accessors are
+ *  generated from the layout in deferred.c. Depth follows the targets.
+ */
+#if defined(GBUFFER_SPECULAR_COLOR) || defined(GBUFFER_SPECULAR_INTENSITY)
+    #define SPECULAR
+#endif
+
+#include "include/octahedral.glsl"
+#include "include/lighting.glsl"
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef LIGHTING_GLSL
+#define LIGHTING_GLSL
+/** Lighting shared by every renderer, ESSL 1.00 and 3.00 alike */
+
+/* Specular powers are stored in [0..1] scaled down by this */
+const float kMaxSpecularPower = 128.0;
+
+/** Point light falloff, reaching 0 at the light's size */
+float light_attenuation(float dist, float size)
+{
+    return 1.0 - pow( clamp(dist/size, 0.0, 1.0), 2.0);
+}
+/** View space position of a pixel, from its [0..1] screen coordinate and
+ *  its depth buffer value
+ */
+vec3 view_position(mat4 inv_proj, vec2 tex_coord, float depth)
+{
+    vec4 view_pos = inv_proj * vec4(tex_coord*2.0-1.0, depth*2.0 - 1.0, 1.0);
+    return view_pos.xyz / view_pos.w;
+}
+/** View space depth of a depth buffer value */
+float view_depth(mat4 inv_proj, float depth)
+{
+    vec4 view_pos = inv_proj * vec4(0.0, 0.0, depth*2.0 - 1.0, 1.0);
+    return view_pos.z / view_pos.w;
+}
+/** Specular light is accumulated as luminance next to the diffuse light */
+float light_luminance(vec3 color)
+{
+    return dot(color, vec3(0.299, 0.587, 0.114));
+}
+/** The accumulated specular light, given the diffuse light's color back */
+vec3 colored_specular(vec4 light)
+{
+    vec3 chromaticity = light.rgb / max(light_luminance(light.rgb), 0.0001);
+    return light.a * chromaticity;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef OCTAHEDRAL_GLSL
+#define OCTAHEDRAL_GLSL
+/** Octahedral normal encoding. Folds the sphere onto a square so all of it,
+ *  both signs of z included, is stored in two UNORM channels.
+ */
+vec2 sign_not_zero(vec2 v)
+{
+    return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+vec2 encode(vec3 normal)
+{
+    vec2 oct = normal.xy / (abs(normal.x) + abs(normal.y) + abs(normal.z));
+    if(normal.z < 0.0)
+        oct = (1.0 - abs(oct.yx)) * sign_not_zero(oct);
+    return oct*0.5+0.5;
+}
+vec3 decode(vec2 encoded)
+{
+    vec2 oct = encoded*2.0 - 1.0;
+    vec3 norm = vec3(oct, 1.0 - abs(oct.x) - abs(oct.y));
+    if(norm.z < 0.0)
+        norm.xy = (1.0 - abs(norm.yx)) * sign_not_zero(norm.xy);
+    return normalize(norm);
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef UPSAMPLE_GLSL
+#define UPSAMPLE_GLSL
+/** Joint bilateral upsample of a half resolution light buffer, ESSL 3.00.
+ *  The including shader defines how to read its half resolution GBuffer.
+ */
+#include "include/lighting.glsl"
+
+/* How quickly half resolution samples lose weight as their relative view
+ * depth and their normal move away from the pixel's
+ */
+const float kDepthSharpness = 32.0;
+const float kNormalSharpness = 8.0;
+
+/** Normal and view space depth of a half resolution texel */
+vec3 half_normal(ivec2 texel);
+float half_view_depth(ivec2 texel);
+
+/** The light at this pixel, whose normal is `normal` and view depth `z`.
+ *  The four nearest half resolution samples are weighted bilinearly and by
+ *  how well their depth and normal match this pixel's.
+ */
+vec4 upsample_light(sampler2D light_buffer, vec3 normal, float z)
+{
+    ivec2 half_last = textureSize(light_buffer, 0) - 1;
+    vec2 half_pos = gl_FragCoord.xy*0.5 - 0.5;
+    ivec2 base = ivec2(floor(half_pos));
+    vec2 fraction = half_pos - vec2(base);
+
+    vec4 light = vec4(0.0);
+    float total_weight = 0.0;
+    vec4 closest_light = vec4(0.0);
+    float closest_dz = 1.0e30;
+    for(int ii=0; ii<4; ++ii) {
+        ivec2 offset = ivec2(ii & 1, ii >> 1);
+        ivec2 texel = clamp(base + offset, ivec2(0), half_last);
+        vec2 bilinear = mix(1.0 - fraction, fraction, vec2(offset));
+
+        vec3 sample_normal = half_normal(texel);
+        float sample_z = half_view_depth(texel);
+        vec4 sample_light = texelFetch(light_buffer, texel, 0);
+
+        float dz = abs(sample_z - z) / abs(z);
+        float weight = bilinear.x * bilinear.y
+                     * exp(-dz*kDepthSharpness)
+                     * pow(max(dot(normal, sample_normal), 0.0), kNormalSharpness);
+        light += weight * sample_light;
+        total_weight += weight;
+        if(dz < closest_dz) {
+            closest_dz = dz;
+            closest_light = sample_light;
+        }
+    }
+    /* No sample matches, the surface is thinner than a half resolution
+     * pixel. Take the one closest in depth.
+     */
+    return total_weight > 0.0001 ? light/total_weight : closest_light;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#version 300 es
+precision mediump float;
+
+out vec4 o_Color;
+
+/* Never runs, the rasterizer is disabled during transform feedback */
+void main(void)
+{
+    o_Color = vec4(0.0);
+}
@@ -0,0 +1,20 @@
+#version 300 es
+uniform mat4    u_View;
+uniform float   u_Time;
+
+in vec4 a_LightPosition;    /* World space, size in w */
+in vec4 a_LightColor;       /* Phase in w */
+in vec4 a_LightAnimation;   /* Swing axis scaled by its amplitude, speed in w */
+
+/* Captured by transform feedback as a light volume instance */
+out vec4 v_LightPosition;   /* View space, size in w */
+out vec3 v_LightColor;
+
+void main(void)
+{
+    float swing = sin(u_Time*a_LightAnimation.w + a_LightColor.w);
+    vec4 position = vec4(a_LightPosition.xyz + a_LightAnimation.xyz*swing, 1.0);
+    v_LightPosition = vec4((u_View * position).xyz, a_LightPosition.w);
+    v_LightColor = a_LightColor.rgb;
+    gl_Position = vec4(0.0, 0.0, 0.0, 1.0);
+}
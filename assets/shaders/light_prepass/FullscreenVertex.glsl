@@ -0,0 +1,7 @@
+#version 300 es
+in vec4 a_Position;
+
+void main(void)
+{
+    gl_Position = a_Position;
+}
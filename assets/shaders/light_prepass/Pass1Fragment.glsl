@@ -10,6 +10,8 @@ varying vec2 v_TexCoord;
 
 varying vec2 v_Depth;
 
+#include "include/lighting.glsl"
+
 void main(void)
 {
     /** Load texture values
@@ -23,5 +25,5 @@ void main(void)
     mat3 TBN = mat3(T, B, N);
     normal = normalize(TBN*normal);
 
-    gl_FragColor = vec4((normal + 1.0) * 0.5, u_SpecularPower);
+    gl_FragColor = vec4((normal + 1.0) * 0.5, u_SpecularPower/kMaxSpecularPower);
 }
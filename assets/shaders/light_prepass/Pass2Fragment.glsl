@@ -6,11 +6,10 @@ uniform mat4    u_InvProj;
 
 uniform vec2    u_Viewport;
 
-uniform vec3    u_LightColor;
-uniform vec3    u_LightPosition;
-uniform float   u_LightSize;
+varying vec4    v_LightPosition;
+varying vec3    v_LightColor;
 
-varying vec4    v_Position;
+#include "include/lighting.glsl"
 
 void main(void)
 {
@@ -20,25 +19,29 @@ void main(void)
 
     vec4 gbuffer_val = texture2D(s_GBuffer, tex_coord);
     vec3 normal = gbuffer_val.rgb * 2.0 - 1.0;
-    float specular_power = gbuffer_val.a;
+    float specular_power = gbuffer_val.a * kMaxSpecularPower;
     float depth = texture2D(s_Depth, tex_coord).r;
 
     /* Calculate the pixel's position in view space */
-    vec4 view_pos = vec4(tex_coord*2.0-1.0, depth * 2.0 - 1.0, 1.0);
-    view_pos = u_InvProj * view_pos;
-    view_pos /= view_pos.w;
+    vec3 view_pos = view_position(u_InvProj, tex_coord, depth);
 
-    vec3 light_dir = u_LightPosition - view_pos.xyz;
+    vec3 light_dir = v_LightPosition.xyz - view_pos;
     float dist = length(light_dir);
-    float size = u_LightSize;
-    float attenuation = 1.0 - pow( clamp(dist/size, 0.0, 1.0), 2.0);
+    float size = v_LightPosition.w;
+    float attenuation = light_attenuation(dist, size);
     light_dir = normalize(light_dir);
 
     /* Calculate diffuse lighting */
     float n_dot_l = clamp(dot(light_dir, normal), 0.0, 1.0);
-    vec3 diffuse = u_LightColor * n_dot_l;
-
-    vec3 final_color = attenuation * (diffuse);
-
-    gl_FragColor = vec4(final_color, 1.0);
+    vec3 diffuse = v_LightColor * n_dot_l;
+    /* Calculate specular lighting, the same way the forward renderer does */
+    vec3 reflection = reflect(vec3(0.0,0.0,-1.0), normal);
+    float r_dot_l = clamp(dot(reflection, -light_dir), 0.0, 1.0);
+    float specular = min(1.0, pow(r_dot_l, specular_power));
+
+    /** Light buffer format
+     *  RGB: Diffuse light
+     *  A: Specular light, as luminance. Pass 3 tints it with the diffuse color
+     */
+    gl_FragColor = attenuation * vec4(diffuse, specular*light_luminance(v_LightColor));
 }
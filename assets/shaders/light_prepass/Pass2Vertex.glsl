@@ -1,10 +1,16 @@
 uniform mat4 u_Projection;
-uniform mat4 u_View;
-uniform mat4 u_World;
 
 attribute vec4 a_Position;
+attribute vec4 a_LightPosition; /* View space position, size in w */
+attribute vec3 a_LightColor;
+
+varying vec4 v_LightPosition;
+varying vec3 v_LightColor;
 
 void main(void)
 {
-    gl_Position = u_Projection * u_View * u_World * a_Position;
+    vec4 view_pos = vec4(a_Position.xyz*a_LightPosition.w + a_LightPosition.xyz, 1.0);
+    v_LightPosition = a_LightPosition;
+    v_LightColor = a_LightColor;
+    gl_Position = u_Projection * view_pos;
 }
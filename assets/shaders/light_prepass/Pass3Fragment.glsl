@@ -4,8 +4,13 @@ uniform sampler2D s_Albedo;
 
 uniform vec2 u_Viewport;
 
+uniform vec3    u_SpecularColor;
+uniform float   u_SpecularCoefficient;
+
 varying vec2 v_TexCoord;
 
+#include "include/lighting.glsl"
+
 /** GBuffer format
  *  [0] RGB: Albedo
  *  [1] RGB: VS Normal
@@ -16,7 +21,10 @@ void main(void)
     /** Load texture values
      */
     vec2 tex_coord = gl_FragCoord.xy/u_Viewport; // map to [0..1]
-    vec3 light = texture2D(s_GBuffer,tex_coord).rgb;
+    vec4 light = texture2D(s_GBuffer,tex_coord);
     vec3 albedo = texture2D(s_Albedo, v_TexCoord).rgb;
-    gl_FragColor = vec4(light*albedo,1.0);
+
+    vec3 specular = u_SpecularCoefficient * u_SpecularColor * colored_specular(light);
+
+    gl_FragColor = vec4(light.rgb*albedo + specular,1.0);
 }
@@ -0,0 +1,68 @@
+#version 300 es
+precision highp float;
+precision highp sampler2D;
+
+uniform sampler2D   s_Depth;
+uniform sampler2D   s_PrevDepth;
+uniform sampler2D   s_PrevLight;
+uniform sampler2D   s_Normal;
+uniform sampler2D   s_PrevNormal;
+
+uniform mat4    u_InvProj;
+uniform mat4    u_ViewToPrevClip;
+uniform mat4    u_PrevViewToView;
+uniform int     u_RefreshPhase;
+
+out vec4 o_Color;
+
+/* Relative view depth difference still considered the same surface */
+const float kMaxDepthError = 0.02;
+/* Cosine of the largest normal change still considered the same surface,
+ * catches models turning in place
+ */
+const float kMinNormalDot = 0.99;
+/* Cosine of the largest change in view direction whose specular is kept */
+const float kMinViewDot = 0.9998; /* About 1.1 degrees */
+
+#include "include/lighting.glsl"
+
+/** Copies last frame's light for the pixels whose surface was visible then,
+ *  facing the same way and seen from nearly the same direction. Every other
+ *  pixel is discarded, leaving it to the light volumes.
+ */
+void main(void)
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(s_Depth, 0);
+
+    /* Sky, and one pixel of every 4x4 block in turn, is shaded again */
+    float depth = texelFetch(s_Depth, pixel, 0).r;
+    if(depth == 1.0 || ((pixel.x & 3) | ((pixel.y & 3) << 2)) == u_RefreshPhase)
+        discard;
+
+    /* Where this pixel's surface was last frame */
+    vec3 view_pos = view_position(u_InvProj, gl_FragCoord.xy/vec2(size), depth);
+    vec4 prev_clip = u_ViewToPrevClip * vec4(view_pos, 1.0);
+    vec2 prev_coord = (prev_clip.xy/prev_clip.w*0.5 + 0.5) * vec2(size);
+    if(prev_clip.w <= 0.0 || any(lessThan(prev_coord, vec2(0.0))) || any(greaterThanEqual(prev_coord, vec2(size))))
+        discard;
+    ivec2 prev_pixel = ivec2(prev_coord);
+
+    /* Disoccluded, something else covered it */
+    float prev_z = view_depth(u_InvProj, texelFetch(s_PrevDepth, prev_pixel, 0).r);
+    if(abs(prev_z - prev_clip.w) > kMaxDepthError*prev_clip.w)
+        discard;
+
+    /* Same place, but the surface turned */
+    vec3 normal = texelFetch(s_Normal, pixel, 0).xyz*2.0 - 1.0;
+    vec3 prev_normal = mat3(u_PrevViewToView) * (texelFetch(s_PrevNormal, prev_pixel, 0).xyz*2.0 - 1.0);
+    if(dot(normal, prev_normal) < kMinNormalDot*length(normal)*length(prev_normal))
+        discard;
+
+    /* Specular in alpha depends on the view direction */
+    vec3 prev_eye = (u_PrevViewToView * vec4(0.0, 0.0, 0.0, 1.0)).xyz;
+    if(dot(normalize(view_pos), normalize(view_pos - prev_eye)) < kMinViewDot)
+        discard;
+
+    o_Color = texelFetch(s_PrevLight, prev_pixel, 0);
+}
@@ -0,0 +1,39 @@
+#version 300 es
+precision highp float;
+precision highp sampler2D;
+
+uniform sampler2D   s_GBuffer;
+uniform sampler2D   s_Depth;
+uniform sampler2D   s_HalfGBuffer;
+uniform sampler2D   s_HalfDepth;
+uniform sampler2D   s_Light;
+
+uniform mat4    u_InvProj;
+
+out vec4 o_Color;
+
+#include "include/upsample.glsl"
+
+vec3 half_normal(ivec2 texel)
+{
+    return texelFetch(s_HalfGBuffer, texel, 0).rgb * 2.0 - 1.0;
+}
+float half_view_depth(ivec2 texel)
+{
+    return view_depth(u_InvProj, texelFetch(s_HalfDepth, texel, 0).r);
+}
+
+void main(void)
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+
+    float depth = texelFetch(s_Depth, pixel, 0).r;
+    if(depth == 1.0) {
+        o_Color = vec4(0.0);
+        return;
+    }
+    vec3 normal = texelFetch(s_GBuffer, pixel, 0).rgb * 2.0 - 1.0;
+    float z = view_depth(u_InvProj, depth);
+
+    o_Color = upsample_light(s_Light, normal, z);
+}
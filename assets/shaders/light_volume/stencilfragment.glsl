@@ -0,0 +1,7 @@
+precision lowp float;
+
+/* Color writes are masked off, only the stencil result matters */
+void main(void)
+{
+    gl_FragColor = vec4(0.0);
+}
@@ -0,0 +1,10 @@
+uniform mat4 u_Projection;
+
+attribute vec4 a_Position;
+attribute vec4 a_LightPosition; /* View space position, size in w */
+
+void main(void)
+{
+    vec4 view_pos = vec4(a_Position.xyz*a_LightPosition.w + a_LightPosition.xyz, 1.0);
+    gl_Position = u_Projection * view_pos;
+}
@@ -0,0 +1,7 @@
+#version 300 es
+precision mediump float;
+
+/* Depth only */
+void main(void)
+{
+}
@@ -0,0 +1,10 @@
+#version 300 es
+uniform mat4 u_ViewProj;
+uniform mat4 u_World;
+
+in vec4 a_Position;
+
+void main(void)
+{
+    gl_Position = u_ViewProj * (u_World * a_Position);
+}
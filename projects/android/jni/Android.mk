@@ -12,6 +12,7 @@ WARNINGS    +=
 LOCAL_MODULE    := libandroidinterface
 LOCAL_CFLAGS    := $(INCLUDES) $(WARNINGS) $(C_STD)
 LOCAL_CXXFLAGS  := $(INCLUDES) $(WARNINGS) $(CXX_STD)
+LOCAL_ARM_NEON  := true
 LOCAL_SRC_FILES := 	jni.c \
 				../../../src/android/system_android.c \
 				../../../src/graphics.c \
@@ -25,6 +26,13 @@ LOCAL_SRC_FILES := 	jni.c \
                     ../../../src/ui.c \
                     ../../../src/utility.c \
                     ../../../src/texture.c \
+                    ../../../src/light_grid.c \
+                    ../../../src/light_volume.c \
+                    ../../../src/light_culling.c \
+                    ../../../src/shadow.c \
+                    ../../../src/gbuffer_downsample.c \
+                    ../../../src/light_animation.c \
+                    ../../../src/gpu_timing.c \
                     ../../../src/scene.cpp \
                     ../../../external/stb_image.c
 LOCAL_LDLIBS := -lGLESv3 -lEGL -llog -landroid
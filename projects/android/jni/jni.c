@@ -1,5 +1,6 @@
 #include <jni.h>
 #include <sys/types.h>
+#include <stdio.h>
 #include <android/asset_manager_jni.h>
 #include "game.h"
 #include "system.h"
@@ -7,6 +8,8 @@
 #define UNUSED_PARAMETER(param) (void)sizeof((param))
 
 extern AAssetManager* _asset_manager;
+extern char _cache_directory[256];
+extern char _asset_directory[256];
 
 static Game* _game = NULL;
 
@@ -33,13 +36,30 @@ JNIEXPORT void JNICALL Java_com_intel_deferredgles_JNIWrapper_init_1asset_1manag
     UNUSED_PARAMETER(env);
     UNUSED_PARAMETER(obj);
 }
-JNIEXPORT void JNICALL Java_com_intel_deferredgles_JNIWrapper_frame(JNIEnv * env, jobject obj)
+JNIEXPORT void JNICALL Java_com_intel_deferredgles_JNIWrapper_init_1cache_1directory(JNIEnv * env, jobject obj, jstring path)
+{
+    const char* chars = (*env)->GetStringUTFChars(env, path, NULL);
+    snprintf(_cache_directory, sizeof(_cache_directory), "%s/", chars);
+    (*env)->ReleaseStringUTFChars(env, path, chars);
+
+    UNUSED_PARAMETER(obj);
+}
+JNIEXPORT void JNICALL Java_com_intel_deferredgles_JNIWrapper_init_1asset_1directory(JNIEnv * env, jobject obj, jstring path)
+{
+    const char* chars = (*env)->GetStringUTFChars(env, path, NULL);
+    snprintf(_asset_directory, sizeof(_asset_directory), "%s/", chars);
+    (*env)->ReleaseStringUTFChars(env, path, chars);
+
+    UNUSED_PARAMETER(obj);
+}
+JNIEXPORT jboolean JNICALL Java_com_intel_deferredgles_JNIWrapper_frame(JNIEnv * env, jobject obj)
 {
     update_game(_game);
     render_game(_game);
 
     UNUSED_PARAMETER(env);
     UNUSED_PARAMETER(obj);
+    return game_idle(_game) ? JNI_FALSE : JNI_TRUE;
 }
 JNIEXPORT void JNICALL Java_com_intel_deferredgles_JNIWrapper_touch_1down(JNIEnv * env, jobject obj, int index, float x, float y)
 {
@@ -10,6 +10,7 @@ import android.os.Bundle;
 import android.widget.Toast;
 import android.content.res.AssetManager;
 import android.util.Log;
+import java.io.File;
 import android.view.MotionEvent;
 import android.opengl.GLSurfaceView.EGLContextFactory;
 import javax.microedition.khronos.egl.EGLContext;
@@ -33,12 +34,16 @@ public class DeferredGLES extends Activity
         _view = new GLSurfaceView(this);
         _view.setEGLContextClientVersion(2);
         _view.setEGLConfigChooser(8,8,8,8,16,0);
-        _view.setRenderer(new Renderer());
+        _view.setRenderer(new Renderer(_view));
         setContentView(_view);
 
         /* Load asset manager */
         _asset_manager = getAssets();
         JNIWrapper.init_asset_manager(_asset_manager);
+        JNIWrapper.init_cache_directory(getCacheDir().getAbsolutePath());
+        File asset_directory = getExternalFilesDir(null);
+        if(asset_directory != null)
+            JNIWrapper.init_asset_directory(asset_directory.getAbsolutePath());
     }
 
     @Override protected void onPause()
@@ -58,6 +63,9 @@ public class DeferredGLES extends Activity
     @Override
     public boolean onTouchEvent( MotionEvent event ) {
         int index = event.getActionIndex();
+
+        /* Wake up from idle */
+        _view.setRenderMode(GLSurfaceView.RENDERMODE_CONTINUOUSLY);
         int pointerId = event.getPointerId(index);
         int action = event.getActionMasked();
 
@@ -83,6 +91,12 @@ public class DeferredGLES extends Activity
      */
     private static class Renderer implements GLSurfaceView.Renderer
     {
+        private GLSurfaceView _view;
+
+        public Renderer(GLSurfaceView view)
+        {
+            _view = view;
+        }
         public void onSurfaceCreated(GL10 gl, EGLConfig config)
         {
             JNIWrapper.init(1, 1);
@@ -93,7 +107,9 @@ public class DeferredGLES extends Activity
         }
         public void onDrawFrame(GL10 gl)
         {
-            JNIWrapper.frame();
+            /* Idle frames look the same, stop swapping until touched */
+            if(!JNIWrapper.frame())
+                _view.setRenderMode(GLSurfaceView.RENDERMODE_WHEN_DIRTY);
         }
     }
 }
@@ -12,7 +12,15 @@ public class JNIWrapper
     public static native void init(int width, int height);
     public static native void resize(int width, int height);
     public static native void init_asset_manager(AssetManager asset_manager);
-    public static native void frame();
+    /** Where compiled shader programs are cached between launches */
+    public static native void init_cache_directory(String path);
+    /** Loose files here override the packaged assets, and are reloaded when
+     *  they change */
+    public static native void init_asset_directory(String path);
+    /** @return false when nothing is changing, the view can stop redrawing
+     *      until the next touch
+     */
+    public static native boolean frame();
 
     public static native void touch_down(int index, float x, float y);
     public static native void touch_up(int index, float x, float y);
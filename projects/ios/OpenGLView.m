@@ -48,6 +48,7 @@
     int width = (int)[self screenSize].size.width;
     int height = (int)[self screenSize].size.height;
     resize_game(self.game, width, height);
+    self.paused = NO;
 }
 -(void)update
 {
@@ -56,6 +57,9 @@
 - (void)glkView:(GLKView *)view drawInRect:(CGRect)rect
 {
     render_game(self.game);
+    /* Nothing is changing, stop drawing until the next touch */
+    if(game_idle(self.game))
+        self.paused = YES;
 
     (void)sizeof(view);
     (void)sizeof(rect);
@@ -130,6 +134,7 @@
 }
 - (void)touchesBegan:(NSSet *)touches withEvent:(UIEvent *)event {
     TouchPoint points[16] = {0};
+    self.paused = NO;
     int num_points = [self prepareTouches:touches withPoints:points];
     add_touch_points(_game, num_points, points);
     (void)sizeof(event);
@@ -6,10 +6,16 @@
 #include <android/log.h>
 #include <android/asset_manager.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
 
 /* Defines
  */
 #define min(a,b) ((a) < (b) ? (a) : (b))
+#define MAX_ASSET_WATCHES 64
+#define MAX_WATCH_DEPTH 4
 
 /* Types
  */
@@ -17,12 +23,98 @@
 /* Constants
  */
 AAssetManager* _asset_manager = NULL;
+char _cache_directory[256] = {0}; /* Set by the Java side, with a trailing '/' */
+char _asset_directory[256] = {0}; /* Loose assets, also set by the Java side */
 
 /* Variables
  */
+static int  _inotify = -1;
+static int  _watches[MAX_ASSET_WATCHES];
+static char _watch_paths[MAX_ASSET_WATCHES][256];
+static int  _num_watches = 0;
 
 /* Internal functions
  */
+static int _read_file(const char* path, void** data, size_t* data_size)
+{
+    FILE* file = fopen(path, "rb");
+    long size;
+    if(file == NULL)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size <= 0) {
+        fclose(file);
+        return -1;
+    }
+    *data = malloc(size);
+    *data_size = size;
+    if(fread(*data, size, 1, file) != 1) {
+        fclose(file);
+        free(*data);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+/** Writes beside `path` and renames over it, so a crash or full disk
+ *  mid-write never leaves a truncated file behind
+ */
+static int _write_file(const char* path, const void* data, size_t data_size)
+{
+    char temp_path[1024];
+    FILE* file;
+    size_t written;
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    file = fopen(temp_path, "wb");
+    if(file == NULL)
+        return -1;
+    written = fwrite(data, data_size, 1, file);
+    if(fclose(file) != 0 || written != 1) {
+        remove(temp_path);
+        return -1;
+    }
+    return rename(temp_path, path) == 0 ? 0 : -1;
+}
+
+/** inotify doesn't recurse, each directory gets its own watch */
+static void _watch_directory(const char* path, int depth)
+{
+    DIR* directory;
+    struct dirent* entry;
+    int watch;
+    if(_num_watches == MAX_ASSET_WATCHES || depth > MAX_WATCH_DEPTH)
+        return;
+    watch = inotify_add_watch(_inotify, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                              IN_DELETE | IN_CREATE);
+    if(watch < 0)
+        return;
+    _watches[_num_watches] = watch;
+    snprintf(_watch_paths[_num_watches], sizeof(_watch_paths[0]), "%s", path);
+    _num_watches++;
+
+    directory = opendir(path);
+    if(directory == NULL)
+        return;
+    while((entry = readdir(directory)) != NULL) {
+        char child[256];
+        if(entry->d_type != DT_DIR || entry->d_name[0] == '.')
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        _watch_directory(child, depth+1);
+    }
+    closedir(directory);
+}
+static const char* _watch_path(int watch)
+{
+    int ii;
+    for(ii=0;ii<_num_watches;++ii) {
+        if(_watches[ii] == watch)
+            return _watch_paths[ii];
+    }
+    return NULL;
+}
 
 /* External functions
  */
@@ -33,7 +125,14 @@ void free_file_data(void* data)
 }
 int load_file_data(const char* filename, void** data, size_t* data_size)
 {
-    AAsset* file = AAssetManager_open(_asset_manager, filename, AASSET_MODE_UNKNOWN);
+    AAsset* file;
+    if(_asset_directory[0] != '\0') {
+        char path[512];
+        snprintf(path, sizeof(path), "%s%s", _asset_directory, filename);
+        if(_read_file(path, data, data_size) == 0)
+            return 0;
+    }
+    file = AAssetManager_open(_asset_manager, filename, AASSET_MODE_UNKNOWN);
     if(file) {
         off_t file_size = AAsset_getLength(file);
         *data = malloc(file_size);
@@ -45,6 +144,61 @@ int load_file_data(const char* filename, void** data, size_t* data_size)
     }
     return 0;
 }
+int load_cache_data(const char* name, void** data, size_t* data_size)
+{
+    char path[512];
+    if(_cache_directory[0] == '\0')
+        return -1;
+    snprintf(path, sizeof(path), "%s%s", _cache_directory, name);
+    return _read_file(path, data, data_size);
+}
+int save_cache_data(const char* name, const void* data, size_t data_size)
+{
+    char path[512];
+    if(_cache_directory[0] == '\0')
+        return -1;
+    snprintf(path, sizeof(path), "%s%s", _cache_directory, name);
+    return _write_file(path, data, data_size);
+}
+int asset_files_changed(void)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    int changed = 0;
+
+    if(_asset_directory[0] == '\0')
+        return 0;
+    if(_inotify < 0) {
+        char root[256];
+        _inotify = inotify_init1(IN_NONBLOCK);
+        if(_inotify < 0)
+            return 0;
+        /* Without the trailing '/' */
+        snprintf(root, sizeof(root), "%.*s", (int)strlen(_asset_directory)-1, _asset_directory);
+        _watch_directory(root, 0);
+        system_log("Watching %d directories under %s for assets\n", _num_watches, root);
+    }
+    while((length = read(_inotify, buffer, sizeof(buffer))) > 0) {
+        ssize_t offset = 0;
+        while(offset < length) {
+            const struct inotify_event* event = (const struct inotify_event*)(buffer + offset);
+            if(event->len > 0 && (event->mask & IN_ISDIR)) {
+                const char* parent = _watch_path(event->wd);
+                if(parent && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    char child[256];
+                    snprintf(child, sizeof(child), "%s/%s", parent, event->name);
+                    _watch_directory(child, 1);
+                }
+            } else if(event->len > 0 && !(event->mask & IN_CREATE)) {
+                /* Created files are reported again when they're closed */
+                system_log("Asset changed: %s\n", event->name);
+                changed = 1;
+            }
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
 void system_log(const char* format, ...)
 {
     va_list args;
@@ -3,31 +3,70 @@
  */
 #include "deferred.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "gl_include.h"
 #include "mesh.h"
 #include "scene.h"
 #include "graphics.h"
 #include "program.h"
+#include "light_grid.h"
+#include "light_volume.h"
+#include "shadow.h"
+#include "gbuffer_downsample.h"
+#include "gpu_timing.h"
 
 /* Defines
  */
 #define GetUniformLocation(R, pass, program, uniform) R->pass.uniform = glGetUniformLocation(R->pass.program, #uniform)
-#define GBUFFER_SIZE 2
+#define MAX_GBUFFER_TARGETS 3
+#define MAX_GBUFFER_FIELDS 5
+#define MAX_DEFINES_SIZE 1024
+#define NORMAL_ERROR_SAMPLES 100000
+#define DEFAULT_GBUFFER_LAYOUT kGBufferSpecular
+#ifndef GL_RG16_EXT
+    #define GL_RG16_EXT 0x822C /* EXT_texture_norm16 */
+#endif
 
 /* Types
  */
+typedef enum {
+    kTargetRGBA8,
+    kTargetRGB10A2,
+    kTargetNormals, /* In the renderer's NormalFormat */
+} GBufferTargetFormat;
+
 struct DeferredRenderer
 {
     int width;
     int height;
+    int stencil_lights;
+    GLuint  gpu_light_buffer;
+    int     num_gpu_lights;
+    NormalFormat    normal_format;
+    int             normal_supported[MAX_NORMAL_FORMATS];
+    GBufferLayout   layout;
+    int                 half_res_lighting;
+    AccumulationFormat  accumulation_format;
+
+    GLuint  quad_vertex_buffer;
+    GLuint  quad_index_buffer;
 
-    GLuint  cube_vertex_buffer;
-    GLuint  cube_index_buffer;
+    LightGrid*  light_grid;
+    LightVolume*    light_volume;
 
     GLuint  gbuffer_framebuffer;
-    GLuint  gbuffer[GBUFFER_SIZE];
+    GLuint  gbuffer[MAX_GBUFFER_TARGETS];
     GLuint  depth_buffer;
 
+    /* Half resolution lighting */
+    GBufferDownsample*  downsample;
+    GLuint  half_gbuffer_framebuffer;
+    GLuint  half_light_framebuffer;
+    GLuint  half_gbuffer[MAX_GBUFFER_TARGETS];
+    GLuint  half_depth_buffer;
+    GLuint  half_light_buffer;
+
     struct {
         GLuint  program;
 
@@ -35,6 +74,10 @@ struct DeferredRenderer
         GLuint  u_View;
         GLuint  u_Projection;
 
+        GLuint  u_SpecularColor;
+        GLuint  u_SpecularPower;
+        GLuint  u_SpecularCoefficient;
+
         GLuint  s_Albedo;
         GLuint  s_Normal;
     } geometry;
@@ -42,63 +85,129 @@ struct DeferredRenderer
     struct {
         GLuint  program;
 
-        GLuint  u_World;
-        GLuint  u_View;
         GLuint  u_Projection;
 
         GLuint  u_InvProj;
         GLuint  u_Viewport;
 
-        GLuint  u_LightColor;
-        GLuint  u_LightPosition;
-        GLuint  u_LightSize;
+        GLuint  s_GBuffer;
+    } light, half_light;
+
+    struct {
+        GLuint  program;
+
+        GLuint  u_InvProj;
+
+        GLuint  s_GBuffer;
+        GLuint  s_HalfGBuffer;
+        GLuint  s_Light;
+    } compose;
+
+    struct {
+        GLuint  program;
+
+        GLuint  u_InvProj;
+        GLuint  u_Viewport;
+
+        GLuint  s_GBuffer;
+        GLuint  s_LightData;
+        GLuint  s_LightGrid;
+        GLuint  s_LightIndices;
+    } tiled;
+
+    struct {
+        GLuint  program;
+
+        GLuint  u_InvProj;
+        GLuint  u_Viewport;
+        GLuint  u_SunDirection;
+        GLuint  u_SunColor;
+        GLuint  u_ShadowMatrix;
+        GLuint  u_CascadeEnd;
 
         GLuint  s_GBuffer;
-    } light;
+        GLuint  s_ShadowMap;
+    } sun;
 };
 
 /* Constants
  */
-/* cube vertices
- *
- *               5---------4
- *              /|        /|
- *             / |       / |
- *            1---------0  |
- *            |  |      |  |
- *            |  6------|--7
- *            | /       | /
- *            |/        |/
- *            2---------3
- *
- *   front: { 0, 2, 1 }, { 0, 3, 2 }
- *   right: { 4, 3, 0 }, { 4, 7, 3 }
- *     top: { 4, 1, 5 }, { 4, 0, 1 }
- *    left: { 1, 6, 5 }, { 1, 2, 6 }
- *  bottom: { 3, 6, 2 }, { 3, 7, 6 }
- *    back: { 5, 7, 4 }, { 5, 6, 7 }
- *
- */
-static const Vec3 kCubeVertices[] =
-{
-    {  1.0f,  1.0f, -1.0f }, /* 0 */
-    { -1.0f,  1.0f, -1.0f }, /* 1 */
-    { -1.0f, -1.0f, -1.0f }, /* 2 */
-    {  1.0f, -1.0f, -1.0f }, /* 3 */
-    {  1.0f,  1.0f,  1.0f }, /* 4 */
-    { -1.0f,  1.0f,  1.0f }, /* 5 */
-    { -1.0f, -1.0f,  1.0f }, /* 6 */
-    {  1.0f, -1.0f,  1.0f }, /* 7 */
+static const Vec3 kQuadVertices[] =
+{
+    {  1.0f,  1.0f, 0.0f },
+    { -1.0f,  1.0f, 0.0f },
+    { -1.0f, -1.0f, 0.0f },
+    {  1.0f, -1.0f, 0.0f },
 };
-
-static const uint16_t kCubeIndices[] =
+static const uint16_t kQuadIndices[] =
+{
+    0, 2, 1,
+    0, 3, 2,
+};
+static const AttributeSlot kGeometrySlots[] =
+{
+    kPositionSlot,
+    kNormalSlot,
+    kTangentSlot,
+    kBitangentSlot,
+    kTexCoordSlot,
+    kEmptySlot
+};
+static const AttributeSlot kLightSlots[] =
+{
+    kPositionSlot,
+    kLightPositionSlot,
+    kLightColorSlot,
+    kEmptySlot
+};
+static const AttributeSlot kTiledSlots[] =
 {
-    0, 2, 1,   0, 3, 2,  /* front */
-    4, 3, 0,   4, 7, 3,  /* right */
-    4, 1, 5,   4, 0, 1,  /* top */
-    1, 6, 5,   1, 2, 6,  /* left */
-    3, 6, 2,   3, 7, 6,  /* bottom */
-    5, 7, 4,   5, 6, 7,  /* back */
+    kPositionSlot,
+    kEmptySlot
+};
+static const struct {
+    GLenum      internal_format;
+    GLenum      format;
+    GLenum      type;
+    int         bits;
+    int         bytes_per_pixel;
+    const char* name;
+} kNormalFormats[MAX_NORMAL_FORMATS] = {
+    { GL_RG8,       GL_RG,      GL_UNSIGNED_BYTE,               8,  2, "RG8" },
+    { GL_RGB10_A2,  GL_RGBA,    GL_UNSIGNED_INT_2_10_10_10_REV, 10, 4, "RGB10A2" },
+    { GL_RG16_EXT,  GL_RG,      GL_UNSIGNED_SHORT,              16, 4, "RG16" },
+};
+/** GBuffer layouts. Each field is packed into `channels` of a target and
+ *  reaches the shaders as a GBUFFER_<field>(g) accessor on the array of
+ *  targets, so the shaders follow whatever is described here. Depth is
+ *  always the last sampler, after the targets.
+ */
+static const struct {
+    const char*         name;
+    int                 num_targets;
+    GBufferTargetFormat targets[MAX_GBUFFER_TARGETS];
+    struct {
+        const char* field;
+        int         target;
+        const char* channels;
+    } fields[MAX_GBUFFER_FIELDS];
+} kGBufferLayouts[MAX_GBUFFER_LAYOUTS] = {
+    { "Compact", 2, { kTargetRGBA8, kTargetNormals },
+        { { "ALBEDO", 0, "rgb" },
+          { "NORMAL", 1, "rg" },
+          { NULL } } },
+    { "Specular", 2, { kTargetRGBA8, kTargetRGB10A2 },
+        { { "ALBEDO", 0, "rgb" },
+          { "SPECULAR_INTENSITY", 0, "a" },
+          { "NORMAL", 1, "rg" },
+          { "SPECULAR_POWER", 1, "b" }, /* 2 bits of alpha left for a material id */
+          { NULL } } },
+    { "Full", 3, { kTargetRGBA8, kTargetNormals, kTargetRGBA8 },
+        { { "ALBEDO", 0, "rgb" },
+          { "NORMAL", 1, "rg" },
+          { "SPECULAR_COLOR", 2, "rgb" },
+          { "SPECULAR_POWER", 2, "a" },
+          { NULL } } },
 };
 
 /* Variables
@@ -106,78 +215,199 @@ static const uint16_t kCubeIndices[] =
 
 /* Internal functions
  */
-static void _draw_point_light(DeferredRenderer* R)
+static void _draw_fullscreen_quad(DeferredRenderer* R)
 {
-    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->cube_vertex_buffer));
-    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->cube_index_buffer));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->quad_vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->quad_index_buffer));
     ASSERT_GL(glVertexAttribPointer(kPositionSlot, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
-    ASSERT_GL(glDrawElements(GL_TRIANGLES, sizeof(kCubeIndices)/sizeof(kCubeIndices[0]), GL_UNSIGNED_SHORT, NULL));
+    ASSERT_GL(glDrawElements(GL_TRIANGLES, sizeof(kQuadIndices)/sizeof(kQuadIndices[0]), GL_UNSIGNED_SHORT, NULL));
 }
-
-/* External functions
- */
-DeferredRenderer* create_deferred_renderer(Graphics* G)
+/** CPU copies of the GLSL octahedral encoding, for the error report */
+static float _sign_not_zero(float f)
 {
-    AttributeSlot geometry_slots[] = {
-        kPositionSlot,
-        kNormalSlot,
-        kTangentSlot,
-        kBitangentSlot,
-        kTexCoordSlot,
-        kEmptySlot
-    };
-    AttributeSlot light_slots[] = {
-        kPositionSlot,
-        kEmptySlot
-    };
-    DeferredRenderer* R = (DeferredRenderer*)calloc(1, sizeof(DeferredRenderer));
-    int i[] = {0,1,2};
+    return f >= 0.0f ? 1.0f : -1.0f;
+}
+static Vec2 _oct_encode(Vec3 n)
+{
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    Vec2 oct = vec2_create(n.x/l1, n.y/l1);
+    if(n.z < 0.0f) {
+        Vec2 folded = vec2_create((1.0f - fabsf(oct.y))*_sign_not_zero(oct.x),
+                                  (1.0f - fabsf(oct.x))*_sign_not_zero(oct.y));
+        oct = folded;
+    }
+    return vec2_create(oct.x*0.5f + 0.5f, oct.y*0.5f + 0.5f);
+}
+static Vec3 _oct_decode(Vec2 encoded)
+{
+    Vec2 oct = vec2_create(encoded.x*2.0f - 1.0f, encoded.y*2.0f - 1.0f);
+    Vec3 n = vec3_create(oct.x, oct.y, 1.0f - fabsf(oct.x) - fabsf(oct.y));
+    if(n.z < 0.0f) {
+        float x = (1.0f - fabsf(oct.y))*_sign_not_zero(oct.x);
+        float y = (1.0f - fabsf(oct.x))*_sign_not_zero(oct.y);
+        n.x = x;
+        n.y = y;
+    }
+    return vec3_normalize(n);
+}
+static float _quantize_unorm(float f, int bits)
+{
+    float scale = (float)((1 << bits) - 1);
+    return floorf(f*scale + 0.5f)/scale;
+}
+/** Doesn't touch rand()'s sequence */
+static float _random_signed(uint32_t* seed)
+{
+    *seed = *seed*1664525u + 1013904223u;
+    return (*seed >> 8)/(float)(1 << 24)*2.0f - 1.0f;
+}
+static float _angle_degrees(Vec3 a, Vec3 b)
+{
+    float d = vec3_dot(a, b);
+    if(d > 1.0f) d = 1.0f;
+    if(d < -1.0f) d = -1.0f;
+    return rad_to_deg(acosf(d));
+}
+static void _probe_normal_formats(DeferredRenderer* R)
+{
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    GLuint texture, framebuffer;
     int ii;
 
-    /* Create vertex buffer */
-    ASSERT_GL(glGenBuffers(1, &R->cube_vertex_buffer));
-    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->cube_vertex_buffer));
-    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(kCubeVertices), kCubeVertices, GL_STATIC_DRAW));
-    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
-
-    /* Create index buffer */
-    ASSERT_GL(glGenBuffers(1, &R->cube_index_buffer));
-    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->cube_index_buffer));
-    ASSERT_GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(kCubeIndices), kCubeIndices, GL_STATIC_DRAW));
-    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
-
-    /** Create Gbuffer
-     */
-
-    /* Create framebuffer */
-    ASSERT_GL(glGenFramebuffers(1, &R->gbuffer_framebuffer));
-
-    ASSERT_GL(glGenTextures(GBUFFER_SIZE, R->gbuffer));
-    for(ii=0;ii<GBUFFER_SIZE;++ii) {
-        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[ii]));
-        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glGenTextures(1, &texture));
+    ASSERT_GL(glGenFramebuffers(1, &framebuffer));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, texture));
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, framebuffer));
+    for(ii=0;ii<MAX_NORMAL_FORMATS;++ii) {
+        if(ii == kNormalRG16 && (extensions == NULL || strstr(extensions, "GL_EXT_texture_norm16") == NULL))
+            continue;
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, kNormalFormats[ii].internal_format, 4, 4, 0,
+                               kNormalFormats[ii].format, kNormalFormats[ii].type, 0));
+        ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0));
+        R->normal_supported[ii] = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
     }
-    ASSERT_GL(glGenTextures(1, &R->depth_buffer));
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->depth_buffer));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+    ASSERT_GL(glDeleteFramebuffers(1, &framebuffer));
+    ASSERT_GL(glDeleteTextures(1, &texture));
+}
+static int _num_targets(const DeferredRenderer* R)
+{
+    return kGBufferLayouts[R->layout].num_targets;
+}
+static int _target_bytes(GBufferTargetFormat target, NormalFormat normals)
+{
+    switch(target) {
+    case kTargetRGBA8:
+    case kTargetRGB10A2:
+        return 4;
+    case kTargetNormals:
+        return kNormalFormats[normals].bytes_per_pixel;
+    default:
+        assert(0);
+        return 0;
+    }
+}
+static void _target_tex_image(GBufferTargetFormat target, NormalFormat normals, int width, int height)
+{
+    switch(target) {
+    case kTargetRGBA8:
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
+        break;
+    case kTargetRGB10A2:
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB10_A2, width, height, 0, GL_RGBA, GL_UNSIGNED_INT_2_10_10_10_REV, 0));
+        break;
+    case kTargetNormals:
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, kNormalFormats[normals].internal_format, width, height, 0,
+                               kNormalFormats[normals].format, kNormalFormats[normals].type, 0));
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+/** Writes the GLSL defines describing `layout` into `defines` */
+static void _layout_defines(GBufferLayout layout, char* defines)
+{
+    int length = sprintf(defines, "#define GBUFFER_SIZE %d\n", kGBufferLayouts[layout].num_targets);
+    int ii;
+    for(ii=0;ii<MAX_GBUFFER_FIELDS && kGBufferLayouts[layout].fields[ii].field;++ii) {
+        length += sprintf(defines+length, "#define GBUFFER_%s(g) g[%d].%s\n#define GBUFFER_%s_TARGET %d\n",
+                          kGBufferLayouts[layout].fields[ii].field,
+                          kGBufferLayouts[layout].fields[ii].target,
+                          kGBufferLayouts[layout].fields[ii].channels,
+                          kGBufferLayouts[layout].fields[ii].field,
+                          kGBufferLayouts[layout].fields[ii].target);
+    }
+    assert(length < MAX_DEFINES_SIZE);
+}
+static void _destroy_programs(DeferredRenderer* R)
+{
+    destroy_program(R->compose.program);
+    destroy_program(R->sun.program);
+    destroy_program(R->tiled.program);
+    destroy_program(R->half_light.program);
+    destroy_program(R->light.program);
+    destroy_program(R->geometry.program);
+    R->compose.program = R->sun.program = R->tiled.program = 0;
+    R->half_light.program = R->light.program = R->geometry.program = 0;
+}
+static void _program_defines(GBufferLayout layout, char* defines, char* light_buffer_defines)
+{
+    _layout_defines(layout, defines);
+    strcpy(light_buffer_defines, defines);
+    strcat(light_buffer_defines, "#define LIGHT_BUFFER\n");
+}
+static void _submit_programs(GBufferLayout layout)
+{
+    char defines[MAX_DEFINES_SIZE];
+    char light_buffer_defines[MAX_DEFINES_SIZE];
+    _program_defines(layout, defines, light_buffer_defines);
+    submit_program_with_defines("shaders/deferred/geometryvertex.glsl",
+                                "shaders/deferred/geometryfragment.glsl",
+                                kGeometrySlots, defines);
+    submit_program_with_defines("shaders/deferred/lightvertex.glsl",
+                                "shaders/deferred/lightfragment.glsl",
+                                kLightSlots, defines);
+    submit_program_with_defines("shaders/deferred/lightvertex.glsl",
+                                "shaders/deferred/lightfragment.glsl",
+                                kLightSlots, light_buffer_defines);
+    submit_program_with_defines("shaders/deferred/tiledvertex.glsl",
+                                "shaders/deferred/composefragment.glsl",
+                                kTiledSlots, defines);
+    submit_program_with_defines("shaders/deferred/tiledvertex.glsl",
+                                "shaders/deferred/tiledfragment.glsl",
+                                kTiledSlots, defines);
+    submit_program_with_defines("shaders/deferred/tiledvertex.glsl",
+                                "shaders/deferred/sunfragment.glsl",
+                                kTiledSlots, defines);
+}
+/** Looks the uniforms up and sets the texture units, again after a reload */
+static void _setup_programs(DeferredRenderer* R)
+{
+    int num_targets = _num_targets(R);
+    int gbuffer_units[MAX_GBUFFER_TARGETS+1];
+    int tiled_gbuffer_units[MAX_GBUFFER_TARGETS+1];
+    int half_gbuffer_units[MAX_GBUFFER_TARGETS+1];
+    int ii;
+
+    /* Targets, then depth. The tiled pass keeps units 0-2 for the light grid */
+    for(ii=0;ii<=num_targets;++ii) {
+        gbuffer_units[ii] = ii;
+        tiled_gbuffer_units[ii] = 3+ii;
+        half_gbuffer_units[ii] = num_targets+1+ii;
+    }
 
     /** Geometry pass
      */
-    R->geometry.program = create_program("shaders/deferred/geometryvertex.glsl",
-                                         "shaders/deferred/geometryfragment.glsl",
-                                         geometry_slots);
-
     ASSERT_GL(GetUniformLocation(R, geometry, program, u_Projection));
     ASSERT_GL(GetUniformLocation(R, geometry, program, u_View));
     ASSERT_GL(GetUniformLocation(R, geometry, program, u_World));
 
+    ASSERT_GL(GetUniformLocation(R, geometry, program, u_SpecularColor));
+    ASSERT_GL(GetUniformLocation(R, geometry, program, u_SpecularPower));
+    ASSERT_GL(GetUniformLocation(R, geometry, program, u_SpecularCoefficient));
+
     ASSERT_GL(GetUniformLocation(R, geometry, program, s_Normal));
     ASSERT_GL(GetUniformLocation(R, geometry, program, s_Albedo));
 
@@ -195,31 +425,419 @@ DeferredRenderer* create_deferred_renderer(Graphics* G)
 
     /** Light pass
      */
-    R->light.program = create_program("shaders/deferred/lightvertex.glsl", "shaders/deferred/lightfragment.glsl", light_slots);
-
     ASSERT_GL(GetUniformLocation(R, light, program, u_Projection));
-    ASSERT_GL(GetUniformLocation(R, light, program, u_View));
-    ASSERT_GL(GetUniformLocation(R, light, program, u_World));
 
     ASSERT_GL(GetUniformLocation(R, light, program, u_InvProj));
     ASSERT_GL(GetUniformLocation(R, light, program, u_Viewport));
 
     ASSERT_GL(GetUniformLocation(R, light, program, s_GBuffer));
 
+    ASSERT_GL(glUseProgram(R->light.program));
+
+    ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
 
-    ASSERT_GL(GetUniformLocation(R, light, program, u_LightColor));
-    ASSERT_GL(GetUniformLocation(R, light, program, u_LightPosition));
-    ASSERT_GL(GetUniformLocation(R, light, program, u_LightSize));
+    ASSERT_GL(glUniform1iv(R->light.s_GBuffer, num_targets+1, gbuffer_units));
+    ASSERT_GL(glUseProgram(0));
 
-    ASSERT_GL(glUseProgram(R->light.program));
+    /** Half resolution light pass, accumulates light without the material
+     */
+    ASSERT_GL(GetUniformLocation(R, half_light, program, u_Projection));
+
+    ASSERT_GL(GetUniformLocation(R, half_light, program, u_InvProj));
+    ASSERT_GL(GetUniformLocation(R, half_light, program, u_Viewport));
+
+    ASSERT_GL(GetUniformLocation(R, half_light, program, s_GBuffer));
+
+    ASSERT_GL(glUseProgram(R->half_light.program));
 
     ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
 
-    ASSERT_GL(glUniform1iv(R->light.s_GBuffer, GBUFFER_SIZE+1, i));
+    ASSERT_GL(glUniform1iv(R->half_light.s_GBuffer, num_targets+1, gbuffer_units));
     ASSERT_GL(glUseProgram(0));
 
-    if(R->geometry.program == 0 ||
-       R->light.program == 0) {
+    /** Compose, upsamples the half resolution light onto the GBuffer
+     */
+    ASSERT_GL(GetUniformLocation(R, compose, program, u_InvProj));
+
+    ASSERT_GL(GetUniformLocation(R, compose, program, s_GBuffer));
+    ASSERT_GL(GetUniformLocation(R, compose, program, s_HalfGBuffer));
+    ASSERT_GL(GetUniformLocation(R, compose, program, s_Light));
+
+    ASSERT_GL(glUseProgram(R->compose.program));
+
+    ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
+
+    ASSERT_GL(glUniform1iv(R->compose.s_GBuffer, num_targets+1, gbuffer_units));
+    ASSERT_GL(glUniform1iv(R->compose.s_HalfGBuffer, num_targets+1, half_gbuffer_units));
+    ASSERT_GL(glUniform1i(R->compose.s_Light, 2*num_targets+2));
+    ASSERT_GL(glUseProgram(0));
+
+    /** Tiled light pass
+     */
+    ASSERT_GL(GetUniformLocation(R, tiled, program, u_InvProj));
+    ASSERT_GL(GetUniformLocation(R, tiled, program, u_Viewport));
+
+    ASSERT_GL(GetUniformLocation(R, tiled, program, s_GBuffer));
+    ASSERT_GL(GetUniformLocation(R, tiled, program, s_LightData));
+    ASSERT_GL(GetUniformLocation(R, tiled, program, s_LightGrid));
+    ASSERT_GL(GetUniformLocation(R, tiled, program, s_LightIndices));
+
+    ASSERT_GL(glUseProgram(R->tiled.program));
+
+    ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
+
+    ASSERT_GL(glUniform1i(R->tiled.s_LightData, 0));
+    ASSERT_GL(glUniform1i(R->tiled.s_LightGrid, 1));
+    ASSERT_GL(glUniform1i(R->tiled.s_LightIndices, 2));
+    ASSERT_GL(glUniform1iv(R->tiled.s_GBuffer, num_targets+1, tiled_gbuffer_units));
+    ASSERT_GL(glUseProgram(0));
+
+    /** Sun pass
+     */
+    ASSERT_GL(GetUniformLocation(R, sun, program, u_InvProj));
+    ASSERT_GL(GetUniformLocation(R, sun, program, u_Viewport));
+    ASSERT_GL(GetUniformLocation(R, sun, program, u_SunDirection));
+    ASSERT_GL(GetUniformLocation(R, sun, program, u_SunColor));
+    ASSERT_GL(GetUniformLocation(R, sun, program, u_ShadowMatrix));
+    ASSERT_GL(GetUniformLocation(R, sun, program, u_CascadeEnd));
+
+    ASSERT_GL(GetUniformLocation(R, sun, program, s_GBuffer));
+    ASSERT_GL(GetUniformLocation(R, sun, program, s_ShadowMap));
+
+    ASSERT_GL(glUseProgram(R->sun.program));
+
+    ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
+
+    ASSERT_GL(glUniform1iv(R->sun.s_GBuffer, num_targets+1, gbuffer_units));
+    ASSERT_GL(glUniform1i(R->sun.s_ShadowMap, num_targets+1));
+    ASSERT_GL(glUseProgram(0));
+}
+/** Builds the programs for `layout` and, only once all of them built,
+ *  replaces the current ones and switches R to the layout
+ *  @return 1 if a program failed, R keeps its programs and layout
+ */
+static int _create_programs(DeferredRenderer* R, GBufferLayout layout)
+{
+    char defines[MAX_DEFINES_SIZE];
+    char light_buffer_defines[MAX_DEFINES_SIZE];
+    Program geometry, light, half_light, compose, tiled, sun;
+
+    _program_defines(layout, defines, light_buffer_defines);
+    /* All six compile together, each create call then waits for its own */
+    _submit_programs(layout);
+
+    geometry = create_program_with_defines("shaders/deferred/geometryvertex.glsl",
+                                                      "shaders/deferred/geometryfragment.glsl",
+                                           kGeometrySlots, defines);
+    light = create_program_with_defines("shaders/deferred/lightvertex.glsl",
+                                        "shaders/deferred/lightfragment.glsl",
+                                        kLightSlots, defines);
+    half_light = create_program_with_defines("shaders/deferred/lightvertex.glsl",
+                                             "shaders/deferred/lightfragment.glsl",
+                                             kLightSlots, light_buffer_defines);
+    compose = create_program_with_defines("shaders/deferred/tiledvertex.glsl",
+                                          "shaders/deferred/composefragment.glsl",
+                                          kTiledSlots, defines);
+    tiled = create_program_with_defines("shaders/deferred/tiledvertex.glsl",
+                                        "shaders/deferred/tiledfragment.glsl",
+                                        kTiledSlots, defines);
+    sun = create_program_with_defines("shaders/deferred/tiledvertex.glsl",
+                                      "shaders/deferred/sunfragment.glsl",
+                                      kTiledSlots, defines);
+
+    if(geometry == 0 || light == 0 || half_light == 0 ||
+       compose == 0 || tiled == 0 || sun == 0) {
+        destroy_program(sun);
+        destroy_program(tiled);
+        destroy_program(compose);
+        destroy_program(half_light);
+        destroy_program(light);
+        destroy_program(geometry);
+        return 1;
+    }
+    _destroy_programs(R);
+    R->geometry.program = geometry;
+    R->light.program = light;
+    R->half_light.program = half_light;
+    R->compose.program = compose;
+    R->tiled.program = tiled;
+    R->sun.program = sun;
+    R->layout = layout;
+    _setup_programs(R);
+    return 0;
+}
+/** Allocates the half resolution GBuffer and light buffer, or shrinks them
+ *  when half resolution lighting is off
+ */
+static void _resize_half_resolution(DeferredRenderer* R)
+{
+    int width = R->half_res_lighting ? HALF_RESOLUTION(R->width) : 1;
+    int height = R->half_res_lighting ? HALF_RESOLUTION(R->height) : 1;
+    int num_targets = _num_targets(R);
+    GLenum framebuffer_status;
+    int ii;
+
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_gbuffer_framebuffer));
+    for(ii=0;ii<MAX_GBUFFER_TARGETS;++ii) {
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_gbuffer[ii]));
+        if(ii < num_targets) {
+            _target_tex_image(kGBufferLayouts[R->layout].targets[ii], R->normal_format, width, height);
+            ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0+ii, GL_TEXTURE_2D, R->half_gbuffer[ii], 0));
+        } else {
+            _target_tex_image(kTargetRGBA8, R->normal_format, 1, 1);
+            ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0+ii, GL_TEXTURE_2D, 0, 0));
+        }
+    }
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_depth_buffer));
+    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, R->half_depth_buffer, 0));
+
+    framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+        system_log("%s:%d Framebuffer error: %s\n", __FILE__, __LINE__, _glStatusString(framebuffer_status));
+        assert(0);
+    }
+
+    /* Specular is accumulated in alpha */
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_light_buffer));
+    accumulation_tex_image(accumulation_format_with_alpha(R->accumulation_format), width, height);
+
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_light_framebuffer));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->half_light_buffer, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, R->half_depth_buffer, 0));
+
+    framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+        system_log("%s:%d Framebuffer error: %s\n", __FILE__, __LINE__, _glStatusString(framebuffer_status));
+        assert(0);
+    }
+}
+/** Lights the GBuffer at half resolution, then upsamples the light and
+ *  applies the materials at full resolution into `framebuffer`
+ */
+static void _render_half_res_lights(DeferredRenderer* R, GLuint framebuffer,
+                                    Mat4 proj_matrix, Mat4 view_matrix,
+                                    const Light* lights, int num_lights)
+{
+    GLenum buffers[] = {
+        GL_COLOR_ATTACHMENT0,
+    };
+    Mat4 inv_proj = mat4_inverse(proj_matrix);
+    int half_width = HALF_RESOLUTION(R->width);
+    int half_height = HALF_RESOLUTION(R->height);
+    float viewport[] = { half_width, half_height };
+    int num_targets = _num_targets(R);
+    int ii;
+
+    /** Downsample
+     */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_gbuffer_framebuffer));
+    ASSERT_GL(glViewport(0, 0, half_width, half_height));
+    downsample_gbuffer(R->downsample, R->depth_buffer, R->gbuffer, num_targets);
+
+    /** Light
+     */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_light_framebuffer));
+    ASSERT_GL(glDrawBuffers(1, buffers));
+    /* Specular accumulates in alpha */
+    ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT));
+
+    ASSERT_GL(glEnable(GL_BLEND));
+    ASSERT_GL(glBlendFunc(GL_ONE, GL_ONE));
+    ASSERT_GL(glCullFace(GL_FRONT));
+    ASSERT_GL(glDepthMask(GL_FALSE));
+    ASSERT_GL(glDepthFunc(GL_GEQUAL));
+
+    ASSERT_GL(glUseProgram(R->half_light.program));
+    set_uniform_matrix4fv(R->half_light.program, R->half_light.u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->half_light.program, R->half_light.u_InvProj, 1, (float*)&inv_proj);
+    set_uniform_2fv(R->half_light.program, R->half_light.u_Viewport, 1, viewport);
+
+    for(ii=0;ii<num_targets;++ii) {
+        ASSERT_GL(glActiveTexture(GL_TEXTURE0+ii));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_gbuffer[ii]));
+    }
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+ii));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_depth_buffer));
+
+    render_light_volumes(R->light_volume, R->half_light.program,
+                         proj_matrix, view_matrix, half_width, half_height,
+                         lights, num_lights, R->stencil_lights);
+    if(R->num_gpu_lights) {
+        ASSERT_GL(glUseProgram(R->half_light.program));
+        draw_light_volume_buffer(R->light_volume, R->gpu_light_buffer, R->num_gpu_lights);
+    }
+
+    ASSERT_GL(glDisable(GL_BLEND));
+    ASSERT_GL(glDepthMask(GL_TRUE));
+    ASSERT_GL(glDepthFunc(GL_LESS));
+    ASSERT_GL(glCullFace(GL_BACK));
+
+    /** Compose
+     */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, framebuffer));
+    ASSERT_GL(glDrawBuffers(1, buffers));
+    /* The depth buffer is sampled, it can't be attached */
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, 0, 0));
+    ASSERT_GL(glViewport(0, 0, R->width, R->height));
+    ASSERT_GL(glDisable(GL_DEPTH_TEST));
+    ASSERT_GL(glDepthMask(GL_FALSE));
+
+    ASSERT_GL(glUseProgram(R->compose.program));
+    set_uniform_matrix4fv(R->compose.program, R->compose.u_InvProj, 1, (float*)&inv_proj);
+    for(ii=0;ii<num_targets;++ii) {
+        ASSERT_GL(glActiveTexture(GL_TEXTURE0+ii));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[ii]));
+        ASSERT_GL(glActiveTexture(GL_TEXTURE0+num_targets+1+ii));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_gbuffer[ii]));
+    }
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+num_targets));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->depth_buffer));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+2*num_targets+1));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_depth_buffer));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+2*num_targets+2));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_light_buffer));
+
+    _draw_fullscreen_quad(R);
+
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glEnable(GL_DEPTH_TEST));
+    ASSERT_GL(glDepthMask(GL_TRUE));
+}
+static void _render_geometry(DeferredRenderer* R, Mat4 proj_matrix, Mat4 view_matrix,
+                             const Model* models, int num_models)
+{
+    GLenum buffers[] = {
+        GL_COLOR_ATTACHMENT0,
+        GL_COLOR_ATTACHMENT1,
+        GL_COLOR_ATTACHMENT2,
+    };
+    GLint framebuffer_status;
+    int ii;
+
+    begin_gpu_pass("GBuffer");
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->gbuffer_framebuffer));
+    framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+        system_log("%s:%d Framebuffer error: %s\n", __FILE__, __LINE__, _glStatusString(framebuffer_status));
+        assert(0);
+    }
+    ASSERT_GL(glDrawBuffers(_num_targets(R), buffers));
+    ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
+    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT));
+    ASSERT_GL(glDepthMask(GL_TRUE));
+    ASSERT_GL(glDepthFunc(GL_LESS));
+    ASSERT_GL(glCullFace(GL_BACK));
+
+    ASSERT_GL(glUseProgram(R->geometry.program));
+    set_uniform_matrix4fv(R->geometry.program, R->geometry.u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->geometry.program, R->geometry.u_View, 1, (float*)&view_matrix);
+
+    for(ii=0;ii<num_models;++ii) {
+        Mat4 world_matrix = transform_get_matrix(models[ii].transform);
+        /* Material */
+        ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->albedo));
+        ASSERT_GL(glActiveTexture(GL_TEXTURE1));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->normal));
+        set_uniform_3fv(R->geometry.program, R->geometry.u_SpecularColor, 1, (float*)&models[ii].material->specular_color);
+        set_uniform_1f(R->geometry.program, R->geometry.u_SpecularPower, models[ii].material->specular_power);
+        set_uniform_1f(R->geometry.program, R->geometry.u_SpecularCoefficient, models[ii].material->specular_coefficient);
+        /* Mesh */
+        set_uniform_matrix4fv(R->geometry.program, R->geometry.u_World, 1, (float*)&world_matrix);
+        draw_mesh(models[ii].mesh);
+    }
+    end_gpu_pass();
+}
+
+/* External functions
+ */
+void submit_deferred_programs(void)
+{
+    _submit_programs(DEFAULT_GBUFFER_LAYOUT);
+    submit_light_volume_programs();
+    submit_gbuffer_downsample_programs();
+}
+void resolve_deferred_uniforms(DeferredRenderer* R)
+{
+    _setup_programs(R);
+    resolve_light_volume_uniforms(R->light_volume);
+    resolve_gbuffer_downsample_uniforms(R->downsample);
+}
+DeferredRenderer* create_deferred_renderer(Graphics* G)
+{
+    DeferredRenderer* R = (DeferredRenderer*)calloc(1, sizeof(DeferredRenderer));
+    int ii;
+
+    /* Light volumes, the deferred renderer requires ES 3.0 */
+    R->light_volume = create_light_volume(1);
+
+    /* GBuffer normals. RGB10A2 is always renderable and as big as the old RG16F */
+    _probe_normal_formats(R);
+    R->normal_format = kNormalRGB10A2;
+    R->layout = DEFAULT_GBUFFER_LAYOUT;
+    for(ii=0;ii<MAX_GBUFFER_LAYOUTS;++ii) {
+        int written, read_per_light;
+        gbuffer_layout_bandwidth((GBufferLayout)ii, R->normal_format, &written, &read_per_light);
+        system_log("GBuffer layout %s: %d targets, %d bytes/pixel written, %d read per light\n",
+                   kGBufferLayouts[ii].name, kGBufferLayouts[ii].num_targets, written, read_per_light);
+    }
+
+    /* Create fullscreen quad */
+    ASSERT_GL(glGenBuffers(1, &R->quad_vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->quad_vertex_buffer));
+    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(kQuadVertices), kQuadVertices, GL_STATIC_DRAW));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+
+    ASSERT_GL(glGenBuffers(1, &R->quad_index_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->quad_index_buffer));
+    ASSERT_GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(kQuadIndices), kQuadIndices, GL_STATIC_DRAW));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+
+    /** Create Gbuffer
+     */
+
+    /* Create framebuffer */
+    ASSERT_GL(glGenFramebuffers(1, &R->gbuffer_framebuffer));
+
+    ASSERT_GL(glGenTextures(MAX_GBUFFER_TARGETS, R->gbuffer));
+    for(ii=0;ii<MAX_GBUFFER_TARGETS;++ii) {
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[ii]));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    }
+    ASSERT_GL(glGenTextures(1, &R->depth_buffer));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->depth_buffer));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+
+    /** Half resolution GBuffer and light buffer
+     */
+    R->downsample = create_gbuffer_downsample();
+    ASSERT_GL(glGenFramebuffers(1, &R->half_gbuffer_framebuffer));
+    ASSERT_GL(glGenFramebuffers(1, &R->half_light_framebuffer));
+    ASSERT_GL(glGenTextures(MAX_GBUFFER_TARGETS, R->half_gbuffer));
+    ASSERT_GL(glGenTextures(1, &R->half_depth_buffer));
+    ASSERT_GL(glGenTextures(1, &R->half_light_buffer));
+    for(ii=0;ii<MAX_GBUFFER_TARGETS+2;++ii) {
+        GLuint texture = ii < MAX_GBUFFER_TARGETS ? R->half_gbuffer[ii] :
+                         ii == MAX_GBUFFER_TARGETS ? R->half_depth_buffer : R->half_light_buffer;
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, texture));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    }
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+
+    R->light_grid = create_light_grid(1);
+
+    if(_create_programs(R, R->layout) || R->downsample == NULL) {
         /* Failed to create programs. Return NULL */
         free(R);
         return NULL;
@@ -228,35 +846,41 @@ DeferredRenderer* create_deferred_renderer(Graphics* G)
 }
 void destroy_deferred_renderer(DeferredRenderer* R)
 {
-    destroy_program(R->geometry.program);
+    destroy_light_volume(R->light_volume);
+    destroy_light_grid(R->light_grid);
+    destroy_gbuffer_downsample(R->downsample);
+    _destroy_programs(R);
     free(R);
 }
 void resize_deferred_renderer(DeferredRenderer* R, int width, int height)
 {
     GLenum framebuffer_status;
+    int num_targets = _num_targets(R);
+    int ii;
     R->width = width;
     R->height = height;
 
-    /** GBuffer format
-     *  [0] RGB: Albedo
-     *  [1] RG: VS Normal (encoded)
-     *  [2] R: Depth
+    /** GBuffer format, described by kGBufferLayouts[R->layout]. Targets
+     *  the layout doesn't use are shrunk so they don't hold memory.
      */
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[0]));
-    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
-
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[1]));
-    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, width, height, 0, GL_RG, GL_FLOAT, 0));
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->gbuffer_framebuffer));
+    for(ii=0;ii<MAX_GBUFFER_TARGETS;++ii) {
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[ii]));
+        if(ii < num_targets) {
+            _target_tex_image(kGBufferLayouts[R->layout].targets[ii], R->normal_format, width, height);
+            ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0+ii, GL_TEXTURE_2D, R->gbuffer[ii], 0));
+        } else {
+            _target_tex_image(kTargetRGBA8, R->normal_format, 1, 1);
+            ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0+ii, GL_TEXTURE_2D, 0, 0));
+        }
+    }
 
-    /* Depth texture */
+    /* Depth texture, with stencil for masking light volumes */
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->depth_buffer));
-    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0));
+    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0));
 
     /* Framebuffer */
-    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->gbuffer_framebuffer));
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->gbuffer[0], 0));
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, R->gbuffer[1], 0));
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, R->depth_buffer, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, R->depth_buffer, 0));
 
     framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
     if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
@@ -264,6 +888,8 @@ void resize_deferred_renderer(DeferredRenderer* R, int width, int height)
         assert(0);
     }
 
+    _resize_half_resolution(R);
+
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
 
@@ -282,45 +908,24 @@ void render_deferred(DeferredRenderer* R, GLuint default_framebuffer,
     Mat4 inv_proj = mat4_inverse(proj_matrix);
     float viewport[] = { R->width, R->height };
     int ii;
-    GLint framebuffer_status;
 
     /** Geometry
      */
-    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->gbuffer_framebuffer));
-    framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
-        system_log("%s:%d Framebuffer error: %s\n", __FILE__, __LINE__, _glStatusString(framebuffer_status));
-        assert(0);
-    }
-    ASSERT_GL(glDrawBuffers(GBUFFER_SIZE, buffers));
-    ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
-    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
-    ASSERT_GL(glDepthMask(GL_TRUE));
-    ASSERT_GL(glDepthFunc(GL_LESS));
-    ASSERT_GL(glCullFace(GL_BACK));
+    _render_geometry(R, proj_matrix, view_matrix, models, num_models);
 
-    ASSERT_GL(glUseProgram(R->geometry.program));
-    ASSERT_GL(glUniformMatrix4fv(R->geometry.u_Projection, 1, GL_FALSE, (float*)&proj_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->geometry.u_View, 1, GL_FALSE, (float*)&view_matrix));
-
-    for(ii=0;ii<num_models;++ii) {
-        Mat4 world_matrix = transform_get_matrix(models[ii].transform);
-        /* Material */
-        ASSERT_GL(glActiveTexture(GL_TEXTURE0));
-        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->albedo));
-        ASSERT_GL(glActiveTexture(GL_TEXTURE1));
-        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->normal));
-        /* Mesh */
-        ASSERT_GL(glUniformMatrix4fv(R->geometry.u_World, 1, GL_FALSE, (float*)&world_matrix));
-        draw_mesh(models[ii].mesh);
+    if(R->half_res_lighting) {
+        begin_gpu_pass("Half res lights");
+        _render_half_res_lights(R, default_framebuffer, proj_matrix, view_matrix, lights, num_lights);
+        end_gpu_pass();
+        return;
     }
 
-
     /** Light
      */
+    begin_gpu_pass("Light volumes");
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, default_framebuffer));
     ASSERT_GL(glDrawBuffers(1, buffers));
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, R->depth_buffer, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, R->depth_buffer, 0));
     ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
     ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT));
 
@@ -331,40 +936,277 @@ void render_deferred(DeferredRenderer* R, GLuint default_framebuffer,
     ASSERT_GL(glDepthFunc(GL_GEQUAL));
 
     ASSERT_GL(glUseProgram(R->light.program));
-    ASSERT_GL(glUniformMatrix4fv(R->light.u_Projection, 1, GL_FALSE, (float*)&proj_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->light.u_View, 1, GL_FALSE, (float*)&view_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->light.u_InvProj, 1, GL_FALSE, (float*)&inv_proj));
-    ASSERT_GL(glUniform2fv(R->light.u_Viewport, 1, viewport));
+    set_uniform_matrix4fv(R->light.program, R->light.u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->light.program, R->light.u_InvProj, 1, (float*)&inv_proj);
+    set_uniform_2fv(R->light.program, R->light.u_Viewport, 1, viewport);
 
-    for(ii=0;ii<GBUFFER_SIZE;++ii) {
+    for(ii=0;ii<_num_targets(R);++ii) {
         ASSERT_GL(glActiveTexture(GL_TEXTURE0+ii));
         ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[ii]));
     }
     ASSERT_GL(glActiveTexture(GL_TEXTURE0+ii));
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->depth_buffer));
 
-    for(ii=0;ii<num_lights;++ii) {
-        float size = lights[ii].size;
-        Mat4 world = mat4_identity;
-        Vec4 position = vec4_zero;
+    render_light_volumes(R->light_volume, R->light.program,
+                         proj_matrix, view_matrix, R->width, R->height,
+                         lights, num_lights, R->stencil_lights);
+    if(R->num_gpu_lights) {
+        ASSERT_GL(glUseProgram(R->light.program));
+        draw_light_volume_buffer(R->light_volume, R->gpu_light_buffer, R->num_gpu_lights);
+    }
+    end_gpu_pass();
+
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glDisable(GL_BLEND));
+    ASSERT_GL(glDepthMask(GL_TRUE));
+    ASSERT_GL(glDepthFunc(GL_LESS));
+    ASSERT_GL(glCullFace(GL_BACK));
+
+}
+void render_tiled_deferred(DeferredRenderer* R, GLuint default_framebuffer,
+                           Mat4 proj_matrix, Mat4 view_matrix,
+                           const Model* models, int num_models,
+                           const Light* lights, int num_lights)
+{
+    GLenum buffers[] = {
+        GL_COLOR_ATTACHMENT0,
+    };
+    Mat4 inv_proj = mat4_inverse(proj_matrix);
+    float viewport[] = { R->width, R->height };
+    int ii;
+
+    /** Light binning
+     */
+    if(!build_light_grid(R->light_grid, R->width, R->height,
+                         proj_matrix, view_matrix, lights, num_lights))
+        return;
+
+    /** Geometry
+     */
+    _render_geometry(R, proj_matrix, view_matrix, models, num_models);
+
+    /** Light
+     *  One fullscreen pass reads the GBuffer once and loops over the
+     *  tile's lights
+     */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, default_framebuffer));
+    ASSERT_GL(glDrawBuffers(1, buffers));
+    /* The depth buffer is sampled, it can't be attached */
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, 0, 0));
+    ASSERT_GL(glDisable(GL_DEPTH_TEST));
+    ASSERT_GL(glDepthMask(GL_FALSE));
+
+    ASSERT_GL(glUseProgram(R->tiled.program));
+    set_uniform_matrix4fv(R->tiled.program, R->tiled.u_InvProj, 1, (float*)&inv_proj);
+    set_uniform_2fv(R->tiled.program, R->tiled.u_Viewport, 1, viewport);
+
+    bind_light_grid(R->light_grid, 0);
+    for(ii=0;ii<_num_targets(R);++ii) {
+        ASSERT_GL(glActiveTexture(GL_TEXTURE3+ii));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[ii]));
+    }
+    ASSERT_GL(glActiveTexture(GL_TEXTURE3+ii));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->depth_buffer));
+
+    begin_gpu_pass("Tiled lights");
+    _draw_fullscreen_quad(R);
+    end_gpu_pass();
+
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glEnable(GL_DEPTH_TEST));
+    ASSERT_GL(glDepthMask(GL_TRUE));
+}
+void render_deferred_sun(DeferredRenderer* R, GLuint default_framebuffer,
+                         Mat4 proj_matrix, Mat4 view_matrix,
+                         const DirectionalLight* sun, const ShadowMap* shadow_map)
+{
+    Mat4 inv_proj = mat4_inverse(proj_matrix);
+    Mat4 shadow_matrices[NUM_SHADOW_CASCADES];
+    float cascade_ends[NUM_SHADOW_CASCADES];
+    float viewport[] = { R->width, R->height };
+    Vec3 direction;
+    int ii;
+
+    /* Towards the sun, in view space */
+    direction = vec3_negate(vec3_normalize(sun->direction));
+    direction = vec3_normalize(mat3_mul_vector(direction, mat3_from_mat4(view_matrix)));
 
-        world = mat4_scalef(size,size,size);
-        world.r3 = vec4_from_vec3(lights[ii].position,1.0f);
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, default_framebuffer));
+    /* The depth buffer is sampled, it can't be attached */
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, 0, 0));
+    ASSERT_GL(glDisable(GL_DEPTH_TEST));
+    ASSERT_GL(glDepthMask(GL_FALSE));
+    ASSERT_GL(glEnable(GL_BLEND));
+    ASSERT_GL(glBlendFunc(GL_ONE, GL_ONE));
 
-        position = vec4_from_vec3(lights[ii].position, 1.0f);
-        position = mat4_mul_vector(position, view_matrix);
+    ASSERT_GL(glUseProgram(R->sun.program));
+    set_uniform_matrix4fv(R->sun.program, R->sun.u_InvProj, 1, (float*)&inv_proj);
+    set_uniform_2fv(R->sun.program, R->sun.u_Viewport, 1, viewport);
+    set_uniform_3fv(R->sun.program, R->sun.u_SunDirection, 1, (float*)&direction);
+    set_uniform_3fv(R->sun.program, R->sun.u_SunColor, 1, (float*)&sun->color);
 
-        ASSERT_GL(glUniformMatrix4fv(R->light.u_World, 1, GL_FALSE, (float*)&world));
-        ASSERT_GL(glUniform3fv(R->light.u_LightPosition, 1, (float*)&position));
-        ASSERT_GL(glUniform3fv(R->light.u_LightColor, 1, (float*)&lights[ii].color));
-        ASSERT_GL(glUniform1f(R->light.u_LightSize, lights[ii].size));
-        _draw_point_light(R);
+    bind_shadow_map(shadow_map, _num_targets(R)+1, view_matrix, shadow_matrices, cascade_ends);
+    set_uniform_matrix4fv(R->sun.program, R->sun.u_ShadowMatrix, NUM_SHADOW_CASCADES, (float*)shadow_matrices);
+    set_uniform_1fv(R->sun.program, R->sun.u_CascadeEnd, NUM_SHADOW_CASCADES, cascade_ends);
+
+    for(ii=0;ii<_num_targets(R);++ii) {
+        ASSERT_GL(glActiveTexture(GL_TEXTURE0+ii));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer[ii]));
     }
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+ii));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->depth_buffer));
 
+    begin_gpu_pass("Sun");
+    _draw_fullscreen_quad(R);
+    end_gpu_pass();
+
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+_num_targets(R)+1));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
     ASSERT_GL(glActiveTexture(GL_TEXTURE0));
     ASSERT_GL(glDisable(GL_BLEND));
+    ASSERT_GL(glEnable(GL_DEPTH_TEST));
     ASSERT_GL(glDepthMask(GL_TRUE));
-    ASSERT_GL(glDepthFunc(GL_LESS));
-    ASSERT_GL(glCullFace(GL_BACK));
+}
+int tiled_deferred_supported(const DeferredRenderer* R)
+{
+    return light_grid_fits(R->light_grid, R->width, R->height);
+}
+int deferred_normal_format_supported(const DeferredRenderer* R, NormalFormat format)
+{
+    return format < MAX_NORMAL_FORMATS && R->normal_supported[format];
+}
+void set_deferred_normal_format(DeferredRenderer* R, NormalFormat format)
+{
+    assert(deferred_normal_format_supported(R, format));
+    R->normal_format = format;
+    if(R->width && R->height)
+        resize_deferred_renderer(R, R->width, R->height);
+}
+NormalFormat deferred_normal_format(const DeferredRenderer* R)
+{
+    return R->normal_format;
+}
+const char* normal_format_name(NormalFormat format)
+{
+    return kNormalFormats[format].name;
+}
+void log_normal_format_error(void)
+{
+    float sum[MAX_NORMAL_FORMATS+1] = {0};
+    float worst[MAX_NORMAL_FORMATS+1] = {0};
+    uint32_t seed = 1;
+    int ii, jj;
 
+    for(ii=0;ii<NORMAL_ERROR_SAMPLES;++ii) {
+        Vec3 n;
+        Vec2 encoded;
+        do {
+            n = vec3_create(_random_signed(&seed), _random_signed(&seed), _random_signed(&seed));
+        } while(vec3_length_sq(n) > 1.0f || vec3_length_sq(n) < 0.0001f);
+        n = vec3_normalize(n);
+
+        encoded = _oct_encode(n);
+        for(jj=0;jj<MAX_NORMAL_FORMATS;++jj) {
+            Vec2 stored = vec2_create(_quantize_unorm(encoded.x, kNormalFormats[jj].bits),
+                                      _quantize_unorm(encoded.y, kNormalFormats[jj].bits));
+            float error = _angle_degrees(n, _oct_decode(stored));
+            sum[jj] += error;
+            if(error > worst[jj])
+                worst[jj] = error;
+        }
+        { /* Old encoding: xy only, z assumed positive */
+            Vec3 decoded = vec3_create(n.x, n.y, sqrtf(fmaxf(0.0f, 1.0f - n.x*n.x - n.y*n.y)));
+            float error = _angle_degrees(n, decoded);
+            sum[jj] += error;
+            if(error > worst[jj])
+                worst[jj] = error;
+        }
+    }
+    system_log("GBuffer normal error over %d random normals:\n", NORMAL_ERROR_SAMPLES);
+    for(jj=0;jj<MAX_NORMAL_FORMATS;++jj) {
+        system_log("\t%-8s %d bytes: mean %.4f, max %.4f degrees\n", kNormalFormats[jj].name,
+                   kNormalFormats[jj].bytes_per_pixel, sum[jj]/NORMAL_ERROR_SAMPLES, worst[jj]);
+    }
+    system_log("\t%-8s %d bytes: mean %.4f, max %.4f degrees (xy only)\n", "RG16F",
+               4, sum[jj]/NORMAL_ERROR_SAMPLES, worst[jj]);
+}
+int gbuffer_layout_uses_normal_format(GBufferLayout layout)
+{
+    int ii;
+    for(ii=0;ii<kGBufferLayouts[layout].num_targets;++ii) {
+        if(kGBufferLayouts[layout].targets[ii] == kTargetNormals)
+            return 1;
+    }
+    return 0;
+}
+int set_deferred_gbuffer_layout(DeferredRenderer* R, GBufferLayout layout)
+{
+    assert(layout < MAX_GBUFFER_LAYOUTS);
+    if(R->layout == layout)
+        return 0;
+    /* The shaders are generated from the layout */
+    if(_create_programs(R, layout)) {
+        system_log("Creating GBuffer layout %s programs failed, keeping %s\n",
+                   kGBufferLayouts[layout].name, kGBufferLayouts[R->layout].name);
+        return 1;
+    }
+    if(R->width && R->height)
+        resize_deferred_renderer(R, R->width, R->height);
+    return 0;
+}
+GBufferLayout deferred_gbuffer_layout(const DeferredRenderer* R)
+{
+    return R->layout;
+}
+const char* gbuffer_layout_name(GBufferLayout layout)
+{
+    return kGBufferLayouts[layout].name;
+}
+void gbuffer_layout_bandwidth(GBufferLayout layout, NormalFormat normals,
+                              int* written, int* read_per_light)
+{
+    int ii;
+    /* 24 bit depth with 8 bits stencil, written by the geometry pass and
+     * read back to rebuild the position
+     */
+    *written = 4;
+    *read_per_light = 4;
+    for(ii=0;ii<kGBufferLayouts[layout].num_targets;++ii) {
+        int bytes = _target_bytes(kGBufferLayouts[layout].targets[ii], normals);
+        int jj;
+        *written += bytes;
+        /* Every field is lit, a target is read if anything is packed in it */
+        for(jj=0;jj<MAX_GBUFFER_FIELDS && kGBufferLayouts[layout].fields[jj].field;++jj) {
+            if(kGBufferLayouts[layout].fields[jj].target == ii) {
+                *read_per_light += bytes;
+                break;
+            }
+        }
+    }
+}
+void set_deferred_light_stencil(DeferredRenderer* R, int enabled)
+{
+    R->stencil_lights = enabled;
+}
+void set_deferred_half_res_lighting(DeferredRenderer* R, int enabled)
+{
+    if(R->half_res_lighting == enabled)
+        return;
+    R->half_res_lighting = enabled;
+    if(R->width && R->height)
+        resize_deferred_renderer(R, R->width, R->height);
+}
+int deferred_half_res_lighting(const DeferredRenderer* R)
+{
+    return R->half_res_lighting;
+}
+void set_deferred_accumulation_format(DeferredRenderer* R, AccumulationFormat format)
+{
+    /* Takes effect on the next resize */
+    R->accumulation_format = format;
+}
+void set_deferred_gpu_lights(DeferredRenderer* R, GLuint light_buffer, int num_lights)
+{
+    R->gpu_light_buffer = light_buffer;
+    R->num_gpu_lights = num_lights;
 }
@@ -9,9 +9,16 @@
 #include "graphics.h"
 #include "scene.h"
 #include "mesh.h"
+#include "shadow.h"
 
 typedef struct DeferredRenderer DeferredRenderer;
 
+/** @brief Starts compiling the programs for the default GBuffer layout, see
+ *      submit_program. Requires OpenGL ES 3.0.
+ */
+void submit_deferred_programs(void);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_deferred_uniforms(DeferredRenderer* R);
 DeferredRenderer* create_deferred_renderer(Graphics* G);
 void destroy_deferred_renderer(DeferredRenderer* R);
 void resize_deferred_renderer(DeferredRenderer* R, int width, int height);
@@ -20,6 +27,67 @@ void render_deferred(DeferredRenderer* R, GLuint default_framebuffer,
                      Mat4 proj_matrix, Mat4 view_matrix,
                      const Model* models, int num_models,
                      const Light* lights, int num_lights);
+/** @brief Limits each light volume to the pixels inside it with a stencil
+ *      pre-pass instead of drawing all volumes in one instanced call.
+ */
+void set_deferred_light_stencil(DeferredRenderer* R, int enabled);
+/** @brief Tiled deferred shading. Lights are binned into screen tiles on the
+ *      CPU and the GBuffer is shaded in a single fullscreen pass.
+ */
+void render_tiled_deferred(DeferredRenderer* R, GLuint default_framebuffer,
+                           Mat4 proj_matrix, Mat4 view_matrix,
+                           const Model* models, int num_models,
+                           const Light* lights, int num_lights);
+/** @return Whether the tile grid for the current size fits in
+ *      GL_MAX_TEXTURE_SIZE
+ */
+int tiled_deferred_supported(const DeferredRenderer* R);
+int deferred_normal_format_supported(const DeferredRenderer* R, NormalFormat format);
+/** @brief Reallocates the GBuffer with normals stored in `format` */
+void set_deferred_normal_format(DeferredRenderer* R, NormalFormat format);
+NormalFormat deferred_normal_format(const DeferredRenderer* R);
+const char* normal_format_name(NormalFormat format);
+/** @brief Logs the mean and max angular error of each normal format over
+ *      random unit normals, next to the old xy-only RG16F encoding
+ */
+void log_normal_format_error(void);
+/** @brief Rebuilds the GBuffer and its shaders for `layout`
+ *  @return 1 if the layout's programs failed to build, the previous layout
+ *      is kept
+ */
+int set_deferred_gbuffer_layout(DeferredRenderer* R, GBufferLayout layout);
+GBufferLayout deferred_gbuffer_layout(const DeferredRenderer* R);
+const char* gbuffer_layout_name(GBufferLayout layout);
+/** @return Whether the layout stores normals in the selected NormalFormat,
+ *      instead of a format of its own
+ */
+int gbuffer_layout_uses_normal_format(GBufferLayout layout);
+/** @brief Bytes per pixel the geometry pass writes and each light reads back,
+ *      depth included. Tiled shading reads once per pixel instead of per light.
+ */
+void gbuffer_layout_bandwidth(GBufferLayout layout, NormalFormat normals,
+                              int* written, int* read_per_light);
+
+/** @brief Lights render_deferred at half resolution, from a downsampled
+ *      GBuffer, and upsamples the light with a joint bilateral filter when
+ *      applying the materials. Tiled shading is unaffected.
+ */
+void set_deferred_half_res_lighting(DeferredRenderer* R, int enabled);
+int deferred_half_res_lighting(const DeferredRenderer* R);
+/** @brief Format of the half resolution light buffer, applied on the next resize */
+void set_deferred_accumulation_format(DeferredRenderer* R, AccumulationFormat format);
 
+/** @brief Lights whose volume instances are written on the GPU, in the
+ *      LIGHT_INSTANCE_SIZE layout. render_deferred draws them after the
+ *      submitted lights, unculled. Tiled shading doesn't see them.
+ */
+void set_deferred_gpu_lights(DeferredRenderer* R, GLuint light_buffer, int num_lights);
+
+/** @brief Adds the shadowed sun to the output of the last render_deferred or
+ *      render_tiled_deferred call, reusing its GBuffer.
+ */
+void render_deferred_sun(DeferredRenderer* R, GLuint default_framebuffer,
+                         Mat4 proj_matrix, Mat4 view_matrix,
+                         const DirectionalLight* sun, const ShadowMap* shadow_map);
 
 #endif /* include guard */
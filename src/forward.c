@@ -3,15 +3,26 @@
  */
 #include "forward.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include "assert.h"
 #include "gl_include.h"
 #include "mesh.h"
 #include "scene.h"
 #include "graphics.h"
 #include "program.h"
+#include "gpu_timing.h"
+#include "light_grid.h"
 
 /* Defines
  */
 #define GetUniformLocation(R, program, uniform) R->uniform = glGetUniformLocation(R->program, #uniform)
+#define GetPassUniformLocation(R, pass, program, uniform) R->pass.uniform = glGetUniformLocation(R->pass.program, #uniform)
+#define GetVariantUniformLocation(R, variant, uniform) R->variants[variant].uniform = glGetUniformLocation(R->variants[variant].program, #uniform)
+#define NUM_CLUSTER_SLICES 16
+#define MAX_FORWARD_LIGHTS 64 /* Light count of the largest forward/fragment.glsl variant */
+#define NUM_LIGHT_VARIANTS 8
+#define NUM_VARIANTS (NUM_LIGHT_VARIANTS*2) /* With and without normal mapping */
+#define NORMAL_MAP_FEATURE (1u << (NUM_LIGHT_VARIANTS-1))
 
 /* Types
  */
@@ -22,73 +33,257 @@ struct ForwardRenderer
     int     major_version;
     int     minor_version;
 
-    GLuint  program;
+    /** Permutations of forward/fragment.glsl, one per light count, with the
+     *  light loop unrolled, times normal mapping. All are built at startup,
+     *  any of them can be needed once lights move.
+     */
+    ProgramPermutations*    permutations;
+    struct {
+        GLuint  program;
+        int     num_lights;
 
-    GLuint  u_World;
-    GLuint  u_View;
-    GLuint  u_Projection;
+        GLuint  u_World;
+        GLuint  u_View;
+        GLuint  u_Projection;
 
-    GLuint  s_Albedo;
-    GLuint  s_Normal;
+        GLuint  s_Albedo;
+        GLuint  s_Normal;
 
-    GLuint  u_LightPositions;
-    GLuint  u_LightColors;
-    GLuint  u_LightSizes;
-    GLuint  u_NumLights;
+        GLuint  u_LightPositions;
+        GLuint  u_LightColors;
+        GLuint  u_LightSizes;
 
-    GLuint  u_CameraPosition;
+        GLuint  u_SpecularColor;
+        GLuint  u_SpecularPower;
+        GLuint  u_SpecularCoefficient;
+    } variants[NUM_VARIANTS];
 
-    GLuint  u_SpecularColor;
-    GLuint  u_SpecularPower;
-    GLuint  u_SpecularCoefficient;
+    /* View space lights, and each model's share of them with room to pad
+     * its last pass
+     */
+    Vec3    light_positions[MAX_LIGHTS];
+    Vec3    light_colors[MAX_LIGHTS];
+    float   light_sizes[MAX_LIGHTS];
+    Vec3    model_positions[MAX_LIGHTS+MAX_FORWARD_LIGHTS];
+    Vec3    model_colors[MAX_LIGHTS+MAX_FORWARD_LIGHTS];
+    float   model_sizes[MAX_LIGHTS+MAX_FORWARD_LIGHTS];
+
+    float   average_model_lights;
+    float   average_model_passes;
+
+    LightGrid*  light_grid;
+
+    struct {
+        GLuint  program;
+
+        GLuint  u_World;
+        GLuint  u_View;
+        GLuint  u_Projection;
+
+        GLuint  s_Albedo;
+        GLuint  s_Normal;
+        GLuint  s_LightData;
+        GLuint  s_LightGrid;
+        GLuint  s_LightIndices;
+
+        GLuint  u_SliceScale;
+        GLuint  u_SliceBias;
+        GLuint  u_NumSlices;
+        GLuint  u_TilesX;
+        GLuint  u_TilesY;
+        GLuint  u_SliceColumns;
+
+        GLuint  u_SpecularColor;
+        GLuint  u_SpecularPower;
+        GLuint  u_SpecularCoefficient;
+    } clustered;
 };
 
 /* Constants
  */
+static const int kVariantLightCounts[NUM_LIGHT_VARIANTS] = { 0, 1, 2, 4, 8, 16, 32, MAX_FORWARD_LIGHTS };
+/* Bit n is kForwardFeatures[n], no light bit means NUM_LIGHTS 0 */
+static const char* const kForwardFeatures[] =
+{
+    "NUM_LIGHTS 1",
+    "NUM_LIGHTS 2",
+    "NUM_LIGHTS 4",
+    "NUM_LIGHTS 8",
+    "NUM_LIGHTS 16",
+    "NUM_LIGHTS 32",
+    "NUM_LIGHTS 64",
+    "NORMAL_MAP",
+};
+static const AttributeSlot kSlots[] =
+{
+    kPositionSlot,
+    kNormalSlot,
+    kTangentSlot,
+    kBitangentSlot,
+    kTexCoordSlot,
+    kEmptySlot
+};
 
 /* Variables
  */
 
 /* Internal functions
  */
-
-/* External functions
+/** Collects the lights whose sphere touches the model's bounding sphere,
+ *  both in view space
+ *  @return The number of lights written to the output arrays
  */
+static int _model_lights(const Model* model, Mat4 view_matrix,
+                         const Vec3* positions, const Vec3* colors, const float* sizes, int num_lights,
+                         Vec3* model_positions, Vec3* model_colors, float* model_sizes)
+{
+    Mat4    world_matrix = transform_get_matrix(model->transform);
+    Vec3    center;
+    float   radius;
+    int     num_model_lights = 0;
+    int     ii;
 
-ForwardRenderer* create_forward_renderer(Graphics* G, int major_version, int minor_version)
+    mesh_bounds(model->mesh, &center, &radius);
+    center = vec3_from_vec4(mat4_mul_vector(mat4_mul_vector(vec4_from_vec3(center, 1.0f), world_matrix), view_matrix));
+    radius *= model->transform.scale;
+
+    for(ii=0;ii<num_lights;++ii) {
+        float reach = sizes[ii] + radius;
+        if(vec3_distance_sq(positions[ii], center) >= reach*reach)
+            continue;
+        model_positions[num_model_lights] = positions[ii];
+        model_colors[num_model_lights] = colors[ii];
+        model_sizes[num_model_lights] = sizes[ii];
+        num_model_lights++;
+    }
+    return num_model_lights;
+}
+/** @return The smallest variant with room for `num_lights` */
+static int _light_variant(int num_lights)
 {
-    AttributeSlot slots[] = {
-        kPositionSlot,
-        kNormalSlot,
-        kTangentSlot,
-        kBitangentSlot,
-        kTexCoordSlot,
-        kEmptySlot
-    };
-    ForwardRenderer* R = (ForwardRenderer*)calloc(1,sizeof(*R));
-    R->major_version = major_version;
-    R->minor_version = minor_version;
+    int ii;
+    for(ii=0;ii<NUM_LIGHT_VARIANTS-1;++ii) {
+        if(kVariantLightCounts[ii] >= num_lights)
+            break;
+    }
+    return ii;
+}
+/** @return The variant for `light_variant` lights, with or without normal mapping */
+static int _variant(int light_variant, int normal_map)
+{
+    return light_variant + (normal_map ? NUM_LIGHT_VARIANTS : 0);
+}
+/** @return The feature mask of `variant` */
+static uint32_t _variant_features(int variant)
+{
+    int light_variant = variant % NUM_LIGHT_VARIANTS;
+    uint32_t features = light_variant ? 1u << (light_variant-1) : 0;
+    if(variant >= NUM_LIGHT_VARIANTS)
+        features |= NORMAL_MAP_FEATURE;
+    return features;
+}
+static void _load_variant(ForwardRenderer* R, int variant)
+{
+    R->variants[variant].num_lights = kVariantLightCounts[variant % NUM_LIGHT_VARIANTS];
+    R->variants[variant].program = program_permutation(R->permutations, _variant_features(variant));
 
-    R->program = create_program("shaders/forward/vertex.glsl", "shaders/forward/fragment.glsl", slots);
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_Projection));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_View));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_World));
 
-    ASSERT_GL(GetUniformLocation(R, program, u_Projection));
-    ASSERT_GL(GetUniformLocation(R, program, u_View));
-    ASSERT_GL(GetUniformLocation(R, program, u_World));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, s_Normal));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, s_Albedo));
 
-    ASSERT_GL(GetUniformLocation(R, program, s_Normal));
-    ASSERT_GL(GetUniformLocation(R, program, s_Albedo));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_LightPositions));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_LightColors));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_LightSizes));
 
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_SpecularColor));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_SpecularPower));
+    ASSERT_GL(GetVariantUniformLocation(R, variant, u_SpecularCoefficient));
 
-    ASSERT_GL(GetUniformLocation(R, program, u_LightPositions));
-    ASSERT_GL(GetUniformLocation(R, program, u_LightColors));
-    ASSERT_GL(GetUniformLocation(R, program, u_LightSizes));
-    ASSERT_GL(GetUniformLocation(R, program, u_NumLights));
+    ASSERT_GL(glUseProgram(R->variants[variant].program));
+    ASSERT_GL(glUniform1i(R->variants[variant].s_Albedo, 0));
+    ASSERT_GL(glUniform1i(R->variants[variant].s_Normal, 1));
+}
+/** Binds `variant` with this frame's matrices, uploaded only when they changed */
+static void _use_variant(ForwardRenderer* R, int variant, Mat4 proj_matrix, Mat4 view_matrix)
+{
+    ASSERT_GL(glUseProgram(R->variants[variant].program));
+    set_uniform_matrix4fv(R->variants[variant].program, R->variants[variant].u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->variants[variant].program, R->variants[variant].u_View, 1, (float*)&view_matrix);
+}
+/** Uniform lookups and texture units, again after a reload */
+static void _setup_clustered_program(ForwardRenderer* R)
+{
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_Projection));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_View));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_World));
+
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, s_Albedo));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, s_Normal));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, s_LightData));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, s_LightGrid));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, s_LightIndices));
 
-    ASSERT_GL(GetUniformLocation(R, program, u_SpecularColor));
-    ASSERT_GL(GetUniformLocation(R, program, u_SpecularPower));
-    ASSERT_GL(GetUniformLocation(R, program, u_SpecularCoefficient));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_SliceScale));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_SliceBias));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_NumSlices));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_TilesX));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_TilesY));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_SliceColumns));
 
-    ASSERT_GL(glUseProgram(R->program));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_SpecularColor));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_SpecularPower));
+    ASSERT_GL(GetPassUniformLocation(R, clustered, program, u_SpecularCoefficient));
+
+    ASSERT_GL(glUseProgram(R->clustered.program));
+    ASSERT_GL(glUniform1i(R->clustered.s_Albedo, 0));
+    ASSERT_GL(glUniform1i(R->clustered.s_Normal, 1));
+    ASSERT_GL(glUniform1i(R->clustered.s_LightData, 2));
+    ASSERT_GL(glUniform1i(R->clustered.s_LightGrid, 3));
+    ASSERT_GL(glUniform1i(R->clustered.s_LightIndices, 4));
+    ASSERT_GL(glUniform1i(R->clustered.u_NumSlices, NUM_CLUSTER_SLICES));
+    ASSERT_GL(glUseProgram(0));
+}
+static void _create_clustered_program(ForwardRenderer* R)
+{
+    R->clustered.program = create_program("shaders/forward/clustered_vertex.glsl",
+                                          "shaders/forward/clustered_fragment.glsl", kSlots);
+    if(R->clustered.program == 0) {
+        system_log("Clustered forward shading not available\n");
+        return;
+    }
+    R->light_grid = create_light_grid(NUM_CLUSTER_SLICES);
+    _setup_clustered_program(R);
+}
+
+/* External functions
+ */
+void submit_forward_programs(int major_version)
+{
+    uint32_t masks[NUM_VARIANTS];
+    int ii;
+    for(ii=0;ii<NUM_VARIANTS;++ii)
+        masks[ii] = _variant_features(ii);
+    submit_program_permutations("shaders/forward/vertex.glsl", "shaders/forward/fragment.glsl", kSlots,
+                                kForwardFeatures, sizeof(kForwardFeatures)/sizeof(kForwardFeatures[0]),
+                                masks, NUM_VARIANTS);
+    if(major_version >= 3)
+        submit_program("shaders/forward/clustered_vertex.glsl",
+                       "shaders/forward/clustered_fragment.glsl", kSlots);
+}
+ForwardRenderer* create_forward_renderer(Graphics* G, int major_version, int minor_version)
+{
+    ForwardRenderer* R = (ForwardRenderer*)calloc(1,sizeof(*R));
+    int ii;
+    R->major_version = major_version;
+    R->minor_version = minor_version;
+
+    R->permutations = create_program_permutations("shaders/forward/vertex.glsl", "shaders/forward/fragment.glsl", kSlots,
+                                                  kForwardFeatures, sizeof(kForwardFeatures)/sizeof(kForwardFeatures[0]));
+    for(ii=0;ii<NUM_VARIANTS;++ii)
+        _load_variant(R, ii);
 
     ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
     ASSERT_GL(glEnableVertexAttribArray(kNormalSlot));
@@ -96,15 +291,29 @@ ForwardRenderer* create_forward_renderer(Graphics* G, int major_version, int min
     ASSERT_GL(glEnableVertexAttribArray(kBitangentSlot));
     ASSERT_GL(glEnableVertexAttribArray(kTexCoordSlot));
 
-    ASSERT_GL(glUniform1i(R->s_Albedo, 0));
-    ASSERT_GL(glUniform1i(R->s_Normal, 1));
-    ASSERT_GL(glUseProgram(0));
+    if(major_version >= 3)
+        _create_clustered_program(R);
 
     return R;
 }
+void resolve_forward_uniforms(ForwardRenderer* R)
+{
+    int ii;
+    /* Permutations keep their names, looking them up again is cheap */
+    for(ii=0;ii<NUM_VARIANTS;++ii) {
+        if(R->variants[ii].program)
+            _load_variant(R, ii);
+    }
+    if(R->clustered.program)
+        _setup_clustered_program(R);
+}
 void destroy_forward_renderer(ForwardRenderer* R)
 {
-    destroy_program(R->program);
+    if(R->light_grid)
+        destroy_light_grid(R->light_grid);
+    if(R->clustered.program)
+        destroy_program(R->clustered.program);
+    destroy_program_permutations(R->permutations);
     free(R);
 }
 void resize_forward_renderer(ForwardRenderer* R, int width, int height)
@@ -118,20 +327,20 @@ void render_forward(ForwardRenderer* R, GLuint default_framebuffer,
                     const Model* models, int num_models,
                     const Light* lights, int num_lights)
 {
-    //Mat4    inv_view = mat4_inverse(view_matrix);
-    //Mat4    inv_proj = mat4_inverse(proj_matrix);
-    Vec3    light_positions[MAX_LIGHTS];
-    Vec3    light_colors[MAX_LIGHTS];
-    float   light_sizes[MAX_LIGHTS];
+    int     total_model_lights = 0;
+    int     total_passes = 0;
+    int     current_variant = -1;
     int     ii;
 
+    assert(num_lights <= MAX_LIGHTS);
+
     /* Fill out light buffer and transform to view space */
     for(ii=0;ii<num_lights;++ii) {
         Vec4 position = vec4_from_vec3(lights[ii].position, 1.0f);
         position = mat4_mul_vector(position, view_matrix);
-        light_positions[ii] = vec3_from_vec4(position);
-        light_colors[ii] = lights[ii].color;
-        light_sizes[ii] = lights[ii].size;
+        R->light_positions[ii] = vec3_from_vec4(position);
+        R->light_colors[ii] = lights[ii].color;
+        R->light_sizes[ii] = lights[ii].size;
     }
     
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, default_framebuffer)); 
@@ -139,26 +348,137 @@ void render_forward(ForwardRenderer* R, GLuint default_framebuffer,
     ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
     ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT));
 
-    ASSERT_GL(glUseProgram(R->program));
-    ASSERT_GL(glUniformMatrix4fv(R->u_Projection, 1, GL_FALSE, (float*)&proj_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->u_View, 1, GL_FALSE, (float*)&view_matrix));
-    ASSERT_GL(glUniform3fv(R->u_LightPositions, num_lights, (float*)light_positions));
-    ASSERT_GL(glUniform3fv(R->u_LightColors, num_lights, (float*)light_colors));
-    ASSERT_GL(glUniform1fv(R->u_LightSizes, num_lights, (float*)light_sizes));
-    ASSERT_GL(glUniform1i(R->u_NumLights, num_lights));
+    ASSERT_GL(glBlendFunc(GL_ONE, GL_ONE));
+
+    begin_gpu_pass("Forward");
+    for(ii=0;ii<num_models;++ii) {
+        Mat4 world_matrix = transform_get_matrix(models[ii].transform);
+        /* Lights, only the ones reaching the model */
+        int num_model_lights = _model_lights(&models[ii], view_matrix,
+                                             R->light_positions, R->light_colors, R->light_sizes, num_lights,
+                                             R->model_positions, R->model_colors, R->model_sizes);
+        int first_light = 0;
+        total_model_lights += num_model_lights;
+
+        /** Light passes
+         *  Up to MAX_FORWARD_LIGHTS lights per pass, later passes add their
+         *  light over the first one's depth
+         */
+        do {
+            int pass_lights = num_model_lights - first_light;
+            int variant;
+            int jj;
+            if(pass_lights > MAX_FORWARD_LIGHTS)
+                pass_lights = MAX_FORWARD_LIGHTS;
+            variant = _variant(_light_variant(pass_lights), models[ii].material->normal != 0);
+            if(variant != current_variant) {
+                _use_variant(R, variant, proj_matrix, view_matrix);
+                current_variant = variant;
+            }
+            if(first_light == MAX_FORWARD_LIGHTS) {
+                ASSERT_GL(glEnable(GL_BLEND));
+                ASSERT_GL(glDepthFunc(GL_LEQUAL));
+                ASSERT_GL(glDepthMask(GL_FALSE));
+            }
+            /* Pad the variant's remaining lights with black ones */
+            for(jj=first_light+pass_lights;jj<first_light+R->variants[variant].num_lights;++jj) {
+                R->model_positions[jj] = vec3_create(0.0f, 0.0f, -1e6f);
+                R->model_colors[jj] = vec3_create(0.0f, 0.0f, 0.0f);
+                R->model_sizes[jj] = 1.0f;
+            }
+            if(R->variants[variant].num_lights) {
+                int count = R->variants[variant].num_lights;
+                set_uniform_3fv(R->variants[variant].program, R->variants[variant].u_LightPositions, count, (float*)(R->model_positions+first_light));
+                set_uniform_3fv(R->variants[variant].program, R->variants[variant].u_LightColors, count, (float*)(R->model_colors+first_light));
+                set_uniform_1fv(R->variants[variant].program, R->variants[variant].u_LightSizes, count, R->model_sizes+first_light);
+            }
+            /* Material */
+            set_uniform_3fv(R->variants[variant].program, R->variants[variant].u_SpecularColor, 1, (float*)&models[ii].material->specular_color);
+            set_uniform_1f(R->variants[variant].program, R->variants[variant].u_SpecularPower, models[ii].material->specular_power);
+            set_uniform_1f(R->variants[variant].program, R->variants[variant].u_SpecularCoefficient, models[ii].material->specular_coefficient);
+            ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+            ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->albedo));
+            ASSERT_GL(glActiveTexture(GL_TEXTURE1));
+            ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->normal));
+            /* Mesh */
+            set_uniform_matrix4fv(R->variants[variant].program, R->variants[variant].u_World, 1, (float*)&world_matrix);
+            draw_mesh(models[ii].mesh);
+
+            first_light += pass_lights;
+            total_passes++;
+        } while(first_light < num_model_lights);
+
+        if(first_light > MAX_FORWARD_LIGHTS) {
+            ASSERT_GL(glDisable(GL_BLEND));
+            ASSERT_GL(glDepthFunc(GL_LESS));
+            ASSERT_GL(glDepthMask(GL_TRUE));
+        }
+    }
+    end_gpu_pass();
+    R->average_model_lights = num_models ? total_model_lights/(float)num_models : 0.0f;
+    R->average_model_passes = num_models ? total_passes/(float)num_models : 0.0f;
+}
+float forward_lights_per_model(const ForwardRenderer* R)
+{
+    return R->average_model_lights;
+}
+float forward_passes_per_model(const ForwardRenderer* R)
+{
+    return R->average_model_passes;
+}
+int clustered_forward_supported(const ForwardRenderer* R)
+{
+    return R->clustered.program != 0 && light_grid_fits(R->light_grid, R->width, R->height);
+}
+void render_clustered_forward(ForwardRenderer* R, GLuint default_framebuffer,
+                              Mat4 proj_matrix, Mat4 view_matrix,
+                              const Model* models, int num_models,
+                              const Light* lights, int num_lights)
+{
+    float   slice_scale;
+    float   slice_bias;
+    int     tiles_x, tiles_y, slice_columns;
+    int     ii;
+
+    /** Light binning
+     *  Lights are assigned to screen tiles split into depth slices, each
+     *  fragment only walks the list of its own cluster
+     */
+    if(!build_light_grid(R->light_grid, R->width, R->height,
+                         proj_matrix, view_matrix, lights, num_lights))
+        return;
+    light_grid_slice_params(R->light_grid, &slice_scale, &slice_bias);
+    light_grid_layout(R->light_grid, &tiles_x, &tiles_y, &slice_columns);
+
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, default_framebuffer));
+    ASSERT_GL(glViewport(0, 0, R->width, R->height));
+    ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT));
+
+    ASSERT_GL(glUseProgram(R->clustered.program));
+    set_uniform_matrix4fv(R->clustered.program, R->clustered.u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->clustered.program, R->clustered.u_View, 1, (float*)&view_matrix);
+    set_uniform_1f(R->clustered.program, R->clustered.u_SliceScale, slice_scale);
+    set_uniform_1f(R->clustered.program, R->clustered.u_SliceBias, slice_bias);
+    set_uniform_1i(R->clustered.program, R->clustered.u_TilesX, tiles_x);
+    set_uniform_1i(R->clustered.program, R->clustered.u_TilesY, tiles_y);
+    set_uniform_1i(R->clustered.program, R->clustered.u_SliceColumns, slice_columns);
+    bind_light_grid(R->light_grid, 2);
 
+    begin_gpu_pass("Clustered forward");
     for(ii=0;ii<num_models;++ii) {
         Mat4 world_matrix = transform_get_matrix(models[ii].transform);
         /* Material */
-        ASSERT_GL(glUniform3fv(R->u_SpecularColor, 1, (float*)&models[ii].material->specular_color));
-        ASSERT_GL(glUniform1f(R->u_SpecularPower, models[ii].material->specular_power));
-        ASSERT_GL(glUniform1f(R->u_SpecularCoefficient, models[ii].material->specular_coefficient));
+        set_uniform_3fv(R->clustered.program, R->clustered.u_SpecularColor, 1, (float*)&models[ii].material->specular_color);
+        set_uniform_1f(R->clustered.program, R->clustered.u_SpecularPower, models[ii].material->specular_power);
+        set_uniform_1f(R->clustered.program, R->clustered.u_SpecularCoefficient, models[ii].material->specular_coefficient);
         ASSERT_GL(glActiveTexture(GL_TEXTURE0));
         ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->albedo));
         ASSERT_GL(glActiveTexture(GL_TEXTURE1));
         ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->normal));
         /* Mesh */
-        ASSERT_GL(glUniformMatrix4fv(R->u_World, 1, GL_FALSE, (float*)&world_matrix));
+        set_uniform_matrix4fv(R->clustered.program, R->clustered.u_World, 1, (float*)&world_matrix);
         draw_mesh(models[ii].mesh);
     }
+    end_gpu_pass();
 }
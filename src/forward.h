@@ -11,13 +11,37 @@
 
 typedef struct ForwardRenderer ForwardRenderer;
 
+/** @brief Starts compiling the renderer's programs, see submit_program */
+void submit_forward_programs(int major_version);
 ForwardRenderer* create_forward_renderer(Graphics* G, int major_version, int minor_version);
 void destroy_forward_renderer(ForwardRenderer* R);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_forward_uniforms(ForwardRenderer* R);
 void resize_forward_renderer(ForwardRenderer* R, int width, int height);
 
+/** @brief Each model is shaded by the lights whose sphere touches its
+ *      bounding sphere, uploaded before its draw. The model is drawn with the
+ *      smallest shader variant, compiled for a fixed light count, that holds them.
+ *  Models reached by more lights than the largest variant holds are drawn
+ *  again for the rest, blended additively. Materials without a normal map
+ *  use variants that skip it. Variants are compiled on first use.
+ */
 void render_forward(ForwardRenderer* R, GLuint default_framebuffer,
                     Mat4 proj_matrix, Mat4 view_matrix,
                     const Model* models, int num_models,
                     const Light* lights, int num_lights);
+/** @return The average number of lights per model in the last render_forward */
+float forward_lights_per_model(const ForwardRenderer* R);
+/** @return The average number of light passes per model in the last render_forward */
+float forward_passes_per_model(const ForwardRenderer* R);
+
+/** @brief Clustered forward shading, requires OpenGL ES 3.0 and a light
+ *      grid for the current size within GL_MAX_TEXTURE_SIZE
+ */
+int clustered_forward_supported(const ForwardRenderer* R);
+void render_clustered_forward(ForwardRenderer* R, GLuint default_framebuffer,
+                              Mat4 proj_matrix, Mat4 view_matrix,
+                              const Model* models, int num_models,
+                              const Light* lights, int num_lights);
 
 #endif /* include guard */
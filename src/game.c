@@ -8,14 +8,20 @@
 #include "system.h"
 #include "timer.h"
 #include "graphics.h"
+#include "deferred.h"
 #include "vec_math.h"
 #include "scene.h"
+#include "program.h"
 #include "ui.h"
+#include "gpu_timing.h"
 #include "assert.h"
 
 /* Defines
  */
 #define NUM_LIGHTS 63
+#define LIGHT_BUDGET 64 /* Lights shaded per frame */
+#define NUM_GPU_LIGHTS (10*1024)
+#define HALF_RES_LIGHTING_PIXELS (2560*1440) /* Light at half resolution from here up */
 
 /* Types
  */
@@ -31,10 +37,14 @@ struct Game
     /* Game objects */
     Transform   camera;
     Scene*      scene;
-    Light       sun_light;
+    DirectionalLight    sun_light;
     Light       lights[NUM_LIGHTS];
     float       light_transform;
     int         dynamic_lights;
+    AnimatedLight*  gpu_lights;
+    int             use_gpu_lights;
+    int         idle;
+    int         shaders_reloaded;
 
     /* Input */
     TouchPoint  points[16];
@@ -61,6 +71,41 @@ static float _rand_float()
 {
     return rand()/(float)RAND_MAX;
 }
+/** Fills the scene with small lights swinging like the CPU ones */
+static AnimatedLight* _create_gpu_lights(void)
+{
+    AnimatedLight* lights = (AnimatedLight*)calloc(NUM_GPU_LIGHTS, sizeof(AnimatedLight));
+    int ii;
+    for(ii=0;ii<NUM_GPU_LIGHTS;++ii) {
+        AnimatedLight* light = &lights[ii];
+        light->position = vec3_create(_rand_float()*24.0f - 12.0f, _rand_float()*4.0f + 0.5f, _rand_float()*24.0f - 12.0f);
+        light->size = 1.0f;
+        light->color = vec3_mul_scalar(vec3_normalize(vec3_create(_rand_float(), _rand_float(), _rand_float())), 0.5f);
+        light->phase = _rand_float()*2.0f*kPi;
+        if(ii % 2)
+            light->axis = vec3_create(0.0f, 0.0f, 2.0f);
+        else
+            light->axis = vec3_create(2.0f, 0.0f, 0.0f);
+        light->speed = 0.5f + _rand_float()*0.5f;
+    }
+    return lights;
+}
+static void _toggle_gpu_lights(Game* G)
+{
+    if(G->gpu_lights == NULL)
+        return;
+    G->use_gpu_lights = !G->use_gpu_lights;
+    set_gpu_lights(G->graphics, G->gpu_lights, G->use_gpu_lights ? NUM_GPU_LIGHTS : 0);
+}
+/** Decided on the size graphics renders at, which the static size toggle
+ *  holds at 720p whatever the screen
+ */
+static void _update_half_res_lighting(Game* G)
+{
+    int width, height;
+    graphics_size(G->graphics, &width, &height);
+    set_half_res_lighting(G->graphics, width*height >= HALF_RES_LIGHTING_PIXELS);
+}
 static void _control_camera(Game* G, float delta_time)
 {
     if(G->num_points == 1) {
@@ -104,8 +149,17 @@ Game* create_game(void)
     int ii;
     Game* G = (Game*)calloc(1, sizeof(Game));
     G->timer = create_timer();
+
+    /* Shaders compile while the scene loads */
+    submit_graphics_programs();
+    submit_ui_programs();
+    reset_timer(G->timer);
+    G->scene = create_scene("lightHouse.obj");
+
     G->graphics = create_graphics();
+    set_light_budget(G->graphics, LIGHT_BUDGET);
     G->ui = create_ui(G->graphics);
+    finish_submitted_programs();
 
     /* Set up camera */
     G->camera = transform_zero;
@@ -114,12 +168,10 @@ Game* create_game(void)
     G->camera.position.y = 2;
     G->camera.position.z = 7.5f;
 
-    /* Load scene */
-    reset_timer(G->timer);
-    G->scene = create_scene("lightHouse.obj");
-    G->sun_light.position = vec3_create(-4.0f, 5.0f, 2.0f);
+    /* Set up scene */
+    G->sun_light.direction = vec3_normalize(vec3_create(4.0f, -5.0f, -2.0f));
     G->sun_light.color = vec3_create(1, 1, 1);
-    G->sun_light.size = 25.0f;
+    set_sun_light(G->graphics, G->sun_light);
 
     G->lights[0].color = vec3_create(1, 0, 0);
     G->lights[1].color = vec3_create(1, 1, 0);
@@ -143,6 +195,9 @@ Game* create_game(void)
     get_model(G->scene, 3)->material->specular_coefficient = 1.0f;
 
     G->dynamic_lights = 1;
+    set_lights_static(G->graphics, !G->dynamic_lights);
+    if(gpu_lights_supported(G->graphics))
+        G->gpu_lights = _create_gpu_lights();
 
     reset_timer(G->timer);
     return G;
@@ -151,6 +206,7 @@ void destroy_game(Game* G)
 {
     destroy_timer(G->timer);
     destroy_graphics(G->graphics);
+    free(G->gpu_lights);
     free(G);
 }
 void resize_game(Game* G, int width, int height)
@@ -158,6 +214,7 @@ void resize_game(Game* G, int width, int height)
     G->width = width;
     G->height = height;
     resize_graphics(G->graphics, width, height);
+    _update_half_res_lighting(G);
     resize_ui(G->ui, width, height);
 }
 void update_game(Game* G)
@@ -165,9 +222,18 @@ void update_game(Game* G)
     float delta_time = (float)get_delta_time(G->timer);
     int ii;
 
+    /* The platform may have stopped drawing while idle, don't simulate that time */
+    if(G->idle)
+        delta_time = 0.0f;
+
+    /* Loose shader files were edited, swap in the new programs */
+    if(asset_files_changed() && reload_graphics_shaders(G->graphics)) {
+        resolve_ui_uniforms(G->ui);
+        G->shaders_reloaded = 1;
+    }
+
     _control_camera(G, delta_time);
     set_view_matrix(G->graphics, mat4_inverse(transform_get_matrix(G->camera)));
-    add_light(G->graphics, G->sun_light);
 
     /* Dynamic Lights */
     if(G->dynamic_lights) {
@@ -179,7 +245,9 @@ void update_game(Game* G)
                 G->lights[ii].position.x = sinf((G->light_transform + ii * 1.0f)/2.0f) * 10.0f;
         }
     }
-    for(ii=0;ii<NUM_LIGHTS;++ii) {
+    /* The GPU lights replace the CPU ones */
+    set_gpu_light_time(G->graphics, G->light_transform);
+    for(ii=0;ii<NUM_LIGHTS && !G->use_gpu_lights;++ii) {
         add_light(G->graphics, G->lights[ii]);
     }
     render_scene(G->scene, G->graphics);
@@ -188,7 +256,8 @@ void update_game(Game* G)
 
     /* Calculate FPS */
     G->fps_time += delta_time;
-    G->fps_count++;
+    if(!G->idle)
+        G->fps_count++;
 
     if(G->fps_time >= 1.0f) {
         G->fps = G->fps_count/G->fps_time;
@@ -211,6 +280,8 @@ void update_game(Game* G)
         case kForward: add_string(G->ui, x, y, scale, "Forward renderer"); break;
         case kLightPrePass: add_string(G->ui, x, y, scale, "Deferred Lighting"); break;
         case kDeferred: add_string(G->ui, x, y, scale, "Deferred Shading"); break;
+        case kTiledDeferred: add_string(G->ui, x, y, scale, "Tiled Deferred Shading"); break;
+        case kClusteredForward: add_string(G->ui, x, y, scale, "Clustered Forward Shading"); break;
         default: assert(!"Invalid renderer"); break;
         }
         y -= scale;
@@ -219,6 +290,76 @@ void update_game(Game* G)
         sprintf(buffer, "%dx%d", width, height);
         add_string(G->ui, x, y, scale, buffer);
         y -= scale;
+        // Lights
+        {
+            int submitted, visible;
+            graphics_light_counts(G->graphics, &submitted, &visible);
+            sprintf(buffer, "Lights: %d/%d", visible, submitted);
+            add_string(G->ui, x, y, scale, buffer);
+            y -= scale;
+            sprintf(buffer, "Dropped energy: %.1f%%", graphics_dropped_light_energy(G->graphics));
+            add_string(G->ui, x, y, scale, buffer);
+            y -= scale;
+            if(renderer_type(G->graphics) == kForward) {
+                sprintf(buffer, "Lights per object: %.1f, %.1f passes", graphics_forward_lights_per_model(G->graphics),
+                        graphics_forward_passes_per_model(G->graphics));
+                add_string(G->ui, x, y, scale, buffer);
+                y -= scale;
+            }
+            if(num_gpu_lights(G->graphics)) {
+                sprintf(buffer, "GPU lights: %d", num_gpu_lights(G->graphics));
+                add_string(G->ui, x, y, scale, buffer);
+                y -= scale;
+            }
+        }
+        // Light accumulation
+        sprintf(buffer, "Accumulation: %s%s", accumulation_format_name(accumulation_format(G->graphics)),
+                format_benchmark_running(G->graphics) ? " (benchmarking)" : "");
+        add_string(G->ui, x, y, scale, buffer);
+        y -= scale;
+        if(renderer_type(G->graphics) == kDeferred || renderer_type(G->graphics) == kTiledDeferred) {
+            GBufferLayout layout = gbuffer_layout(G->graphics);
+            int written, read_per_light;
+            gbuffer_layout_bandwidth(layout, gbuffer_normal_format(G->graphics), &written, &read_per_light);
+            if(gbuffer_layout_uses_normal_format(layout))
+                sprintf(buffer, "GBuffer: %s, %s normals, %d B/px", gbuffer_layout_name(layout),
+                        normal_format_name(gbuffer_normal_format(G->graphics)), written);
+            else
+                sprintf(buffer, "GBuffer: %s, %d B/px", gbuffer_layout_name(layout), written);
+            add_string(G->ui, x, y, scale, buffer);
+            y -= scale;
+        }
+        // Shadows
+        {
+            int static_cascades, dynamic_cascades;
+            if(graphics_shadow_stats(G->graphics, &static_cascades, &dynamic_cascades)) {
+                sprintf(buffer, "Shadow redraws: %d static, %d dynamic", static_cascades, dynamic_cascades);
+                add_string(G->ui, x, y, scale, buffer);
+                y -= scale;
+            }
+        }
+        // Light volume stencil
+        if(renderer_type(G->graphics) == kDeferred || renderer_type(G->graphics) == kLightPrePass) {
+            add_string(G->ui, x, y, scale, light_stencil_enabled(G->graphics) ? "Stencil lights: on" : "Stencil lights: off");
+            y -= scale;
+            add_string(G->ui, x, y, scale, half_res_lighting_enabled(G->graphics) ? "Light resolution: half" : "Light resolution: full");
+            y -= scale;
+        }
+        if(renderer_type(G->graphics) == kLightPrePass) {
+            add_string(G->ui, x, y, scale, light_reuse_active(G->graphics) ? "Light reuse: on" : "Light reuse: off");
+            y -= scale;
+        }
+        sprintf(buffer, "Skipped uniforms: %d", skipped_uniform_uploads());
+        add_string(G->ui, x, y, scale, buffer);
+        y -= scale;
+        // GPU time of each pass, before and after the last shader reload
+        for(ii=0;ii<num_gpu_passes() && G->shaders_reloaded;++ii) {
+            if(gpu_pass_time(ii) == 0.0f && gpu_pass_baseline(ii) == 0.0f)
+                continue;
+            sprintf(buffer, "%s: %.2f | %.2f ms", gpu_pass_name(ii), gpu_pass_baseline(ii), gpu_pass_time(ii));
+            add_string(G->ui, x, y, scale, buffer);
+            y -= scale;
+        }
 
     }
 }
@@ -226,6 +367,12 @@ void render_game(Game* G)
 {
     render_graphics(G->graphics);
     draw_ui(G->ui);
+    G->idle = G->num_points == 0 && !G->dynamic_lights
+           && graphics_frame_reused(G->graphics) && !ui_changed(G->ui);
+}
+int game_idle(const Game* G)
+{
+    return G->idle;
 }
 void add_touch_points(Game* G, int num_touch_points, TouchPoint* points)
 {
@@ -241,6 +388,10 @@ void add_touch_points(Game* G, int num_touch_points, TouchPoint* points)
         Vec2 avg = vec2_add(G->points[0].pos, G->points[1].pos);
         avg = vec2_mul_scalar(avg, 0.5f);
         G->prev_double = avg;
+    } else if(G->num_points == 3) {
+        start_format_benchmark(G->graphics);
+    } else if(G->num_points == 4) {
+        _toggle_gpu_lights(G);
     }
 }
 void update_touch_points(Game* G, int num_touch_points, TouchPoint* points)
@@ -282,12 +433,15 @@ void remove_touch_points(Game* G, int num_touch_points, TouchPoint* points)
                     cycle_renderers(G->graphics);
                 } else { // bottom left
                     G->dynamic_lights = !G->dynamic_lights;
+                    set_lights_static(G->graphics, !G->dynamic_lights);
                 }
 
             } else {
                 if(G->prev_single.y < G->height/2) { // Top right
                     toggle_static_size(G->graphics);
+                    _update_half_res_lighting(G);
                 } else { // bottom right
+                    toggle_light_stencil(G->graphics);
                 }
             }
         }
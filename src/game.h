@@ -22,6 +22,11 @@ void resize_game(Game* G, int width, int height);
 
 void update_game(Game* G);
 void render_game(Game* G);
+/** @brief Whether the last frame showed nothing new: no touches, no moving
+ *      lights, the same scene and the same text. The platform can stop
+ *      drawing until the next touch.
+ */
+int game_idle(const Game* G);
 
 void add_touch_points(Game* G, int num_touch_points, TouchPoint* points);
 void update_touch_points(Game* G, int num_touch_points, TouchPoint* points);
@@ -0,0 +1,135 @@
+/*! @file gbuffer_downsample.c
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "gbuffer_downsample.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include "vertex.h"
+#include "program.h"
+#include "vec_math.h"
+
+/* Defines
+ */
+
+/* Types
+ */
+struct GBufferDownsample
+{
+    GLuint  quad_vertex_buffer;
+    GLuint  quad_index_buffer;
+
+    GLuint  program;
+    GLuint  s_Depth;
+    GLuint  s_Target;
+};
+
+/* Constants
+ */
+static const Vec3 kQuadVertices[] =
+{
+    {  1.0f,  1.0f, 0.0f },
+    { -1.0f,  1.0f, 0.0f },
+    { -1.0f, -1.0f, 0.0f },
+    {  1.0f, -1.0f, 0.0f },
+};
+static const uint16_t kQuadIndices[] =
+{
+    0, 2, 1,
+    0, 3, 2,
+};
+static const AttributeSlot kSlots[] =
+{
+    kPositionSlot,
+    kEmptySlot
+};
+static const GLenum kDrawBuffers[MAX_DOWNSAMPLE_TARGETS] =
+{
+    GL_COLOR_ATTACHMENT0,
+    GL_COLOR_ATTACHMENT1,
+    GL_COLOR_ATTACHMENT2,
+};
+
+/* Variables
+ */
+
+/* Internal functions
+ */
+
+/* External functions
+ */
+void submit_gbuffer_downsample_programs(void)
+{
+    submit_program("shaders/downsample/vertex.glsl", "shaders/downsample/fragment.glsl", kSlots);
+}
+GBufferDownsample* create_gbuffer_downsample(void)
+{
+    GBufferDownsample* D = (GBufferDownsample*)calloc(1, sizeof(*D));
+
+    ASSERT_GL(glGenBuffers(1, &D->quad_vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, D->quad_vertex_buffer));
+    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(kQuadVertices), kQuadVertices, GL_STATIC_DRAW));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+
+    ASSERT_GL(glGenBuffers(1, &D->quad_index_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, D->quad_index_buffer));
+    ASSERT_GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(kQuadIndices), kQuadIndices, GL_STATIC_DRAW));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+
+    D->program = create_program("shaders/downsample/vertex.glsl", "shaders/downsample/fragment.glsl", kSlots);
+    if(D->program == 0) {
+        free(D);
+        return NULL;
+    }
+    resolve_gbuffer_downsample_uniforms(D);
+
+    return D;
+}
+void resolve_gbuffer_downsample_uniforms(GBufferDownsample* D)
+{
+    /* Depth on unit 0, then the targets */
+    int target_units[MAX_DOWNSAMPLE_TARGETS] = {1,2,3};
+    D->s_Depth = glGetUniformLocation(D->program, "s_Depth");
+    D->s_Target = glGetUniformLocation(D->program, "s_Target");
+
+    ASSERT_GL(glUseProgram(D->program));
+    ASSERT_GL(glUniform1i(D->s_Depth, 0));
+    ASSERT_GL(glUniform1iv(D->s_Target, MAX_DOWNSAMPLE_TARGETS, target_units));
+    ASSERT_GL(glUseProgram(0));
+}
+void destroy_gbuffer_downsample(GBufferDownsample* D)
+{
+    if(D == NULL)
+        return;
+    ASSERT_GL(glDeleteBuffers(1, &D->quad_vertex_buffer));
+    ASSERT_GL(glDeleteBuffers(1, &D->quad_index_buffer));
+    destroy_program(D->program);
+    free(D);
+}
+void downsample_gbuffer(GBufferDownsample* D, GLuint depth_texture,
+                        const GLuint* targets, int num_targets)
+{
+    int ii;
+    assert(num_targets <= MAX_DOWNSAMPLE_TARGETS);
+
+    ASSERT_GL(glDrawBuffers(num_targets, kDrawBuffers));
+    ASSERT_GL(glClear(GL_STENCIL_BUFFER_BIT));
+    /* Every pixel writes its depth */
+    ASSERT_GL(glDepthFunc(GL_ALWAYS));
+    ASSERT_GL(glDepthMask(GL_TRUE));
+
+    ASSERT_GL(glUseProgram(D->program));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, depth_texture));
+    for(ii=0;ii<MAX_DOWNSAMPLE_TARGETS;++ii) {
+        ASSERT_GL(glActiveTexture(GL_TEXTURE1+ii));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, ii < num_targets ? targets[ii] : 0));
+    }
+
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, D->quad_vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, D->quad_index_buffer));
+    ASSERT_GL(glVertexAttribPointer(kPositionSlot, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
+    ASSERT_GL(glDrawElements(GL_TRIANGLES, sizeof(kQuadIndices)/sizeof(kQuadIndices[0]), GL_UNSIGNED_SHORT, NULL));
+
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glDepthFunc(GL_LESS));
+}
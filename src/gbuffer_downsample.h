@@ -0,0 +1,33 @@
+/*! @file gbuffer_downsample.h
+ *  @brief Half resolution GBuffers for the deferred renderers
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __gbuffer_downsample_h__
+#define __gbuffer_downsample_h__
+
+#include "gl_include.h"
+
+#define MAX_DOWNSAMPLE_TARGETS 3
+/* Size of the half resolution buffers for a full resolution size */
+#define HALF_RESOLUTION(size) (((size)+1)/2)
+
+typedef struct GBufferDownsample GBufferDownsample;
+
+/** Requires OpenGL ES 3.0 */
+void submit_gbuffer_downsample_programs(void);
+GBufferDownsample* create_gbuffer_downsample(void);
+void destroy_gbuffer_downsample(GBufferDownsample* D);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_gbuffer_downsample_uniforms(GBufferDownsample* D);
+
+/** @brief Halves `depth_texture` and up to MAX_DOWNSAMPLE_TARGETS color
+ *      targets into the bound framebuffer, which has a depth attachment and
+ *      the targets' formats, and its viewport set to half the source.
+ *  Every half resolution pixel copies one source pixel of its 2x2 quad,
+ *  alternating the nearest and the farthest in a checkerboard so both
+ *  surfaces along an edge survive. Depth is written through gl_FragDepth.
+ */
+void downsample_gbuffer(GBufferDownsample* D, GLuint depth_texture,
+                        const GLuint* targets, int num_targets);
+
+#endif /* include guard */
@@ -0,0 +1,175 @@
+/*! @file gpu_timing.c
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "gpu_timing.h"
+#include <stdlib.h>
+#include <string.h>
+#include "gl_include.h"
+#include "system.h"
+
+/* Defines
+ */
+#define GL_TIME_ELAPSED_EXT 0x88BF /* EXT_disjoint_timer_query */
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#define QUERIES_PER_PASS    4   /* Frames of latency before a pass stops being timed */
+#define SAMPLES_PER_AVERAGE 30
+
+/* Types
+ */
+typedef struct GpuPass
+{
+    const char* name;
+    GLuint      queries[QUERIES_PER_PASS];
+    int         first_query;    /* Oldest query in flight */
+    int         num_queries;
+    int         num_stale;      /* In flight from before the last baseline */
+    int         last_frame;     /* Frame the pass was last begun */
+
+    double      total_ms;
+    int         num_samples;
+    float       time;
+    float       baseline;
+} GpuPass;
+
+/* Constants
+ */
+
+/* Variables
+ */
+static int      _supported = 0;
+static GpuPass  _passes[MAX_GPU_PASSES];
+static int      _num_passes = 0;
+static int      _active_pass = -1;
+static int      _frame = 0;
+
+/* Internal functions
+ */
+static GpuPass* _find_pass(const char* name)
+{
+    int ii;
+    for(ii=0;ii<_num_passes;++ii) {
+        if(strcmp(_passes[ii].name, name) == 0)
+            return &_passes[ii];
+    }
+    if(_num_passes == MAX_GPU_PASSES)
+        return NULL;
+    memset(&_passes[_num_passes], 0, sizeof(GpuPass));
+    _passes[_num_passes].name = name;
+    ASSERT_GL(glGenQueries(QUERIES_PER_PASS, _passes[_num_passes].queries));
+    return &_passes[_num_passes++];
+}
+
+/* A pass that isn't being drawn, like the other renderer's, shows no time */
+static int _pass_current(int pass)
+{
+    return _frame - _passes[pass].last_frame <= SAMPLES_PER_AVERAGE;
+}
+
+/* External functions
+ */
+void init_gpu_timing(void)
+{
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    GLint major_version = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major_version);
+    glGetError();
+    _supported = major_version >= 3 && extensions
+                 && strstr(extensions, "GL_EXT_disjoint_timer_query") != NULL;
+    _num_passes = 0;
+    _active_pass = -1;
+    if(_supported == 0)
+        system_log("GPU pass timing not available\n");
+}
+void shutdown_gpu_timing(void)
+{
+    int ii;
+    for(ii=0;ii<_num_passes;++ii)
+        ASSERT_GL(glDeleteQueries(QUERIES_PER_PASS, _passes[ii].queries));
+    _num_passes = 0;
+    _supported = 0;
+}
+void begin_gpu_pass(const char* name)
+{
+    GpuPass* pass;
+    if(_supported == 0 || _active_pass != -1)
+        return;
+    pass = _find_pass(name);
+    /* Every query is still in flight, skip this one */
+    if(pass == NULL || pass->num_queries == QUERIES_PER_PASS)
+        return;
+    ASSERT_GL(glBeginQuery(GL_TIME_ELAPSED_EXT, pass->queries[(pass->first_query + pass->num_queries) % QUERIES_PER_PASS]));
+    pass->num_queries++;
+    pass->last_frame = _frame;
+    _active_pass = (int)(pass - _passes);
+}
+void end_gpu_pass(void)
+{
+    if(_active_pass == -1)
+        return;
+    ASSERT_GL(glEndQuery(GL_TIME_ELAPSED_EXT));
+    _active_pass = -1;
+}
+void update_gpu_timing(void)
+{
+    GLint disjoint = 0;
+    int ii;
+    if(_supported == 0)
+        return;
+    _frame++;
+    /* A disjoint event, like a frequency change, spoils the queries in flight */
+    ASSERT_GL(glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint));
+    for(ii=0;ii<_num_passes;++ii) {
+        GpuPass* pass = &_passes[ii];
+        while(pass->num_queries > 0) {
+            GLuint query = pass->queries[pass->first_query];
+            GLuint available = GL_FALSE;
+            GLuint nanoseconds = 0;
+            ASSERT_GL(glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available));
+            if(available == GL_FALSE)
+                break;
+            ASSERT_GL(glGetQueryObjectuiv(query, GL_QUERY_RESULT, &nanoseconds));
+            pass->first_query = (pass->first_query + 1) % QUERIES_PER_PASS;
+            pass->num_queries--;
+            if(pass->num_stale > 0) {
+                pass->num_stale--;
+                continue;
+            }
+            if(disjoint)
+                continue;
+            pass->total_ms += nanoseconds * 1e-6;
+            if(++pass->num_samples == SAMPLES_PER_AVERAGE) {
+                pass->time = (float)(pass->total_ms / pass->num_samples);
+                pass->total_ms = 0.0;
+                pass->num_samples = 0;
+            }
+        }
+    }
+}
+void set_gpu_timing_baseline(void)
+{
+    int ii;
+    for(ii=0;ii<_num_passes;++ii) {
+        GpuPass* pass = &_passes[ii];
+        pass->baseline = pass->time;
+        pass->time = 0.0f;
+        pass->total_ms = 0.0;
+        pass->num_samples = 0;
+        pass->num_stale = pass->num_queries;
+    }
+}
+int num_gpu_passes(void)
+{
+    return _num_passes;
+}
+const char* gpu_pass_name(int pass)
+{
+    return _passes[pass].name;
+}
+float gpu_pass_time(int pass)
+{
+    return _pass_current(pass) ? _passes[pass].time : 0.0f;
+}
+float gpu_pass_baseline(int pass)
+{
+    return _pass_current(pass) ? _passes[pass].baseline : 0.0f;
+}
@@ -0,0 +1,40 @@
+/*! @file gpu_timing.h
+ *  @brief GPU time of each render pass, from timer queries
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __gpu_timing_h__
+#define __gpu_timing_h__
+
+#define MAX_GPU_PASSES 16
+
+/** @brief Times passes with EXT_disjoint_timer_query on ES 3.0. Without it
+ *      every other call does nothing and no passes are reported.
+ */
+void init_gpu_timing(void);
+void shutdown_gpu_timing(void);
+
+/** @brief Times the GL commands until end_gpu_pass. Passes don't nest, a pass
+ *      begun inside another isn't timed. `name` has to outlive the pass.
+ */
+void begin_gpu_pass(const char* name);
+void end_gpu_pass(void);
+/** @brief Collects finished queries, once per frame. Results come a few
+ *      frames late.
+ */
+void update_gpu_timing(void);
+
+/** @brief Keeps each pass's current average as its baseline, to compare the
+ *      passes against after a change, and starts the averages over
+ */
+void set_gpu_timing_baseline(void);
+
+int num_gpu_passes(void);
+const char* gpu_pass_name(int pass);
+/** @return The pass's average time in milliseconds, 0 until it has one or
+ *      once it stops being drawn
+ */
+float gpu_pass_time(int pass);
+/** @return The average when the baseline was set, 0 if there's none */
+float gpu_pass_baseline(int pass);
+
+#endif /* include guard */
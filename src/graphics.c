@@ -8,19 +8,52 @@
 #include "gl_include.h"
 #include "program.h"
 #include "vertex.h"
+#include "timer.h"
 
 #include "forward.h"
 #include "light_prepass.h"
 #include "deferred.h"
+#include "light_culling.h"
+#include "shadow.h"
+#include "light_animation.h"
+#include "gpu_timing.h"
 
 /* Defines
  */
 #define MAX_RENDER_COMMANDS 1024
 #define STATIC_WIDTH 1280
 #define STATIC_HEIGHT 720
+#define SHADOW_MAP_SIZE 1024
+/* Renderers without shadowed sun support light the scene with a point light
+ * this far back along the sun's direction instead
+ */
+#define SUN_FALLBACK_DISTANCE 7.0f
+#define SUN_FALLBACK_SIZE 25.0f
+#define BENCHMARK_WARMUP_FRAMES 10
+#define BENCHMARK_FRAMES 100
+#define BENCHMARK_LIGHT_STEPS 11 /* 1 to MAX_LIGHTS lights, doubling */
+#define RELOAD_TIMING_FRAMES 120 /* Frames rendered after a reload, to time the new shaders */
 
 /* Types
  */
+typedef enum {
+    kSweepAccumulation,
+    kSweepNormals,
+    kSweepLayouts,
+    kSweepLights,
+} BenchmarkSweep;
+typedef struct BenchmarkStep
+{
+    BenchmarkSweep      sweep;
+    AccumulationFormat  accumulation;
+    NormalFormat        normals;
+    GBufferLayout       layout;
+    int                 num_lights;
+    double              seconds;
+    double              visible_lights; /* Summed over the timed frames, after culling */
+    int                 failed; /* The layout's programs didn't build, skipped */
+} BenchmarkStep;
+
 struct Graphics
 {
     int width;
@@ -30,10 +63,14 @@ struct Graphics
     int major_version;
     int minor_version;
     int static_size;
+    int light_stencil;
+    int half_res_lighting;
 
     ForwardRenderer*        forward;
     LightPrepassRenderer*   light_prepass;
     DeferredRenderer*       deferred;
+    ShadowMap*              shadow_map;
+    LightAnimation*         light_animation;
 
     GLint   default_framebuffer;
 
@@ -41,6 +78,7 @@ struct Graphics
     GLuint  fullscreen_quad_vertex_buffer;
     GLuint  fullscreen_quad_index_buffer;
     GLuint  fullscreen_texture;
+    GLuint  fullscreen_tone_map;
 
     GLuint  framebuffer;
     GLuint  color_texture;
@@ -53,8 +91,39 @@ struct Graphics
     Light   lights[MAX_LIGHTS];
     int     num_render_commands;
     int     num_lights;
+    int     num_submitted_lights;
+    int     num_visible_lights;
+    int     light_budget;
+    LightBudgetStats    light_budget_stats;
+    DirectionalLight    sun;
+    int                 has_sun;
+    float               gpu_light_time;
+
+    /* Last rendered frame, to detect frames that look the same */
+    Model   prev_render_commands[MAX_RENDER_COMMANDS];
+    Light   prev_lights[MAX_LIGHTS];
+    int     prev_num_render_commands;
+    int     prev_num_lights;
+    Mat4    prev_view_matrix;
+    int     frame_dirty;
+    int     frame_reused;
+    int     reload_frames;
 
     RendererType active_renderer;
+    AccumulationFormat  accumulation_format;
+    int                 accumulation_supported[MAX_ACCUMULATION_FORMATS];
+
+    struct {
+        Timer*  timer;
+        int     running;
+        int     frame;
+        int     step;
+        int     num_steps;
+        AccumulationFormat  restore_accumulation;
+        NormalFormat        restore_normals;
+        GBufferLayout       restore_layout;
+        BenchmarkStep       steps[MAX_ACCUMULATION_FORMATS+MAX_NORMAL_FORMATS+MAX_GBUFFER_LAYOUTS+BENCHMARK_LIGHT_STEPS];
+    } benchmark;
 };
 
 /* Constants
@@ -72,25 +141,44 @@ static const uint32_t kFullscreenIndices[] = {
     0, 2, 1,
     0, 3, 2,
 };
+static const struct {
+    GLenum      internal_format;
+    GLenum      format;
+    GLenum      type;
+    int         bytes_per_pixel;
+    int         tone_map;
+    const char* name;
+} kAccumulationFormats[MAX_ACCUMULATION_FORMATS] = {
+    { GL_RGBA,              GL_RGBA,    GL_UNSIGNED_BYTE,               4, 0, "RGBA8" },
+    { GL_RGB10_A2,          GL_RGBA,    GL_UNSIGNED_INT_2_10_10_10_REV, 4, 0, "RGB10A2" },
+    { GL_R11F_G11F_B10F,    GL_RGB,     GL_HALF_FLOAT,                  4, 1, "R11G11B10F" },
+    { GL_RGBA16F,           GL_RGBA,    GL_HALF_FLOAT,                  8, 1, "RGBA16F" },
+};
+static const AttributeSlot kFullscreenSlots[] =
+{
+    kPositionSlot,
+    kTexCoordSlot,
+    kEmptySlot
+};
 
 /* Variables
  */
 
 /* Internal functions
  */
-static void _create_fullscreen_quad(Graphics* G)
+static void _setup_fullscreen_program(Graphics* G)
 {
-    AttributeSlot slots[] = {
-        kPositionSlot,
-        kTexCoordSlot,
-        kEmptySlot
-    };
-    G->fullscreen_program = create_program("fullscreen_vertex.glsl", "fullscreen_fragment.glsl", slots);
     ASSERT_GL(glUseProgram(G->fullscreen_program));
     ASSERT_GL(G->fullscreen_texture = glGetUniformLocation(G->fullscreen_program, "s_Texture"));
+    ASSERT_GL(G->fullscreen_tone_map = glGetUniformLocation(G->fullscreen_program, "u_ToneMap"));
     ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
     ASSERT_GL(glEnableVertexAttribArray(kTexCoordSlot));
     ASSERT_GL(glUseProgram(0));
+}
+static void _create_fullscreen_quad(Graphics* G)
+{
+    G->fullscreen_program = create_program("fullscreen_vertex.glsl", "fullscreen_fragment.glsl", kFullscreenSlots);
+    _setup_fullscreen_program(G);
 
     /* Create vertex buffer */
     ASSERT_GL(glGenBuffers(1, &G->fullscreen_quad_vertex_buffer));
@@ -113,6 +201,188 @@ static void _draw_fullscreen_quad(Graphics* G)
     ASSERT_GL(glVertexAttribPointer(kTexCoordSlot,    2, GL_FLOAT, GL_FALSE, sizeof(kFullscreenVertices[0]), (void*)(ptr+=3)));
     ASSERT_GL(glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, NULL));
 }
+static int _renderer_supported(const Graphics* G, RendererType type)
+{
+    switch(type) {
+    case kForward:          return G->forward != NULL;
+    case kLightPrePass:     return G->light_prepass != NULL;
+    case kDeferred:         return G->major_version >= 3 && G->deferred != NULL;
+    case kTiledDeferred:    return G->major_version >= 3 && G->deferred != NULL && tiled_deferred_supported(G->deferred);
+    case kClusteredForward: return G->forward != NULL && clustered_forward_supported(G->forward);
+    default:                return 0;
+    }
+}
+/** The shadowed sun is drawn from the deferred GBuffer */
+static int _sun_supported(const Graphics* G)
+{
+    return G->shadow_map != NULL && G->deferred != NULL &&
+           (G->active_renderer == kDeferred || G->active_renderer == kTiledDeferred);
+}
+/** On ES 3.0 every depth texture attached to the framebuffer also carries a
+ *  stencil buffer. Attaching them all the same way keeps the depth and
+ *  stencil attachments from referring to different images.
+ */
+static GLenum _depth_attachment(const Graphics* G)
+{
+    return (G->major_version >= 3) ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+}
+/** Checks which accumulation formats can be rendered to. RGBA8 always can,
+ *  RGB10A2 is renderable in ES 3.0 and the float formats need
+ *  EXT_color_buffer_float.
+ */
+static void _probe_accumulation_formats(Graphics* G)
+{
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    int color_buffer_float = extensions && strstr(extensions, "GL_EXT_color_buffer_float") != NULL;
+    GLuint texture, framebuffer;
+    int ii;
+
+    G->accumulation_supported[kAccumulationRGBA8] = 1;
+    if(G->major_version < 3)
+        return;
+
+    ASSERT_GL(glGenTextures(1, &texture));
+    ASSERT_GL(glGenFramebuffers(1, &framebuffer));
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, framebuffer));
+    for(ii=kAccumulationRGB10A2;ii<MAX_ACCUMULATION_FORMATS;++ii) {
+        if(kAccumulationFormats[ii].tone_map && !color_buffer_float)
+            continue;
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, texture));
+        accumulation_tex_image((AccumulationFormat)ii, 4, 4);
+        ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0));
+        G->accumulation_supported[ii] = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    }
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+    ASSERT_GL(glDeleteFramebuffers(1, &framebuffer));
+    ASSERT_GL(glDeleteTextures(1, &texture));
+
+    for(ii=0;ii<MAX_ACCUMULATION_FORMATS;++ii) {
+        system_log("Accumulation format %s:\t%s\n", kAccumulationFormats[ii].name,
+                   G->accumulation_supported[ii] ? "supported" : "unsupported");
+    }
+}
+/** Prefers range first, then the smallest format with it */
+static AccumulationFormat _default_accumulation_format(const Graphics* G)
+{
+    if(G->accumulation_supported[kAccumulationR11G11B10F])
+        return kAccumulationR11G11B10F;
+    if(G->accumulation_supported[kAccumulationRGBA16F])
+        return kAccumulationRGBA16F;
+    if(G->accumulation_supported[kAccumulationRGB10A2])
+        return kAccumulationRGB10A2;
+    return kAccumulationRGBA8;
+}
+/** @return 1 if the step's GBuffer layout failed to build */
+static int _apply_benchmark_step(Graphics* G, const BenchmarkStep* step)
+{
+    if(G->deferred && deferred_gbuffer_layout(G->deferred) != step->layout &&
+       set_deferred_gbuffer_layout(G->deferred, step->layout))
+        return 1;
+    if(G->deferred && deferred_normal_format(G->deferred) != step->normals)
+        set_deferred_normal_format(G->deferred, step->normals);
+    if(G->accumulation_format != step->accumulation)
+        set_accumulation_format(G, step->accumulation);
+    return 0;
+}
+static void _log_benchmark(const Graphics* G)
+{
+    const BenchmarkStep* steps = G->benchmark.steps;
+    double baseline = 0.0;
+    double baseline_lights = 0.0;
+    int ii;
+
+    system_log("Format benchmark, %dx%d, %d frames each:\n", G->width, G->height, BENCHMARK_FRAMES);
+    for(ii=0;ii<G->benchmark.num_steps;++ii) {
+        const BenchmarkStep* step = &steps[ii];
+        double ms = 1000.0*step->seconds/BENCHMARK_FRAMES;
+        double visible = step->visible_lights/BENCHMARK_FRAMES;
+        /* Each sweep is compared against its first step */
+        if(ii == 0 || step->sweep != steps[ii-1].sweep) {
+            baseline = ms;
+            baseline_lights = visible;
+            /* The normal formats' precision, next to their cost */
+            if(step->sweep == kSweepNormals)
+                log_normal_format_error();
+            if(step->sweep == kSweepAccumulation)
+                system_log("  Light accumulation:\n");
+            else if(step->sweep == kSweepNormals)
+                system_log("  GBuffer normals, %s layout:\n", gbuffer_layout_name(step->layout));
+            else if(step->sweep == kSweepLayouts)
+                system_log("  GBuffer layouts, %s normals:\n", normal_format_name(step->normals));
+            else
+                system_log("  Light count, no light budget:\n");
+        }
+        if(step->failed) {
+            system_log("\t%-10s programs failed to build, skipped\n", gbuffer_layout_name(step->layout));
+        } else if(step->sweep == kSweepLights) {
+            /* Culling drops lights outside the view, only the shaded ones cost */
+            system_log("\t%4d lights, %6.1f visible: %.3f ms/frame (%.4f ms per light)\n",
+                       step->num_lights, visible, ms,
+                       visible - baseline_lights >= 1.0 ? (ms - baseline)/(visible - baseline_lights) : 0.0);
+        } else if(step->sweep == kSweepAccumulation) {
+            int bytes = kAccumulationFormats[step->accumulation].bytes_per_pixel;
+            system_log("\t%-10s %d bytes/pixel, %.2f MB per light layer: %.3f ms/frame (%+.3f ms)\n",
+                       kAccumulationFormats[step->accumulation].name, bytes,
+                       G->width*G->height*bytes/(1024.0f*1024.0f), ms, ms - baseline);
+        } else {
+            int written, read_per_light;
+            gbuffer_layout_bandwidth(step->layout, step->normals, &written, &read_per_light);
+            system_log("\t%-10s %d bytes/pixel written, %d read per light: %.3f ms/frame (%+.3f ms)\n",
+                       step->sweep == kSweepNormals ? normal_format_name(step->normals) : gbuffer_layout_name(step->layout),
+                       written, read_per_light, ms, ms - baseline);
+        }
+    }
+}
+/** Called once the frame is presented. Times whole frames, only one format
+ *  changes between steps so the differences are its cost.
+ */
+static void _update_benchmark(Graphics* G, double frame_seconds)
+{
+    if(G->benchmark.frame++ >= BENCHMARK_WARMUP_FRAMES) {
+        G->benchmark.steps[G->benchmark.step].seconds += frame_seconds;
+        G->benchmark.steps[G->benchmark.step].visible_lights += G->num_visible_lights;
+    }
+    if(G->benchmark.frame < BENCHMARK_WARMUP_FRAMES + BENCHMARK_FRAMES)
+        return;
+
+    G->benchmark.frame = 0;
+    while(++G->benchmark.step < G->benchmark.num_steps) {
+        BenchmarkStep* step = &G->benchmark.steps[G->benchmark.step];
+        if(_apply_benchmark_step(G, step) == 0)
+            return;
+        step->failed = 1;
+    }
+
+    /* Done */
+    _log_benchmark(G);
+    G->benchmark.running = 0;
+    if(G->deferred) {
+        set_deferred_gbuffer_layout(G->deferred, G->benchmark.restore_layout);
+        set_deferred_normal_format(G->deferred, G->benchmark.restore_normals);
+    }
+    set_accumulation_format(G, G->benchmark.restore_accumulation);
+}
+/** Replaces the frame's lights with `count` lights for a light count step,
+ *  copies of the submitted ones spread out around them
+ */
+static void _benchmark_lights(Graphics* G, int count)
+{
+    int num_seeds = G->num_lights;
+    int ii;
+    if(num_seeds == 0)
+        return;
+    for(ii=num_seeds;ii<count;++ii) {
+        Light light = G->lights[ii % num_seeds];
+        int ring = ii / num_seeds;
+        float angle = ring * 2.39996f;
+        float radius = 0.5f * sqrtf((float)ring);
+        light.position.x += cosf(angle) * radius;
+        light.position.z += sinf(angle) * radius;
+        G->lights[ii] = light;
+    }
+    G->num_lights = count;
+}
 static void _create_framebuffer(Graphics* G)
 {
     /* Color buffer */
@@ -142,19 +412,19 @@ static void _resize_framebuffer(Graphics* G)
 
     /* Color buffer */
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, G->color_texture));
-    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, G->width, G->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
+    accumulation_tex_image(G->accumulation_format, G->width, G->height);
 
     /* Depth buffer */
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, G->depth_texture));
     if(G->major_version >= 3)
-        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, G->width, G->height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0));
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, G->width, G->height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0));
     else
         ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, G->width, G->height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0));
 
     /* Framebuffer */
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, G->framebuffer));
     ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, G->color_texture, 0));
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, G->depth_texture, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, _depth_attachment(G), GL_TEXTURE_2D, G->depth_texture, 0));
 
     framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
     if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
@@ -166,8 +436,130 @@ static void _resize_framebuffer(Graphics* G)
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
 }
 
+/** @return Whether the submitted frame matches the last rendered one */
+static int _frame_unchanged(const Graphics* G)
+{
+    int ii;
+    if(G->frame_dirty || G->reload_frames || G->benchmark.running)
+        return 0;
+    if(G->num_render_commands != G->prev_num_render_commands || G->num_lights != G->prev_num_lights)
+        return 0;
+    if(memcmp(&G->view_matrix, &G->prev_view_matrix, sizeof(G->view_matrix)) != 0)
+        return 0;
+    if(memcmp(G->lights, G->prev_lights, G->num_lights*sizeof(G->lights[0])) != 0)
+        return 0;
+    for(ii=0;ii<G->num_render_commands;++ii) {
+        const Model* model = &G->render_commands[ii];
+        const Model* prev = &G->prev_render_commands[ii];
+        if(model->mesh != prev->mesh || model->material != prev->material)
+            return 0;
+        if(memcmp(&model->transform, &prev->transform, sizeof(model->transform)) != 0)
+            return 0;
+    }
+    return 1;
+}
+static void _save_frame(Graphics* G)
+{
+    memcpy(G->prev_render_commands, G->render_commands, G->num_render_commands*sizeof(G->render_commands[0]));
+    memcpy(G->prev_lights, G->lights, G->num_lights*sizeof(G->lights[0]));
+    G->prev_num_render_commands = G->num_render_commands;
+    G->prev_num_lights = G->num_lights;
+    G->prev_view_matrix = G->view_matrix;
+    G->frame_dirty = 0;
+}
+/** Renders the submitted frame into G->framebuffer */
+static void _render_scene(Graphics* G)
+{
+    int shadowed_sun = G->has_sun && _sun_supported(G);
+    int sweeping_lights = G->benchmark.running && G->benchmark.steps[G->benchmark.step].sweep == kSweepLights;
+
+    if(shadowed_sun) {
+        update_shadow_map(G->shadow_map, G->proj_matrix, G->view_matrix, G->sun.direction,
+                          G->render_commands, G->num_render_commands);
+    } else if(G->has_sun) {
+        Light light;
+        light.position = vec3_mul_scalar(vec3_normalize(G->sun.direction), -SUN_FALLBACK_DISTANCE);
+        light.color = G->sun.color;
+        light.size = SUN_FALLBACK_SIZE;
+        add_light(G, light);
+    }
+
+    /* Only the light volume renderers draw GPU lights */
+    if(num_gpu_lights(G))
+        animate_lights(G->light_animation, G->view_matrix, G->gpu_light_time);
+
+    ASSERT_GL(glViewport(0, 0, G->width, G->height));
+
+    if(sweeping_lights)
+        _benchmark_lights(G, G->benchmark.steps[G->benchmark.step].num_lights);
+
+    /* Drop lights outside the view before any renderer sees them */
+    G->num_submitted_lights = G->num_lights;
+    G->num_lights = cull_lights(G->proj_matrix, G->view_matrix, G->lights, G->num_lights);
+    G->num_visible_lights = G->num_lights;
+    G->num_lights = budget_lights(G->proj_matrix, G->view_matrix, G->width, G->height,
+                                  G->lights, G->num_lights, sweeping_lights ? 0 : G->light_budget,
+                                  &G->light_budget_stats);
+
+    /* Render scene */
+    if(G->major_version >= 3 && G->deferred && G->active_renderer == kDeferred) {
+        render_deferred(G->deferred, G->framebuffer,
+                        G->proj_matrix, G->view_matrix,
+                        G->render_commands, G->num_render_commands,
+                        G->lights, G->num_lights);
+    } else if(G->major_version >= 3 && G->deferred && G->active_renderer == kTiledDeferred) {
+        render_tiled_deferred(G->deferred, G->framebuffer,
+                              G->proj_matrix, G->view_matrix,
+                              G->render_commands, G->num_render_commands,
+                              G->lights, G->num_lights);
+    } else if(G->active_renderer == kForward) {
+        /* The other renderers attach their own depth buffers */
+        ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, G->framebuffer));
+        ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, _depth_attachment(G), GL_TEXTURE_2D, G->depth_texture, 0));
+        render_forward(G->forward, G->framebuffer,
+                       G->proj_matrix, G->view_matrix,
+                       G->render_commands, G->num_render_commands,
+                       G->lights, G->num_lights);
+    } else if(G->forward && G->active_renderer == kClusteredForward) {
+        ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, G->framebuffer));
+        ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, _depth_attachment(G), GL_TEXTURE_2D, G->depth_texture, 0));
+        render_clustered_forward(G->forward, G->framebuffer,
+                                 G->proj_matrix, G->view_matrix,
+                                 G->render_commands, G->num_render_commands,
+                                 G->lights, G->num_lights);
+    } else if(G->active_renderer == kLightPrePass) {
+        render_light_prepass(G->light_prepass, G->framebuffer,
+                             G->proj_matrix, G->view_matrix,
+                             G->render_commands, G->num_render_commands,
+                             G->lights, G->num_lights);
+    } else {
+        assert(!"No Active Renderer");
+    }
+    if(shadowed_sun) {
+        render_deferred_sun(G->deferred, G->framebuffer,
+                            G->proj_matrix, G->view_matrix,
+                            &G->sun, G->shadow_map);
+    }
+}
+
 /* External functions
  */
+void submit_graphics_programs(void)
+{
+    GLint major_version = 0;
+    /* ES 2.0 doesn't know the query and leaves it at 0 */
+    glGetIntegerv(GL_MAJOR_VERSION, &major_version);
+    glGetError();
+
+    submit_program("fullscreen_vertex.glsl", "fullscreen_fragment.glsl", kFullscreenSlots);
+    submit_forward_programs(major_version);
+    submit_light_prepass_programs(major_version);
+    if(major_version >= 3) {
+        submit_deferred_programs();
+        submit_shadow_map_programs();
+        submit_light_animation_programs();
+    }
+}
 Graphics* create_graphics(void)
 {
     Graphics* G = NULL;
@@ -201,33 +593,50 @@ Graphics* create_graphics(void)
     }
 
     /* Set up self */
+    init_gpu_timing();
     _create_fullscreen_quad(G);
     _create_framebuffer(G);
+    _probe_accumulation_formats(G);
+    G->accumulation_format = _default_accumulation_format(G);
+    G->benchmark.timer = create_timer();
 
     /* Set up renderers */
     G->forward = create_forward_renderer(G, G->major_version, G->minor_version);
     G->light_prepass = create_light_prepass_renderer(G, G->major_version, G->minor_version);
-    if(G->major_version >= 3)
+    if(G->major_version >= 3) {
         G->deferred = create_deferred_renderer(G);
+        G->shadow_map = create_shadow_map(SHADOW_MAP_SIZE);
+        G->light_animation = create_light_animation();
+    }
 
     if(G->deferred)
         G->active_renderer = kDeferred;
     else
         G->active_renderer = kLightPrePass;
     G->static_size = 0;
+    if(G->light_prepass)
+        set_light_prepass_accumulation_format(G->light_prepass, G->accumulation_format);
+    if(G->deferred)
+        set_deferred_accumulation_format(G->deferred, G->accumulation_format);
 
     return G;
 }
 void destroy_graphics(Graphics* G)
 {
+    destroy_shadow_map(G->shadow_map);
+    destroy_light_animation(G->light_animation);
     destroy_deferred_renderer(G->deferred);
     destroy_light_prepass_renderer(G->light_prepass);
     destroy_forward_renderer(G->forward);
     destroy_program(G->fullscreen_program);
+    destroy_timer(G->benchmark.timer);
+    shutdown_gpu_timing();
+    free_light_budget_scratch();
     free(G);
 }
 void resize_graphics(Graphics* G, int width, int height)
 {
+    G->frame_dirty = 1;
     if(G->static_size) {
         G->width = STATIC_WIDTH;// width;
         G->height = STATIC_HEIGHT; //height;
@@ -249,6 +658,9 @@ void resize_graphics(Graphics* G, int width, int height)
         resize_light_prepass_renderer(G->light_prepass, G->width, G->height);
     if(G->deferred)
         resize_deferred_renderer(G->deferred, G->width, G->height);
+    /* The clustered and tiled grids may not fit the new size */
+    if(!_renderer_supported(G, G->active_renderer))
+        cycle_renderers(G);
 
     system_log("Graphics resized: %d, %d\n", width, height);
 }
@@ -257,26 +669,20 @@ void render_graphics(Graphics* G)
     GLint device_framebuffer;
     ASSERT_GL(glGetIntegerv(GL_FRAMEBUFFER_BINDING, &device_framebuffer));
 
-    ASSERT_GL(glViewport(0, 0, G->width, G->height));
-    /* Render scene */
-    if(G->major_version >= 3 && G->deferred && G->active_renderer == kDeferred) {
-        render_deferred(G->deferred, G->framebuffer,
-                        G->proj_matrix, G->view_matrix,
-                        G->render_commands, G->num_render_commands,
-                        G->lights, G->num_lights);
-    } else if(G->active_renderer == kForward) {
-        render_forward(G->forward, G->framebuffer,
-                       G->proj_matrix, G->view_matrix,
-                       G->render_commands, G->num_render_commands,
-                       G->lights, G->num_lights);
-    } else if(G->active_renderer == kLightPrePass) {
-        render_light_prepass(G->light_prepass, G->framebuffer,
-                             G->proj_matrix, G->view_matrix,
-                             G->render_commands, G->num_render_commands,
-                             G->lights, G->num_lights);
-    } else {
-        assert(!"No Active Renderer");
+    if(G->benchmark.running) {
+        /* Don't time work queued before this frame */
+        ASSERT_GL(glFinish());
+        get_delta_time(G->benchmark.timer);
+    }
+
+    /* Nothing changed, present the last frame again */
+    G->frame_reused = _frame_unchanged(G);
+    if(!G->frame_reused) {
+        _save_frame(G);
+        _render_scene(G);
     }
+    if(G->reload_frames)
+        G->reload_frames--;
     G->num_render_commands = 0;
     G->num_lights = 0;
 
@@ -286,10 +692,39 @@ void render_graphics(Graphics* G)
     ASSERT_GL(glClearColor(1.0f, 0.0f, 1.0f, 1.0f));
     ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
     ASSERT_GL(glUseProgram(G->fullscreen_program));
+    set_uniform_1i(G->fullscreen_program, G->fullscreen_tone_map, kAccumulationFormats[G->accumulation_format].tone_map);
     ASSERT_GL(glActiveTexture(GL_TEXTURE0));
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, G->color_texture));
     _draw_fullscreen_quad(G);
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+
+    if(G->benchmark.running) {
+        ASSERT_GL(glFinish());
+        _update_benchmark(G, get_delta_time(G->benchmark.timer));
+    }
+    update_gpu_timing();
+}
+int reload_graphics_shaders(Graphics* G)
+{
+    int reloaded = reload_changed_programs();
+    if(reloaded == 0)
+        return 0;
+    set_gpu_timing_baseline();
+    _setup_fullscreen_program(G);
+    if(G->forward)
+        resolve_forward_uniforms(G->forward);
+    if(G->light_prepass)
+        resolve_light_prepass_uniforms(G->light_prepass);
+    if(G->deferred)
+        resolve_deferred_uniforms(G->deferred);
+    if(G->shadow_map)
+        resolve_shadow_map_uniforms(G->shadow_map);
+    if(G->light_animation)
+        resolve_light_animation_uniforms(G->light_animation);
+    G->frame_dirty = 1;
+    G->reload_frames = RELOAD_TIMING_FRAMES;
+    system_log("Reloaded %d programs\n", reloaded);
+    return reloaded;
 }
 
 void set_view_matrix(Graphics* G, Mat4 view)
@@ -305,7 +740,7 @@ void add_render_command(Graphics* G, Model model)
 void add_light(Graphics* G, Light light)
 {
     int index = G->num_lights++;
-    assert(index <= MAX_LIGHTS);
+    assert(index < MAX_LIGHTS);
     G->lights[index] = light;
 }
 RendererType renderer_type(const Graphics* G)
@@ -314,12 +749,12 @@ RendererType renderer_type(const Graphics* G)
 }
 void cycle_renderers(Graphics* G)
 {
-    G->active_renderer++;
-    if(G->active_renderer == kDeferred && (G->major_version < 3 || G->deferred == NULL))
+    G->frame_dirty = 1;
+    do {
         G->active_renderer++;
-
-    if(G->active_renderer == MAX_RENDERERS)
-        G->active_renderer = 0;
+        if(G->active_renderer == MAX_RENDERERS)
+            G->active_renderer = 0;
+    } while(!_renderer_supported(G, G->active_renderer));
 }
 void graphics_size(const Graphics* G, int* width, int* height)
 {
@@ -331,3 +766,246 @@ void toggle_static_size(Graphics* G)
     G->static_size = !G->static_size;
     resize_graphics(G, G->real_width, G->real_height);
 }
+void graphics_light_counts(const Graphics* G, int* submitted, int* visible)
+{
+    *submitted = G->num_submitted_lights;
+    *visible = G->num_visible_lights;
+}
+void set_light_budget(Graphics* G, int budget)
+{
+    G->frame_dirty = 1;
+    G->light_budget = budget;
+}
+float graphics_dropped_light_energy(const Graphics* G)
+{
+    const LightBudgetStats* stats = &G->light_budget_stats;
+    if(stats->total_energy <= 0.0f)
+        return 0.0f;
+    return 100.0f*stats->dropped_energy/stats->total_energy;
+}
+void toggle_light_stencil(Graphics* G)
+{
+    G->frame_dirty = 1;
+    G->light_stencil = !G->light_stencil;
+    if(G->deferred)
+        set_deferred_light_stencil(G->deferred, G->light_stencil);
+    if(G->light_prepass)
+        set_light_prepass_light_stencil(G->light_prepass, G->light_stencil);
+}
+int light_stencil_enabled(const Graphics* G)
+{
+    return G->light_stencil;
+}
+void set_half_res_lighting(Graphics* G, int enabled)
+{
+    G->frame_dirty = 1;
+    G->half_res_lighting = enabled;
+    if(G->deferred)
+        set_deferred_half_res_lighting(G->deferred, enabled);
+    if(G->light_prepass)
+        set_light_prepass_half_res_lighting(G->light_prepass, enabled);
+}
+int half_res_lighting_enabled(const Graphics* G)
+{
+    /* Light pre-pass needs ES 3.0 for it */
+    if(G->active_renderer == kLightPrePass)
+        return light_prepass_half_res_lighting(G->light_prepass);
+    return G->half_res_lighting;
+}
+void set_lights_static(Graphics* G, int lights_static)
+{
+    if(G->light_prepass)
+        set_light_prepass_static_lights(G->light_prepass, lights_static);
+}
+int light_reuse_active(const Graphics* G)
+{
+    return G->active_renderer == kLightPrePass && light_prepass_reused_light(G->light_prepass);
+}
+void set_sun_light(Graphics* G, DirectionalLight sun)
+{
+    G->frame_dirty = 1;
+    G->sun = sun;
+    G->has_sun = 1;
+}
+int graphics_shadow_stats(const Graphics* G, int* static_cascades, int* dynamic_cascades)
+{
+    if(!G->has_sun || !_sun_supported(G))
+        return 0;
+    shadow_map_stats(G->shadow_map, static_cascades, dynamic_cascades);
+    return 1;
+}
+int accumulation_format_supported(const Graphics* G, AccumulationFormat format)
+{
+    return format < MAX_ACCUMULATION_FORMATS && G->accumulation_supported[format];
+}
+void set_accumulation_format(Graphics* G, AccumulationFormat format)
+{
+    assert(accumulation_format_supported(G, format));
+    G->accumulation_format = format;
+    if(G->light_prepass)
+        set_light_prepass_accumulation_format(G->light_prepass, format);
+    if(G->deferred)
+        set_deferred_accumulation_format(G->deferred, format);
+    resize_graphics(G, G->real_width, G->real_height);
+}
+AccumulationFormat accumulation_format(const Graphics* G)
+{
+    return G->accumulation_format;
+}
+const char* accumulation_format_name(AccumulationFormat format)
+{
+    return kAccumulationFormats[format].name;
+}
+void accumulation_tex_image(AccumulationFormat format, int width, int height)
+{
+    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, kAccumulationFormats[format].internal_format, width, height, 0,
+                           kAccumulationFormats[format].format, kAccumulationFormats[format].type, 0));
+}
+AccumulationFormat accumulation_format_with_alpha(AccumulationFormat format)
+{
+    switch(format) {
+    case kAccumulationRGB10A2:      return kAccumulationRGBA8;
+    case kAccumulationR11G11B10F:   return kAccumulationRGBA16F;
+    default:                        return format;
+    }
+}
+void start_format_benchmark(Graphics* G)
+{
+    BenchmarkStep* step = G->benchmark.steps;
+    NormalFormat normals = gbuffer_normal_format(G);
+    GBufferLayout layout = gbuffer_layout(G);
+    int ii;
+
+    if(G->benchmark.running)
+        return;
+    G->benchmark.restore_accumulation = G->accumulation_format;
+    G->benchmark.restore_normals = normals;
+    G->benchmark.restore_layout = layout;
+
+    for(ii=0;ii<MAX_ACCUMULATION_FORMATS;++ii) {
+        if(!G->accumulation_supported[ii])
+            continue;
+        step->sweep = kSweepAccumulation;
+        step->accumulation = (AccumulationFormat)ii;
+        step->normals = normals;
+        step->layout = layout;
+        step->seconds = 0.0;
+        step++;
+    }
+    /* The GBuffer only matters to the renderers with one */
+    if(G->deferred && (G->active_renderer == kDeferred || G->active_renderer == kTiledDeferred)) {
+        for(ii=0;ii<MAX_NORMAL_FORMATS && gbuffer_layout_uses_normal_format(layout);++ii) {
+            if(!deferred_normal_format_supported(G->deferred, (NormalFormat)ii))
+                continue;
+            step->sweep = kSweepNormals;
+            step->accumulation = G->accumulation_format;
+            step->normals = (NormalFormat)ii;
+            step->layout = layout;
+            step->seconds = 0.0;
+            step++;
+        }
+        for(ii=0;ii<MAX_GBUFFER_LAYOUTS;++ii) {
+            step->sweep = kSweepLayouts;
+            step->accumulation = G->accumulation_format;
+            step->normals = normals;
+            step->layout = (GBufferLayout)ii;
+            step->seconds = 0.0;
+            step++;
+        }
+    }
+    /* Then the light count, in the active formats */
+    for(ii=0;ii<BENCHMARK_LIGHT_STEPS;++ii) {
+        step->sweep = kSweepLights;
+        step->accumulation = G->accumulation_format;
+        step->normals = normals;
+        step->layout = layout;
+        step->num_lights = 1 << ii;
+        step->seconds = 0.0;
+        step++;
+    }
+    for(ii=0;ii<(int)(step - G->benchmark.steps);++ii) {
+        G->benchmark.steps[ii].visible_lights = 0.0;
+        G->benchmark.steps[ii].failed = 0;
+    }
+    G->benchmark.num_steps = (int)(step - G->benchmark.steps);
+    G->benchmark.step = 0;
+    G->benchmark.frame = 0;
+    G->benchmark.running = 1;
+    _apply_benchmark_step(G, &G->benchmark.steps[0]);
+}
+int format_benchmark_running(const Graphics* G)
+{
+    return G->benchmark.running;
+}
+NormalFormat gbuffer_normal_format(const Graphics* G)
+{
+    return G->deferred ? deferred_normal_format(G->deferred) : kNormalRGB10A2;
+}
+int gbuffer_normal_format_supported(const Graphics* G, NormalFormat format)
+{
+    return G->deferred && deferred_normal_format_supported(G->deferred, format);
+}
+int set_gbuffer_normal_format(Graphics* G, NormalFormat format)
+{
+    GBufferLayout layout = gbuffer_layout(G);
+    if(!gbuffer_layout_uses_normal_format(layout)) {
+        system_log("The %s GBuffer layout has fixed normals, keeping them\n", gbuffer_layout_name(layout));
+        return 1;
+    }
+    G->frame_dirty = 1;
+    set_deferred_normal_format(G->deferred, format);
+    return 0;
+}
+GBufferLayout gbuffer_layout(const Graphics* G)
+{
+    return G->deferred ? deferred_gbuffer_layout(G->deferred) : kGBufferSpecular;
+}
+int set_gbuffer_layout(Graphics* G, GBufferLayout layout)
+{
+    G->frame_dirty = 1;
+    return set_deferred_gbuffer_layout(G->deferred, layout);
+}
+int graphics_frame_reused(const Graphics* G)
+{
+    return G->frame_reused;
+}
+int gpu_lights_supported(const Graphics* G)
+{
+    return G->light_animation != NULL;
+}
+void set_gpu_lights(Graphics* G, const AnimatedLight* lights, int num_lights)
+{
+    GLuint buffer;
+    assert(gpu_lights_supported(G) || num_lights == 0);
+    if(G->light_animation == NULL)
+        return;
+    set_animated_lights(G->light_animation, lights, num_lights);
+    buffer = animated_light_buffer(G->light_animation);
+    if(G->deferred)
+        set_deferred_gpu_lights(G->deferred, buffer, num_lights);
+    if(G->light_prepass)
+        set_light_prepass_gpu_lights(G->light_prepass, buffer, num_lights);
+    G->frame_dirty = 1;
+}
+void set_gpu_light_time(Graphics* G, float time)
+{
+    if(G->gpu_light_time != time)
+        G->frame_dirty = 1;
+    G->gpu_light_time = time;
+}
+int num_gpu_lights(const Graphics* G)
+{
+    if(G->light_animation == NULL)
+        return 0;
+    if(G->active_renderer != kDeferred && G->active_renderer != kLightPrePass)
+        return 0;
+    return num_animated_lights(G->light_animation);
+}
+float graphics_forward_lights_per_model(const Graphics* G)
+{
+    return G->forward ? forward_lights_per_model(G->forward) : 0.0f;
+}
+float graphics_forward_passes_per_model(const Graphics* G)
+{
+    return G->forward ? forward_passes_per_model(G->forward) : 0.0f;
+}
@@ -8,16 +8,58 @@
 #include "scene.h"
 #include "graphics_types.h"
 
-#define MAX_LIGHTS 128
+#define MAX_LIGHTS 1024
 
 typedef enum {
     kForward,
     kLightPrePass,
     kDeferred,
+    kTiledDeferred,
+    kClusteredForward,
     
     MAX_RENDERERS
 } RendererType;
 
+/** Format lights are accumulated in. The float formats need
+ *  EXT_color_buffer_float and are tone mapped when presented.
+ */
+typedef enum {
+    kAccumulationRGBA8,
+    kAccumulationRGB10A2,
+    kAccumulationR11G11B10F,
+    kAccumulationRGBA16F,
+
+    MAX_ACCUMULATION_FORMATS
+} AccumulationFormat;
+
+/** Format of the octahedral view space normals in the deferred GBuffer.
+ *  RG16 needs EXT_texture_norm16.
+ */
+typedef enum {
+    kNormalRG8,
+    kNormalRGB10A2,
+    kNormalRG16,
+
+    MAX_NORMAL_FORMATS
+} NormalFormat;
+
+/** What the deferred GBuffer stores, see kGBufferLayouts
+ *  Compact:  RGBA8 albedo, normals. No specular
+ *  Specular: RGBA8 albedo + specular intensity, RGB10A2 normals + power
+ *  Full:     RGBA8 albedo, normals, RGBA8 specular color + power
+ */
+typedef enum {
+    kGBufferCompact,
+    kGBufferSpecular,
+    kGBufferFull,
+
+    MAX_GBUFFER_LAYOUTS
+} GBufferLayout;
+
+/** @brief Starts compiling every program create_graphics builds, so they
+ *      compile while the caller does other work. See submit_program.
+ */
+void submit_graphics_programs(void);
 Graphics* create_graphics(void);
 void destroy_graphics(Graphics* G);
 
@@ -26,14 +68,116 @@ void resize_graphics(Graphics* G, int width, int height);
 void set_view_matrix(Graphics* G, Mat4 view);
 void add_render_command(Graphics* G, Model model);
 void add_light(Graphics* G, Light light);
+/** @brief Sets the directional sun light. The deferred renderers draw it
+ *      with cascaded shadow maps, the others with an unshadowed point light.
+ *  Models with `dynamic` set are kept out of the cached shadows.
+ */
+void set_sun_light(Graphics* G, DirectionalLight sun);
 
+/** @return The average number of lights per model the forward renderer shaded */
+float graphics_forward_lights_per_model(const Graphics* G);
+/** @return The average number of light passes per model the forward renderer drew */
+float graphics_forward_passes_per_model(const Graphics* G);
+
+/** @brief Lights animated on the GPU with transform feedback, next to the
+ *      lights added each frame. They are uploaded once and never read back.
+ *  Only the deferred renderer and deferred lighting draw them, unculled.
+ *  Requires OpenGL ES 3.0.
+ */
+int gpu_lights_supported(const Graphics* G);
+void set_gpu_lights(Graphics* G, const AnimatedLight* lights, int num_lights);
+/** @brief Time, in seconds, the GPU lights are animated to */
+void set_gpu_light_time(Graphics* G, float time);
+/** @return The number of GPU lights the active renderer draws */
+int num_gpu_lights(const Graphics* G);
+
+/** @brief Renders the submitted frame, or presents the last one again when
+ *      the view, models and lights match it and no setting changed
+ */
 void render_graphics(Graphics* G);
+/** @return Whether the last render_graphics call only re-presented */
+int graphics_frame_reused(const Graphics* G);
 
 RendererType renderer_type(const Graphics* G);
 void cycle_renderers(Graphics* G);
 
 void graphics_size(const Graphics* G, int* width, int* height);
+/** @brief Lights added and lights left after frustum culling, last frame */
+void graphics_light_counts(const Graphics* G, int* submitted, int* visible);
+
+/** @brief Caps the number of lights shaded per frame. Lower ranked lights
+ *      are merged into aggregate lights or dropped. 0 disables the cap.
+ */
+void set_light_budget(Graphics* G, int budget);
+/** @return The percentage of estimated light energy dropped last frame */
+float graphics_dropped_light_energy(const Graphics* G);
+
+/** @brief Shadow cascades re-rendered last frame
+ *  @return 0 if the active renderer doesn't draw shadows
+ */
+int graphics_shadow_stats(const Graphics* G, int* static_cascades, int* dynamic_cascades);
+
+int accumulation_format_supported(const Graphics* G, AccumulationFormat format);
+void set_accumulation_format(Graphics* G, AccumulationFormat format);
+AccumulationFormat accumulation_format(const Graphics* G);
+const char* accumulation_format_name(AccumulationFormat format);
+/** @brief Allocates the texture bound to GL_TEXTURE_2D in `format` */
+void accumulation_tex_image(AccumulationFormat format, int width, int height);
+/** @return The nearest format to `format` with an alpha channel, for light
+ *      buffers that keep specular in alpha
+ */
+AccumulationFormat accumulation_format_with_alpha(AccumulationFormat format);
+
+int gbuffer_normal_format_supported(const Graphics* G, NormalFormat format);
+/** @brief Only layouts with a normals target, see
+ *      gbuffer_layout_uses_normal_format, store normals in `format`. The
+ *      default Specular layout packs them in RGB10A2 beside the power.
+ *  @return 1, changing nothing, if the current layout's normals are fixed
+ */
+int set_gbuffer_normal_format(Graphics* G, NormalFormat format);
+NormalFormat gbuffer_normal_format(const Graphics* G);
+/** @return 1 if the layout's programs failed to build, see
+ *      set_deferred_gbuffer_layout
+ */
+int set_gbuffer_layout(Graphics* G, GBufferLayout layout);
+GBufferLayout gbuffer_layout(const Graphics* G);
+
+/** @brief Renders a fixed number of frames in every supported accumulation
+ *      format, then in every GBuffer normal format and layout when a
+ *      deferred renderer is active, and logs the frame time of each, plus
+ *      the normal formats' angular error. The active formats are restored
+ *      afterwards.
+ *  Last it sweeps 1 to MAX_LIGHTS lights, copies of the submitted lights
+ *  spread around them, with the light budget off.
+ */
+void start_format_benchmark(Graphics* G);
+int format_benchmark_running(const Graphics* G);
 
 void toggle_static_size(Graphics* G);
 
+/** @brief Toggles stencil masking of light volumes in the deferred renderers */
+void toggle_light_stencil(Graphics* G);
+int light_stencil_enabled(const Graphics* G);
+
+/** @brief Accumulates light at half resolution in the deferred renderers
+ *      that support it, upsampling with a depth and normal aware filter
+ */
+void set_half_res_lighting(Graphics* G, int enabled);
+int half_res_lighting_enabled(const Graphics* G);
+
+/** @brief Lets the renderers reuse last frame's light while the lights
+ *      submitted each frame don't change
+ */
+void set_lights_static(Graphics* G, int lights_static);
+/** @return Whether the last frame reprojected the previous frame's light */
+int light_reuse_active(const Graphics* G);
+
+/** @brief Rebuilds the renderers' programs whose shader files changed, see
+ *      reload_changed_programs, and keeps the GPU pass times from before as
+ *      the baseline. Frames are rendered for a while afterwards, even if
+ *      they look the same, so the new times come in.
+ *  @return The number of programs relinked
+ */
+int reload_graphics_shaders(Graphics* G);
+
 #endif /* include guard */
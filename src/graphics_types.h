@@ -13,6 +13,23 @@ typedef struct Light
     Vec3    color;
     float   size;
 } Light;
+/** Light animated on the GPU. It swings around `position` along `axis`:
+ *  position + axis*sin(speed*time + phase)
+ */
+typedef struct AnimatedLight
+{
+    Vec3    position;
+    float   size;
+    Vec3    color;
+    float   phase;
+    Vec3    axis;   /* Scaled by the swing's amplitude */
+    float   speed;  /* Radians per second */
+} AnimatedLight;
+typedef struct DirectionalLight
+{
+    Vec3    direction; /* World space, from the light towards the scene */
+    Vec3    color;
+} DirectionalLight;
 
 typedef struct Mesh Mesh;
 
@@ -21,6 +21,53 @@
 
 /* Internal functions
  */
+static int _load_cache_file(const char* path, void** data, size_t* data_size)
+{
+    FILE* file = fopen(path, "rb");
+    long size;
+    if(file == NULL)
+        return -1;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size <= 0) {
+        fclose(file);
+        return -1;
+    }
+    *data = malloc(size);
+    *data_size = size;
+    if(fread(*data, size, 1, file) != 1) {
+        fclose(file);
+        free(*data);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+/** Writes beside `path` and renames over it, so a crash or full disk
+ *  mid-write never leaves a truncated file behind
+ */
+static int _save_cache_file(const char* path, const void* data, size_t data_size)
+{
+    char temp_path[1024];
+    FILE* file;
+    size_t written;
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    file = fopen(temp_path, "wb");
+    if(file == NULL)
+        return -1;
+    written = fwrite(data, data_size, 1, file);
+    if(fclose(file) != 0 || written != 1) {
+        remove(temp_path);
+        return -1;
+    }
+    return rename(temp_path, path) == 0 ? 0 : -1;
+}
+static const char* _cache_path(const char* name)
+{
+    NSString* directory = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+    return [[directory stringByAppendingPathComponent:[NSString stringWithUTF8String:name]] UTF8String];
+}
 
 /* External functions
  */
@@ -51,6 +98,23 @@ void free_file_data(void* data)
 {
     free(data);
 }
+int load_cache_data(const char* name, void** data, size_t* data_size)
+{
+    @autoreleasepool {
+        return _load_cache_file(_cache_path(name), data, data_size);
+    }
+}
+int save_cache_data(const char* name, const void* data, size_t data_size)
+{
+    @autoreleasepool {
+        return _save_cache_file(_cache_path(name), data, data_size);
+    }
+}
+int asset_files_changed(void)
+{
+    /* Not watched, assets are read from the bundle */
+    return 0;
+}
 void system_log(const char* format, ...)
 {
     va_list args;
@@ -0,0 +1,143 @@
+/*! @file light_animation.c
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "light_animation.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include "program.h"
+#include "vertex.h"
+#include "light_volume.h"
+
+/* Defines
+ */
+
+/* Types
+ */
+struct LightAnimation
+{
+    GLuint  program;
+    GLuint  u_View;
+    GLuint  u_Time;
+
+    GLuint  light_buffer;       /* AnimatedLight */
+    GLuint  instance_buffer;    /* Written by transform feedback */
+    int     num_lights;
+};
+
+/* Constants
+ */
+/* Captured in the order of the light volume instance layout */
+static const char* const kVaryings[] =
+{
+    "v_LightPosition",
+    "v_LightColor",
+};
+static const AttributeSlot kSlots[] =
+{
+    kLightPositionSlot,
+    kLightColorSlot,
+    kLightAnimationSlot,
+    kEmptySlot
+};
+
+/* Variables
+ */
+
+/* Internal functions
+ */
+
+/* External functions
+ */
+void submit_light_animation_programs(void)
+{
+    submit_feedback_program("shaders/light_animation/vertex.glsl",
+                            "shaders/light_animation/fragment.glsl",
+                            kSlots, kVaryings,
+                            sizeof(kVaryings)/sizeof(kVaryings[0]));
+}
+LightAnimation* create_light_animation(void)
+{
+    LightAnimation* A = (LightAnimation*)calloc(1, sizeof(*A));
+
+    A->program = create_feedback_program("shaders/light_animation/vertex.glsl",
+                                         "shaders/light_animation/fragment.glsl",
+                                         kSlots, kVaryings,
+                                         sizeof(kVaryings)/sizeof(kVaryings[0]));
+    if(A->program == 0) {
+        free(A);
+        return NULL;
+    }
+    resolve_light_animation_uniforms(A);
+
+    ASSERT_GL(glGenBuffers(1, &A->light_buffer));
+    ASSERT_GL(glGenBuffers(1, &A->instance_buffer));
+
+    return A;
+}
+void resolve_light_animation_uniforms(LightAnimation* A)
+{
+    ASSERT_GL(A->u_View = glGetUniformLocation(A->program, "u_View"));
+    ASSERT_GL(A->u_Time = glGetUniformLocation(A->program, "u_Time"));
+}
+void destroy_light_animation(LightAnimation* A)
+{
+    if(A == NULL)
+        return;
+    ASSERT_GL(glDeleteBuffers(1, &A->light_buffer));
+    ASSERT_GL(glDeleteBuffers(1, &A->instance_buffer));
+    destroy_program(A->program);
+    free(A);
+}
+void set_animated_lights(LightAnimation* A, const AnimatedLight* lights, int num_lights)
+{
+    A->num_lights = num_lights;
+    if(num_lights == 0)
+        return;
+
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, A->light_buffer));
+    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(AnimatedLight)*num_lights, lights, GL_STATIC_DRAW));
+    /* Only ever touched by the GPU */
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, A->instance_buffer));
+    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, LIGHT_INSTANCE_SIZE*num_lights, NULL, GL_DYNAMIC_COPY));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+}
+int num_animated_lights(const LightAnimation* A)
+{
+    return A->num_lights;
+}
+void animate_lights(LightAnimation* A, Mat4 view_matrix, float time)
+{
+    if(A->num_lights == 0)
+        return;
+
+    ASSERT_GL(glUseProgram(A->program));
+    set_uniform_matrix4fv(A->program, A->u_View, 1, (float*)&view_matrix);
+    set_uniform_1f(A->program, A->u_Time, time);
+
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, A->light_buffer));
+    ASSERT_GL(glEnableVertexAttribArray(kLightPositionSlot));
+    ASSERT_GL(glEnableVertexAttribArray(kLightColorSlot));
+    ASSERT_GL(glEnableVertexAttribArray(kLightAnimationSlot));
+    ASSERT_GL(glVertexAttribPointer(kLightPositionSlot, 4, GL_FLOAT, GL_FALSE, sizeof(AnimatedLight), (void*)offsetof(AnimatedLight, position)));
+    ASSERT_GL(glVertexAttribPointer(kLightColorSlot, 4, GL_FLOAT, GL_FALSE, sizeof(AnimatedLight), (void*)offsetof(AnimatedLight, color)));
+    ASSERT_GL(glVertexAttribPointer(kLightAnimationSlot, 4, GL_FLOAT, GL_FALSE, sizeof(AnimatedLight), (void*)offsetof(AnimatedLight, axis)));
+
+    /* One point per light, nothing is rasterized */
+    ASSERT_GL(glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, A->instance_buffer));
+    ASSERT_GL(glEnable(GL_RASTERIZER_DISCARD));
+    ASSERT_GL(glBeginTransformFeedback(GL_POINTS));
+    ASSERT_GL(glDrawArrays(GL_POINTS, 0, A->num_lights));
+    ASSERT_GL(glEndTransformFeedback());
+    ASSERT_GL(glDisable(GL_RASTERIZER_DISCARD));
+    ASSERT_GL(glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0));
+
+    /* Attribute state is global, don't leak it into mesh draws */
+    ASSERT_GL(glDisableVertexAttribArray(kLightPositionSlot));
+    ASSERT_GL(glDisableVertexAttribArray(kLightColorSlot));
+    ASSERT_GL(glDisableVertexAttribArray(kLightAnimationSlot));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+}
+GLuint animated_light_buffer(const LightAnimation* A)
+{
+    return A->instance_buffer;
+}
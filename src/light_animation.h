@@ -0,0 +1,32 @@
+/*! @file light_animation.h
+ *  @brief Point lights animated on the GPU with transform feedback
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __light_animation_h__
+#define __light_animation_h__
+
+#include "gl_include.h"
+#include "graphics_types.h"
+
+typedef struct LightAnimation LightAnimation;
+
+/** Requires OpenGL ES 3.0 */
+void submit_light_animation_programs(void);
+LightAnimation* create_light_animation(void);
+void destroy_light_animation(LightAnimation* A);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_light_animation_uniforms(LightAnimation* A);
+
+/** @brief Uploads the lights. They stay on the GPU until the next call. */
+void set_animated_lights(LightAnimation* A, const AnimatedLight* lights, int num_lights);
+int num_animated_lights(const LightAnimation* A);
+
+/** @brief Moves every light to where it is at `time` with a transform
+ *      feedback pass. The result, in view space, is written to the buffer
+ *      returned by animated_light_buffer in the LIGHT_INSTANCE_SIZE layout
+ *      the light volumes read.
+ */
+void animate_lights(LightAnimation* A, Mat4 view_matrix, float time);
+GLuint animated_light_buffer(const LightAnimation* A);
+
+#endif /* include guard */
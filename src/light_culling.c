@@ -0,0 +1,368 @@
+/*! @file light_culling.c
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "light_culling.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simd.h"
+#include "graphics.h"
+
+/* Defines
+ */
+#define MAX_AGGREGATE_GROWTH 4.0f
+
+/* Types
+ */
+typedef struct RankedLight
+{
+    float   importance;
+    float   area;
+    int     index;
+} RankedLight;
+/** budget_lights' working arrays, kept between calls */
+typedef struct BudgetScratch
+{
+    RankedLight*    ranked;
+    Light*          aggregates;
+    Vec3*           aggregate_energy; /* Sum of color x area */
+    float*          aggregate_weight;
+    float*          aggregate_max_size;
+    Light*          kept;
+    int             capacity;
+} BudgetScratch;
+
+/* Constants
+ */
+
+/* Variables
+ */
+static BudgetScratch _scratch = {0};
+
+/* Internal functions
+ */
+static void _reserve_scratch(int num_lights)
+{
+    if(num_lights <= _scratch.capacity)
+        return;
+    _scratch.ranked = (RankedLight*)realloc(_scratch.ranked, sizeof(RankedLight)*num_lights);
+    _scratch.aggregates = (Light*)realloc(_scratch.aggregates, sizeof(Light)*num_lights);
+    _scratch.aggregate_energy = (Vec3*)realloc(_scratch.aggregate_energy, sizeof(Vec3)*num_lights);
+    _scratch.aggregate_weight = (float*)realloc(_scratch.aggregate_weight, sizeof(float)*num_lights);
+    _scratch.aggregate_max_size = (float*)realloc(_scratch.aggregate_max_size, sizeof(float)*num_lights);
+    _scratch.kept = (Light*)realloc(_scratch.kept, sizeof(Light)*num_lights);
+    _scratch.capacity = num_lights;
+}
+/** Projects the extent of a circle along one axis.
+ *  Works in the plane spanned by that axis (a) and view depth (z). The
+ *  bounds are either where the lines through the eye touch the circle or,
+ *  if those touching points are behind the near plane, where the circle
+ *  crosses the near plane.
+ *  @param scale [in] Projection scale of the axis (P.r0.x or P.r1.y)
+ *  @param offset [in] Projection offset of the axis (P.r2.x or P.r2.y)
+ *  @return 0 if no part of the circle is in front of the near plane
+ */
+static int _project_extent(float a, float z, float radius, float near_plane,
+                           float scale, float offset, float* min_ndc, float* max_ndc)
+{
+    float   d2 = a*a + z*z;
+    float   r2 = radius*radius;
+    int     found = 0;
+    int     ii;
+
+    *min_ndc = 1.0f;
+    *max_ndc = -1.0f;
+
+    if(d2 <= r2) {
+        /* The eye is inside the circle, it covers the whole axis */
+        *min_ndc = -1.0f;
+        *max_ndc = 1.0f;
+        return 1;
+    }
+
+    /* Touching points, the center direction rotated by +-asin(r/d) */
+    {
+        float t = sqrtf(d2 - r2);
+        for(ii=-1;ii<=1;ii+=2) {
+            float pa = (a*t - ii*z*radius)*t/d2;
+            float pz = (z*t + ii*a*radius)*t/d2;
+            if(pz > near_plane) {
+                float ndc = scale*pa/pz + offset;
+                if(ndc < *min_ndc) *min_ndc = ndc;
+                if(ndc > *max_ndc) *max_ndc = ndc;
+                found = 1;
+            }
+        }
+    }
+
+    /* Near plane crossings */
+    {
+        float dz = near_plane - z;
+        if(dz*dz < r2) {
+            float h = sqrtf(r2 - dz*dz);
+            for(ii=-1;ii<=1;ii+=2) {
+                float ndc = scale*(a + ii*h)/near_plane + offset;
+                if(ndc < *min_ndc) *min_ndc = ndc;
+                if(ndc > *max_ndc) *max_ndc = ndc;
+                found = 1;
+            }
+        }
+    }
+    return found;
+}
+
+/** Extracts the frustum planes of a left-handed, D3D style (0 <= z <= w)
+ *  clip space. A point p is inside when dot(plane.xyz, p) + plane.w >= 0.
+ */
+static void _frustum_planes(Mat4 view_proj, Vec4* planes)
+{
+    const Mat4* M = &view_proj;
+    Vec4    c0 = vec4_create(M->r0.x, M->r1.x, M->r2.x, M->r3.x);
+    Vec4    c1 = vec4_create(M->r0.y, M->r1.y, M->r2.y, M->r3.y);
+    Vec4    c2 = vec4_create(M->r0.z, M->r1.z, M->r2.z, M->r3.z);
+    Vec4    c3 = vec4_create(M->r0.w, M->r1.w, M->r2.w, M->r3.w);
+    int     ii;
+
+    planes[0] = vec4_add(c3, c0); /* Left */
+    planes[1] = vec4_sub(c3, c0); /* Right */
+    planes[2] = vec4_add(c3, c1); /* Bottom */
+    planes[3] = vec4_sub(c3, c1); /* Top */
+    planes[4] = c2;               /* Near */
+    planes[5] = vec4_sub(c3, c2); /* Far */
+    for(ii=0;ii<6;++ii) {
+        float length = sqrtf(planes[ii].x*planes[ii].x + planes[ii].y*planes[ii].y + planes[ii].z*planes[ii].z);
+        planes[ii] = vec4_div_scalar(planes[ii], length);
+    }
+}
+
+static float _luminance(Vec3 color)
+{
+    return 0.2126f*color.x + 0.7152f*color.y + 0.0722f*color.z;
+}
+static float _screen_area(Vec3 position, float size, Mat4 proj_matrix, Mat4 view_matrix,
+                          int width, int height)
+{
+    Vec4        view_position = mat4_mul_vector(vec4_from_vec3(position, 1.0f), view_matrix);
+    LightRect   rect;
+    if(!compute_light_rect(vec3_from_vec4(view_position), size, proj_matrix, width, height, &rect))
+        return 0.0f;
+    return (float)rect.width*rect.height;
+}
+static int _compare_importance(const void* a, const void* b)
+{
+    float ia = ((const RankedLight*)a)->importance;
+    float ib = ((const RankedLight*)b)->importance;
+    return (ia < ib) - (ia > ib); /* Descending */
+}
+/** Moves the aggregate to the importance weighted center of it and `light`
+ *  @return The radius that still bounds everything it absorbed
+ */
+static float _merged_size(const Light* aggregate, float aggregate_weight,
+                          const Light* light, float weight, Vec3* center)
+{
+    float total = aggregate_weight + weight;
+    float size;
+    *center = aggregate->position;
+    if(total > 0.0f)
+        *center = vec3_lerp(aggregate->position, light->position, weight/total);
+    size = aggregate->size + vec3_distance(*center, aggregate->position);
+    if(vec3_distance(*center, light->position) + light->size > size)
+        size = vec3_distance(*center, light->position) + light->size;
+    return size;
+}
+
+/* External functions
+ */
+int compute_light_rect(Vec3 view_position, float radius, Mat4 proj_matrix,
+                       int width, int height, LightRect* rect)
+{
+    const Mat4* P = &proj_matrix;
+    /* LH projection: r2.z = f/(f-n), r3.z = -nf/(f-n) */
+    float   near_plane = -P->r3.z/P->r2.z;
+    float   far_plane = P->r3.z/(1.0f - P->r2.z);
+    float   min_x, max_x;
+    float   min_y, max_y;
+    int     x0, x1, y0, y1;
+
+    if(view_position.z + radius <= near_plane || view_position.z - radius >= far_plane)
+        return 0;
+    if(!_project_extent(view_position.x, view_position.z, radius, near_plane,
+                        P->r0.x, P->r2.x, &min_x, &max_x))
+        return 0;
+    if(!_project_extent(view_position.y, view_position.z, radius, near_plane,
+                        P->r1.y, P->r2.y, &min_y, &max_y))
+        return 0;
+    if(max_x <= -1.0f || min_x >= 1.0f || max_y <= -1.0f || min_y >= 1.0f)
+        return 0;
+
+    x0 = (int)floorf((min_x*0.5f + 0.5f)*width);
+    x1 = (int)ceilf((max_x*0.5f + 0.5f)*width);
+    y0 = (int)floorf((min_y*0.5f + 0.5f)*height);
+    y1 = (int)ceilf((max_y*0.5f + 0.5f)*height);
+    if(x0 < 0) x0 = 0;
+    if(y0 < 0) y0 = 0;
+    if(x1 > width) x1 = width;
+    if(y1 > height) y1 = height;
+    if(x0 >= x1 || y0 >= y1)
+        return 0;
+
+    rect->x = x0;
+    rect->y = y0;
+    rect->width = x1 - x0;
+    rect->height = y1 - y0;
+    rect->min_z = (view_position.z - radius > near_plane) ? view_position.z - radius : near_plane;
+    rect->max_z = (view_position.z + radius < far_plane) ? view_position.z + radius : far_plane;
+    return 1;
+}
+int cull_lights(Mat4 proj_matrix, Mat4 view_matrix, Light* lights, int num_lights)
+{
+    Vec4    planes[6];
+    int     num_visible = 0;
+    int     ii, jj;
+
+    _frustum_planes(mat4_multiply(view_matrix, proj_matrix), planes);
+
+    for(ii=0;ii<num_lights;ii+=4) {
+        float   x[4], y[4], z[4], r[4];
+        int     count = (num_lights - ii < 4) ? num_lights - ii : 4;
+        int     visible = 0xF;
+        simd4f  sx, sy, sz, snr;
+
+        /* Transpose to one register per component */
+        for(jj=0;jj<4;++jj) {
+            const Light* light = &lights[ii + (jj < count ? jj : 0)];
+            x[jj] = light->position.x;
+            y[jj] = light->position.y;
+            z[jj] = light->position.z;
+            r[jj] = light->size;
+        }
+        sx = simd4f_load(x);
+        sy = simd4f_load(y);
+        sz = simd4f_load(z);
+        snr = simd4f_negate(simd4f_load(r));
+
+        for(jj=0;jj<6;++jj) {
+            simd4f dist = simd4f_madd(sx, simd4f_splat(planes[jj].x), simd4f_splat(planes[jj].w));
+            dist = simd4f_madd(sy, simd4f_splat(planes[jj].y), dist);
+            dist = simd4f_madd(sz, simd4f_splat(planes[jj].z), dist);
+            visible &= simd4m_movemask(simd4f_greater_equal(dist, snr));
+        }
+
+        /* Compact. Writes never pass the batch being read */
+        for(jj=0;jj<count;++jj) {
+            if(visible & (1 << jj))
+                lights[num_visible++] = lights[ii+jj];
+        }
+    }
+    return num_visible;
+}
+int budget_lights(Mat4 proj_matrix, Mat4 view_matrix, int width, int height,
+                  Light* lights, int num_lights, int budget, LightBudgetStats* stats)
+{
+    RankedLight* ranked;
+    Light*      aggregates;
+    Vec3*       aggregate_energy;
+    float*      aggregate_weight;
+    float*      aggregate_max_size;
+    int         max_aggregates;
+    int         num_kept;
+    int         num_aggregates = 0;
+    int         ii, jj;
+
+    memset(stats, 0, sizeof(*stats));
+    _reserve_scratch(num_lights);
+    ranked = _scratch.ranked;
+    aggregates = _scratch.aggregates;
+    aggregate_energy = _scratch.aggregate_energy;
+    aggregate_weight = _scratch.aggregate_weight;
+    aggregate_max_size = _scratch.aggregate_max_size;
+
+    for(ii=0;ii<num_lights;++ii) {
+        ranked[ii].area = _screen_area(lights[ii].position, lights[ii].size,
+                                       proj_matrix, view_matrix, width, height);
+        ranked[ii].importance = ranked[ii].area*_luminance(lights[ii].color);
+        ranked[ii].index = ii;
+        stats->total_energy += ranked[ii].importance;
+    }
+    if(budget <= 0 || num_lights <= budget) {
+        stats->num_shaded = num_lights;
+        return num_lights;
+    }
+    qsort(ranked, num_lights, sizeof(ranked[0]), _compare_importance);
+
+    max_aggregates = budget/4 ? budget/4 : 1;
+    num_kept = budget - max_aggregates;
+
+    /** Aggregate the rest
+     *  Each light joins the first aggregate its sphere overlaps, as long as
+     *  the merged aggregate stays within MAX_AGGREGATE_GROWTH times the
+     *  radius of the light that started it, or starts a new one while there
+     *  are slots left. Aggregates sit at the importance weighted center and
+     *  grow to bound every light they absorb.
+     */
+    for(ii=num_kept;ii<num_lights;++ii) {
+        const Light* light = &lights[ranked[ii].index];
+        float weight = ranked[ii].importance;
+        Light* aggregate = NULL;
+        Vec3 center = light->position;
+        float size = 0.0f;
+
+        for(jj=0;jj<num_aggregates;++jj) {
+            float distance = vec3_distance(aggregates[jj].position, light->position);
+            if(distance >= aggregates[jj].size + light->size)
+                continue;
+            size = _merged_size(&aggregates[jj], aggregate_weight[jj], light, weight, &center);
+            if(size <= aggregate_max_size[jj]) {
+                aggregate = &aggregates[jj];
+                break;
+            }
+        }
+        if(aggregate == NULL && num_aggregates < max_aggregates) {
+            jj = num_aggregates++;
+            aggregate = &aggregates[jj];
+            *aggregate = *light;
+            aggregate_energy[jj] = vec3_mul_scalar(light->color, ranked[ii].area);
+            aggregate_weight[jj] = weight;
+            aggregate_max_size[jj] = light->size*MAX_AGGREGATE_GROWTH;
+            stats->num_merged++;
+            continue;
+        }
+        if(aggregate == NULL) {
+            stats->num_dropped++;
+            stats->dropped_energy += weight;
+            continue;
+        }
+        aggregate->position = center;
+        aggregate->size = size;
+        aggregate_energy[jj] = vec3_add(aggregate_energy[jj], vec3_mul_scalar(light->color, ranked[ii].area));
+        aggregate_weight[jj] += weight;
+        stats->num_merged++;
+    }
+
+    /* Spread each aggregate's energy over the area it now covers */
+    for(ii=0;ii<num_aggregates;++ii) {
+        float area = _screen_area(aggregates[ii].position, aggregates[ii].size,
+                                  proj_matrix, view_matrix, width, height);
+        if(area > 0.0f)
+            aggregates[ii].color = vec3_div_scalar(aggregate_energy[ii], area);
+    }
+
+    /* Kept lights first, in ranked order, then the aggregates */
+    for(ii=0;ii<num_kept;++ii)
+        _scratch.kept[ii] = lights[ranked[ii].index];
+    memcpy(lights, _scratch.kept, sizeof(Light)*num_kept);
+    memcpy(lights+num_kept, aggregates, sizeof(Light)*num_aggregates);
+    stats->num_shaded = num_kept + num_aggregates;
+    return stats->num_shaded;
+}
+void free_light_budget_scratch(void)
+{
+    free(_scratch.ranked);
+    free(_scratch.aggregates);
+    free(_scratch.aggregate_energy);
+    free(_scratch.aggregate_weight);
+    free(_scratch.aggregate_max_size);
+    free(_scratch.kept);
+    memset(&_scratch, 0, sizeof(_scratch));
+}
@@ -0,0 +1,61 @@
+/*! @file light_culling.h
+ *  @brief Screen space bounds of point lights
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __light_culling_h__
+#define __light_culling_h__
+
+#include "vec_math.h"
+#include "graphics_types.h"
+
+typedef struct LightRect
+{
+    /* Pixels, origin at the bottom left like glScissor */
+    int     x;
+    int     y;
+    int     width;
+    int     height;
+    /* View space depth range, clipped to the near and far planes */
+    float   min_z;
+    float   max_z;
+} LightRect;
+
+/** @brief Computes the screen rectangle covered by a light's sphere,
+ *      including spheres that cross the near plane.
+ *  @param view_position [in] Light position in view space
+ *  @param proj_matrix [in] Left-handed perspective projection
+ *  @return 0 if the light is outside the view, the rect is left undefined
+ */
+int compute_light_rect(Vec3 view_position, float radius, Mat4 proj_matrix,
+                       int width, int height, LightRect* rect);
+
+/** @brief Removes the lights whose spheres lie completely outside the view
+ *      frustum. Spheres are tested four at a time against all six planes.
+ *  @return The number of lights left, packed in order at the front of
+ *      `lights`
+ */
+int cull_lights(Mat4 proj_matrix, Mat4 view_matrix, Light* lights, int num_lights);
+
+typedef struct LightBudgetStats
+{
+    int     num_shaded;     /* Lights handed to the renderer, aggregates included */
+    int     num_merged;     /* Lights folded into aggregates */
+    int     num_dropped;
+    float   total_energy;   /* Sum of projected area x intensity */
+    float   dropped_energy;
+} LightBudgetStats;
+
+/** @brief Caps the number of lights to `budget`.
+ *  Lights are ranked by estimated screen contribution (projected area times
+ *  luminance). The top ranked lights are kept as is; a quarter of the
+ *  budget is reserved for aggregate lights that absorb the remaining lights
+ *  they overlap. Lights that fit no aggregate are dropped.
+ *  @param lights [in,out] Visible lights. Replaced by the budgeted list.
+ *  @return The number of lights left in `lights`
+ */
+int budget_lights(Mat4 proj_matrix, Mat4 view_matrix, int width, int height,
+                  Light* lights, int num_lights, int budget, LightBudgetStats* stats);
+/** @brief Frees the working arrays budget_lights keeps between calls */
+void free_light_budget_scratch(void);
+
+#endif /* include guard */
@@ -0,0 +1,455 @@
+/*! @file light_grid.c
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "light_grid.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "gl_include.h"
+#include "simd.h"
+
+/* Defines
+ */
+#define MAX_TILES           256 /* Per axis. 4096 pixels */
+#define MAX_SLICES          64
+#define MAX_BOUNDARIES      (MAX_TILES+1+3) /* Rounded up for the SIMD loop */
+#define LIGHT_TEXTURE_WIDTH 512
+#define INDEX_TEXTURE_WIDTH 1024
+
+/* Types
+ */
+typedef struct ClusterRange
+{
+    int x0, x1;
+    int y0, y1;
+    int z0, z1;
+} ClusterRange;
+
+struct LightGrid
+{
+    int     width;
+    int     height;
+    int     tiles_x;
+    int     tiles_y;
+    int     num_slices;
+    int     slice_columns;  /* Slices side by side in the grid texture */
+    int     max_texture_size;
+    Mat4    proj_matrix;
+
+    /** Tile boundary planes
+     *  Every tile edge is a plane through the eye. Columns are stored as the
+     *  x and z components of their normals, rows as y and z.
+     */
+    float   column_x[MAX_BOUNDARIES];
+    float   column_z[MAX_BOUNDARIES];
+    float   row_y[MAX_BOUNDARIES];
+    float   row_z[MAX_BOUNDARIES];
+    float   far_plane;
+    float   slice_scale;
+    float   slice_bias;
+
+    /* CPU data */
+    Vec4*       light_data;
+    ClusterRange* light_ranges;
+    int         light_capacity;
+
+    uint32_t*   cluster_data;
+    int         cluster_capacity;
+
+    uint16_t*   indices;
+    int         index_capacity;
+    int         num_indices;
+    int         truncated;      /* Cluster lists were cut to fit the index texture */
+
+    /* GPU data */
+    GLuint  light_texture;
+    GLuint  grid_texture;
+    GLuint  index_texture;
+    int     light_texture_height;
+    int     grid_texture_width;
+    int     grid_texture_height;
+    int     index_texture_height;
+};
+
+/* Constants
+ */
+
+/* Variables
+ */
+
+/* Internal functions
+ */
+static GLuint _create_texture(void)
+{
+    GLuint texture = 0;
+    ASSERT_GL(glGenTextures(1, &texture));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, texture));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+    return texture;
+}
+static int _rows_needed(int count, int width)
+{
+    int rows = (count + width - 1)/width;
+    return rows ? rows : 1;
+}
+/** Lays the slices out in as few columns as keep the grid texture within
+ *  GL_MAX_TEXTURE_SIZE
+ *  @return 0 if no layout fits
+ */
+static int _slice_columns(const LightGrid* grid, int tiles_x, int tiles_y, int* slice_columns)
+{
+    int columns;
+    for(columns=1;columns<=grid->num_slices;++columns) {
+        int rows = (grid->num_slices + columns - 1)/columns;
+        if(tiles_x*columns > grid->max_texture_size)
+            return 0;
+        if(tiles_y*rows <= grid->max_texture_size) {
+            *slice_columns = columns;
+            return 1;
+        }
+    }
+    return 0;
+}
+static int _grid_texture_width(const LightGrid* grid)
+{
+    return grid->tiles_x*grid->slice_columns;
+}
+static int _grid_texture_height(const LightGrid* grid)
+{
+    return grid->tiles_y*_rows_needed(grid->num_slices, grid->slice_columns);
+}
+/** Computes the planes through the eye that bound each tile column and row.
+ *  A point is right of (above) boundary `ii` when the dot product with the
+ *  boundary's normal is positive.
+ */
+static void _build_planes(LightGrid* grid)
+{
+    const Mat4* P = &grid->proj_matrix;
+    float near_plane;
+    int ii;
+
+    memset(grid->column_x, 0, sizeof(grid->column_x));
+    memset(grid->column_z, 0, sizeof(grid->column_z));
+    memset(grid->row_y, 0, sizeof(grid->row_y));
+    memset(grid->row_z, 0, sizeof(grid->row_z));
+
+    for(ii=0;ii<=grid->tiles_x;++ii) {
+        int x = ii*LIGHT_GRID_TILE_SIZE;
+        float ndc = 2.0f*(x < grid->width ? x : grid->width)/grid->width - 1.0f;
+        float nx = P->r0.x;
+        float nz = P->r2.x - ndc;
+        float length = sqrtf(nx*nx + nz*nz);
+        grid->column_x[ii] = nx/length;
+        grid->column_z[ii] = nz/length;
+    }
+    for(ii=0;ii<=grid->tiles_y;++ii) {
+        int y = ii*LIGHT_GRID_TILE_SIZE;
+        float ndc = 2.0f*(y < grid->height ? y : grid->height)/grid->height - 1.0f;
+        float ny = P->r1.y;
+        float nz = P->r2.y - ndc;
+        float length = sqrtf(ny*ny + nz*nz);
+        grid->row_y[ii] = ny/length;
+        grid->row_z[ii] = nz/length;
+    }
+
+    /* LH projection: r2.z = f/(f-n), r3.z = -nf/(f-n) */
+    near_plane = -P->r3.z/P->r2.z;
+    grid->far_plane = P->r3.z/(1.0f - P->r2.z);
+
+    /** Depth slices are spaced logarithmically from the near to the far
+     *  plane: slice = log(z/near)/log(far/near) * num_slices
+     */
+    grid->slice_scale = grid->num_slices/logf(grid->far_plane/near_plane);
+    grid->slice_bias = -logf(near_plane)*grid->slice_scale;
+}
+static int _slice(const LightGrid* grid, float z)
+{
+    int slice;
+    if(z <= 0.0f)
+        return 0;
+    slice = (int)floorf(logf(z)*grid->slice_scale + grid->slice_bias);
+    if(slice < 0)
+        return 0;
+    if(slice >= grid->num_slices)
+        return grid->num_slices-1;
+    return slice;
+}
+/** Finds the range of tiles along one axis that a sphere overlaps. The
+ *  boundary planes are tested four at a time.
+ *  @param a [in] The sphere center's x (columns) or y (rows)
+ *  @return 0 if the sphere doesn't overlap any tile
+ */
+static int _tile_range(const float* plane_a, const float* plane_z, int num_tiles,
+                       float a, float z, float radius, int* first, int* last)
+{
+    uint8_t right_of[MAX_BOUNDARIES];
+    uint8_t left_of[MAX_BOUNDARIES];
+    simd4f  sa = simd4f_splat(a);
+    simd4f  sz = simd4f_splat(z);
+    simd4f  sr = simd4f_splat(radius);
+    simd4f  snr = simd4f_splat(-radius);
+    int     ii;
+
+    for(ii=0;ii<=num_tiles;ii+=4) {
+        simd4f  dist = simd4f_madd(simd4f_load(plane_a+ii), sa, simd4f_mul(simd4f_load(plane_z+ii), sz));
+        int     right_mask = simd4m_movemask(simd4f_greater_equal(dist, snr));
+        int     left_mask = simd4m_movemask(simd4f_less_equal(dist, sr));
+        int     jj;
+        for(jj=0;jj<4;++jj) {
+            right_of[ii+jj] = (uint8_t)((right_mask >> jj) & 1);
+            left_of[ii+jj] = (uint8_t)((left_mask >> jj) & 1);
+        }
+    }
+
+    /* Tile ii lies between boundary ii and ii+1 */
+    *first = -1;
+    *last = -1;
+    for(ii=0;ii<num_tiles;++ii) {
+        if(right_of[ii] && left_of[ii+1]) {
+            if(*first < 0)
+                *first = ii;
+            *last = ii;
+        }
+    }
+    return *first >= 0;
+}
+/** Cluster (x, y, z) is texel (column*tiles_x + x, row*tiles_y + y), slice z
+ *  being in column z % slice_columns and row z / slice_columns
+ */
+static int _cluster(const LightGrid* grid, int x, int y, int z)
+{
+    int texel_x = (z % grid->slice_columns)*grid->tiles_x + x;
+    int texel_y = (z / grid->slice_columns)*grid->tiles_y + y;
+    return texel_y*_grid_texture_width(grid) + texel_x;
+}
+static void _reserve_lights(LightGrid* grid, int num_lights)
+{
+    /* Light data is uploaded a full texture row at a time */
+    int capacity = _rows_needed(num_lights*2, LIGHT_TEXTURE_WIDTH)*LIGHT_TEXTURE_WIDTH/2;
+    if(capacity <= grid->light_capacity)
+        return;
+    grid->light_data = (Vec4*)realloc(grid->light_data, sizeof(Vec4)*2*capacity);
+    grid->light_ranges = (ClusterRange*)realloc(grid->light_ranges, sizeof(ClusterRange)*capacity);
+    memset(grid->light_data, 0, sizeof(Vec4)*2*capacity);
+    grid->light_capacity = capacity;
+}
+static void _reserve_indices(LightGrid* grid, int num_indices)
+{
+    int capacity = _rows_needed(num_indices, INDEX_TEXTURE_WIDTH)*INDEX_TEXTURE_WIDTH;
+    if(capacity <= grid->index_capacity)
+        return;
+    grid->indices = (uint16_t*)realloc(grid->indices, sizeof(uint16_t)*capacity);
+    memset(grid->indices, 0, sizeof(uint16_t)*capacity);
+    grid->index_capacity = capacity;
+}
+static void _upload(LightGrid* grid, int num_lights)
+{
+    int light_rows = _rows_needed(num_lights*2, LIGHT_TEXTURE_WIDTH);
+    int index_rows = _rows_needed(grid->num_indices, INDEX_TEXTURE_WIDTH);
+    int grid_width = _grid_texture_width(grid);
+    int grid_height = _grid_texture_height(grid);
+
+    /* Light data */
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, grid->light_texture));
+    if(light_rows > grid->light_texture_height) {
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, LIGHT_TEXTURE_WIDTH, light_rows, 0, GL_RGBA, GL_FLOAT, NULL));
+        grid->light_texture_height = light_rows;
+    }
+    ASSERT_GL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LIGHT_TEXTURE_WIDTH, light_rows, GL_RGBA, GL_FLOAT, grid->light_data));
+
+    /* Clusters, slices are tiled in slice_columns columns */
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, grid->grid_texture));
+    if(grid_width != grid->grid_texture_width || grid_height != grid->grid_texture_height) {
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, grid_width, grid_height, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL));
+        grid->grid_texture_width = grid_width;
+        grid->grid_texture_height = grid_height;
+    }
+    ASSERT_GL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, grid_width, grid_height, GL_RG_INTEGER, GL_UNSIGNED_INT, grid->cluster_data));
+
+    /* Indices */
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, grid->index_texture));
+    if(index_rows > grid->index_texture_height) {
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, INDEX_TEXTURE_WIDTH, index_rows, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL));
+        grid->index_texture_height = index_rows;
+    }
+    ASSERT_GL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, INDEX_TEXTURE_WIDTH, index_rows, GL_RED_INTEGER, GL_UNSIGNED_SHORT, grid->indices));
+
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+}
+
+/* External functions
+ */
+LightGrid* create_light_grid(int num_slices)
+{
+    LightGrid* grid = (LightGrid*)calloc(1, sizeof(*grid));
+    assert(num_slices > 0 && num_slices <= MAX_SLICES);
+    grid->num_slices = num_slices;
+    grid->slice_columns = 1;
+    ASSERT_GL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &grid->max_texture_size));
+    grid->light_texture = _create_texture();
+    grid->grid_texture = _create_texture();
+    grid->index_texture = _create_texture();
+    _reserve_lights(grid, 1);
+    _reserve_indices(grid, 1);
+    return grid;
+}
+void destroy_light_grid(LightGrid* grid)
+{
+    ASSERT_GL(glDeleteTextures(1, &grid->light_texture));
+    ASSERT_GL(glDeleteTextures(1, &grid->grid_texture));
+    ASSERT_GL(glDeleteTextures(1, &grid->index_texture));
+    free(grid->light_data);
+    free(grid->light_ranges);
+    free(grid->cluster_data);
+    free(grid->indices);
+    free(grid);
+}
+int light_grid_fits(const LightGrid* grid, int width, int height)
+{
+    int tiles_x = (width + LIGHT_GRID_TILE_SIZE - 1)/LIGHT_GRID_TILE_SIZE;
+    int tiles_y = (height + LIGHT_GRID_TILE_SIZE - 1)/LIGHT_GRID_TILE_SIZE;
+    int slice_columns;
+    if(tiles_x > MAX_TILES || tiles_y > MAX_TILES)
+        return 0;
+    return _slice_columns(grid, tiles_x, tiles_y, &slice_columns);
+}
+int build_light_grid(LightGrid* grid, int width, int height,
+                     Mat4 proj_matrix, Mat4 view_matrix,
+                     const Light* lights, int num_lights)
+{
+    int num_clusters;
+    int ii;
+    uint32_t offset;
+    uint32_t total;
+    uint32_t max_indices = (uint32_t)INDEX_TEXTURE_WIDTH*(uint32_t)grid->max_texture_size;
+
+    if(!light_grid_fits(grid, width, height))
+        return 0;
+
+    /* Rebuild the tile planes when the projection changes */
+    if(width != grid->width || height != grid->height ||
+       memcmp(&proj_matrix, &grid->proj_matrix, sizeof(proj_matrix)) != 0) {
+        grid->width = width;
+        grid->height = height;
+        grid->tiles_x = (width + LIGHT_GRID_TILE_SIZE - 1)/LIGHT_GRID_TILE_SIZE;
+        grid->tiles_y = (height + LIGHT_GRID_TILE_SIZE - 1)/LIGHT_GRID_TILE_SIZE;
+        _slice_columns(grid, grid->tiles_x, grid->tiles_y, &grid->slice_columns);
+        grid->proj_matrix = proj_matrix;
+        _build_planes(grid);
+    }
+    /* Includes the unused cells after the last slice */
+    num_clusters = _grid_texture_width(grid)*_grid_texture_height(grid);
+    if(num_clusters > grid->cluster_capacity) {
+        grid->cluster_data = (uint32_t*)realloc(grid->cluster_data, sizeof(uint32_t)*2*num_clusters);
+        grid->cluster_capacity = num_clusters;
+    }
+    memset(grid->cluster_data, 0, sizeof(uint32_t)*2*num_clusters);
+    _reserve_lights(grid, num_lights);
+
+    /* Find each light's clusters and count the lights per cluster */
+    for(ii=0;ii<num_lights;++ii) {
+        Vec4 position = mat4_mul_vector(vec4_from_vec3(lights[ii].position, 1.0f), view_matrix);
+        float radius = lights[ii].size;
+        ClusterRange* range = &grid->light_ranges[ii];
+        int x, y, z;
+
+        grid->light_data[ii*2+0] = vec4_create(position.x, position.y, position.z, radius);
+        grid->light_data[ii*2+1] = vec4_from_vec3(lights[ii].color, 1.0f);
+
+        range->x0 = range->y0 = range->z0 = 0;
+        range->x1 = range->y1 = range->z1 = -1;
+        if(position.z + radius <= 0.0f || position.z - radius >= grid->far_plane)
+            continue;
+        if(!_tile_range(grid->column_x, grid->column_z, grid->tiles_x,
+                        position.x, position.z, radius, &range->x0, &range->x1))
+            continue;
+        if(!_tile_range(grid->row_y, grid->row_z, grid->tiles_y,
+                        position.y, position.z, radius, &range->y0, &range->y1)) {
+            range->x1 = -1;
+            continue;
+        }
+        range->z0 = _slice(grid, position.z - radius);
+        range->z1 = _slice(grid, position.z + radius);
+        for(z=range->z0;z<=range->z1;++z) {
+            for(y=range->y0;y<=range->y1;++y) {
+                for(x=range->x0;x<=range->x1;++x) {
+                    grid->cluster_data[_cluster(grid, x, y, z)*2+1]++;
+                }
+            }
+        }
+    }
+
+    /* Turn the counts into offsets. Lists past the index texture's capacity
+     * are cut short, each cluster ends where the next one starts.
+     */
+    offset = 0;
+    total = 0;
+    for(ii=0;ii<num_clusters;++ii) {
+        uint32_t count = grid->cluster_data[ii*2+1];
+        total += count;
+        if(count > max_indices - offset)
+            count = max_indices - offset;
+        grid->cluster_data[ii*2+0] = offset;
+        offset += count;
+        grid->cluster_data[ii*2+1] = 0;
+    }
+    if((total > offset) != grid->truncated) {
+        grid->truncated = total > offset;
+        if(grid->truncated)
+            system_log("Light grid needs %u indices, truncated to %u\n", total, offset);
+    }
+    grid->num_indices = (int)offset;
+    _reserve_indices(grid, grid->num_indices);
+
+    /* Fill the index list */
+    for(ii=0;ii<num_lights;++ii) {
+        const ClusterRange* range = &grid->light_ranges[ii];
+        int x, y, z;
+        for(z=range->z0;z<=range->z1;++z) {
+            for(y=range->y0;y<=range->y1;++y) {
+                for(x=range->x0;x<=range->x1;++x) {
+                    int index = _cluster(grid, x, y, z);
+                    uint32_t* cluster = &grid->cluster_data[index*2];
+                    uint32_t end = index+1 < num_clusters ? cluster[2] : offset;
+                    if(cluster[0] + cluster[1] < end)
+                        grid->indices[cluster[0] + cluster[1]++] = (uint16_t)ii;
+                }
+            }
+        }
+    }
+
+    _upload(grid, num_lights);
+    return 1;
+}
+void bind_light_grid(const LightGrid* grid, int first_unit)
+{
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+first_unit+0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, grid->light_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+first_unit+1));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, grid->grid_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+first_unit+2));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, grid->index_texture));
+}
+void light_grid_slice_params(const LightGrid* grid, float* scale, float* bias)
+{
+    *scale = grid->slice_scale;
+    *bias = grid->slice_bias;
+}
+int light_grid_num_slices(const LightGrid* grid)
+{
+    return grid->num_slices;
+}
+void light_grid_layout(const LightGrid* grid, int* tiles_x, int* tiles_y, int* slice_columns)
+{
+    *tiles_x = grid->tiles_x;
+    *tiles_y = grid->tiles_y;
+    *slice_columns = grid->slice_columns;
+}
+int light_grid_index_count(const LightGrid* grid)
+{
+    return grid->num_indices;
+}
@@ -0,0 +1,61 @@
+/*! @file light_grid.h
+ *  @brief Screen-space (tiled) and view-frustum (clustered) light binning
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __light_grid_h__
+#define __light_grid_h__
+
+#include "gl_include.h"
+#include "graphics_types.h"
+
+/** Size of a grid tile, in pixels. Must match the shaders that read the grid.
+ */
+#define LIGHT_GRID_TILE_SIZE 16
+
+typedef struct LightGrid LightGrid;
+
+/** @param num_slices [in] Number of logarithmic depth slices per tile. 1
+ *      gives a purely 2D tile grid.
+ */
+LightGrid* create_light_grid(int num_slices);
+void destroy_light_grid(LightGrid* grid);
+
+/** @return Whether the grid texture for a width x height target fits in
+ *      GL_MAX_TEXTURE_SIZE
+ */
+int light_grid_fits(const LightGrid* grid, int width, int height);
+/** @brief Bins every light into the clusters its sphere overlaps and
+ *      uploads the result.
+ *  @param width [in] Width of the render target, in pixels
+ *  @param height [in] Height of the render target, in pixels
+ *      Cluster lists that don't fit in the index texture are cut short.
+ *  @return 0, leaving the grid as it was, if it doesn't fit
+ */
+int build_light_grid(LightGrid* grid, int width, int height,
+                     Mat4 proj_matrix, Mat4 view_matrix,
+                     const Light* lights, int num_lights);
+
+/** @brief Binds the light grid textures to three consecutive texture units
+ *      starting at `first_unit`:
+ *  [0] RGBA32F: Light data. Two texels per light, view space position/size
+ *      followed by color
+ *  [1] RG32UI: Per-cluster offset into the index list and light count.
+ *      Slices are laid out slice_columns wide, cluster (x, y, slice) is
+ *      stored at texel ((slice % slice_columns)*tiles_x + x,
+ *      (slice / slice_columns)*tiles_y + y)
+ *  [2] R16UI: Light index list
+ */
+void bind_light_grid(const LightGrid* grid, int first_unit);
+
+/** @brief Slice `s` contains view space depth z when
+ *      floor(log(z)*scale + bias) == s, clamped to [0, num_slices-1].
+ */
+void light_grid_slice_params(const LightGrid* grid, float* scale, float* bias);
+int light_grid_num_slices(const LightGrid* grid);
+/** @brief Tile counts and slice columns of the last built grid */
+void light_grid_layout(const LightGrid* grid, int* tiles_x, int* tiles_y, int* slice_columns);
+
+/** @return The total number of cluster/light pairs in the last built grid */
+int light_grid_index_count(const LightGrid* grid);
+
+#endif /* include guard */
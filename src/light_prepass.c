@@ -8,11 +8,20 @@
 #include "scene.h"
 #include "graphics.h"
 #include "program.h"
+#include "light_volume.h"
+#include "gbuffer_downsample.h"
+#include "gpu_timing.h"
 
 /* Defines
  */
 #define GetUniformLocation(R, pass, program, uniform) R->pass.uniform = glGetUniformLocation(R->pass.program, #uniform)
 
+/* Temporal light reuse stops when the camera moves more than this per frame */
+#define MAX_REUSE_TRANSLATION   0.25f
+#define MIN_REUSE_FORWARD_DOT   0.9995f /* About 1.8 degrees */
+/* One pixel of every 4x4 block is shaded again each frame */
+#define REFRESH_PERIOD          16
+
 /* Types
  */
 struct LightPrepassRenderer
@@ -21,15 +30,43 @@ struct LightPrepassRenderer
     int height;
     int major_version;
     int minor_version;
+    int stencil_lights;
+    GLuint  gpu_light_buffer;
+    int     num_gpu_lights;
+    AccumulationFormat  accumulation_format;
+    int                 half_res_lighting;
 
-    GLuint  cube_vertex_buffer;
-    GLuint  cube_index_buffer;
+    LightVolume*    light_volume;
 
     GLuint  gbuffer_framebuffer;
     GLuint  gbuffer_color_texture;
     GLuint  gbuffer_depth_texture;
+    GLenum  depth_attachment;
     GLuint  lighting_buffer;
 
+    /* Half resolution lighting */
+    GBufferDownsample*  downsample;
+    GLuint  half_gbuffer_framebuffer;
+    GLuint  half_light_framebuffer;
+    GLuint  upsample_framebuffer;
+    GLuint  half_color_texture;
+    GLuint  half_depth_texture;
+    GLuint  half_lighting_buffer;
+    GLuint  quad_vertex_buffer;
+    GLuint  quad_index_buffer;
+
+    /* Temporal light reuse */
+    int     static_lights;
+    int     history_valid;
+    int     reused_light;
+    int     refresh_phase;
+    int     history_num_lights;
+    Mat4    history_view;
+    GLuint  history_framebuffer;
+    GLuint  history_depth_texture;
+    GLuint  history_normal_texture;
+    GLuint  history_lighting_buffer;
+
     /* Pass 1 */
     struct {
         GLuint  program;
@@ -47,17 +84,11 @@ struct LightPrepassRenderer
     struct {
         GLuint  program;
 
-        GLuint  u_World;
-        GLuint  u_View;
         GLuint  u_Projection;
 
         GLuint  u_InvProj;
         GLuint  u_Viewport;
 
-        GLuint  u_LightColor;
-        GLuint  u_LightPosition;
-        GLuint  u_LightSize;
-
         GLuint  s_GBuffer;
         GLuint  s_Depth;
     } pass2;
@@ -72,53 +103,83 @@ struct LightPrepassRenderer
 
         GLuint  u_Viewport;
 
+        GLuint  u_SpecularColor;
+        GLuint  u_SpecularCoefficient;
+
         GLuint  s_GBuffer;
         GLuint  s_Albedo;
     } pass3;
+
+    /* Upsamples the half resolution lighting buffer */
+    struct {
+        GLuint  program;
+
+        GLuint  u_InvProj;
+
+        GLuint  s_GBuffer;
+        GLuint  s_Depth;
+        GLuint  s_HalfGBuffer;
+        GLuint  s_HalfDepth;
+        GLuint  s_Light;
+    } upsample;
+
+    /* Copies last frame's light to the pixels still showing the same surface */
+    struct {
+        GLuint  program;
+
+        GLuint  u_InvProj;
+        GLuint  u_ViewToPrevClip;
+        GLuint  u_PrevViewToView;
+        GLuint  u_RefreshPhase;
+
+        GLuint  s_Depth;
+        GLuint  s_PrevDepth;
+        GLuint  s_PrevLight;
+        GLuint  s_Normal;
+        GLuint  s_PrevNormal;
+    } reproject;
 };
 
 /* Constants
  */
- /* cube vertices
- *
- *               5---------4
- *              /|        /|
- *             / |       / |
- *            1---------0  |
- *            |  |      |  |
- *            |  6------|--7
- *            | /       | /
- *            |/        |/
- *            2---------3
- *
- *   front: { 0, 2, 1 }, { 0, 3, 2 }
- *   right: { 4, 3, 0 }, { 4, 7, 3 }
- *     top: { 4, 1, 5 }, { 4, 0, 1 }
- *    left: { 1, 6, 5 }, { 1, 2, 6 }
- *  bottom: { 3, 6, 2 }, { 3, 7, 6 }
- *    back: { 5, 7, 4 }, { 5, 6, 7 }
- *
- */
-static const Vec3 kCubeVertices[] =
-{
-    {  1.0f,  1.0f, -1.0f }, /* 0 */
-    { -1.0f,  1.0f, -1.0f }, /* 1 */
-    { -1.0f, -1.0f, -1.0f }, /* 2 */
-    {  1.0f, -1.0f, -1.0f }, /* 3 */
-    {  1.0f,  1.0f,  1.0f }, /* 4 */
-    { -1.0f,  1.0f,  1.0f }, /* 5 */
-    { -1.0f, -1.0f,  1.0f }, /* 6 */
-    {  1.0f, -1.0f,  1.0f }, /* 7 */
+static const Vec3 kQuadVertices[] =
+{
+    {  1.0f,  1.0f, 0.0f },
+    { -1.0f,  1.0f, 0.0f },
+    { -1.0f, -1.0f, 0.0f },
+    {  1.0f, -1.0f, 0.0f },
 };
-
-static const uint16_t kCubeIndices[] =
+static const uint16_t kQuadIndices[] =
+{
+    0, 2, 1,
+    0, 3, 2,
+};
+static const AttributeSlot kPass1Slots[] =
+{
+    kPositionSlot,
+    kNormalSlot,
+    kTangentSlot,
+    kBitangentSlot,
+    kTexCoordSlot,
+    kEmptySlot
+};
+static const AttributeSlot kPass2Slots[] =
+{
+    kPositionSlot,
+    kLightPositionSlot,
+    kLightColorSlot,
+    kEmptySlot
+};
+static const AttributeSlot kPass3Slots[] =
+{
+    kPositionSlot,
+    kTexCoordSlot,
+    kEmptySlot
+};
+static const AttributeSlot kFullscreenSlots[] =
 {
-    0, 2, 1,   0, 3, 2,  /* front */
-    4, 3, 0,   4, 7, 3,  /* right */
-    4, 1, 5,   4, 0, 1,  /* top */
-    1, 6, 5,   1, 2, 6,  /* left */
-    3, 6, 2,   3, 7, 6,  /* bottom */
-    5, 7, 4,   5, 6, 7,  /* back */
+    kPositionSlot,
+    kEmptySlot
 };
 
 /* Variables
@@ -126,86 +187,54 @@ static const uint16_t kCubeIndices[] =
 
 /* Internal functions
  */
-static void _draw_point_light(LightPrepassRenderer* R)
-{
-    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->cube_vertex_buffer));
-    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->cube_index_buffer));
-    ASSERT_GL(glVertexAttribPointer(kPositionSlot, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
-    ASSERT_GL(glDrawElements(GL_TRIANGLES, sizeof(kCubeIndices)/sizeof(kCubeIndices[0]), GL_UNSIGNED_SHORT, NULL));
-}
-
-/* External functions
- */
-LightPrepassRenderer* create_light_prepass_renderer(Graphics* G, int major_version, int minor_version)
+/* Uniform lookups and texture units, again after a reload */
+static void _setup_upsample(LightPrepassRenderer* R)
 {
-    AttributeSlot pass1_slots[] = {
-        kPositionSlot,
-        kNormalSlot,
-        kTangentSlot,
-        kBitangentSlot,
-        kTexCoordSlot,
-        kEmptySlot
-    };
-    AttributeSlot pass2_slots[] = {
-        kPositionSlot,
-        kEmptySlot
-    };
-    AttributeSlot pass3_slots[] = {
-        kPositionSlot,
-        kTexCoordSlot,
-        kEmptySlot
-    };
-
-    LightPrepassRenderer* R = (LightPrepassRenderer*)calloc(1,sizeof(*R));
-    R->major_version = major_version;
-    R->minor_version = minor_version;
+    ASSERT_GL(GetUniformLocation(R, upsample, program, u_InvProj));
 
-    /* Create vertex buffer */
-    ASSERT_GL(glGenBuffers(1, &R->cube_vertex_buffer));
-    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->cube_vertex_buffer));
-    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(kCubeVertices), kCubeVertices, GL_STATIC_DRAW));
-    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+    ASSERT_GL(GetUniformLocation(R, upsample, program, s_GBuffer));
+    ASSERT_GL(GetUniformLocation(R, upsample, program, s_Depth));
+    ASSERT_GL(GetUniformLocation(R, upsample, program, s_HalfGBuffer));
+    ASSERT_GL(GetUniformLocation(R, upsample, program, s_HalfDepth));
+    ASSERT_GL(GetUniformLocation(R, upsample, program, s_Light));
 
-    /* Create index buffer */
-    ASSERT_GL(glGenBuffers(1, &R->cube_index_buffer));
-    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->cube_index_buffer));
-    ASSERT_GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(kCubeIndices), kCubeIndices, GL_STATIC_DRAW));
-    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+    ASSERT_GL(glUseProgram(R->upsample.program));
 
-    /* Create framebuffer */
-    ASSERT_GL(glGenFramebuffers(1, &R->gbuffer_framebuffer));
+    ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
 
-    /* Color buffer */
-    ASSERT_GL(glGenTextures(1, &R->gbuffer_color_texture));
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_color_texture));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glUniform1i(R->upsample.s_GBuffer, 0));
+    ASSERT_GL(glUniform1i(R->upsample.s_Depth, 1));
+    ASSERT_GL(glUniform1i(R->upsample.s_HalfGBuffer, 2));
+    ASSERT_GL(glUniform1i(R->upsample.s_HalfDepth, 3));
+    ASSERT_GL(glUniform1i(R->upsample.s_Light, 4));
+    ASSERT_GL(glUseProgram(0));
+}
+static void _setup_reproject(LightPrepassRenderer* R)
+{
+    ASSERT_GL(GetUniformLocation(R, reproject, program, u_InvProj));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, u_ViewToPrevClip));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, u_PrevViewToView));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, u_RefreshPhase));
 
-    /* Depth buffer */
-    ASSERT_GL(glGenTextures(1, &R->gbuffer_depth_texture));
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_depth_texture));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, s_Depth));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, s_PrevDepth));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, s_PrevLight));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, s_Normal));
+    ASSERT_GL(GetUniformLocation(R, reproject, program, s_PrevNormal));
 
-    
-    /* Light buffer */
-    ASSERT_GL(glGenTextures(1, &R->lighting_buffer));
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->lighting_buffer));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glUseProgram(R->reproject.program));
 
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
-
-    /** Pass 1
-     */
-    R->pass1.program = create_program("shaders/light_prepass/Pass1Vertex.glsl", "shaders/light_prepass/Pass1Fragment.glsl", pass1_slots);
+    ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
 
+    ASSERT_GL(glUniform1i(R->reproject.s_Depth, 0));
+    ASSERT_GL(glUniform1i(R->reproject.s_PrevDepth, 1));
+    ASSERT_GL(glUniform1i(R->reproject.s_PrevLight, 2));
+    ASSERT_GL(glUniform1i(R->reproject.s_Normal, 3));
+    ASSERT_GL(glUniform1i(R->reproject.s_PrevNormal, 4));
+    ASSERT_GL(glUseProgram(0));
+}
+static void _setup_pass1(LightPrepassRenderer* R)
+{
     ASSERT_GL(GetUniformLocation(R, pass1, program, u_Projection));
     ASSERT_GL(GetUniformLocation(R, pass1, program, u_View));
     ASSERT_GL(GetUniformLocation(R, pass1, program, u_World));
@@ -224,14 +253,10 @@ LightPrepassRenderer* create_light_prepass_renderer(Graphics* G, int major_versi
 
     ASSERT_GL(glUniform1i(R->pass1.s_Normal, 0));
     ASSERT_GL(glUseProgram(0));
-
-    /** Pass 2
-     */
-    R->pass2.program = create_program("shaders/light_prepass/Pass2Vertex.glsl", "shaders/light_prepass/Pass2Fragment.glsl", pass2_slots);
-
+}
+static void _setup_pass2(LightPrepassRenderer* R)
+{
     ASSERT_GL(GetUniformLocation(R, pass2, program, u_Projection));
-    ASSERT_GL(GetUniformLocation(R, pass2, program, u_View));
-    ASSERT_GL(GetUniformLocation(R, pass2, program, u_World));
 
     ASSERT_GL(GetUniformLocation(R, pass2, program, u_InvProj));
     ASSERT_GL(GetUniformLocation(R, pass2, program, u_Viewport));
@@ -239,11 +264,6 @@ LightPrepassRenderer* create_light_prepass_renderer(Graphics* G, int major_versi
     ASSERT_GL(GetUniformLocation(R, pass2, program, s_GBuffer));
     ASSERT_GL(GetUniformLocation(R, pass2, program, s_Depth));
 
-
-    ASSERT_GL(GetUniformLocation(R, pass2, program, u_LightColor));
-    ASSERT_GL(GetUniformLocation(R, pass2, program, u_LightPosition));
-    ASSERT_GL(GetUniformLocation(R, pass2, program, u_LightSize));
-
     ASSERT_GL(glUseProgram(R->pass2.program));
 
     ASSERT_GL(glEnableVertexAttribArray(kPositionSlot));
@@ -251,17 +271,18 @@ LightPrepassRenderer* create_light_prepass_renderer(Graphics* G, int major_versi
     ASSERT_GL(glUniform1i(R->pass2.s_GBuffer, 0));
     ASSERT_GL(glUniform1i(R->pass2.s_Depth, 1));
     ASSERT_GL(glUseProgram(0));
-
-    /** Pass 3
-     */
-    R->pass3.program = create_program("shaders/light_prepass/Pass3Vertex.glsl", "shaders/light_prepass/Pass3Fragment.glsl", pass3_slots);
-
+}
+static void _setup_pass3(LightPrepassRenderer* R)
+{
     ASSERT_GL(GetUniformLocation(R, pass3, program, u_Projection));
     ASSERT_GL(GetUniformLocation(R, pass3, program, u_View));
     ASSERT_GL(GetUniformLocation(R, pass3, program, u_World));
 
     ASSERT_GL(GetUniformLocation(R, pass3, program, u_Viewport));
 
+    ASSERT_GL(GetUniformLocation(R, pass3, program, u_SpecularColor));
+    ASSERT_GL(GetUniformLocation(R, pass3, program, u_SpecularCoefficient));
+
     ASSERT_GL(GetUniformLocation(R, pass3, program, s_GBuffer));
     ASSERT_GL(GetUniformLocation(R, pass3, program, s_Albedo));
 
@@ -274,11 +295,349 @@ LightPrepassRenderer* create_light_prepass_renderer(Graphics* G, int major_versi
     ASSERT_GL(glUniform1i(R->pass3.s_GBuffer, 0));
     ASSERT_GL(glUniform1i(R->pass3.s_Albedo, 1));
     ASSERT_GL(glUseProgram(0));
+}
+static GLuint _create_texture(void)
+{
+    GLuint texture;
+    ASSERT_GL(glGenTextures(1, &texture));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, texture));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    return texture;
+}
+/** Half resolution lighting needs ES 3.0 */
+static void _create_half_resolution(LightPrepassRenderer* R)
+{
+    R->downsample = create_gbuffer_downsample();
+
+    ASSERT_GL(glGenFramebuffers(1, &R->half_gbuffer_framebuffer));
+    ASSERT_GL(glGenFramebuffers(1, &R->half_light_framebuffer));
+    ASSERT_GL(glGenFramebuffers(1, &R->upsample_framebuffer));
+    R->half_color_texture = _create_texture();
+    R->half_depth_texture = _create_texture();
+    R->half_lighting_buffer = _create_texture();
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+
+    ASSERT_GL(glGenBuffers(1, &R->quad_vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->quad_vertex_buffer));
+    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(kQuadVertices), kQuadVertices, GL_STATIC_DRAW));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+
+    ASSERT_GL(glGenBuffers(1, &R->quad_index_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->quad_index_buffer));
+    ASSERT_GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(kQuadIndices), kQuadIndices, GL_STATIC_DRAW));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+
+    R->upsample.program = create_program("shaders/light_prepass/FullscreenVertex.glsl", "shaders/light_prepass/UpsampleFragment.glsl", kFullscreenSlots);
+    _setup_upsample(R);
+}
+/** Allocates the half resolution buffers, or shrinks them when half
+ *  resolution lighting is off
+ */
+static void _resize_half_resolution(LightPrepassRenderer* R)
+{
+    int width = R->half_res_lighting ? HALF_RESOLUTION(R->width) : 1;
+    int height = R->half_res_lighting ? HALF_RESOLUTION(R->height) : 1;
+    GLenum framebuffer_status;
+
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_color_texture));
+    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_depth_texture));
+    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_lighting_buffer));
+    accumulation_tex_image(accumulation_format_with_alpha(R->accumulation_format), width, height);
+
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_gbuffer_framebuffer));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->half_color_texture, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, R->half_depth_texture, 0));
+    framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+        system_log("Framebuffer error: %s\n", _glStatusString(framebuffer_status));
+        assert(0);
+    }
+
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_light_framebuffer));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->half_lighting_buffer, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, R->half_depth_texture, 0));
+    framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+        system_log("Framebuffer error: %s\n", _glStatusString(framebuffer_status));
+        assert(0);
+    }
+}
+/** Pass 2 at half resolution, upsampled into the full resolution lighting
+ *  buffer for pass 3
+ */
+static void _render_half_res_lights(LightPrepassRenderer* R, Mat4 proj_matrix, Mat4 view_matrix,
+                                    const Light* lights, int num_lights)
+{
+    Mat4 inv_proj = mat4_inverse(proj_matrix);
+    int half_width = HALF_RESOLUTION(R->width);
+    int half_height = HALF_RESOLUTION(R->height);
+    float viewport[] = { half_width, half_height };
+
+    /** Downsample
+     */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_gbuffer_framebuffer));
+    ASSERT_GL(glViewport(0, 0, half_width, half_height));
+    downsample_gbuffer(R->downsample, R->gbuffer_depth_texture, &R->gbuffer_color_texture, 1);
+
+    /** Pass 2
+     */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->half_light_framebuffer));
+    /* Specular accumulates in alpha */
+    ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT));
+
+    ASSERT_GL(glEnable(GL_BLEND));
+    ASSERT_GL(glBlendFunc(GL_ONE, GL_ONE));
+    ASSERT_GL(glCullFace(GL_FRONT));
+    ASSERT_GL(glDepthMask(GL_FALSE));
+    ASSERT_GL(glDepthFunc(GL_GEQUAL));
+
+    ASSERT_GL(glUseProgram(R->pass2.program));
+    set_uniform_matrix4fv(R->pass2.program, R->pass2.u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->pass2.program, R->pass2.u_InvProj, 1, (float*)&inv_proj);
+    set_uniform_2fv(R->pass2.program, R->pass2.u_Viewport, 1, viewport);
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_color_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE1));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_depth_texture));
+
+    render_light_volumes(R->light_volume, R->pass2.program,
+                         proj_matrix, view_matrix, half_width, half_height,
+                         lights, num_lights, R->stencil_lights);
+    if(R->num_gpu_lights) {
+        ASSERT_GL(glUseProgram(R->pass2.program));
+        draw_light_volume_buffer(R->light_volume, R->gpu_light_buffer, R->num_gpu_lights);
+    }
+
+    ASSERT_GL(glDisable(GL_BLEND));
+    ASSERT_GL(glCullFace(GL_BACK));
+
+    /** Upsample
+     */
+    /* The full resolution depth is sampled while upsampling, it can't be attached */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->upsample_framebuffer));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->lighting_buffer, 0));
+    ASSERT_GL(glViewport(0, 0, R->width, R->height));
+    ASSERT_GL(glDisable(GL_DEPTH_TEST));
+
+    ASSERT_GL(glUseProgram(R->upsample.program));
+    set_uniform_matrix4fv(R->upsample.program, R->upsample.u_InvProj, 1, (float*)&inv_proj);
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_color_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE1));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_depth_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE2));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_color_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE3));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_depth_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE4));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->half_lighting_buffer));
+
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->quad_vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->quad_index_buffer));
+    ASSERT_GL(glVertexAttribPointer(kPositionSlot, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
+    ASSERT_GL(glDrawElements(GL_TRIANGLES, sizeof(kQuadIndices)/sizeof(kQuadIndices[0]), GL_UNSIGNED_SHORT, NULL));
+
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glEnable(GL_DEPTH_TEST));
+}
+
+/** Temporal light reuse needs ES 3.0 and the quad from _create_half_resolution */
+static void _create_temporal(LightPrepassRenderer* R)
+{
+    ASSERT_GL(glGenFramebuffers(1, &R->history_framebuffer));
+    R->history_depth_texture = _create_texture();
+    R->history_normal_texture = _create_texture();
+    R->history_lighting_buffer = _create_texture();
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+
+    R->reproject.program = create_program("shaders/light_prepass/FullscreenVertex.glsl", "shaders/light_prepass/ReprojectFragment.glsl", kFullscreenSlots);
+    _setup_reproject(R);
+}
+/** Allocates last frame's depth, normals and light, or shrinks them when the lights
+ *  aren't static
+ */
+static void _resize_temporal(LightPrepassRenderer* R)
+{
+    int width = R->static_lights ? R->width : 1;
+    int height = R->static_lights ? R->height : 1;
+    GLenum framebuffer_status;
+
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->history_depth_texture));
+    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->history_normal_texture));
+    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->history_lighting_buffer));
+    accumulation_tex_image(accumulation_format_with_alpha(R->accumulation_format), width, height);
+
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->history_framebuffer));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, R->history_depth_texture, 0));
+    framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+        system_log("Framebuffer error: %s\n", _glStatusString(framebuffer_status));
+        assert(0);
+    }
+    R->history_valid = 0;
+}
+static int _temporal_lighting(const LightPrepassRenderer* R)
+{
+    return R->static_lights && R->history_framebuffer && !R->half_res_lighting;
+}
+/** @return Whether last frame's light is still worth reprojecting */
+static int _can_reuse_light(const LightPrepassRenderer* R, Mat4 view_matrix, int num_lights)
+{
+    Mat4 prev_camera, camera;
+    Vec3 translation;
+
+    if(!_temporal_lighting(R) || !R->history_valid || num_lights != R->history_num_lights)
+        return 0;
+    prev_camera = mat4_inverse(R->history_view);
+    camera = mat4_inverse(view_matrix);
+    translation = vec3_sub(vec3_from_vec4(camera.r3), vec3_from_vec4(prev_camera.r3));
+    return vec3_length(translation) <= MAX_REUSE_TRANSLATION
+        && vec3_dot(vec3_from_vec4(camera.r2), vec3_from_vec4(prev_camera.r2)) >= MIN_REUSE_FORWARD_DOT;
+}
+/** Fills the bound lighting buffer with last frame's light where the same
+ *  surface is still visible, and marks those pixels with a stencil of 1
+ */
+static void _reproject_light(LightPrepassRenderer* R, Mat4 proj_matrix, Mat4 view_matrix)
+{
+    Mat4 inv_proj = mat4_inverse(proj_matrix);
+    Mat4 view_to_prev_clip = mat4_multiply(mat4_multiply(mat4_inverse(view_matrix), R->history_view), proj_matrix);
+    Mat4 prev_view_to_view = mat4_multiply(mat4_inverse(R->history_view), view_matrix);
+
+    ASSERT_GL(glDisable(GL_DEPTH_TEST));
+    ASSERT_GL(glEnable(GL_STENCIL_TEST));
+    ASSERT_GL(glStencilFunc(GL_ALWAYS, 1, 0xFF));
+    ASSERT_GL(glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE));
+
+    ASSERT_GL(glUseProgram(R->reproject.program));
+    set_uniform_matrix4fv(R->reproject.program, R->reproject.u_InvProj, 1, (float*)&inv_proj);
+    set_uniform_matrix4fv(R->reproject.program, R->reproject.u_ViewToPrevClip, 1, (float*)&view_to_prev_clip);
+    set_uniform_matrix4fv(R->reproject.program, R->reproject.u_PrevViewToView, 1, (float*)&prev_view_to_view);
+    set_uniform_1i(R->reproject.program, R->reproject.u_RefreshPhase, R->refresh_phase);
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_depth_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE1));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->history_depth_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE2));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->history_lighting_buffer));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE3));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_color_texture));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE4));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->history_normal_texture));
+
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, R->quad_vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, R->quad_index_buffer));
+    ASSERT_GL(glVertexAttribPointer(kPositionSlot, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
+    ASSERT_GL(glDrawElements(GL_TRIANGLES, sizeof(kQuadIndices)/sizeof(kQuadIndices[0]), GL_UNSIGNED_SHORT, NULL));
+
+    /* The light volumes only shade the pixels left at 0 */
+    ASSERT_GL(glStencilFunc(GL_EQUAL, 0, 0xFF));
+    ASSERT_GL(glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP));
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+    ASSERT_GL(glEnable(GL_DEPTH_TEST));
+}
+
+/* External functions
+ */
+void submit_light_prepass_programs(int major_version)
+{
+    submit_program("shaders/light_prepass/Pass1Vertex.glsl", "shaders/light_prepass/Pass1Fragment.glsl", kPass1Slots);
+    submit_program("shaders/light_prepass/Pass2Vertex.glsl", "shaders/light_prepass/Pass2Fragment.glsl", kPass2Slots);
+    submit_program("shaders/light_prepass/Pass3Vertex.glsl", "shaders/light_prepass/Pass3Fragment.glsl", kPass3Slots);
+    submit_light_volume_programs();
+    if(major_version >= 3) {
+        submit_program("shaders/light_prepass/FullscreenVertex.glsl", "shaders/light_prepass/UpsampleFragment.glsl", kFullscreenSlots);
+        submit_program("shaders/light_prepass/FullscreenVertex.glsl", "shaders/light_prepass/ReprojectFragment.glsl", kFullscreenSlots);
+        submit_gbuffer_downsample_programs();
+    }
+}
+LightPrepassRenderer* create_light_prepass_renderer(Graphics* G, int major_version, int minor_version)
+{
+    LightPrepassRenderer* R = (LightPrepassRenderer*)calloc(1,sizeof(*R));
+    R->major_version = major_version;
+    R->minor_version = minor_version;
+    /* ES 3.0 depth textures carry a stencil buffer */
+    R->depth_attachment = (major_version >= 3) ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+
+    /* Light volumes are instanced on ES 3.0 */
+    R->light_volume = create_light_volume(major_version >= 3);
+    if(major_version >= 3) {
+        _create_half_resolution(R);
+        _create_temporal(R);
+    }
+
+    /* Create framebuffer */
+    ASSERT_GL(glGenFramebuffers(1, &R->gbuffer_framebuffer));
+
+    /* Color buffer */
+    ASSERT_GL(glGenTextures(1, &R->gbuffer_color_texture));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_color_texture));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+
+    /* Depth buffer */
+    ASSERT_GL(glGenTextures(1, &R->gbuffer_depth_texture));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_depth_texture));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+
+    
+    /* Light buffer */
+    ASSERT_GL(glGenTextures(1, &R->lighting_buffer));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->lighting_buffer));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
+
+    /** Pass 1
+     */
+    R->pass1.program = create_program("shaders/light_prepass/Pass1Vertex.glsl", "shaders/light_prepass/Pass1Fragment.glsl", kPass1Slots);
+    _setup_pass1(R);
+
+    /** Pass 2
+     */
+    R->pass2.program = create_program("shaders/light_prepass/Pass2Vertex.glsl", "shaders/light_prepass/Pass2Fragment.glsl", kPass2Slots);
+    _setup_pass2(R);
+
+    /** Pass 3
+     */
+    R->pass3.program = create_program("shaders/light_prepass/Pass3Vertex.glsl", "shaders/light_prepass/Pass3Fragment.glsl", kPass3Slots);
+    _setup_pass3(R);
 
     return R;
 }
+void resolve_light_prepass_uniforms(LightPrepassRenderer* R)
+{
+    _setup_pass1(R);
+    _setup_pass2(R);
+    _setup_pass3(R);
+    resolve_light_volume_uniforms(R->light_volume);
+    if(R->major_version >= 3) {
+        _setup_upsample(R);
+        _setup_reproject(R);
+        resolve_gbuffer_downsample_uniforms(R->downsample);
+    }
+}
 void destroy_light_prepass_renderer(LightPrepassRenderer* R)
 {
+    destroy_light_volume(R->light_volume);
+    destroy_gbuffer_downsample(R->downsample);
+    destroy_program(R->upsample.program);
+    destroy_program(R->reproject.program);
     destroy_program(R->pass1.program);
     free(R);
 }
@@ -295,18 +654,18 @@ void resize_light_prepass_renderer(LightPrepassRenderer* R, int width, int heigh
     /* Depth buffer */
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_depth_texture));
     if(R->major_version >= 3)
-        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0));
+        ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, 0));
     else
         ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0));
     
     /* Lighting buffer */
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->lighting_buffer));
-    ASSERT_GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0));
+    accumulation_tex_image(accumulation_format_with_alpha(R->accumulation_format), width, height);
 
     /* Framebuffer */
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->gbuffer_framebuffer));
     ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->gbuffer_color_texture, 0));
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, R->gbuffer_depth_texture, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, R->depth_attachment, GL_TEXTURE_2D, R->gbuffer_depth_texture, 0));
 
     framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
     if(framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
@@ -314,6 +673,11 @@ void resize_light_prepass_renderer(LightPrepassRenderer* R, int width, int heigh
         assert(0);
     }
 
+    if(R->downsample)
+        _resize_half_resolution(R);
+    if(R->history_framebuffer)
+        _resize_temporal(R);
+
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, 0));
 
@@ -327,74 +691,86 @@ void render_light_prepass(LightPrepassRenderer* R, GLuint default_framebuffer,
 {
     Mat4 inv_proj = mat4_inverse(proj_matrix);
     float viewport[] = { R->width, R->height };
+    int temporal = _temporal_lighting(R);
     int ii;
 
+    R->reused_light = _can_reuse_light(R, view_matrix, num_lights);
+
     /** Pass 1
      */
+    begin_gpu_pass("Prepass normals");
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, R->gbuffer_framebuffer));
     ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->gbuffer_color_texture, 0));
     ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
-    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT));
     ASSERT_GL(glDepthMask(GL_TRUE));
     ASSERT_GL(glDepthFunc(GL_LESS));
     ASSERT_GL(glCullFace(GL_BACK));
 
 
     ASSERT_GL(glUseProgram(R->pass1.program));
-    ASSERT_GL(glUniformMatrix4fv(R->pass1.u_Projection, 1, GL_FALSE, (float*)&proj_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->pass1.u_View, 1, GL_FALSE, (float*)&view_matrix));
+    set_uniform_matrix4fv(R->pass1.program, R->pass1.u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->pass1.program, R->pass1.u_View, 1, (float*)&view_matrix);
 
     for(ii=0;ii<num_models;++ii) {
         Mat4 world_matrix = transform_get_matrix(models[ii].transform);
         /* Material */
-        ASSERT_GL(glUniform1f(R->pass1.u_SpecularPower, models[ii].material->specular_power));
+        set_uniform_1f(R->pass1.program, R->pass1.u_SpecularPower, models[ii].material->specular_power);
         ASSERT_GL(glActiveTexture(GL_TEXTURE0));
         ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->normal));
         /* Mesh */
-        ASSERT_GL(glUniformMatrix4fv(R->pass1.u_World, 1, GL_FALSE, (float*)&world_matrix));
+        set_uniform_matrix4fv(R->pass1.program, R->pass1.u_World, 1, (float*)&world_matrix);
         draw_mesh(models[ii].mesh);
     }
+    end_gpu_pass();
 
     /** Pass 2
      */
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->lighting_buffer, 0));
-    ASSERT_GL(glViewport(0, 0, R->width, R->height));
-    ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
-    ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT));
-
-    ASSERT_GL(glEnable(GL_BLEND));
-    ASSERT_GL(glBlendFunc(GL_ONE, GL_ONE));
-    ASSERT_GL(glCullFace(GL_FRONT));
-    ASSERT_GL(glDepthMask(GL_FALSE));
-    ASSERT_GL(glDepthFunc(GL_GEQUAL));
-
-    ASSERT_GL(glUseProgram(R->pass2.program));
-    ASSERT_GL(glUniformMatrix4fv(R->pass2.u_Projection, 1, GL_FALSE, (float*)&proj_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->pass2.u_View, 1, GL_FALSE, (float*)&view_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->pass2.u_InvProj, 1, GL_FALSE, (float*)&inv_proj));
-    ASSERT_GL(glUniform2fv(R->pass2.u_Viewport, 1, viewport));
-    ASSERT_GL(glActiveTexture(GL_TEXTURE0));
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_color_texture));
-    ASSERT_GL(glActiveTexture(GL_TEXTURE1));
-    ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_depth_texture));
-
-    for(ii=0;ii<num_lights;++ii) {
-        float size = lights[ii].size;
-        Mat4 world = mat4_identity;
-        Vec4 position = vec4_zero;
-
-        world = mat4_scalef(size,size,size);
-        world.r3 = vec4_from_vec3(lights[ii].position,1.0f);
-
-        position = vec4_from_vec3(lights[ii].position, 1.0f);
-        position = mat4_mul_vector(position, view_matrix);
-
-        ASSERT_GL(glUniformMatrix4fv(R->pass2.u_World, 1, GL_FALSE, (float*)&world));
-        ASSERT_GL(glUniform3fv(R->pass2.u_LightPosition, 1, (float*)&position));
-        ASSERT_GL(glUniform3fv(R->pass2.u_LightColor, 1, (float*)&lights[ii].color));
-        ASSERT_GL(glUniform1f(R->pass2.u_LightSize, lights[ii].size));
-        _draw_point_light(R);
+    begin_gpu_pass("Prepass lights");
+    if(R->half_res_lighting) {
+        _render_half_res_lights(R, proj_matrix, view_matrix, lights, num_lights);
+    } else {
+        ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, R->lighting_buffer, 0));
+        ASSERT_GL(glViewport(0, 0, R->width, R->height));
+        /* Specular accumulates in alpha */
+        ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 0.0f));
+        ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT));
+        if(R->reused_light)
+            _reproject_light(R, proj_matrix, view_matrix);
+
+        ASSERT_GL(glEnable(GL_BLEND));
+        ASSERT_GL(glBlendFunc(GL_ONE, GL_ONE));
+        ASSERT_GL(glCullFace(GL_FRONT));
+        ASSERT_GL(glDepthMask(GL_FALSE));
+        ASSERT_GL(glDepthFunc(GL_GEQUAL));
+
+        ASSERT_GL(glUseProgram(R->pass2.program));
+        set_uniform_matrix4fv(R->pass2.program, R->pass2.u_Projection, 1, (float*)&proj_matrix);
+        set_uniform_matrix4fv(R->pass2.program, R->pass2.u_InvProj, 1, (float*)&inv_proj);
+        set_uniform_2fv(R->pass2.program, R->pass2.u_Viewport, 1, viewport);
+        ASSERT_GL(glActiveTexture(GL_TEXTURE0));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_color_texture));
+        ASSERT_GL(glActiveTexture(GL_TEXTURE1));
+        ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->gbuffer_depth_texture));
+
+        /* Reprojection owns the stencil buffer */
+        render_light_volumes(R->light_volume, R->pass2.program,
+                             proj_matrix, view_matrix, R->width, R->height,
+                             lights, num_lights, R->stencil_lights && !R->reused_light);
+        if(R->num_gpu_lights) {
+            ASSERT_GL(glUseProgram(R->pass2.program));
+            draw_light_volume_buffer(R->light_volume, R->gpu_light_buffer, R->num_gpu_lights);
+        }
+        ASSERT_GL(glDisable(GL_STENCIL_TEST));
+
+        /* Keep this frame's depth for the next one's reprojection */
+        if(temporal) {
+            ASSERT_GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, R->history_framebuffer));
+            ASSERT_GL(glBlitFramebuffer(0, 0, R->width, R->height, 0, 0, R->width, R->height,
+                                        GL_DEPTH_BUFFER_BIT, GL_NEAREST));
+        }
     }
+    end_gpu_pass();
 
     ASSERT_GL(glDisable(GL_BLEND));
     ASSERT_GL(glDepthMask(GL_FALSE));
@@ -403,28 +779,89 @@ void render_light_prepass(LightPrepassRenderer* R, GLuint default_framebuffer,
 
     /** Pass 3
      */
+    begin_gpu_pass("Prepass materials");
     ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, default_framebuffer));
-    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, R->gbuffer_depth_texture, 0));
+    ASSERT_GL(glFramebufferTexture2D(GL_FRAMEBUFFER, R->depth_attachment, GL_TEXTURE_2D, R->gbuffer_depth_texture, 0));
     ASSERT_GL(glViewport(0, 0, R->width, R->height));
     ASSERT_GL(glClearColor(0.0f, 0.0f, 0.0f, 1.0f));
     ASSERT_GL(glClear(GL_COLOR_BUFFER_BIT));
     ASSERT_GL(glUseProgram(R->pass3.program));
-    ASSERT_GL(glUniformMatrix4fv(R->pass3.u_Projection, 1, GL_FALSE, (float*)&proj_matrix));
-    ASSERT_GL(glUniformMatrix4fv(R->pass3.u_View, 1, GL_FALSE, (float*)&view_matrix));
-    ASSERT_GL(glUniform2fv(R->pass3.u_Viewport, 1, viewport));
+    set_uniform_matrix4fv(R->pass3.program, R->pass3.u_Projection, 1, (float*)&proj_matrix);
+    set_uniform_matrix4fv(R->pass3.program, R->pass3.u_View, 1, (float*)&view_matrix);
+    set_uniform_2fv(R->pass3.program, R->pass3.u_Viewport, 1, viewport);
     ASSERT_GL(glActiveTexture(GL_TEXTURE0));
     ASSERT_GL(glBindTexture(GL_TEXTURE_2D, R->lighting_buffer));
 
     for(ii=0;ii<num_models;++ii) {
         Mat4 world_matrix = transform_get_matrix(models[ii].transform);
         /* Material */
+        set_uniform_3fv(R->pass3.program, R->pass3.u_SpecularColor, 1, (float*)&models[ii].material->specular_color);
+        set_uniform_1f(R->pass3.program, R->pass3.u_SpecularCoefficient, models[ii].material->specular_coefficient);
         ASSERT_GL(glActiveTexture(GL_TEXTURE1));
         ASSERT_GL(glBindTexture(GL_TEXTURE_2D, models[ii].material->albedo));
         /* Mesh */
-        ASSERT_GL(glUniformMatrix4fv(R->pass3.u_World, 1, GL_FALSE, (float*)&world_matrix));
+        set_uniform_matrix4fv(R->pass3.program, R->pass3.u_World, 1, (float*)&world_matrix);
         draw_mesh(models[ii].mesh);
     }
+    end_gpu_pass();
     
     ASSERT_GL(glDepthMask(GL_TRUE));
     ASSERT_GL(glDepthFunc(GL_LESS));
+
+    /* This frame's light and normals become the history */
+    if(temporal) {
+        GLuint history = R->history_lighting_buffer;
+        R->history_lighting_buffer = R->lighting_buffer;
+        R->lighting_buffer = history;
+        history = R->history_normal_texture;
+        R->history_normal_texture = R->gbuffer_color_texture;
+        R->gbuffer_color_texture = history;
+        R->history_view = view_matrix;
+        R->history_num_lights = num_lights;
+        R->history_valid = 1;
+        R->refresh_phase = (R->refresh_phase + 1) % REFRESH_PERIOD;
+    } else {
+        R->history_valid = 0;
+    }
+}
+void set_light_prepass_light_stencil(LightPrepassRenderer* R, int enabled)
+{
+    /* ES 2.0 depth textures have no stencil */
+    R->stencil_lights = enabled && R->major_version >= 3;
+}
+void set_light_prepass_accumulation_format(LightPrepassRenderer* R, AccumulationFormat format)
+{
+    /* Takes effect on the next resize */
+    R->accumulation_format = format;
+}
+void set_light_prepass_half_res_lighting(LightPrepassRenderer* R, int enabled)
+{
+    /* Needs ES 3.0 */
+    enabled = enabled && R->downsample != NULL;
+    if(R->half_res_lighting == enabled)
+        return;
+    R->half_res_lighting = enabled;
+    if(R->width && R->height)
+        resize_light_prepass_renderer(R, R->width, R->height);
+}
+int light_prepass_half_res_lighting(const LightPrepassRenderer* R)
+{
+    return R->half_res_lighting;
+}
+void set_light_prepass_static_lights(LightPrepassRenderer* R, int enabled)
+{
+    if(R->static_lights == enabled)
+        return;
+    R->static_lights = enabled;
+    if(R->width && R->height)
+        resize_light_prepass_renderer(R, R->width, R->height);
+}
+int light_prepass_reused_light(const LightPrepassRenderer* R)
+{
+    return R->reused_light;
+}
+void set_light_prepass_gpu_lights(LightPrepassRenderer* R, GLuint light_buffer, int num_lights)
+{
+    R->gpu_light_buffer = light_buffer;
+    R->num_gpu_lights = num_lights;
 }
@@ -12,13 +12,43 @@
 
 typedef struct LightPrepassRenderer LightPrepassRenderer;
 
+/** @brief Starts compiling the renderer's programs, see submit_program */
+void submit_light_prepass_programs(int major_version);
 LightPrepassRenderer* create_light_prepass_renderer(Graphics* G, int major_version, int minor_version);
 void destroy_light_prepass_renderer(LightPrepassRenderer* R);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_light_prepass_uniforms(LightPrepassRenderer* R);
 void resize_light_prepass_renderer(LightPrepassRenderer* R, int width, int height);
 
 void render_light_prepass(LightPrepassRenderer* R, GLuint default_framebuffer,
                           Mat4 proj_matrix, Mat4 view_matrix,
                           const Model* models, int num_models,
                           const Light* lights, int num_lights);
+/** @brief Limits each light volume to the pixels inside it with a stencil
+ *      pre-pass. Requires OpenGL ES 3.0, ignored otherwise.
+ */
+void set_light_prepass_light_stencil(LightPrepassRenderer* R, int enabled);
+/** @brief Format of the lighting buffer, applied on the next resize */
+void set_light_prepass_accumulation_format(LightPrepassRenderer* R, AccumulationFormat format);
+/** @brief Accumulates light at half resolution, from a downsampled normal
+ *      and depth buffer, and upsamples it with a joint bilateral filter
+ *      before pass 3. Requires OpenGL ES 3.0, ignored otherwise.
+ */
+void set_light_prepass_half_res_lighting(LightPrepassRenderer* R, int enabled);
+int light_prepass_half_res_lighting(const LightPrepassRenderer* R);
+/** @brief Lights whose volume instances are written on the GPU, in the
+ *      LIGHT_INSTANCE_SIZE layout, drawn after the submitted lights without
+ *      culling. Requires OpenGL ES 3.0.
+ */
+void set_light_prepass_gpu_lights(LightPrepassRenderer* R, GLuint light_buffer, int num_lights);
+/** @brief Tells the renderer the lights don't change between frames. While
+ *      the camera moves slowly, last frame's light buffer is then reprojected
+ *      and only disoccluded or turned pixels, plus a rotating 1/16th of the
+ *      screen, are shaded again, without stencil masked light volumes. Requires
+ *      OpenGL ES 3.0 and full resolution lighting.
+ */
+void set_light_prepass_static_lights(LightPrepassRenderer* R, int enabled);
+/** @return Whether the last frame reused the previous frame's light */
+int light_prepass_reused_light(const LightPrepassRenderer* R);
 
 #endif /* include guard */
@@ -0,0 +1,424 @@
+/*! @file light_volume.c
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "light_volume.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "vertex.h"
+#include "program.h"
+#include "light_culling.h"
+
+/* Defines
+ */
+#define ICOSPHERE_SUBDIVISIONS  1
+#define MAX_SPHERE_TRIANGLES    (20 << (2*ICOSPHERE_SUBDIVISIONS))
+#define MAX_SPHERE_VERTICES     (MAX_SPHERE_TRIANGLES/2 + 2)
+/* Lights covering more of the screen than this are scissored individually */
+#define LARGE_LIGHT_COVERAGE    (1.0f/16.0f)
+
+/* Types
+ */
+/* Matches LIGHT_INSTANCE_SIZE */
+typedef struct LightInstance
+{
+    Vec4    position_size; /* View space */
+    Vec3    color;
+} LightInstance;
+
+struct LightVolume
+{
+    int     instanced;
+
+    GLuint  vertex_buffer;
+    GLuint  index_buffer;
+    int     index_count;
+    GLuint  instance_buffer;
+    int     instance_buffer_size;
+
+    GLuint  stencil_program;
+    GLuint  u_Projection;
+
+    LightInstance*  instances;
+    int             capacity;
+    int             num_instances;
+
+    /* Culling scratch space */
+    Light*      sorted_lights;
+    LightRect*  rects;
+    LightRect*  sorted_rects;
+    int*        order;
+    int         scratch_capacity;
+};
+
+/* Constants
+ */
+/** Icosahedron, vertices on the unit sphere
+ *  Triangles are wound so (b-a)x(c-a) points out of the volume.
+ */
+#define kX 0.525731112f
+#define kZ 0.850650808f
+static const Vec3 kIcosahedronVertices[] =
+{
+    {  -kX, 0.0f,   kZ }, {   kX, 0.0f,   kZ }, {  -kX, 0.0f,  -kZ }, {   kX, 0.0f,  -kZ },
+    { 0.0f,   kZ,   kX }, { 0.0f,   kZ,  -kX }, { 0.0f,  -kZ,   kX }, { 0.0f,  -kZ,  -kX },
+    {   kZ,   kX, 0.0f }, {  -kZ,   kX, 0.0f }, {   kZ,  -kX, 0.0f }, {  -kZ,  -kX, 0.0f },
+};
+#undef kX
+#undef kZ
+static const uint16_t kIcosahedronIndices[] =
+{
+     0, 1, 4,   0, 4, 9,   9, 4, 5,   4, 8, 5,   4, 1, 8,
+     8, 1,10,   8,10, 3,   5, 8, 3,   5, 3, 2,   2, 3, 7,
+     7, 3,10,   7,10, 6,   7, 6,11,  11, 6, 0,   0, 6, 1,
+     6,10, 1,   9,11, 0,   9, 2,11,   9, 5, 2,   7,11, 2,
+};
+static const AttributeSlot kStencilSlots[] =
+{
+    kPositionSlot,
+    kLightPositionSlot,
+    kEmptySlot
+};
+
+/* Variables
+ */
+
+/* Internal functions
+ */
+typedef struct SphereMesh
+{
+    Vec3        vertices[MAX_SPHERE_VERTICES];
+    uint16_t    indices[MAX_SPHERE_TRIANGLES*3];
+    int         num_vertices;
+    int         num_triangles;
+} SphereMesh;
+
+/** Returns the vertex halfway between a and b, pushed out to the unit sphere.
+ *  Shared edges produce the same vertex so the mesh stays welded.
+ */
+static uint16_t _midpoint(SphereMesh* mesh, uint16_t a, uint16_t b)
+{
+    Vec3 v = vec3_normalize(vec3_lerp(mesh->vertices[a], mesh->vertices[b], 0.5f));
+    int ii;
+    for(ii=0;ii<mesh->num_vertices;++ii) {
+        if(vec3_distance_sq(mesh->vertices[ii], v) < 1e-8f)
+            return (uint16_t)ii;
+    }
+    assert(mesh->num_vertices < MAX_SPHERE_VERTICES);
+    mesh->vertices[mesh->num_vertices] = v;
+    return (uint16_t)mesh->num_vertices++;
+}
+static void _subdivide(SphereMesh* mesh)
+{
+    uint16_t    indices[MAX_SPHERE_TRIANGLES*3];
+    int         num_triangles = mesh->num_triangles;
+    int         ii;
+
+    memcpy(indices, mesh->indices, sizeof(uint16_t)*3*num_triangles);
+    mesh->num_triangles = 0;
+    for(ii=0;ii<num_triangles;++ii) {
+        uint16_t a = indices[ii*3+0];
+        uint16_t b = indices[ii*3+1];
+        uint16_t c = indices[ii*3+2];
+        uint16_t ab = _midpoint(mesh, a, b);
+        uint16_t bc = _midpoint(mesh, b, c);
+        uint16_t ca = _midpoint(mesh, c, a);
+        uint16_t* t = mesh->indices + mesh->num_triangles*3;
+        t[0] = a;  t[1] = ab; t[2] = ca;
+        t[3] = ab; t[4] = b;  t[5] = bc;
+        t[6] = ca; t[7] = bc; t[8] = c;
+        t[9] = ab; t[10] = bc; t[11] = ca;
+        mesh->num_triangles += 4;
+    }
+}
+/** Builds a subdivided icosahedron whose faces all lie outside the unit
+ *  sphere, so it bounds the light's radius like the cube did.
+ *  @return Volume of the mesh relative to the unit sphere
+ */
+static float _create_icosphere(SphereMesh* mesh)
+{
+    float   min_distance = 1.0f;
+    float   volume = 0.0f;
+    float   scale;
+    int     ii;
+
+    memcpy(mesh->vertices, kIcosahedronVertices, sizeof(kIcosahedronVertices));
+    memcpy(mesh->indices, kIcosahedronIndices, sizeof(kIcosahedronIndices));
+    mesh->num_vertices = sizeof(kIcosahedronVertices)/sizeof(kIcosahedronVertices[0]);
+    mesh->num_triangles = sizeof(kIcosahedronIndices)/sizeof(kIcosahedronIndices[0])/3;
+    for(ii=0;ii<ICOSPHERE_SUBDIVISIONS;++ii)
+        _subdivide(mesh);
+
+    /* Push the faces out until the closest one touches the sphere */
+    for(ii=0;ii<mesh->num_triangles;++ii) {
+        Vec3 a = mesh->vertices[mesh->indices[ii*3+0]];
+        Vec3 b = mesh->vertices[mesh->indices[ii*3+1]];
+        Vec3 c = mesh->vertices[mesh->indices[ii*3+2]];
+        Vec3 normal = vec3_normalize(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+        float distance = vec3_dot(normal, a);
+        assert(distance > 0.0f); /* Wound outward */
+        if(distance < min_distance)
+            min_distance = distance;
+    }
+    scale = 1.0f/min_distance;
+    for(ii=0;ii<mesh->num_vertices;++ii)
+        mesh->vertices[ii] = vec3_mul_scalar(mesh->vertices[ii], scale);
+
+    for(ii=0;ii<mesh->num_triangles;++ii) {
+        Vec3 a = mesh->vertices[mesh->indices[ii*3+0]];
+        Vec3 b = mesh->vertices[mesh->indices[ii*3+1]];
+        Vec3 c = mesh->vertices[mesh->indices[ii*3+2]];
+        volume += vec3_dot(a, vec3_cross(b, c))/6.0f;
+    }
+    return volume/(4.0f/3.0f*kPi);
+}
+
+/** Draws one light twice. The first draw marks the pixels whose surface lies
+ *  inside the volume in the stencil buffer, the second shades them.
+ */
+static void _draw_stenciled(LightVolume* V, GLuint program, int index)
+{
+    /** Mark
+     *  Back faces behind the surface increment, front faces behind it
+     *  decrement. Only surfaces between the two end up non-zero. This
+     *  (z-fail) still works with the camera inside the volume.
+     */
+    ASSERT_GL(glUseProgram(V->stencil_program));
+    ASSERT_GL(glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE));
+    ASSERT_GL(glDisable(GL_CULL_FACE));
+    ASSERT_GL(glDepthFunc(GL_LESS));
+    ASSERT_GL(glStencilFunc(GL_ALWAYS, 0, 0xFF));
+    ASSERT_GL(glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP));
+    ASSERT_GL(glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP));
+    draw_light_volume(V, index, 1);
+
+    /** Shade
+     *  Back faces so the light still draws with the camera inside it.
+     *  Shaded pixels reset their stencil for the next light.
+     */
+    ASSERT_GL(glUseProgram(program));
+    ASSERT_GL(glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE));
+    ASSERT_GL(glEnable(GL_CULL_FACE));
+    ASSERT_GL(glCullFace(GL_FRONT));
+    ASSERT_GL(glDepthFunc(GL_ALWAYS));
+    ASSERT_GL(glStencilFunc(GL_NOTEQUAL, 0, 0xFF));
+    ASSERT_GL(glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO));
+    draw_light_volume(V, index, 1);
+}
+/** Instanced draw of the volumes in `instance_buffer`, starting `offset` bytes in */
+static void _draw_instanced(LightVolume* V, GLuint instance_buffer, size_t offset, int count)
+{
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, V->vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, V->index_buffer));
+    ASSERT_GL(glVertexAttribPointer(kPositionSlot, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
+
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, instance_buffer));
+    ASSERT_GL(glEnableVertexAttribArray(kLightPositionSlot));
+    ASSERT_GL(glEnableVertexAttribArray(kLightColorSlot));
+    ASSERT_GL(glVertexAttribPointer(kLightPositionSlot, 4, GL_FLOAT, GL_FALSE, sizeof(LightInstance), (void*)(offset + offsetof(LightInstance, position_size))));
+    ASSERT_GL(glVertexAttribPointer(kLightColorSlot, 3, GL_FLOAT, GL_FALSE, sizeof(LightInstance), (void*)(offset + offsetof(LightInstance, color))));
+    ASSERT_GL(glVertexAttribDivisor(kLightPositionSlot, 1));
+    ASSERT_GL(glVertexAttribDivisor(kLightColorSlot, 1));
+
+    ASSERT_GL(glDrawElementsInstanced(GL_TRIANGLES, V->index_count, GL_UNSIGNED_SHORT, NULL, count));
+
+    /* Attribute state is global, don't leak it into mesh draws */
+    ASSERT_GL(glVertexAttribDivisor(kLightPositionSlot, 0));
+    ASSERT_GL(glVertexAttribDivisor(kLightColorSlot, 0));
+    ASSERT_GL(glDisableVertexAttribArray(kLightPositionSlot));
+    ASSERT_GL(glDisableVertexAttribArray(kLightColorSlot));
+}
+static void _reserve_scratch(LightVolume* V, int num_lights)
+{
+    if(num_lights <= V->scratch_capacity)
+        return;
+    V->sorted_lights = (Light*)realloc(V->sorted_lights, sizeof(Light)*num_lights);
+    V->rects = (LightRect*)realloc(V->rects, sizeof(LightRect)*num_lights);
+    V->sorted_rects = (LightRect*)realloc(V->sorted_rects, sizeof(LightRect)*num_lights);
+    V->order = (int*)realloc(V->order, sizeof(int)*num_lights);
+    V->scratch_capacity = num_lights;
+}
+
+/* External functions
+ */
+void submit_light_volume_programs(void)
+{
+    submit_program("shaders/light_volume/stencilvertex.glsl",
+                   "shaders/light_volume/stencilfragment.glsl",
+                   kStencilSlots);
+}
+LightVolume* create_light_volume(int instanced)
+{
+    LightVolume* V = (LightVolume*)calloc(1, sizeof(*V));
+    SphereMesh sphere;
+    float volume_ratio = _create_icosphere(&sphere);
+    V->instanced = instanced;
+    V->index_count = sphere.num_triangles*3;
+
+    /** A cube proxy covers 6/pi = 1.91x the sphere's volume. Light pass
+     *  fragments scale roughly with the proxy's projected area.
+     */
+    system_log("Light volume: %d triangle icosphere, %.2fx sphere volume (cube: %.2fx)\n",
+               sphere.num_triangles, volume_ratio, 6.0f/kPi);
+
+    /* Create vertex buffer */
+    ASSERT_GL(glGenBuffers(1, &V->vertex_buffer));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, V->vertex_buffer));
+    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(Vec3)*sphere.num_vertices, sphere.vertices, GL_STATIC_DRAW));
+
+    /* Create instance buffer */
+    ASSERT_GL(glGenBuffers(1, &V->instance_buffer));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+
+    /* Create index buffer */
+    ASSERT_GL(glGenBuffers(1, &V->index_buffer));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, V->index_buffer));
+    ASSERT_GL(glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint16_t)*V->index_count, sphere.indices, GL_STATIC_DRAW));
+    ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0));
+
+    /* Stencil marking program */
+    V->stencil_program = create_program("shaders/light_volume/stencilvertex.glsl",
+                                        "shaders/light_volume/stencilfragment.glsl",
+                                        kStencilSlots);
+    resolve_light_volume_uniforms(V);
+
+    return V;
+}
+void resolve_light_volume_uniforms(LightVolume* V)
+{
+    ASSERT_GL(V->u_Projection = glGetUniformLocation(V->stencil_program, "u_Projection"));
+}
+void destroy_light_volume(LightVolume* V)
+{
+    ASSERT_GL(glDeleteBuffers(1, &V->vertex_buffer));
+    ASSERT_GL(glDeleteBuffers(1, &V->index_buffer));
+    ASSERT_GL(glDeleteBuffers(1, &V->instance_buffer));
+    destroy_program(V->stencil_program);
+    free(V->instances);
+    free(V->sorted_lights);
+    free(V->rects);
+    free(V->sorted_rects);
+    free(V->order);
+    free(V);
+}
+void update_light_volume(LightVolume* V, Mat4 view_matrix,
+                         const Light* lights, int num_lights)
+{
+    int ii;
+    if(num_lights > V->capacity) {
+        V->instances = (LightInstance*)realloc(V->instances, sizeof(LightInstance)*num_lights);
+        V->capacity = num_lights;
+    }
+    for(ii=0;ii<num_lights;++ii) {
+        Vec4 position = mat4_mul_vector(vec4_from_vec3(lights[ii].position, 1.0f), view_matrix);
+        position.w = lights[ii].size;
+        V->instances[ii].position_size = position;
+        V->instances[ii].color = lights[ii].color;
+    }
+    V->num_instances = num_lights;
+
+    if(!V->instanced || num_lights == 0)
+        return;
+
+    /* Orphan the old storage so the driver doesn't wait on last frame's draw */
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, V->instance_buffer));
+    if(num_lights > V->instance_buffer_size)
+        V->instance_buffer_size = num_lights;
+    ASSERT_GL(glBufferData(GL_ARRAY_BUFFER, sizeof(LightInstance)*V->instance_buffer_size, NULL, GL_STREAM_DRAW));
+    ASSERT_GL(glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(LightInstance)*num_lights, V->instances));
+    ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+}
+void draw_light_volume(LightVolume* V, int first, int count)
+{
+    assert(first >= 0 && first + count <= V->num_instances);
+    if(count <= 0)
+        return;
+
+    if(V->instanced) {
+        /* ES 3.0 has no base instance, offset the attribute pointers instead */
+        _draw_instanced(V, V->instance_buffer, sizeof(LightInstance)*first, count);
+    } else {
+        /* Disabled attribute arrays read the current constant value */
+        int ii;
+        ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, V->vertex_buffer));
+        ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, V->index_buffer));
+        ASSERT_GL(glVertexAttribPointer(kPositionSlot, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), (void*)0));
+        for(ii=first;ii<first+count;++ii) {
+            ASSERT_GL(glVertexAttrib4fv(kLightPositionSlot, (float*)&V->instances[ii].position_size));
+            ASSERT_GL(glVertexAttrib3fv(kLightColorSlot, (float*)&V->instances[ii].color));
+            ASSERT_GL(glDrawElements(GL_TRIANGLES, V->index_count, GL_UNSIGNED_SHORT, NULL));
+        }
+    }
+}
+void draw_light_volume_buffer(LightVolume* V, GLuint instance_buffer, int count)
+{
+    assert(V->instanced);
+    if(count <= 0)
+        return;
+    _draw_instanced(V, instance_buffer, 0, count);
+}
+int render_light_volumes(LightVolume* V, GLuint program,
+                         Mat4 proj_matrix, Mat4 view_matrix, int width, int height,
+                         const Light* lights, int num_lights, int stencil)
+{
+    float   large_area = LARGE_LIGHT_COVERAGE*width*height;
+    int     num_visible = 0;
+    int     num_small = 0;
+    int     ii, jj;
+
+    _reserve_scratch(V, num_lights);
+
+    /** Cull and sort
+     *  Small lights go first so they can share one instanced draw.
+     */
+    for(ii=0;ii<num_lights;++ii) {
+        Vec4 position = mat4_mul_vector(vec4_from_vec3(lights[ii].position, 1.0f), view_matrix);
+        LightRect* rect = &V->rects[num_visible];
+        if(!compute_light_rect(vec3_from_vec4(position), lights[ii].size, proj_matrix, width, height, rect))
+            continue;
+        V->order[num_visible] = ii;
+        if(!stencil && (float)rect->width*rect->height < large_area)
+            num_small++;
+        num_visible++;
+    }
+    for(ii=0, jj=0;ii<num_visible;++ii) {
+        const LightRect* rect = &V->rects[ii];
+        if(!stencil && (float)rect->width*rect->height < large_area)
+            V->sorted_lights[jj++] = lights[V->order[ii]];
+    }
+    for(ii=0;ii<num_visible;++ii) {
+        const LightRect* rect = &V->rects[ii];
+        if(stencil || (float)rect->width*rect->height >= large_area) {
+            V->sorted_rects[jj] = *rect;
+            V->sorted_lights[jj++] = lights[V->order[ii]];
+        }
+    }
+    update_light_volume(V, view_matrix, V->sorted_lights, num_visible);
+
+    draw_light_volume(V, 0, num_small);
+
+    /* Large lights, each clipped to its own rectangle */
+    if(num_small == num_visible)
+        return num_visible;
+    if(stencil) {
+        ASSERT_GL(glUseProgram(V->stencil_program));
+        set_uniform_matrix4fv(V->stencil_program, V->u_Projection, 1, (float*)&proj_matrix);
+        ASSERT_GL(glEnable(GL_STENCIL_TEST));
+    }
+    ASSERT_GL(glEnable(GL_SCISSOR_TEST));
+    for(ii=num_small;ii<num_visible;++ii) {
+        const LightRect* rect = &V->sorted_rects[ii];
+        ASSERT_GL(glScissor(rect->x, rect->y, rect->width, rect->height));
+        if(stencil)
+            _draw_stenciled(V, program, ii);
+        else
+            draw_light_volume(V, ii, 1);
+    }
+    ASSERT_GL(glDisable(GL_SCISSOR_TEST));
+    if(stencil) {
+        ASSERT_GL(glDisable(GL_STENCIL_TEST));
+        ASSERT_GL(glDepthFunc(GL_GEQUAL));
+    }
+    return num_visible;
+}
@@ -0,0 +1,60 @@
+/*! @file light_volume.h
+ *  @brief Point light volumes shared by the deferred renderers
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __light_volume_h__
+#define __light_volume_h__
+
+#include "gl_include.h"
+#include "graphics_types.h"
+
+typedef struct LightVolume LightVolume;
+
+/** Bytes per light in an instance buffer: the view space position with the
+ *  size in w (vec4), then the color (vec3)
+ */
+#define LIGHT_INSTANCE_SIZE (7*sizeof(float))
+
+/** @brief Starts compiling the stencil program, see submit_program */
+void submit_light_volume_programs(void);
+
+/** @param instanced [in] Draw all volumes with one instanced draw call
+ *      (OpenGL ES 3.0). Otherwise one draw call is issued per light.
+ */
+LightVolume* create_light_volume(int instanced);
+void destroy_light_volume(LightVolume* V);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_light_volume_uniforms(LightVolume* V);
+
+/** @brief Streams the view space position, size and color of every light
+ *      into the per-instance vertex buffer
+ */
+void update_light_volume(LightVolume* V, Mat4 view_matrix,
+                         const Light* lights, int num_lights);
+
+/** @brief Draws `count` volumes starting at light `first` of the last update.
+ *  The bound program reads the light from the kLightPositionSlot (view space
+ *  position and size) and kLightColorSlot attributes.
+ */
+void draw_light_volume(LightVolume* V, int first, int count);
+/** @brief Draws `count` volumes from an instance buffer filled on the GPU,
+ *      with the bound program, in one instanced draw. Nothing is culled.
+ *  Requires an instanced LightVolume.
+ */
+void draw_light_volume_buffer(LightVolume* V, GLuint instance_buffer, int count);
+
+/** @brief Culls the lights outside the view and draws the volumes of the
+ *      rest with `program`, which must be bound and set up by the caller.
+ *  Lights covering less than 1/16th of the screen share one instanced draw,
+ *  larger ones are drawn one at a time, scissored to their screen rect.
+ *  With `stencil` set every light is drawn on its own, scissored and
+ *  stencil masked: the volume first marks the pixels whose surface lies
+ *  inside it, then `program` only shades those. The framebuffer needs a
+ *  stencil buffer cleared to 0 for that. The stencil test is left off.
+ *  @return The number of lights that weren't culled
+ */
+int render_light_volumes(LightVolume* V, GLuint program,
+                         Mat4 proj_matrix, Mat4 view_matrix, int width, int height,
+                         const Light* lights, int num_lights, int stencil);
+
+#endif /* include guard */
@@ -15,6 +15,8 @@ struct Mesh
     GLuint      vertex_buffer;
     GLuint      index_buffer;
     int         index_count;
+    Vec3        center;
+    float       radius;
 };
 
 /* Constants
@@ -25,6 +27,27 @@ struct Mesh
 
 /* Internal functions
  */
+static void _compute_bounds(Mesh* M, const Vertex* vertices, size_t num_vertices)
+{
+    Vec3 min, max;
+    size_t ii;
+    if(num_vertices == 0)
+        return;
+
+    min = max = vertices[0].position;
+    for(ii=1;ii<num_vertices;++ii) {
+        min = vec3_min(min, vertices[ii].position);
+        max = vec3_max(max, vertices[ii].position);
+    }
+    M->center = vec3_mul_scalar(vec3_add(min, max), 0.5f);
+    M->radius = 0.0f;
+    for(ii=0;ii<num_vertices;++ii) {
+        float dist_sq = vec3_distance_sq(vertices[ii].position, M->center);
+        if(dist_sq > M->radius)
+            M->radius = dist_sq;
+    }
+    M->radius = sqrtf(M->radius);
+}
 
 /* External functions
  */
@@ -53,6 +76,7 @@ Mesh* create_mesh(const Vertex* vertex_data, size_t vertex_data_size,
     mesh->vertex_buffer = vertex_buffer;
     mesh->index_buffer = index_buffer;
     mesh->index_count = index_count;
+    _compute_bounds(mesh, vertex_data, vertex_data_size/sizeof(Vertex));
 
     return mesh;
 }
@@ -74,3 +98,8 @@ void destroy_mesh(Mesh* M)
     ASSERT_GL(glDeleteBuffers(1,&M->index_buffer));
     free(M);
 }
+void mesh_bounds(const Mesh* M, Vec3* center, float* radius)
+{
+    *center = M->center;
+    *radius = M->radius;
+}
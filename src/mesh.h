@@ -17,4 +17,7 @@ Mesh* create_mesh(const Vertex* vertex_data, size_t vertex_data_size,
 void draw_mesh(const Mesh* M);
 void destroy_mesh(Mesh* M);
 
+/** @brief Object space bounding sphere of the mesh's vertices */
+void mesh_bounds(const Mesh* M, Vec3* center, float* radius);
+
 #endif /* include guard */
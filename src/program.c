@@ -2,16 +2,99 @@
  *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
  */
 #include "program.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "gl_include.h"
+#if defined(__ANDROID__)
+    #include <EGL/egl.h>
+#endif
 #include "system.h"
 #include "vertex.h"
 #include "assert.h"
 
 /* Defines
  */
+#define PROGRAM_CACHE_MAGIC 0x50524732 /* "PRG2" */
+#define SHADER_INCLUDE_ROOT "shaders/" /* #include paths start here */
+#define MAX_INCLUDE_DEPTH 8
+#define MAX_PROGRAM_SLOTS 9 /* Every AttributeSlot, then kEmptySlot */
+#define MAX_PERMUTATION_DEFINES 1024
+#define MAX_SHADOWED_UNIFORM_SIZE 64 /* A Mat4, larger arrays are always uploaded */
+
+#if defined(__ANDROID__) && !defined(GL_KHR_parallel_shader_compile)
+    /* KHR_parallel_shader_compile, missing from older NDK headers */
+    typedef void (GL_APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+#endif
 
 /* Types
  */
+/** Header of a cached program binary, the binary follows it */
+typedef struct ProgramCacheHeader
+{
+    uint32_t    magic;
+    uint32_t    key[2];
+    uint32_t    format;
+    uint32_t    length;     /* Of the binary */
+    uint32_t    checksum;   /* Of the binary */
+} ProgramCacheHeader;
+typedef struct ShaderSource
+{
+    char*   data;
+    size_t  size;
+    size_t  capacity;
+} ShaderSource;
+/** A program whose compile and link were started by submit_program */
+typedef struct PendingProgram
+{
+    uint32_t    key[2];
+    GLuint      program;
+    GLuint      vertex_shader;
+    GLuint      fragment_shader;
+    int         cached; /* Loaded from a binary, no shaders */
+    char        vertex_shader_filename[128];
+    char        fragment_shader_filename[128];
+} PendingProgram;
+/** The value last uploaded to a uniform location */
+typedef struct UniformShadow
+{
+    GLint       location;
+    size_t      size;
+    uint8_t     value[MAX_SHADOWED_UNIFORM_SIZE];
+} UniformShadow;
+/** What a created program was built from, to build it again when its
+ *  files change
+ */
+typedef struct LiveProgram
+{
+    Program             program;
+    uint32_t            key[2];
+    char                vertex_shader_filename[128];
+    char                fragment_shader_filename[128];
+    AttributeSlot       slots[MAX_PROGRAM_SLOTS];
+    char*               defines;
+    const char* const*  varyings;
+    int                 num_varyings;
+
+    UniformShadow*      uniforms;
+    int                 num_uniforms;
+} LiveProgram;
+typedef struct Permutation
+{
+    uint32_t    features;
+    Program     program;
+} Permutation;
+struct ProgramPermutations
+{
+    const char*         vertex_shader_filename;
+    const char*         fragment_shader_filename;
+    AttributeSlot*      slots;
+    const char* const*  features;
+    int                 num_features;
+
+    Permutation*        permutations;
+    int                 num_permutations;
+};
 
 /* Constants
  */
@@ -22,42 +105,246 @@ static const char* kAttributeSlotNames[] =
     "a_Tangent",    /* kTangentSlot */
     "a_Bitangent",  /* kBitangentSlot */
     "a_TexCoord",   /* kTexCoordSlot */
+    "a_LightPosition",  /* kLightPositionSlot */
+    "a_LightColor",     /* kLightColorSlot */
+    "a_LightAnimation", /* kLightAnimationSlot */
 };
 
 /* Variables
  */
+static int      _binary_cache_supported = -1; /* Unknown until the first program */
+static uint32_t _driver_key[2];
+static PendingProgram*  _pending = NULL;
+static int              _num_pending = 0;
+static int              _parallel_compile_checked = 0;
+static LiveProgram*     _live = NULL;
+static int              _num_live = 0;
+static int              _last_live = 0; /* Programs are set up in runs, look there first */
+static int              _skipped_uploads = 0;
 
 /* Internal functions
  */
-static GLuint _load_shader(const char* filename, GLenum type)
+/** FNV-1a, run twice with different bases for a 64 bit key */
+static void _hash_data(uint32_t* key, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t ii;
+    for(ii=0;ii<size;++ii) {
+        key[0] = (key[0] ^ bytes[ii]) * 16777619u;
+        key[1] = (key[1] ^ bytes[ii]) * 16777619u;
+    }
+    /* Separates consecutive strings */
+    key[0] = (key[0] ^ 0xff) * 16777619u;
+    key[1] = (key[1] ^ 0xff) * 16777619u;
+}
+/** Catches cache files cut short or garbled on disk */
+static uint32_t _checksum(const void* data, size_t size)
+{
+    uint32_t key[2] = { 2166136261u, 0 };
+    _hash_data(key, data, size);
+    return key[0];
+}
+static void _hash_string(uint32_t* key, const char* string)
+{
+    if(string)
+        _hash_data(key, string, strlen(string));
+    else
+        _hash_data(key, "", 0);
+}
+/** Program binaries are core in ES 3.0, if the driver has a format for them.
+ *  They only load on the driver that wrote them, which goes in every key.
+ */
+static int _program_binaries_supported(void)
+{
+    if(_binary_cache_supported < 0) {
+        const char* version = (const char*)glGetString(GL_VERSION);
+        GLint num_formats = 0;
+        _binary_cache_supported = 0;
+        if(version && strncmp(version, "OpenGL ES ", 10) == 0 && version[10] >= '3') {
+            ASSERT_GL(glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats));
+            _binary_cache_supported = num_formats > 0;
+        }
+        _driver_key[0] = 2166136261u;
+        _driver_key[1] = 0x9e3779b9u;
+        _hash_string(_driver_key, (const char*)glGetString(GL_RENDERER));
+        _hash_string(_driver_key, version);
+    }
+    return _binary_cache_supported;
+}
+static void _cache_name(char* name, size_t name_size, const uint32_t* key)
+{
+    snprintf(name, name_size, "program_%08x%08x.bin", key[0], key[1]);
+}
+/** @return The program in the cache under `key`, or 0 if it's missing or
+ *      the driver rejects it
+ */
+static GLuint _load_program_binary(const uint32_t* key)
+{
+    char    name[64];
+    void*   data = NULL;
+    size_t  data_size = 0;
+    const ProgramCacheHeader* header;
+    GLuint  program;
+    GLint   link_status = GL_FALSE;
+
+    _cache_name(name, sizeof(name), key);
+    if(load_cache_data(name, &data, &data_size) != 0)
+        return 0;
+    header = (const ProgramCacheHeader*)data;
+    if(data_size <= sizeof(*header) || header->magic != PROGRAM_CACHE_MAGIC
+       || header->key[0] != key[0] || header->key[1] != key[1]
+       || data_size != sizeof(*header) + header->length
+       || header->checksum != _checksum(header + 1, header->length)) {
+        free(data);
+        return 0;
+    }
+
+    program = glCreateProgram();
+    /* A driver update can reject binaries even with the same strings. That
+     * fails the link, and may raise an error, which is dropped
+     */
+    glProgramBinary(program, header->format, header + 1, (GLsizei)header->length);
+    glGetError();
+    ASSERT_GL(glGetProgramiv(program, GL_LINK_STATUS, &link_status));
+    free(data);
+    if(link_status == GL_FALSE) {
+        system_log("Cached program %s rejected, compiling it\n", name);
+        ASSERT_GL(glDeleteProgram(program));
+        return 0;
+    }
+    return program;
+}
+static void _save_program_binary(GLuint program, const uint32_t* key)
+{
+    char    name[64];
+    GLint   binary_size = 0;
+    GLenum  format = 0;
+    ProgramCacheHeader* header;
+
+    ASSERT_GL(glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binary_size));
+    if(binary_size <= 0)
+        return;
+    header = (ProgramCacheHeader*)malloc(sizeof(*header) + binary_size);
+    ASSERT_GL(glGetProgramBinary(program, binary_size, NULL, &format, header + 1));
+    header->magic = PROGRAM_CACHE_MAGIC;
+    header->key[0] = key[0];
+    header->key[1] = key[1];
+    header->format = format;
+    header->length = (uint32_t)binary_size;
+    header->checksum = _checksum(header + 1, binary_size);
+
+    _cache_name(name, sizeof(name), key);
+    if(save_cache_data(name, header, sizeof(*header) + binary_size) != 0)
+        system_log("Caching program %s failed\n", name);
+    free(header);
+}
+static void _append_source(ShaderSource* source, const char* data, size_t size)
+{
+    if(source->size + size > source->capacity) {
+        source->capacity = (source->size + size)*2;
+        source->data = (char*)realloc(source->data, source->capacity);
+    }
+    memcpy(source->data + source->size, data, size);
+    source->size += size;
+}
+/** Appends `filename` to `source` with each `#include "path"` line replaced
+ *  by the file at SHADER_INCLUDE_ROOT/path, recursively
+ *  @return 0 on success, -1 on failure
+ */
+static int _load_source(ShaderSource* source, const char* filename, int depth)
 {
     char*   data = NULL;
     size_t  data_size = 0;
-    GLuint  shader = 0;
-    GLint   compile_status = 0;
-    int     result;
-    GLint   shader_size = 0;
-    GLint   info_length = 0;
+    size_t  line_start = 0;
 
-    result = (int)load_file_data(filename, (void*)&data, &data_size);
-    if(result != 0) {
+    if(depth > MAX_INCLUDE_DEPTH) {
+        system_log("Shader includes nested too deep at %s\n", filename);
+        return -1;
+    }
+    if(load_file_data(filename, (void*)&data, &data_size) != 0) {
         system_log("Loading shader %s failed", filename);
-        return 0;
+        return -1;
+    }
+    while(line_start < data_size) {
+        const char* line = data + line_start;
+        const char* end = (const char*)memchr(line, '\n', data_size - line_start);
+        size_t line_size = end ? (size_t)(end - line) + 1 : data_size - line_start;
+        const char* directive = line;
+        while(directive < line + line_size && (*directive == ' ' || *directive == '\t'))
+            ++directive;
+
+        if(line_size - (directive - line) > 8 && strncmp(directive, "#include", 8) == 0) {
+            const char* open = (const char*)memchr(directive, '"', line_size - (directive - line));
+            const char* close = open ? (const char*)memchr(open+1, '"', line_size - (open+1 - line)) : NULL;
+            char path[256];
+            if(close == NULL || close - open - 1 + sizeof(SHADER_INCLUDE_ROOT) > sizeof(path)) {
+                system_log("Bad #include in %s: %.*s\n", filename, (int)line_size, line);
+                free_file_data(data);
+                return -1;
+            }
+            sprintf(path, "%s%.*s", SHADER_INCLUDE_ROOT, (int)(close - open - 1), open+1);
+            if(_load_source(source, path, depth+1) != 0) {
+                free_file_data(data);
+                return -1;
+            }
+            /* Included files may not end in a newline */
+            _append_source(source, "\n", 1);
+        } else {
+            _append_source(source, line, line_size);
+        }
+        line_start += line_size;
+    }
+    free_file_data(data);
+    return 0;
+}
+/** Hands the source to the driver without waiting for the result, which
+ *  _check_shader reads
+ */
+static GLuint _compile_shader(GLenum type, const char* data, size_t data_size,
+                              const char* defines)
+{
+    const char* sources[3];
+    GLint   source_sizes[3];
+    int     num_sources = 0;
+    GLuint  shader = 0;
+    GLint   shader_size = (GLint)data_size;
+
+    /* Defines go after the #version line, which has to come first */
+    if(defines && strncmp(data, "#version", 8) == 0) {
+        const char* end = (const char*)memchr(data, '\n', data_size);
+        GLint version_size = end ? (GLint)(end - data) + 1 : shader_size;
+        sources[num_sources] = data;
+        source_sizes[num_sources++] = version_size;
+        sources[num_sources] = defines;
+        source_sizes[num_sources++] = (GLint)strlen(defines);
+        sources[num_sources] = data + version_size;
+        source_sizes[num_sources++] = shader_size - version_size;
+    } else {
+        if(defines) {
+            sources[num_sources] = defines;
+            source_sizes[num_sources++] = (GLint)strlen(defines);
+        }
+        sources[num_sources] = data;
+        source_sizes[num_sources++] = shader_size;
     }
-    assert(result == 0);
-    shader_size = (GLint)data_size;
 
     shader = glCreateShader(type);
-    ASSERT_GL(glShaderSource(shader, 1, (const char**)&data, &shader_size));
+    ASSERT_GL(glShaderSource(shader, num_sources, sources, source_sizes));
     ASSERT_GL(glCompileShader(shader));
+    return shader;
+}
+/** @return 0 if `shader` compiled, -1 after logging the error */
+static int _check_shader(GLuint shader, const char* filename)
+{
+    GLint   compile_status = 0;
+    GLint   info_length = 0;
+
     ASSERT_GL(glGetShaderiv(shader, GL_COMPILE_STATUS, &compile_status));
     if(compile_status == GL_FALSE) {
         char message[1024] = {0};
         ASSERT_GL(glGetShaderInfoLog(shader, sizeof(message), 0, message));
         system_log("Error compiling %s: %s", filename, message);
-        assert(compile_status != GL_FALSE);
-        free_file_data(data);
-        return 0;
+        return -1;
     }
     ASSERT_GL(glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_length));
     if(info_length > 0) {
@@ -65,58 +352,599 @@ static GLuint _load_shader(const char* filename, GLenum type)
         ASSERT_GL(glGetShaderInfoLog(shader, sizeof(info_log), NULL, info_log));
         system_log("Info compiling %s: %s", filename, info_log);
     }
-
-    free_file_data(data);
-
-    return shader;
+    return 0;
 }
-
-/* External functions
-// */
-Program create_program(const char* vertex_shader_filename,
-                       const char* fragment_shader_filename,
-                       const AttributeSlot* slots)
+/** Starts linking `program` from the shaders, without waiting for it */
+static void _link_program(GLuint program, GLuint vertex_shader, GLuint fragment_shader,
+                          const AttributeSlot* slots,
+                          const char* const* varyings,
+                          int num_varyings)
 {
-    GLuint  vertex_shader;
-    GLuint  fragment_shader;
-    GLuint  program;
-    GLint   link_status;
-
-    /* Compile shaders */
-    vertex_shader = _load_shader(vertex_shader_filename, GL_VERTEX_SHADER);
-    fragment_shader = _load_shader(fragment_shader_filename, GL_FRAGMENT_SHADER);
-
-    /* Create program */
-    program = glCreateProgram();
     ASSERT_GL(glAttachShader(program, vertex_shader));
     ASSERT_GL(glAttachShader(program, fragment_shader));
     while(slots && *slots != kEmptySlot) {
         ASSERT_GL(glBindAttribLocation(program, *slots,    kAttributeSlotNames[*slots]));
         ++slots;
     }
+    /* Captured outputs have to be chosen before linking */
+    if(num_varyings > 0)
+        ASSERT_GL(glTransformFeedbackVaryings(program, num_varyings, varyings, GL_INTERLEAVED_ATTRIBS));
     ASSERT_GL(glLinkProgram(program));
+}
+/** Asks the driver to compile on its own threads, when it can. Compiles
+ *  then return at once and only the status queries wait.
+ */
+static void _enable_parallel_compile(void)
+{
+    const char* extensions;
+    if(_parallel_compile_checked)
+        return;
+    _parallel_compile_checked = 1;
+    extensions = (const char*)glGetString(GL_EXTENSIONS);
+    if(extensions == NULL || strstr(extensions, "GL_KHR_parallel_shader_compile") == NULL)
+        return;
+#if defined(__ANDROID__)
+    {
+        PFNGLMAXSHADERCOMPILERTHREADSKHRPROC max_threads =
+            (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+        if(max_threads) {
+            /* 0xFFFFFFFF lets the driver pick */
+            max_threads(0xFFFFFFFF);
+            glGetError();
+            system_log("Parallel shader compilation enabled\n");
+        }
+    }
+#endif
+}
+/** Loads both shaders through the preprocessor and keys the program by
+ *  everything that goes into the link, so edited shaders and new drivers
+ *  get new keys
+ *  @return 0 on success, -1 if a file fails to load
+ */
+static int _load_program(const char* vertex_shader_filename,
+                         const char* fragment_shader_filename,
+                         const AttributeSlot* slots,
+                         const char* defines,
+                         const char* const* varyings,
+                         int num_varyings,
+                         ShaderSource* vertex_source,
+                         ShaderSource* fragment_source,
+                         uint32_t* key)
+{
+    int ii;
+
+    if(_load_source(vertex_source, vertex_shader_filename, 0) != 0
+       || _load_source(fragment_source, fragment_shader_filename, 0) != 0) {
+        free(vertex_source->data);
+        free(fragment_source->data);
+        return -1;
+    }
+    _program_binaries_supported();
+    key[0] = _driver_key[0];
+    key[1] = _driver_key[1];
+    _hash_data(key, vertex_source->data, vertex_source->size);
+    _hash_data(key, fragment_source->data, fragment_source->size);
+    _hash_string(key, defines);
+    for(ii=0;slots && slots[ii] != kEmptySlot;++ii)
+        _hash_data(key, &slots[ii], sizeof(slots[ii]));
+    for(ii=0;ii<num_varyings;++ii)
+        _hash_string(key, varyings[ii]);
+    return 0;
+}
+/** Takes a cached binary, or compiles and links the loaded sources, and
+ *  frees them. Nothing waits on the driver, _finish_program checks the result.
+ */
+static void _submit_program(PendingProgram* pending,
+                            const char* vertex_shader_filename,
+                            const char* fragment_shader_filename,
+                            const AttributeSlot* slots,
+                            const char* defines,
+                            const char* const* varyings,
+                            int num_varyings,
+                            ShaderSource* vertex_source,
+                            ShaderSource* fragment_source)
+{
+    int use_cache = _program_binaries_supported();
+    GLuint program = 0;
+
+    _enable_parallel_compile();
+    snprintf(pending->vertex_shader_filename, sizeof(pending->vertex_shader_filename), "%s", vertex_shader_filename);
+    snprintf(pending->fragment_shader_filename, sizeof(pending->fragment_shader_filename), "%s", fragment_shader_filename);
+    pending->vertex_shader = 0;
+    pending->fragment_shader = 0;
+
+    if(use_cache)
+        program = _load_program_binary(pending->key);
+    pending->cached = program != 0;
+    pending->program = program;
+    if(program) {
+        free(vertex_source->data);
+        free(fragment_source->data);
+        return;
+    }
+
+    /* Compile shaders */
+    pending->vertex_shader = _compile_shader(GL_VERTEX_SHADER, vertex_source->data, vertex_source->size, defines);
+    pending->fragment_shader = _compile_shader(GL_FRAGMENT_SHADER, fragment_source->data, fragment_source->size, defines);
+    free(vertex_source->data);
+    free(fragment_source->data);
+
+    /* Create program */
+    program = glCreateProgram();
+    if(use_cache)
+        ASSERT_GL(glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE));
+    _link_program(program, pending->vertex_shader, pending->fragment_shader,
+                  slots, varyings, num_varyings);
+    pending->program = program;
+}
+/** Waits for a submitted program and reports each file that failed
+ *  @return The program, or 0 if it failed
+ */
+static Program _finish_program(PendingProgram* pending)
+{
+    GLuint  program = pending->program;
+    GLint   link_status;
+    int     failed = 0;
+
+    /* Loaded from the cache, already checked */
+    if(pending->cached)
+        return program;
+
+    if(_check_shader(pending->vertex_shader, pending->vertex_shader_filename) != 0)
+        failed = 1;
+    if(_check_shader(pending->fragment_shader, pending->fragment_shader_filename) != 0)
+        failed = 1;
+    /* Compile errors are logged by _check_shader, callers fall back on 0 */
     ASSERT_GL(glGetProgramiv(program, GL_LINK_STATUS, &link_status));
-    if(link_status == GL_FALSE) {
+    if(!failed && link_status == GL_FALSE) {
         char message[1024];
         ASSERT_GL(glGetProgramInfoLog(program, sizeof(message), 0, message));
-        system_log("Creating program: %s--%s failed: %s\n", vertex_shader_filename, fragment_shader_filename, message);
+        system_log("Creating program: %s--%s failed: %s\n", pending->vertex_shader_filename, pending->fragment_shader_filename, message);
         //assert(link_status != GL_FALSE);
-        ASSERT_GL(glDetachShader(program, fragment_shader));
-        ASSERT_GL(glDetachShader(program, vertex_shader));
-        ASSERT_GL(glDeleteShader(fragment_shader));
-        ASSERT_GL(glDeleteShader(vertex_shader));
+        failed = 1;
+    }
+    ASSERT_GL(glDetachShader(program, pending->fragment_shader));
+    ASSERT_GL(glDetachShader(program, pending->vertex_shader));
+    ASSERT_GL(glDeleteShader(pending->fragment_shader));
+    ASSERT_GL(glDeleteShader(pending->vertex_shader));
+    if(failed) {
         ASSERT_GL(glDeleteProgram(program));
         return 0;
     }
-    ASSERT_GL(glDetachShader(program, fragment_shader));
-    ASSERT_GL(glDetachShader(program, vertex_shader));
+
+    if(_program_binaries_supported())
+        _save_program_binary(program, pending->key);
+
+    return program;
+}
+static void _queue_program(const char* vertex_shader_filename,
+                           const char* fragment_shader_filename,
+                           const AttributeSlot* slots,
+                           const char* defines,
+                           const char* const* varyings,
+                           int num_varyings)
+{
+    ShaderSource vertex_source = {NULL, 0, 0};
+    ShaderSource fragment_source = {NULL, 0, 0};
+    PendingProgram* pending;
+    uint32_t key[2];
+    int ii;
+
+    if(_load_program(vertex_shader_filename, fragment_shader_filename, slots, defines,
+                     varyings, num_varyings, &vertex_source, &fragment_source, key) != 0)
+        return;
+    for(ii=0;ii<_num_pending;++ii) {
+        if(_pending[ii].key[0] == key[0] && _pending[ii].key[1] == key[1]) {
+            free(vertex_source.data);
+            free(fragment_source.data);
+            return;
+        }
+    }
+    _pending = (PendingProgram*)realloc(_pending, (_num_pending+1)*sizeof(PendingProgram));
+    pending = &_pending[_num_pending++];
+    pending->key[0] = key[0];
+    pending->key[1] = key[1];
+    _submit_program(pending, vertex_shader_filename, fragment_shader_filename, slots, defines,
+                    varyings, num_varyings, &vertex_source, &fragment_source);
+}
+static void _register_program(Program program, const uint32_t* key,
+                              const char* vertex_shader_filename,
+                              const char* fragment_shader_filename,
+                              const AttributeSlot* slots,
+                              const char* defines,
+                              const char* const* varyings,
+                              int num_varyings)
+{
+    LiveProgram* live;
+    int ii;
+
+    _live = (LiveProgram*)realloc(_live, (_num_live+1)*sizeof(LiveProgram));
+    live = &_live[_num_live++];
+    live->program = program;
+    live->key[0] = key[0];
+    live->key[1] = key[1];
+    snprintf(live->vertex_shader_filename, sizeof(live->vertex_shader_filename), "%s", vertex_shader_filename);
+    snprintf(live->fragment_shader_filename, sizeof(live->fragment_shader_filename), "%s", fragment_shader_filename);
+    for(ii=0;slots && slots[ii] != kEmptySlot;++ii) {
+        assert(ii < MAX_PROGRAM_SLOTS-1);
+        live->slots[ii] = slots[ii];
+    }
+    live->slots[ii] = kEmptySlot;
+    live->defines = NULL;
+    if(defines) {
+        live->defines = (char*)malloc(strlen(defines)+1);
+        strcpy(live->defines, defines);
+    }
+    live->varyings = varyings;
+    live->num_varyings = num_varyings;
+    live->uniforms = NULL;
+    live->num_uniforms = 0;
+}
+static LiveProgram* _find_live_program(Program program)
+{
+    int ii;
+    if(_last_live < _num_live && _live[_last_live].program == program)
+        return &_live[_last_live];
+    for(ii=0;ii<_num_live;++ii) {
+        if(_live[ii].program == program) {
+            _last_live = ii;
+            return &_live[ii];
+        }
+    }
+    return NULL;
+}
+/** Records `value` as the uniform's value, unless it already is
+ *  @return 1 if the upload can be skipped
+ */
+static int _uniform_unchanged(Program program, GLint location, const void* value, size_t size)
+{
+    LiveProgram* live;
+    UniformShadow* shadow = NULL;
+    int ii;
+
+    if(location == -1 || size > MAX_SHADOWED_UNIFORM_SIZE)
+        return 0;
+    live = _find_live_program(program);
+    if(live == NULL)
+        return 0;
+    for(ii=0;ii<live->num_uniforms;++ii) {
+        if(live->uniforms[ii].location == location) {
+            shadow = &live->uniforms[ii];
+            break;
+        }
+    }
+    if(shadow && shadow->size == size && memcmp(shadow->value, value, size) == 0) {
+        _skipped_uploads++;
+        return 1;
+    }
+    if(shadow == NULL) {
+        live->uniforms = (UniformShadow*)realloc(live->uniforms, (live->num_uniforms+1)*sizeof(UniformShadow));
+        shadow = &live->uniforms[live->num_uniforms++];
+        shadow->location = location;
+    }
+    shadow->size = size;
+    memcpy(shadow->value, value, size);
+    return 0;
+}
+/** Builds `live` again from its files, if they changed. The program keeps
+ *  its name, and keeps its old executable if the new one fails to build.
+ *  @return 1 if it was relinked
+ */
+static int _reload_program(LiveProgram* live)
+{
+    ShaderSource vertex_source = {NULL, 0, 0};
+    ShaderSource fragment_source = {NULL, 0, 0};
+    uint32_t key[2];
+    GLuint  vertex_shader;
+    GLuint  fragment_shader;
+    GLuint  test_program;
+    GLint   link_status = GL_FALSE;
+    int     failed = 0;
+
+    if(_load_program(live->vertex_shader_filename, live->fragment_shader_filename, live->slots,
+                     live->defines, live->varyings, live->num_varyings,
+                     &vertex_source, &fragment_source, key) != 0)
+        return 0;
+    if(key[0] == live->key[0] && key[1] == live->key[1]) {
+        free(vertex_source.data);
+        free(fragment_source.data);
+        return 0;
+    }
+
+    vertex_shader = _compile_shader(GL_VERTEX_SHADER, vertex_source.data, vertex_source.size, live->defines);
+    fragment_shader = _compile_shader(GL_FRAGMENT_SHADER, fragment_source.data, fragment_source.size, live->defines);
+    free(vertex_source.data);
+    free(fragment_source.data);
+    if(_check_shader(vertex_shader, live->vertex_shader_filename) != 0)
+        failed = 1;
+    if(_check_shader(fragment_shader, live->fragment_shader_filename) != 0)
+        failed = 1;
+
+    /* A failed link loses the executable, so it's tried on a scratch program first */
+    if(!failed) {
+        test_program = glCreateProgram();
+        _link_program(test_program, vertex_shader, fragment_shader,
+                      live->slots, live->varyings, live->num_varyings);
+        ASSERT_GL(glGetProgramiv(test_program, GL_LINK_STATUS, &link_status));
+        if(link_status == GL_FALSE) {
+            char message[1024];
+            ASSERT_GL(glGetProgramInfoLog(test_program, sizeof(message), 0, message));
+            system_log("Reloading program: %s--%s failed: %s\n", live->vertex_shader_filename, live->fragment_shader_filename, message);
+            failed = 1;
+        }
+        ASSERT_GL(glDetachShader(test_program, fragment_shader));
+        ASSERT_GL(glDetachShader(test_program, vertex_shader));
+        ASSERT_GL(glDeleteProgram(test_program));
+    }
+    if(!failed) {
+        _link_program(live->program, vertex_shader, fragment_shader,
+                      live->slots, live->varyings, live->num_varyings);
+        ASSERT_GL(glDetachShader(live->program, fragment_shader));
+        ASSERT_GL(glDetachShader(live->program, vertex_shader));
+    }
     ASSERT_GL(glDeleteShader(fragment_shader));
     ASSERT_GL(glDeleteShader(vertex_shader));
+    if(failed) {
+        system_log("Keeping the old %s--%s\n", live->vertex_shader_filename, live->fragment_shader_filename);
+        return 0;
+    }
+
+    live->key[0] = key[0];
+    live->key[1] = key[1];
+    /* Linking reset every uniform */
+    live->num_uniforms = 0;
+    if(_program_binaries_supported())
+        _save_program_binary(live->program, live->key);
+    system_log("Reloaded %s--%s\n", live->vertex_shader_filename, live->fragment_shader_filename);
+    return 1;
+}
+static Program _create_program(const char* vertex_shader_filename,
+                               const char* fragment_shader_filename,
+                               const AttributeSlot* slots,
+                               const char* defines,
+                               const char* const* varyings,
+                               int num_varyings)
+{
+    ShaderSource vertex_source = {NULL, 0, 0};
+    ShaderSource fragment_source = {NULL, 0, 0};
+    PendingProgram pending;
+    Program program;
+    int submitted = 0;
+    int ii;
+
+    if(_load_program(vertex_shader_filename, fragment_shader_filename, slots, defines,
+                     varyings, num_varyings, &vertex_source, &fragment_source, pending.key) != 0)
+        return 0;
 
+    /* Submitted earlier, its compile has been running since */
+    for(ii=0;ii<_num_pending;++ii) {
+        if(_pending[ii].key[0] == pending.key[0] && _pending[ii].key[1] == pending.key[1]) {
+            pending = _pending[ii];
+            _pending[ii] = _pending[--_num_pending];
+            free(vertex_source.data);
+            free(fragment_source.data);
+            submitted = 1;
+            break;
+        }
+    }
+    if(!submitted)
+        _submit_program(&pending, vertex_shader_filename, fragment_shader_filename, slots, defines,
+                        varyings, num_varyings, &vertex_source, &fragment_source);
+    program = _finish_program(&pending);
+    if(program)
+        _register_program(program, pending.key, vertex_shader_filename, fragment_shader_filename,
+                          slots, defines, varyings, num_varyings);
     return program;
 }
 
+/* External functions
+// */
+Program create_program(const char* vertex_shader_filename,
+                       const char* fragment_shader_filename,
+                       const AttributeSlot* slots)
+{
+    return create_program_with_defines(vertex_shader_filename, fragment_shader_filename, slots, NULL);
+}
+Program create_program_with_defines(const char* vertex_shader_filename,
+                                    const char* fragment_shader_filename,
+                                    const AttributeSlot* slots,
+                                    const char* defines)
+{
+    return _create_program(vertex_shader_filename, fragment_shader_filename, slots, defines, NULL, 0);
+}
+Program create_feedback_program(const char* vertex_shader_filename,
+                                const char* fragment_shader_filename,
+                                const AttributeSlot* slots,
+                                const char* const* varyings,
+                                int num_varyings)
+{
+    return _create_program(vertex_shader_filename, fragment_shader_filename, slots, NULL, varyings, num_varyings);
+}
+
 void destroy_program(Program program)
 {
+    int ii;
+    for(ii=0;ii<_num_live;++ii) {
+        if(_live[ii].program == program) {
+            free(_live[ii].defines);
+            free(_live[ii].uniforms);
+            _live[ii] = _live[--_num_live];
+            break;
+        }
+    }
     glDeleteProgram(program);
 }
+int reload_changed_programs(void)
+{
+    int num_reloaded = 0;
+    int ii;
+    for(ii=0;ii<_num_live;++ii)
+        num_reloaded += _reload_program(&_live[ii]);
+    return num_reloaded;
+}
+
+void set_uniform_1i(Program program, int location, int value)
+{
+    if(!_uniform_unchanged(program, location, &value, sizeof(value)))
+        ASSERT_GL(glUniform1i(location, value));
+}
+void set_uniform_1f(Program program, int location, float value)
+{
+    if(!_uniform_unchanged(program, location, &value, sizeof(value)))
+        ASSERT_GL(glUniform1f(location, value));
+}
+void set_uniform_1fv(Program program, int location, int count, const float* value)
+{
+    if(!_uniform_unchanged(program, location, value, count*sizeof(float)))
+        ASSERT_GL(glUniform1fv(location, count, value));
+}
+void set_uniform_2fv(Program program, int location, int count, const float* value)
+{
+    if(!_uniform_unchanged(program, location, value, count*2*sizeof(float)))
+        ASSERT_GL(glUniform2fv(location, count, value));
+}
+void set_uniform_3fv(Program program, int location, int count, const float* value)
+{
+    if(!_uniform_unchanged(program, location, value, count*3*sizeof(float)))
+        ASSERT_GL(glUniform3fv(location, count, value));
+}
+void set_uniform_4fv(Program program, int location, int count, const float* value)
+{
+    if(!_uniform_unchanged(program, location, value, count*4*sizeof(float)))
+        ASSERT_GL(glUniform4fv(location, count, value));
+}
+void set_uniform_matrix4fv(Program program, int location, int count, const float* value)
+{
+    if(!_uniform_unchanged(program, location, value, count*16*sizeof(float)))
+        ASSERT_GL(glUniformMatrix4fv(location, count, GL_FALSE, value));
+}
+int skipped_uniform_uploads(void)
+{
+    int skipped = _skipped_uploads;
+    _skipped_uploads = 0;
+    return skipped;
+}
+
+void submit_program(const char* vertex_shader_filename,
+                    const char* fragment_shader_filename,
+                    const AttributeSlot* slots)
+{
+    _queue_program(vertex_shader_filename, fragment_shader_filename, slots, NULL, NULL, 0);
+}
+void submit_program_with_defines(const char* vertex_shader_filename,
+                                 const char* fragment_shader_filename,
+                                 const AttributeSlot* slots,
+                                 const char* defines)
+{
+    _queue_program(vertex_shader_filename, fragment_shader_filename, slots, defines, NULL, 0);
+}
+void submit_feedback_program(const char* vertex_shader_filename,
+                             const char* fragment_shader_filename,
+                             const AttributeSlot* slots,
+                             const char* const* varyings,
+                             int num_varyings)
+{
+    _queue_program(vertex_shader_filename, fragment_shader_filename, slots, NULL, varyings, num_varyings);
+}
+void finish_submitted_programs(void)
+{
+    int ii;
+    for(ii=0;ii<_num_pending;++ii) {
+        system_log("Submitted program %s--%s was never created\n",
+                   _pending[ii].vertex_shader_filename, _pending[ii].fragment_shader_filename);
+        destroy_program(_finish_program(&_pending[ii]));
+    }
+    free(_pending);
+    _pending = NULL;
+    _num_pending = 0;
+}
+
+/** The "#define" lines of the features in `mask`
+ *  @return The length of `defines`
+ */
+static size_t _permutation_defines(const char* const* features, int num_features, uint32_t mask,
+                                   char* defines, size_t size)
+{
+    size_t length = 0;
+    int ii;
+    defines[0] = '\0';
+    for(ii=0;ii<num_features;++ii) {
+        if(mask & (1u << ii)) {
+            length += snprintf(defines+length, size-length, "#define %s\n", features[ii]);
+            assert(length < size);
+        }
+    }
+    return length;
+}
+void submit_program_permutations(const char* vertex_shader_filename,
+                                 const char* fragment_shader_filename,
+                                 const AttributeSlot* slots,
+                                 const char* const* features,
+                                 int num_features,
+                                 const uint32_t* masks,
+                                 int num_masks)
+{
+    char    defines[MAX_PERMUTATION_DEFINES];
+    int     ii;
+    for(ii=0;ii<num_masks;++ii) {
+        size_t length = _permutation_defines(features, num_features, masks[ii], defines, sizeof(defines));
+        _queue_program(vertex_shader_filename, fragment_shader_filename, slots,
+                       length ? defines : NULL, NULL, 0);
+    }
+}
+ProgramPermutations* create_program_permutations(const char* vertex_shader_filename,
+                                                 const char* fragment_shader_filename,
+                                                 const AttributeSlot* slots,
+                                                 const char* const* features,
+                                                 int num_features)
+{
+    ProgramPermutations* P = (ProgramPermutations*)calloc(1, sizeof(*P));
+    int num_slots = 0;
+    assert(num_features <= 32);
+    while(slots && slots[num_slots] != kEmptySlot)
+        ++num_slots;
+    /* Callers build their slot lists on the stack */
+    P->slots = (AttributeSlot*)malloc((num_slots+1)*sizeof(AttributeSlot));
+    memcpy(P->slots, slots, num_slots*sizeof(AttributeSlot));
+    P->slots[num_slots] = kEmptySlot;
+
+    P->vertex_shader_filename = vertex_shader_filename;
+    P->fragment_shader_filename = fragment_shader_filename;
+    P->features = features;
+    P->num_features = num_features;
+    return P;
+}
+void destroy_program_permutations(ProgramPermutations* P)
+{
+    int ii;
+    if(P == NULL)
+        return;
+    for(ii=0;ii<P->num_permutations;++ii)
+        destroy_program(P->permutations[ii].program);
+    free(P->permutations);
+    free(P->slots);
+    free(P);
+}
+Program program_permutation(ProgramPermutations* P, uint32_t features)
+{
+    char    defines[MAX_PERMUTATION_DEFINES];
+    size_t  length;
+    Program program;
+    int     ii;
+
+    for(ii=0;ii<P->num_permutations;++ii) {
+        if(P->permutations[ii].features == features)
+            return P->permutations[ii].program;
+    }
+
+    /* First use, compile it, or take it over if it was submitted */
+    length = _permutation_defines(P->features, P->num_features, features, defines, sizeof(defines));
+    program = create_program_with_defines(P->vertex_shader_filename, P->fragment_shader_filename,
+                                          P->slots, length ? defines : NULL);
+
+    P->permutations = (Permutation*)realloc(P->permutations, (P->num_permutations+1)*sizeof(Permutation));
+    P->permutations[P->num_permutations].features = features;
+    P->permutations[P->num_permutations].program = program;
+    P->num_permutations++;
+    return program;
+}
@@ -10,9 +10,107 @@
 
 typedef uint32_t Program;
 
+/** @brief Compiles and links a shader pair, loaded through a preprocessor:
+ *      `#include "path"` lines are replaced by the file at shaders/path.
+ *  On ES 3.0 linked programs are cached as binaries between launches.
+ *  @return The program, or 0 after logging the compile or link errors
+ */
 Program create_program(const char* vertex_shader_filename,
                        const char* fragment_shader_filename,
                        const AttributeSlot* slots);
+/** @brief Same as create_program, with `defines` (GLSL source, one
+ *      "#define" per line) inserted at the top of both shaders, after any
+ *      #version line.
+ */
+Program create_program_with_defines(const char* vertex_shader_filename,
+                                    const char* fragment_shader_filename,
+                                    const AttributeSlot* slots,
+                                    const char* defines);
+/** @brief Same as create_program, with the vertex shader outputs named in
+ *      `varyings` captured interleaved by transform feedback. Requires
+ *      OpenGL ES 3.0.
+ */
+Program create_feedback_program(const char* vertex_shader_filename,
+                                const char* fragment_shader_filename,
+                                const AttributeSlot* slots,
+                                const char* const* varyings,
+                                int num_varyings);
 void destroy_program(Program program);
+/** @brief Rebuilds every program whose files, includes among them, changed
+ *      since it was built. Programs keep their names and are relinked in
+ *      place, which moves their uniforms and resets their values, so owners
+ *      look them up again. A program that fails to build keeps the old one.
+ *  The varyings of feedback programs have to outlive them.
+ *  @return The number of programs relinked
+ */
+int reload_changed_programs(void);
+
+/** @brief glUniform* for `program`, which has to be the one in use. The
+ *      upload is skipped when the location already holds the value, as
+ *      last set through these. Locations set with these shouldn't also be
+ *      set with plain glUniform calls, the shadow wouldn't see them.
+ *  Matrices aren't transposed. Arrays larger than a Mat4 aren't shadowed.
+ */
+void set_uniform_1i(Program program, int location, int value);
+void set_uniform_1f(Program program, int location, float value);
+void set_uniform_1fv(Program program, int location, int count, const float* value);
+void set_uniform_2fv(Program program, int location, int count, const float* value);
+void set_uniform_3fv(Program program, int location, int count, const float* value);
+void set_uniform_4fv(Program program, int location, int count, const float* value);
+void set_uniform_matrix4fv(Program program, int location, int count, const float* value);
+/** @return The uploads the set_uniform functions skipped since the last
+ *      call, so a call per frame counts each frame's
+ */
+int skipped_uniform_uploads(void);
+
+/** @brief Starts compiling and linking a program without waiting for it.
+ *      The create_program call with the same arguments takes it over and
+ *      checks the result, so a startup set can be submitted up front and
+ *      compile, on the driver's threads with KHR_parallel_shader_compile,
+ *      while other work goes on.
+ */
+void submit_program(const char* vertex_shader_filename,
+                    const char* fragment_shader_filename,
+                    const AttributeSlot* slots);
+void submit_program_with_defines(const char* vertex_shader_filename,
+                                 const char* fragment_shader_filename,
+                                 const AttributeSlot* slots,
+                                 const char* defines);
+void submit_feedback_program(const char* vertex_shader_filename,
+                             const char* fragment_shader_filename,
+                             const AttributeSlot* slots,
+                             const char* const* varyings,
+                             int num_varyings);
+/** @brief Reports and deletes the submitted programs no create call took */
+void finish_submitted_programs(void);
+
+/** @brief The programs built from one shader pair with any combination of
+ *      up to 32 optional features. Each feature is the text of a "#define"
+ *      line, like "NORMAL_MAP" or "NUM_LIGHTS 4", and is bit n of the feature
+ *      mask when it's features[n]. A permutation is compiled the first time
+ *      its mask is asked for, and kept until the set is destroyed.
+ *  `features` and the file names aren't copied.
+ */
+typedef struct ProgramPermutations ProgramPermutations;
+
+ProgramPermutations* create_program_permutations(const char* vertex_shader_filename,
+                                                 const char* fragment_shader_filename,
+                                                 const AttributeSlot* slots,
+                                                 const char* const* features,
+                                                 int num_features);
+void destroy_program_permutations(ProgramPermutations* P);
+/** @return The program with the features in `features`, 0 if it fails to build */
+Program program_permutation(ProgramPermutations* P, uint32_t features);
+/** @brief Starts compiling the permutation for each of `masks`, see
+ *      submit_program. program_permutation on a set with the same files,
+ *      slots and features takes them over.
+ */
+void submit_program_permutations(const char* vertex_shader_filename,
+                                 const char* fragment_shader_filename,
+                                 const AttributeSlot* slots,
+                                 const char* const* features,
+                                 int num_features,
+                                 const uint32_t* masks,
+                                 int num_masks);
 
 #endif /* include guard */
@@ -26,6 +26,7 @@ typedef struct Model
     Transform   transform;
     Mesh*       mesh;
     Material*   material;
+    int         dynamic; /* Moves at runtime, kept out of cached shadows */
 } Model;
 
 Scene* create_scene(const char* filename);
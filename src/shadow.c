@@ -0,0 +1,487 @@
+/*! @file shadow.c
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#include "shadow.h"
+#include <stdlib.h>
+#include <string.h>
+#include "assert.h"
+#include "mesh.h"
+#include "program.h"
+
+/* Defines
+ */
+#define SPLIT_LAMBDA 0.75f  /* Blend from uniform (0) to logarithmic (1) splits */
+#define CASCADE_MARGIN 0.25f /* Extra coverage, relative to the slice radius, so small camera moves don't refit */
+
+/* Types
+ */
+typedef struct Caster
+{
+    Vec3    position; /* Light space */
+    float   radius;
+    int     model;
+    int     dynamic;
+} Caster;
+
+/** A static caster as the cached static map last drew it */
+typedef struct StaticCaster
+{
+    Transform   transform;
+    Mesh*       mesh;
+} StaticCaster;
+
+typedef struct Cascade
+{
+    Mat4    view_proj; /* World to cascade clip space */
+    float   end; /* View space depth */
+    /* Light space region the cached static map covers */
+    float   min_x, max_x;
+    float   min_y, max_y;
+    float   min_z, max_z;
+    int     valid;
+    int     had_dynamic;
+} Cascade;
+
+struct ShadowMap
+{
+    int     size;
+    int     frame;
+
+    GLuint  static_depth;
+    GLuint  depth;
+    GLuint  framebuffer;
+    GLuint  read_framebuffer;
+
+    GLuint  program;
+    GLuint  u_ViewProj;
+    GLuint  u_World;
+
+    Vec3    light_direction;
+    Mat4    light_view;
+
+    Caster* casters;
+    int     max_casters;
+    int     num_casters;
+
+    StaticCaster*   static_casters;
+    int             max_static_casters;
+    int             num_static_casters;
+
+    Cascade cascades[NUM_SHADOW_CASCADES];
+
+    int     static_cascades_drawn;
+    int     dynamic_cascades_drawn;
+};
+
+/* Constants
+ */
+static const AttributeSlot kSlots[] =
+{
+    kPositionSlot,
+    kEmptySlot
+};
+
+/* Variables
+ */
+
+/* Internal functions
+ */
+static GLuint _create_depth_array(int size, int compare)
+{
+    GLuint texture;
+    GLint filter = compare ? GL_LINEAR : GL_NEAREST;
+    ASSERT_GL(glGenTextures(1, &texture));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D_ARRAY, texture));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    ASSERT_GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    if(compare) {
+        /* Linear filtering of the comparison gives 2x2 PCF for free */
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE));
+        ASSERT_GL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL));
+    }
+    ASSERT_GL(glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, NUM_SHADOW_CASCADES,
+                           0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 0));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+    return texture;
+}
+static void _reserve_casters(ShadowMap* S, int count)
+{
+    if(count <= S->max_casters)
+        return;
+    S->casters = (Caster*)realloc(S->casters, count*sizeof(Caster));
+    S->max_casters = count;
+}
+/** Compares the static models, in order, against the copies the cached
+ *  static map was drawn from, and takes new copies.
+ *  @return Whether any static model changed
+ */
+static int _update_static_casters(ShadowMap* S, const Model* models, int num_models)
+{
+    int changed = 0;
+    int num_static = 0;
+    int ii;
+
+    if(num_models > S->max_static_casters) {
+        S->static_casters = (StaticCaster*)realloc(S->static_casters, num_models*sizeof(StaticCaster));
+        S->max_static_casters = num_models;
+    }
+    for(ii=0;ii<num_models;++ii) {
+        StaticCaster* caster = &S->static_casters[num_static];
+        if(models[ii].dynamic)
+            continue;
+        if(num_static >= S->num_static_casters || caster->mesh != models[ii].mesh ||
+           memcmp(&caster->transform, &models[ii].transform, sizeof(caster->transform)) != 0) {
+            caster->mesh = models[ii].mesh;
+            caster->transform = models[ii].transform;
+            changed = 1;
+        }
+        num_static++;
+    }
+    if(num_static != S->num_static_casters)
+        changed = 1;
+    S->num_static_casters = num_static;
+    return changed;
+}
+/** World to light space. z runs along the light direction.
+ */
+static Mat4 _light_view(Vec3 direction)
+{
+    Vec3 up = vec3_create(0.0f, 1.0f, 0.0f);
+    Vec3 x, y, z;
+    Mat4 m = mat4_identity;
+
+    z = vec3_normalize(direction);
+    if(fabsf(vec3_dot(up, z)) > 0.99f)
+        up = vec3_create(1.0f, 0.0f, 0.0f);
+    x = vec3_normalize(vec3_cross(up, z));
+    y = vec3_cross(z, x);
+
+    m.r0 = vec4_create(x.x, y.x, z.x, 0.0f);
+    m.r1 = vec4_create(x.y, y.y, z.y, 0.0f);
+    m.r2 = vec4_create(x.z, y.z, z.z, 0.0f);
+    return m;
+}
+/** Collects the light space bounding spheres of every model and the bounds
+ *  of the whole scene
+ */
+static void _gather_casters(ShadowMap* S, Mat4 view_matrix, const Model* models, int num_models,
+                             Vec3* scene_min, Vec3* scene_max, float* max_view_z)
+{
+    int ii;
+
+    _reserve_casters(S, num_models);
+    S->num_casters = 0;
+    *scene_min = vec3_create(1e30f, 1e30f, 1e30f);
+    *scene_max = vec3_create(-1e30f, -1e30f, -1e30f);
+    *max_view_z = 0.0f;
+    for(ii=0;ii<num_models;++ii) {
+        Caster* caster = &S->casters[S->num_casters++];
+        Mat4 world = transform_get_matrix(models[ii].transform);
+        Vec4 center;
+        float view_z;
+        Vec3 extent;
+
+        mesh_bounds(models[ii].mesh, &extent, &caster->radius);
+        center = mat4_mul_vector(vec4_from_vec3(extent, 1.0f), world);
+        caster->radius *= models[ii].transform.scale;
+        caster->position = vec3_from_vec4(mat4_mul_vector(center, S->light_view));
+        caster->model = ii;
+        caster->dynamic = models[ii].dynamic;
+
+        extent = vec3_create(caster->radius, caster->radius, caster->radius);
+        *scene_min = vec3_min(*scene_min, vec3_sub(caster->position, extent));
+        *scene_max = vec3_max(*scene_max, vec3_add(caster->position, extent));
+
+        view_z = mat4_mul_vector(center, view_matrix).z + caster->radius;
+        if(view_z > *max_view_z)
+            *max_view_z = view_z;
+    }
+}
+/** Light space bounding sphere of the view frustum between view depths z0
+ *  and z1. It only depends on the projection, so its size stays fixed while
+ *  the camera turns.
+ */
+static void _slice_sphere(Mat4 proj_matrix, Mat4 view_to_light, float z0, float z1,
+                          Vec3* center, float* radius)
+{
+    float tan_x = 1.0f/proj_matrix.r0.x;
+    float tan_y = 1.0f/proj_matrix.r1.y;
+    Vec3 corners[8];
+    Vec3 sum = vec3_create(0.0f, 0.0f, 0.0f);
+    int ii;
+
+    for(ii=0;ii<8;++ii) {
+        float z = (ii & 4) ? z1 : z0;
+        corners[ii].x = ((ii & 1) ? 1.0f : -1.0f)*tan_x*z;
+        corners[ii].y = ((ii & 2) ? 1.0f : -1.0f)*tan_y*z;
+        corners[ii].z = z;
+        sum = vec3_add(sum, corners[ii]);
+    }
+    sum = vec3_div_scalar(sum, 8.0f);
+    *radius = 0.0f;
+    for(ii=0;ii<8;++ii) {
+        float dist = vec3_distance(corners[ii], sum);
+        if(dist > *radius)
+            *radius = dist;
+    }
+    *center = vec3_from_vec4(mat4_mul_vector(vec4_from_vec3(sum, 1.0f), view_to_light));
+}
+static Mat4 _cascade_proj(const Cascade* cascade)
+{
+    float n = cascade->min_z;
+    float f = cascade->max_z;
+    Mat4 m = mat4_ortho_off_center(cascade->min_x, cascade->max_x,
+                                   cascade->min_y, cascade->max_y, n, f);
+    /* Stretch the [0,1] depth range over GL's [-1,1] clip range */
+    m.r2.z = 2.0f/(f-n);
+    m.r3.z = -(f+n)/(f-n);
+    return m;
+}
+static int _caster_overlaps(const Caster* caster, const Cascade* cascade)
+{
+    return caster->position.x + caster->radius > cascade->min_x &&
+           caster->position.x - caster->radius < cascade->max_x &&
+           caster->position.y + caster->radius > cascade->min_y &&
+           caster->position.y - caster->radius < cascade->max_y;
+}
+/** @return The number of casters drawn */
+static int _draw_casters(ShadowMap* S, const Cascade* cascade,
+                         const Model* models, int dynamic)
+{
+    int drawn = 0;
+    int ii;
+    set_uniform_matrix4fv(S->program, S->u_ViewProj, 1, (float*)&cascade->view_proj);
+    for(ii=0;ii<S->num_casters;++ii) {
+        const Caster* caster = &S->casters[ii];
+        Mat4 world_matrix;
+        if(caster->dynamic != dynamic || !_caster_overlaps(caster, cascade))
+            continue;
+        world_matrix = transform_get_matrix(models[caster->model].transform);
+        set_uniform_matrix4fv(S->program, S->u_World, 1, (float*)&world_matrix);
+        draw_mesh(models[caster->model].mesh);
+        drawn++;
+    }
+    return drawn;
+}
+static int _count_dynamic(const ShadowMap* S, const Cascade* cascade)
+{
+    int count = 0;
+    int ii;
+    for(ii=0;ii<S->num_casters;++ii) {
+        if(S->casters[ii].dynamic && _caster_overlaps(&S->casters[ii], cascade))
+            count++;
+    }
+    return count;
+}
+
+/* External functions
+ */
+void submit_shadow_map_programs(void)
+{
+    submit_program("shaders/shadow/vertex.glsl", "shaders/shadow/fragment.glsl", kSlots);
+}
+ShadowMap* create_shadow_map(int size)
+{
+    GLenum none = GL_NONE;
+    ShadowMap* S = (ShadowMap*)calloc(1, sizeof(ShadowMap));
+    int ii;
+
+    S->size = size;
+    S->program = create_program("shaders/shadow/vertex.glsl", "shaders/shadow/fragment.glsl", kSlots);
+    if(S->program == 0) {
+        free(S);
+        return NULL;
+    }
+    resolve_shadow_map_uniforms(S);
+
+    S->static_depth = _create_depth_array(size, 0);
+    S->depth = _create_depth_array(size, 1);
+
+    /* Depth only framebuffers */
+    ASSERT_GL(glGenFramebuffers(1, &S->framebuffer));
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, S->framebuffer));
+    ASSERT_GL(glDrawBuffers(1, &none));
+    ASSERT_GL(glReadBuffer(GL_NONE));
+    ASSERT_GL(glGenFramebuffers(1, &S->read_framebuffer));
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, S->read_framebuffer));
+    ASSERT_GL(glDrawBuffers(1, &none));
+    ASSERT_GL(glReadBuffer(GL_NONE));
+
+    /* Nothing is in shadow until the first update */
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, S->framebuffer));
+    ASSERT_GL(glClearDepthf(1.0f));
+    for(ii=0;ii<NUM_SHADOW_CASCADES;++ii) {
+        ASSERT_GL(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, S->depth, 0, ii));
+        ASSERT_GL(glClear(GL_DEPTH_BUFFER_BIT));
+    }
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+    return S;
+}
+void resolve_shadow_map_uniforms(ShadowMap* S)
+{
+    ASSERT_GL(S->u_ViewProj = glGetUniformLocation(S->program, "u_ViewProj"));
+    ASSERT_GL(S->u_World = glGetUniformLocation(S->program, "u_World"));
+}
+void destroy_shadow_map(ShadowMap* S)
+{
+    if(S == NULL)
+        return;
+    ASSERT_GL(glDeleteFramebuffers(1, &S->framebuffer));
+    ASSERT_GL(glDeleteFramebuffers(1, &S->read_framebuffer));
+    ASSERT_GL(glDeleteTextures(1, &S->static_depth));
+    ASSERT_GL(glDeleteTextures(1, &S->depth));
+    destroy_program(S->program);
+    free(S->casters);
+    free(S->static_casters);
+    free(S);
+}
+void update_shadow_map(ShadowMap* S, Mat4 proj_matrix, Mat4 view_matrix,
+                       Vec3 light_direction, const Model* models, int num_models)
+{
+    Mat4 view_to_light;
+    Vec3 scene_min, scene_max;
+    float near_z = -proj_matrix.r3.z/proj_matrix.r2.z;
+    float far_z = proj_matrix.r3.z/(1.0f - proj_matrix.r2.z);
+    float max_view_z;
+    float prev_end;
+    int static_dirty = 0;
+    int scheduled;
+    int ii;
+
+    S->static_cascades_drawn = 0;
+    S->dynamic_cascades_drawn = 0;
+
+    if(!vec3_equal(light_direction, S->light_direction)) {
+        S->light_direction = light_direction;
+        S->light_view = _light_view(light_direction);
+        static_dirty = 1;
+    }
+    _gather_casters(S, view_matrix, models, num_models,
+                    &scene_min, &scene_max, &max_view_z);
+    /* Any static model moving, turning or changing mesh invalidates the cache */
+    if(_update_static_casters(S, models, num_models))
+        static_dirty = 1;
+    if(S->num_casters == 0)
+        return;
+
+    /* Only cover the part of the view that has geometry in it */
+    if(max_view_z < far_z)
+        far_z = max_view_z;
+    if(far_z <= near_z)
+        far_z = near_z + 1.0f;
+
+    /* The nearest cascade updates its dynamic casters every other frame, the
+     * others share the remaining frames
+     */
+    if(S->frame % 2 == 0 || NUM_SHADOW_CASCADES == 1)
+        scheduled = 0;
+    else
+        scheduled = 1 + (S->frame/2) % (NUM_SHADOW_CASCADES-1);
+    S->frame++;
+
+    view_to_light = mat4_multiply(mat4_inverse(view_matrix), S->light_view);
+
+    ASSERT_GL(glUseProgram(S->program));
+    ASSERT_GL(glViewport(0, 0, S->size, S->size));
+    ASSERT_GL(glDisable(GL_CULL_FACE));
+    ASSERT_GL(glEnable(GL_POLYGON_OFFSET_FILL));
+    ASSERT_GL(glPolygonOffset(2.0f, 4.0f));
+    ASSERT_GL(glDepthMask(GL_TRUE));
+    ASSERT_GL(glDepthFunc(GL_LESS));
+
+    prev_end = near_z;
+    for(ii=0;ii<NUM_SHADOW_CASCADES;++ii) {
+        Cascade* cascade = &S->cascades[ii];
+        float t = (ii+1)/(float)NUM_SHADOW_CASCADES;
+        float log_split = near_z*powf(far_z/near_z, t);
+        float uniform_split = near_z + (far_z-near_z)*t;
+        float min_x, max_x, min_y, max_y;
+        float radius;
+        Vec3 center;
+        int refit;
+        int num_dynamic;
+
+        cascade->end = uniform_split + (log_split-uniform_split)*SPLIT_LAMBDA;
+        _slice_sphere(proj_matrix, view_to_light, prev_end, cascade->end, &center, &radius);
+        prev_end = cascade->end;
+
+        /* Region this cascade has to cover, clipped to the scene */
+        min_x = fmaxf(center.x - radius, scene_min.x);
+        max_x = fminf(center.x + radius, scene_max.x);
+        min_y = fmaxf(center.y - radius, scene_min.y);
+        max_y = fminf(center.y + radius, scene_max.y);
+
+        refit = static_dirty || !cascade->valid ||
+                min_x < cascade->min_x || max_x > cascade->max_x ||
+                min_y < cascade->min_y || max_y > cascade->max_y ||
+                scene_min.z < cascade->min_z || scene_max.z > cascade->max_z;
+
+        if(refit) {
+            float margin = radius*CASCADE_MARGIN;
+            float texel = 2.0f*(radius+margin)/S->size;
+
+            /* Snap to texels so refits don't make the shadow edges swim */
+            cascade->min_x = floorf(fmaxf(min_x - margin, scene_min.x)/texel)*texel;
+            cascade->max_x = ceilf(fminf(max_x + margin, scene_max.x)/texel)*texel;
+            cascade->min_y = floorf(fmaxf(min_y - margin, scene_min.y)/texel)*texel;
+            cascade->max_y = ceilf(fminf(max_y + margin, scene_max.y)/texel)*texel;
+            if(cascade->max_x <= cascade->min_x)
+                cascade->max_x = cascade->min_x + texel;
+            if(cascade->max_y <= cascade->min_y)
+                cascade->max_y = cascade->min_y + texel;
+            cascade->min_z = scene_min.z - margin;
+            cascade->max_z = scene_max.z + margin;
+            cascade->view_proj = mat4_multiply(S->light_view, _cascade_proj(cascade));
+            cascade->valid = 1;
+
+            ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, S->framebuffer));
+            ASSERT_GL(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, S->static_depth, 0, ii));
+            ASSERT_GL(glClear(GL_DEPTH_BUFFER_BIT));
+            _draw_casters(S, cascade, models, 0);
+            S->static_cascades_drawn++;
+        }
+
+        num_dynamic = _count_dynamic(S, cascade);
+        if(refit || (ii == scheduled && (num_dynamic || cascade->had_dynamic))) {
+            /* Start from the cached static casters */
+            ASSERT_GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, S->read_framebuffer));
+            ASSERT_GL(glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, S->static_depth, 0, ii));
+            ASSERT_GL(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, S->framebuffer));
+            ASSERT_GL(glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, S->depth, 0, ii));
+            ASSERT_GL(glBlitFramebuffer(0, 0, S->size, S->size, 0, 0, S->size, S->size,
+                                        GL_DEPTH_BUFFER_BIT, GL_NEAREST));
+            ASSERT_GL(glBindFramebuffer(GL_READ_FRAMEBUFFER, 0));
+            if(num_dynamic) {
+                _draw_casters(S, cascade, models, 1);
+                S->dynamic_cascades_drawn++;
+            }
+            cascade->had_dynamic = num_dynamic;
+        }
+    }
+
+    ASSERT_GL(glDisable(GL_POLYGON_OFFSET_FILL));
+    ASSERT_GL(glEnable(GL_CULL_FACE));
+    ASSERT_GL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+    ASSERT_GL(glUseProgram(0));
+}
+void bind_shadow_map(const ShadowMap* S, int unit, Mat4 view_matrix,
+                     Mat4* shadow_matrices, float* cascade_ends)
+{
+    Mat4 inv_view = mat4_inverse(view_matrix);
+    int ii;
+    for(ii=0;ii<NUM_SHADOW_CASCADES;++ii) {
+        shadow_matrices[ii] = mat4_multiply(inv_view, S->cascades[ii].view_proj);
+        /* Nothing past the last caster, or no casters at all */
+        cascade_ends[ii] = S->cascades[ii].valid ? S->cascades[ii].end : 0.0f;
+    }
+    ASSERT_GL(glActiveTexture(GL_TEXTURE0+unit));
+    ASSERT_GL(glBindTexture(GL_TEXTURE_2D_ARRAY, S->depth));
+}
+void shadow_map_stats(const ShadowMap* S, int* static_cascades, int* dynamic_cascades)
+{
+    *static_cascades = S->static_cascades_drawn;
+    *dynamic_cascades = S->dynamic_cascades_drawn;
+}
@@ -0,0 +1,50 @@
+/*! @file shadow.h
+ *  @brief Cascaded shadow maps for the directional sun light
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __shadow_h__
+#define __shadow_h__
+
+#include "gl_include.h"
+#include "graphics_types.h"
+#include "scene.h"
+
+/** Must match the sun shaders */
+#define NUM_SHADOW_CASCADES 3
+
+typedef struct ShadowMap ShadowMap;
+
+/** @brief Starts compiling the shadow program, see submit_program */
+void submit_shadow_map_programs(void);
+/** @brief Requires OpenGL ES 3.0
+ *  @param size [in] Width and height of each cascade, in texels
+ */
+ShadowMap* create_shadow_map(int size);
+void destroy_shadow_map(ShadowMap* S);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_shadow_map_uniforms(ShadowMap* S);
+
+/** @brief Fits the cascades to the view and re-renders the ones that are out
+ *      of date.
+ *  Static casters are rendered into a cached copy of each cascade, which is
+ *  only redrawn when the light moves, a static model moves, or the view
+ *  leaves the region the cascade was fitted to. Dynamic casters are drawn on
+ *  top of that copy for one cascade per frame, the nearest one every other
+ *  frame. Leaves the framebuffer and viewport unbound.
+ */
+void update_shadow_map(ShadowMap* S, Mat4 proj_matrix, Mat4 view_matrix,
+                       Vec3 light_direction, const Model* models, int num_models);
+
+/** @brief Binds the cascades, a depth compare texture array with one layer
+ *      per cascade, to texture unit `unit`.
+ *  @param shadow_matrices [out] NUM_SHADOW_CASCADES matrices transforming view
+ *      space into each cascade's clip space
+ *  @param cascade_ends [out] View space depth where each cascade ends
+ */
+void bind_shadow_map(const ShadowMap* S, int unit, Mat4 view_matrix,
+                     Mat4* shadow_matrices, float* cascade_ends);
+
+/** @brief Cascades re-rendered last update, with static and dynamic casters */
+void shadow_map_stats(const ShadowMap* S, int* static_cascades, int* dynamic_cascades);
+
+#endif /* include guard */
@@ -0,0 +1,190 @@
+/** @file simd.h
+ *  @brief Minimal 4-wide float SIMD wrapper (SSE, NEON or scalar)
+ *  @copyright Copyright (c) 2013 Kyle Weicht. All rights reserved.
+ */
+#ifndef __simd_h__
+#define __simd_h__
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #define SIMD_SSE
+    #include <xmmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    #define SIMD_NEON
+    #include <arm_neon.h>
+#endif
+
+#ifdef __cplusplus
+    #define SIMD_INLINE inline
+#else
+    #define SIMD_INLINE static __inline
+#endif
+
+/**
+ * Types
+ *  simd4f holds four floats, simd4m holds the result of a comparison. The
+ *  only thing to do with a mask is combine it with other masks and turn it
+ *  into a 4-bit integer with `simd4m_movemask` (lane 0 is bit 0).
+ */
+#if defined(SIMD_SSE)
+    typedef __m128      simd4f;
+    typedef __m128      simd4m;
+#elif defined(SIMD_NEON)
+    typedef float32x4_t simd4f;
+    typedef uint32x4_t  simd4m;
+#else
+    typedef struct { float f[4]; } simd4f;
+    typedef struct { int m[4]; } simd4m;
+#endif
+
+/**
+ * Load/store
+ */
+/** Loads and stores do not require any alignment */
+SIMD_INLINE simd4f simd4f_load(const float* p)
+{
+#if defined(SIMD_SSE)
+    return _mm_loadu_ps(p);
+#elif defined(SIMD_NEON)
+    return vld1q_f32(p);
+#else
+    simd4f r;
+    r.f[0] = p[0]; r.f[1] = p[1]; r.f[2] = p[2]; r.f[3] = p[3];
+    return r;
+#endif
+}
+SIMD_INLINE void simd4f_store(float* p, simd4f v)
+{
+#if defined(SIMD_SSE)
+    _mm_storeu_ps(p, v);
+#elif defined(SIMD_NEON)
+    vst1q_f32(p, v);
+#else
+    p[0] = v.f[0]; p[1] = v.f[1]; p[2] = v.f[2]; p[3] = v.f[3];
+#endif
+}
+SIMD_INLINE simd4f simd4f_splat(float f)
+{
+#if defined(SIMD_SSE)
+    return _mm_set1_ps(f);
+#elif defined(SIMD_NEON)
+    return vdupq_n_f32(f);
+#else
+    simd4f r;
+    r.f[0] = r.f[1] = r.f[2] = r.f[3] = f;
+    return r;
+#endif
+}
+
+/**
+ * Arithmetic
+ */
+SIMD_INLINE simd4f simd4f_add(simd4f a, simd4f b)
+{
+#if defined(SIMD_SSE)
+    return _mm_add_ps(a, b);
+#elif defined(SIMD_NEON)
+    return vaddq_f32(a, b);
+#else
+    simd4f r;
+    int ii;
+    for(ii=0;ii<4;++ii) r.f[ii] = a.f[ii] + b.f[ii];
+    return r;
+#endif
+}
+SIMD_INLINE simd4f simd4f_sub(simd4f a, simd4f b)
+{
+#if defined(SIMD_SSE)
+    return _mm_sub_ps(a, b);
+#elif defined(SIMD_NEON)
+    return vsubq_f32(a, b);
+#else
+    simd4f r;
+    int ii;
+    for(ii=0;ii<4;++ii) r.f[ii] = a.f[ii] - b.f[ii];
+    return r;
+#endif
+}
+SIMD_INLINE simd4f simd4f_mul(simd4f a, simd4f b)
+{
+#if defined(SIMD_SSE)
+    return _mm_mul_ps(a, b);
+#elif defined(SIMD_NEON)
+    return vmulq_f32(a, b);
+#else
+    simd4f r;
+    int ii;
+    for(ii=0;ii<4;++ii) r.f[ii] = a.f[ii] * b.f[ii];
+    return r;
+#endif
+}
+/** @return a*b + c */
+SIMD_INLINE simd4f simd4f_madd(simd4f a, simd4f b, simd4f c)
+{
+#if defined(SIMD_NEON)
+    return vmlaq_f32(c, a, b);
+#else
+    return simd4f_add(simd4f_mul(a, b), c);
+#endif
+}
+SIMD_INLINE simd4f simd4f_negate(simd4f a)
+{
+    return simd4f_sub(simd4f_splat(0.0f), a);
+}
+
+/**
+ * Comparison
+ */
+SIMD_INLINE simd4m simd4f_greater_equal(simd4f a, simd4f b)
+{
+#if defined(SIMD_SSE)
+    return _mm_cmpge_ps(a, b);
+#elif defined(SIMD_NEON)
+    return vcgeq_f32(a, b);
+#else
+    simd4m r;
+    int ii;
+    for(ii=0;ii<4;++ii) r.m[ii] = a.f[ii] >= b.f[ii];
+    return r;
+#endif
+}
+SIMD_INLINE simd4m simd4f_less_equal(simd4f a, simd4f b)
+{
+#if defined(SIMD_SSE)
+    return _mm_cmple_ps(a, b);
+#elif defined(SIMD_NEON)
+    return vcleq_f32(a, b);
+#else
+    simd4m r;
+    int ii;
+    for(ii=0;ii<4;++ii) r.m[ii] = a.f[ii] <= b.f[ii];
+    return r;
+#endif
+}
+SIMD_INLINE simd4m simd4m_and(simd4m a, simd4m b)
+{
+#if defined(SIMD_SSE)
+    return _mm_and_ps(a, b);
+#elif defined(SIMD_NEON)
+    return vandq_u32(a, b);
+#else
+    simd4m r;
+    int ii;
+    for(ii=0;ii<4;++ii) r.m[ii] = a.m[ii] && b.m[ii];
+    return r;
+#endif
+}
+SIMD_INLINE int simd4m_movemask(simd4m m)
+{
+#if defined(SIMD_SSE)
+    return _mm_movemask_ps(m);
+#elif defined(SIMD_NEON)
+    static const uint32_t kBits[4] = { 1, 2, 4, 8 };
+    uint32x4_t  bits = vandq_u32(m, vld1q_u32(kBits));
+    uint32x2_t  sum = vadd_u32(vget_low_u32(bits), vget_high_u32(bits));
+    return (int)(vget_lane_u32(sum, 0) | vget_lane_u32(sum, 1));
+#else
+    return (m.m[0] ? 1 : 0) | (m.m[1] ? 2 : 0) | (m.m[2] ? 4 : 0) | (m.m[3] ? 8 : 0);
+#endif
+}
+
+#endif /* include guard */
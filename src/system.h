@@ -11,6 +11,18 @@
  */
 int load_file_data(const char* filename, void** data, size_t* data_size);
 void free_file_data(void* data);
+/** @brief Files the app writes itself, in the platform's cache directory.
+ *      The platform may delete them at any time.
+ *  @return 0 on success, -1 on failure
+ */
+int load_cache_data(const char* name, void** data, size_t* data_size);
+int save_cache_data(const char* name, const void* data, size_t data_size);
+/** @brief Loose asset files, in a directory that can be written to while
+ *      the app runs, override the packaged files with the same name.
+ *  @return 1 if a loose file was written or removed since the last call, 0
+ *      if not or if the platform doesn't watch them
+ */
+int asset_files_changed(void);
 /** Prints a message to the systems log
  */
 void system_log(const char* format, ...);
@@ -98,6 +98,14 @@ typedef struct Font {
     GLuint      char_indices;
 } Font;
 
+typedef struct UIString
+{
+    float x;
+    float y;
+    float scale;
+    char string[256];
+} UIString;
+
 struct UI
 {
     Mat4    proj_matrix;
@@ -113,13 +121,13 @@ struct UI
 
     Font    font;
 
-    struct {
-        float x;
-        float y;
-        float scale;
-        char string[256];
-    }       strings[MAX_STRINGS];
+    UIString    strings[MAX_STRINGS];
     int num_strings;
+
+    /* Last frame's strings */
+    UIString    drawn_strings[MAX_STRINGS];
+    int num_drawn_strings;
+    int changed;
 };
 
 /* Constants
@@ -129,6 +137,12 @@ static const uint16_t kQuadIndices[] =
     0, 1, 2,
     2, 3, 0,
 };
+static const AttributeSlot kSlots[] =
+{
+    kPositionSlot,
+    kTexCoordSlot,
+    kEmptySlot
+};
 
 /* Variables
  */
@@ -213,7 +227,7 @@ static FontData _load_font(const char* filename)
 static void _draw_string(UI* U, float x, float y, float scale, char* string)
 {
     Vec4 color = {1.0f, 1.0f, 1.0f, 1.0f};
-    ASSERT_GL(glUniform4fv(U->u_Color, 1, (float*)&color));
+    set_uniform_4fv(U->program, U->u_Color, 1, (float*)&color);
     while(string && *string) {
         char c = *string;
         bmfont_char_t glyph = U->font.data.chars[c];
@@ -224,7 +238,7 @@ static void _draw_string(UI* U, float x, float y, float scale, char* string)
             world.r3.x = x;
             world.r3.y = y;
 
-            ASSERT_GL(glUniformMatrix4fv(U->u_World, 1, GL_FALSE, (float*)&world));
+            set_uniform_matrix4fv(U->program, U->u_World, 1, (float*)&world);
             ASSERT_GL(glBindTexture(GL_TEXTURE_2D, U->font.textures[glyph.page]));
             ASSERT_GL(glBindBuffer(GL_ARRAY_BUFFER, U->font.char_vertices[c]));
             ASSERT_GL(glVertexAttribPointer(kPositionSlot,    3, GL_FLOAT, GL_FALSE, sizeof(float)*5, (void*)(ptr+=0)));
@@ -235,16 +249,28 @@ static void _draw_string(UI* U, float x, float y, float scale, char* string)
         ++string;
     }
 }
+static int _strings_changed(const UI* U)
+{
+    int ii;
+    if(U->num_strings != U->num_drawn_strings)
+        return 1;
+    for(ii=0; ii<U->num_strings; ++ii) {
+        const UIString* a = &U->strings[ii];
+        const UIString* b = &U->drawn_strings[ii];
+        if(a->x != b->x || a->y != b->y || a->scale != b->scale || strcmp(a->string, b->string) != 0)
+            return 1;
+    }
+    return 0;
+}
 
 /* External functions
  */
+void submit_ui_programs(void)
+{
+    submit_program("shaders/ui/vertex.glsl", "shaders/ui/fragment.glsl", kSlots);
+}
 UI* create_ui(Graphics* G)
 {
-    AttributeSlot slots[] = {
-        kPositionSlot,
-        kTexCoordSlot,
-        kEmptySlot
-    };
     int ii = 0;
     UI* U = (UI*)calloc(1, sizeof(UI));
 
@@ -304,14 +330,17 @@ UI* create_ui(Graphics* G)
     /* Create shader */
     U->program = create_program("shaders/ui/vertex.glsl",
                                 "shaders/ui/fragment.glsl",
-                                slots);
+                                kSlots);
+    resolve_ui_uniforms(U);
 
+    return U;
+}
+void resolve_ui_uniforms(UI* U)
+{
     ASSERT_GL(U->u_ViewProjection = glGetUniformLocation(U->program, "u_ViewProjection"));
     ASSERT_GL(U->u_World = glGetUniformLocation(U->program, "u_World"));
     ASSERT_GL(U->u_Color = glGetUniformLocation(U->program, "u_Color"));
     ASSERT_GL(U->s_Texture = glGetUniformLocation(U->program, "s_Texture"));
-
-    return U;
 }
 void destroy_ui(UI* U)
 {
@@ -341,14 +370,21 @@ void draw_ui(UI* U)
     ASSERT_GL(glEnable(GL_BLEND));
     ASSERT_GL(glBlendFunc(GL_SRC_ALPHA,GL_ONE_MINUS_SRC_ALPHA));
     ASSERT_GL(glUseProgram(U->program));
-    ASSERT_GL(glUniformMatrix4fv(U->u_ViewProjection, 1, GL_FALSE, (float*)&U->proj_matrix));
+    set_uniform_matrix4fv(U->program, U->u_ViewProjection, 1, (float*)&U->proj_matrix);
     ASSERT_GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, U->font.char_indices));
     ASSERT_GL(glActiveTexture(GL_TEXTURE0));
     for (ii=0; ii<U->num_strings; ++ii) {
         _draw_string(U, U->strings[ii].x, U->strings[ii].y, U->strings[ii].scale, U->strings[ii].string);
     }
+    U->changed = _strings_changed(U);
+    memcpy(U->drawn_strings, U->strings, U->num_strings*sizeof(U->strings[0]));
+    U->num_drawn_strings = U->num_strings;
     U->num_strings = 0;
     ASSERT_GL(glDepthMask(GL_TRUE));
     ASSERT_GL(glDepthFunc(GL_LESS));
     ASSERT_GL(glDisable(GL_BLEND));
 }
+int ui_changed(const UI* U)
+{
+    return U->changed;
+}
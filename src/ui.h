@@ -9,12 +9,18 @@
 
 typedef struct UI UI;
 
+/** @brief Starts compiling the text program, see submit_program */
+void submit_ui_programs(void);
 UI* create_ui(Graphics* G);
 void destroy_ui(UI* U);
+/** @brief Looks up the uniforms again after reload_changed_programs */
+void resolve_ui_uniforms(UI* U);
 
 void resize_ui(UI* U, int width, int height);
 
 void add_string(UI* U, float x, float y, float scale, const char* string);
 void draw_ui(UI* U);
+/** @return Whether the last draw_ui call drew different text than the one before */
+int ui_changed(const UI* U);
 
 #endif /* include guard */
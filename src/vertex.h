@@ -24,6 +24,12 @@ typedef enum AttributeSlot
     kBitangentSlot,
     kTexCoordSlot,
 
+    /* Per-instance light volume data */
+    kLightPositionSlot,
+    kLightColorSlot,
+    /* Light animation parameters, see AnimatedLight */
+    kLightAnimationSlot,
+
     kEmptySlot = -1
 } AttributeSlot;
 